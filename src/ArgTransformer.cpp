@@ -0,0 +1,272 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "ArgTransformer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "rct/Log.h"
+
+ArgTransformer::ArgTransformer(const Path &command, size_t count)
+    : mCommand(command), mWorkers(std::max<size_t>(count, 1))
+{
+}
+
+ArgTransformer::~ArgTransformer()
+{
+    for (Worker &worker : mWorkers)
+        stop(worker);
+}
+
+// Both ends are close-on-exec from the start so a fork on another thread
+// can't leak them into an unrelated child. dup2 clears the flag on the
+// coprocess' stdin and stdout.
+static inline bool createPipe(int fds[2])
+{
+#ifdef __APPLE__
+    if (pipe(fds))
+        return false;
+    for (int i=0; i<2; ++i)
+        fcntl(fds[i], F_SETFD, fcntl(fds[i], F_GETFD) | FD_CLOEXEC);
+    return true;
+#else
+    return !pipe2(fds, O_CLOEXEC);
+#endif
+}
+
+static inline void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+bool ArgTransformer::start(Worker &worker)
+{
+    int in[2], out[2];
+    if (!createPipe(in)) {
+        error() << "Failed to create pipe for --arg-transform" << errno;
+        return false;
+    }
+    if (!createPipe(out)) {
+        error() << "Failed to create pipe for --arg-transform" << errno;
+        ::close(in[0]);
+        ::close(in[1]);
+        return false;
+    }
+    const pid_t pid = fork();
+    if (pid == -1) {
+        error() << "Failed to fork --arg-transform" << errno;
+        for (int fd : { in[0], in[1], out[0], out[1] })
+            ::close(fd);
+        return false;
+    }
+    if (!pid) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        for (int fd : { in[0], in[1], out[0], out[1] })
+            ::close(fd);
+        const char *argv[] = { mCommand.constData(), nullptr };
+        execv(mCommand.constData(), const_cast<char *const *>(argv));
+        _exit(127);
+    }
+    ::close(in[0]);
+    ::close(out[1]);
+    worker.pid = pid;
+    worker.in = in[1];
+    worker.out = out[0];
+    worker.readBuffer.clear();
+    setNonBlocking(worker.in);
+    setNonBlocking(worker.out);
+    debug() << "Started --arg-transform coprocess" << mCommand << pid;
+    return true;
+}
+
+void ArgTransformer::stop(Worker &worker)
+{
+    if (worker.pid == -1)
+        return;
+    ::close(worker.in);
+    ::close(worker.out);
+    kill(worker.pid, SIGTERM);
+    int status;
+    while (waitpid(worker.pid, &status, 0) == -1 && errno == EINTR);
+    worker = Worker();
+}
+
+void ArgTransformer::transform(List<String> &commands, List<Result> &results)
+{
+    results.assign(commands.size(), Unchanged);
+    if (commands.isEmpty())
+        return;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    struct State {
+        size_t written, read; // indexes into commands, stepping by the worker count
+        String request;
+        size_t requestOffset;
+    };
+    const size_t count = std::min(mWorkers.size(), commands.size());
+    List<State> states(count);
+    for (size_t i=0; i<count; ++i) {
+        State &state = states[i];
+        state.written = state.read = i;
+        state.requestOffset = 0;
+    }
+
+    // Commands a coprocess didn't answer are rejected, like a failing
+    // one-shot --arg-transform, rather than indexed untransformed.
+    auto reject = [&](size_t idx) {
+        for (size_t i=states[idx].read; i<commands.size(); i += count)
+            results[i] = Rejected;
+        states[idx].written = states[idx].read = commands.size();
+    };
+    auto fail = [&](size_t idx, const char *reason) {
+        error() << "--arg-transform coprocess" << mWorkers[idx].pid << reason;
+        stop(mWorkers[idx]);
+        reject(idx);
+    };
+    for (size_t i=0; i<count; ++i) {
+        if (mWorkers[i].pid == -1 && !start(mWorkers[i]))
+            reject(i);
+    }
+
+    // Commands are read back in the order they were written so the response
+    // parsing only needs to track the next index for each coprocess.
+    enum { Timeout = 30000 };
+    List<pollfd> fds;
+    List<size_t> owners;
+    while (true) {
+        fds.clear();
+        owners.clear();
+        for (size_t i=0; i<count; ++i) {
+            const State &state = states[i];
+            if (state.read >= commands.size())
+                continue;
+            if (state.written < commands.size()) {
+                fds.append({ mWorkers[i].in, POLLOUT, 0 });
+                owners.append(i);
+            }
+            fds.append({ mWorkers[i].out, POLLIN, 0 });
+            owners.append(i);
+        }
+        if (fds.isEmpty())
+            break;
+        const int ret = poll(fds.data(), fds.size(), Timeout);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            error() << "poll failed for --arg-transform" << errno;
+            for (size_t i=0; i<count; ++i)
+                fail(i, "aborted");
+            break;
+        } else if (!ret) {
+            for (size_t i=0; i<count; ++i) {
+                if (states[i].read < commands.size())
+                    fail(i, "timed out");
+            }
+            break;
+        }
+        for (size_t f=0; f<fds.size(); ++f) {
+            const size_t idx = owners.at(f);
+            State &state = states[idx];
+            Worker &worker = mWorkers[idx];
+            if (!fds.at(f).revents || worker.pid == -1)
+                continue;
+            if (fds.at(f).events == POLLOUT) {
+                if (fds.at(f).revents & (POLLERR|POLLHUP)) {
+                    fail(idx, "closed stdin");
+                    continue;
+                }
+                // write as much as the pipe takes, the coprocess answers
+                // while we keep feeding it
+                while (state.written < commands.size()) {
+                    if (state.request.isEmpty()) {
+                        const String &command = commands.at(state.written);
+                        state.request = String::format<32>("%zu\n", command.size());
+                        state.request += command;
+                        state.requestOffset = 0;
+                    }
+                    const ssize_t w = ::write(worker.in, state.request.constData() + state.requestOffset,
+                                              state.request.size() - state.requestOffset);
+                    if (w == -1) {
+                        if (errno == EINTR)
+                            continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                            fail(idx, "write failed");
+                        break;
+                    }
+                    state.requestOffset += w;
+                    if (state.requestOffset == state.request.size()) {
+                        state.request.clear();
+                        state.written += count;
+                    }
+                }
+                continue;
+            }
+
+            char buf[16384];
+            while (true) {
+                const ssize_t r = ::read(worker.out, buf, sizeof(buf));
+                if (r > 0) {
+                    worker.readBuffer.append(buf, r);
+                    continue;
+                }
+                if (!r) {
+                    fail(idx, "exited");
+                } else if (errno == EINTR) {
+                    continue;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fail(idx, "read failed");
+                }
+                break;
+            }
+            if (worker.pid == -1)
+                continue;
+            size_t pos = 0;
+            while (state.read < state.written) {
+                const size_t newline = worker.readBuffer.indexOf('\n', pos);
+                if (newline == String::npos)
+                    break;
+                char *end;
+                const long long length = strtoll(worker.readBuffer.constData() + pos, &end, 10);
+                if (end != worker.readBuffer.constData() + newline || length < -1) {
+                    fail(idx, "sent an invalid response");
+                    break;
+                }
+                if (length == -1) {
+                    results[state.read] = Rejected;
+                } else if (newline + 1 + length > worker.readBuffer.size()) {
+                    break;
+                } else if (length) {
+                    String transformed = worker.readBuffer.mid(newline + 1, length);
+                    if (transformed != commands.at(state.read)) {
+                        warning() << "Changed\n" << commands.at(state.read) << "\nto\n" << transformed;
+                        commands[state.read] = std::move(transformed);
+                        results[state.read] = Changed;
+                    }
+                }
+                pos = newline + 1 + std::max<long long>(length, 0);
+                state.read += count;
+            }
+            if (worker.pid != -1 && pos)
+                worker.readBuffer = worker.readBuffer.mid(pos);
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef ArgTransformer_h
+#define ArgTransformer_h
+
+#include <sys/types.h>
+#include <mutex>
+
+#include "rct/List.h"
+#include "rct/Path.h"
+#include "rct/String.h"
+
+/*
+  Runs --arg-transform as a pool of long-lived coprocesses instead of
+  executing it once per command line. Each coprocess reads records from
+  stdin and must answer them in the order they were written:
+
+    request:  "<length>\n<command line>"
+    response: "<length>\n<command line>"
+
+  A response length of 0 leaves the command line unchanged and -1 drops it
+  (like a non-zero exit code in the one-shot mode). Commands a coprocess
+  didn't answer before it died or timed out are dropped as well. rdm
+  writes as many requests as the pipe accepts before it reads the answers,
+  commands are dealt out round-robin between the coprocesses.
+*/
+
+class ArgTransformer
+{
+public:
+    ArgTransformer(const Path &command, size_t count);
+    ~ArgTransformer();
+
+    enum Result {
+        Unchanged,
+        Changed,
+        Rejected
+    };
+    // transforms commands in place, results gets one entry per command
+    void transform(List<String> &commands, List<Result> &results);
+private:
+    struct Worker {
+        Worker()
+            : pid(-1), in(-1), out(-1)
+        {}
+        pid_t pid;
+        int in, out; // our ends, in is the coprocess' stdin
+        String readBuffer;
+    };
+    bool start(Worker &worker);
+    void stop(Worker &worker);
+
+    const Path mCommand;
+    List<Worker> mWorkers;
+    std::mutex mMutex;
+};
+
+#endif
@@ -33,6 +33,7 @@
 #include "RTagsVersion.h"
 #include "VisitFileMessage.h"
 #include "VisitFileResponseMessage.h"
+#include "WorkerMessage.h"
 #include "Location.h"
 
 static inline void setType(Symbol &symbol, const CXType &type)
@@ -79,11 +80,14 @@ ClangIndexer::ClangIndexer(Mode mode)
       mVisitFileResponseMessageVisit(0), mParseDuration(0), mVisitDuration(0), mBlocked(0),
       mAllowed(0), mIndexed(1), mVisitFileTimeout(0), mIndexDataMessageTimeout(0),
       mFileIdsQueried(0), mFileIdsQueriedTime(0), mCursorsVisited(0), mLogFile(nullptr),
-      mConnection(Connection::create(RClient::NumOptions)), mUnionRecursion(false),
+      mConnection(Connection::create(RClient::NumOptions)),
+      mVisitFileConnection(Connection::create(RClient::NumOptions)), mRemotePort(0), mUnionRecursion(false),
       mFromCache(false), mInTemplateFunction(0)
 {
     mConnection->newMessage().connect(std::bind(&ClangIndexer::onMessage, this,
                                                 std::placeholders::_1, std::placeholders::_2));
+    mVisitFileConnection->newMessage().connect(std::bind(&ClangIndexer::onMessage, this,
+                                                         std::placeholders::_1, std::placeholders::_2));
 }
 
 ClangIndexer::~ClangIndexer()
@@ -133,7 +137,7 @@ bool ClangIndexer::exec(const String &data)
         return false;
     }
     uint64_t id;
-    String socketFile;
+    String socketFile, visitFileSocketFile;
     Flags<IndexerJob::Flag> indexerJobFlags;
     uint32_t connectTimeout, connectAttempts;
     int32_t niceValue;
@@ -144,6 +148,7 @@ bool ClangIndexer::exec(const String &data)
     Sandbox::setRoot(sandboxRoot);
     deserializer >> id;
     deserializer >> socketFile;
+    deserializer >> visitFileSocketFile;
     deserializer >> mProject;
     uint32_t count;
     deserializer >> count;
@@ -162,7 +167,10 @@ bool ClangIndexer::exec(const String &data)
     deserializer >> mUnsavedFiles;
     deserializer >> mDataDir;
     deserializer >> mDebugLocations;
+    deserializer >> mPreamble;
     deserializer >> blockedFiles;
+    if (!mRemoteDataDir.isEmpty())
+        mDataDir = mRemoteDataDir;
 
     if (sServerOpts & Server::NoRealPath) {
         Path::setRealPathEnabled(false);
@@ -226,14 +234,34 @@ bool ClangIndexer::exec(const String &data)
     Location::init(blockedFiles);
     Location::set(mSourceFile, mSources.front().fileId);
     while (!mConnection->isConnected()) {
-        if (mConnection->connectUnix(socketFile, connectTimeout))
+        if (mRemoteHost.isEmpty()) {
+            if (mConnection->connectUnix(socketFile, connectTimeout))
+                break;
+        } else if (mConnection->connectTcp(mRemoteHost, mRemotePort, connectTimeout)) {
             break;
+        }
         if (!--connectAttempts) {
-            error("Failed to connect to rdm on %s (%dms timeout)", socketFile.constData(), connectTimeout);
+            if (mRemoteHost.isEmpty()) {
+                error("Failed to connect to rdm on %s (%dms timeout)", socketFile.constData(), connectTimeout);
+            } else {
+                error("Failed to connect to rdm on %s:%d (%dms timeout)", mRemoteHost.constData(), mRemotePort, connectTimeout);
+            }
             return false;
         }
         usleep(500 * 1000);
     }
+    if (!mRemoteHost.isEmpty()) {
+        // rdm drops anything else we send over tcp until this checks out
+        WorkerMessage auth(WorkerMessage::Auth);
+        auth.setSecret(mRemoteSecret);
+        mConnection->send(auth);
+    }
+    // Not fatal, VisitFileMessages go to the main socket then. Remote
+    // workers can't reach rdm's unix sockets at all.
+    if (!mVisitFileConnection->isConnected() && mRemoteHost.isEmpty() && !visitFileSocketFile.isEmpty()
+        && !mVisitFileConnection->connectUnix(visitFileSocketFile, connectTimeout)) {
+        warning() << "Failed to connect to" << visitFileSocketFile;
+    }
 
     if (ClangIndexer::state() == Stopped)
         return true;
@@ -268,7 +296,8 @@ bool ClangIndexer::exec(const String &data)
             break;
         }
     }
-    if (!hasUnit || !writeFiles(RTags::encodeSourceFilePath(mDataDir, mProject, 0), err)) {
+    const Path root = RTags::encodeSourceFilePath(mDataDir, mProject, 0);
+    if (!hasUnit || !writeFiles(root, err) || (!mRemoteHost.isEmpty() && !packShards(root))) {
         message += " error";
         if (!err.isEmpty())
             message += (' ' + err);
@@ -329,6 +358,7 @@ bool ClangIndexer::exec(const String &data)
         message += ")";
 
     mIndexDataMessage.setMessage(std::move(message));
+    mIndexDataMessage.setVisitFileTime(mFileIdsQueried, mFileIdsQueriedTime);
     sw.restart();
     if (ClangIndexer::state() == Stopped)
         return true;
@@ -412,7 +442,7 @@ Location ClangIndexer::createLocation(const Path &sourceFile, unsigned int line,
 
     mVisitFileResponseMessageFileId = UINT_MAX;
     mVisitFileResponseMessageVisit = false;
-    mConnection->send(msg);
+    (mVisitFileConnection->isConnected() ? mVisitFileConnection : mConnection)->send(msg);
     StopWatch sw;
     EventLoop::eventLoop()->exec(mVisitFileTimeout);
     const int elapsed = sw.elapsed();
@@ -1931,6 +1961,41 @@ CXChildVisitResult ClangIndexer::handleCursor(const CXCursor &cursor, CXCursorKi
     return CXChildVisit_Recurse;
 }
 
+bool ClangIndexer::buildPreamble(Flags<CXTranslationUnit_Flags> flags, Flags<Source::CommandLineFlag> commandLineFlags)
+{
+    if (mPreamble.isEmpty() || mSources.size() != 1)
+        return false;
+
+    StopWatch sw;
+    List<String> args = mSources.front().toCommandLine(commandLineFlags);
+    // quoted includes in the preamble are relative to the source file, not to the data dir
+    args << "-iquote" << mSourceFile.parentDir();
+    flags |= CXTranslationUnit_Incomplete;
+    flags |= CXTranslationUnit_ForSerialization;
+    std::shared_ptr<RTags::TranslationUnit> unit = RTags::TranslationUnit::create(mPreamble, args, nullptr, 0, flags, false);
+    if (!unit->unit) {
+        error() << "Failed to parse preamble" << unit->clangLine;
+        return false;
+    }
+
+    const Path path = mPreamble + ".gch";
+    Path tmp = path;
+    tmp << ".tmp";
+    if (clang_saveTranslationUnit(unit->unit, tmp.constData(), clang_defaultSaveOptions(unit->unit)) != CXSaveError_None) {
+        error() << "Failed to save preamble" << tmp;
+        Path::rm(tmp);
+        return false;
+    }
+    if (rename(tmp.constData(), path.constData())) {
+        error() << "Failed to rename preamble" << tmp << path << Rct::strerror();
+        Path::rm(tmp);
+        return false;
+    }
+    warning() << "Built shared preamble" << path << "in" << sw.elapsed() << "ms";
+    mIndexDataMessage.setFlag(IndexDataMessage::BuiltPreamble);
+    return true;
+}
+
 bool ClangIndexer::parse()
 {
     StopWatch sw;
@@ -1973,6 +2038,35 @@ bool ClangIndexer::parse()
         };
     }
 
+    const Flags<IndexerJob::Flag> jobFlags = mIndexDataMessage.indexerJobFlags();
+    bool usePreamble = false;
+    String remapped;
+    if (jobFlags & IndexerJob::BuildPreamble) {
+        if (!buildPreamble(flags, commandLineFlags))
+            warning() << "Failed to build shared preamble" << mPreamble << "for" << mSourceFile;
+    } else if (jobFlags & IndexerJob::UsePreamble && Path(mPreamble + ".gch").isFile()) {
+        // The include block is already in the preamble, the main file is
+        // parsed with it blanked out so headers without include guards
+        // don't get included twice. Newlines stay so locations don't move.
+        size_t length;
+        remapped = mSourceFile.readAll();
+        if (IndexerJob::leadingIncludeBlock(remapped, &length) == Path(mPreamble).readAll()) {
+            char *data = remapped.data();
+            for (size_t i=0; i<length; ++i) {
+                if (data[i] != '\n')
+                    data[i] = ' ';
+            }
+            unsavedFiles[unsavedIndex++] = {
+                mSourceFile.constData(),
+                remapped.constData(),
+                static_cast<unsigned long>(remapped.size())
+            };
+            usePreamble = true;
+        } else {
+            warning() << "Shared preamble" << mPreamble << "doesn't match" << mSourceFile << "anymore";
+        }
+    }
+
     bool ok = false;
     mTranslationUnits.resize(mSources.size());
     for (size_t idx = 0; idx<mSources.size(); ++idx) {
@@ -1984,7 +2078,11 @@ bool ClangIndexer::parse()
         //     error("[%s]", it.constData());
         // }
         bool usedPch = false;
-        const List<String> args = source.toCommandLine(commandLineFlags, &usedPch);
+        List<String> args = source.toCommandLine(commandLineFlags, &usedPch);
+        if (usePreamble) {
+            args << "-include-pch" << (mPreamble + ".gch");
+            usedPch = true;
+        }
         if (usedPch)
             mIndexDataMessage.setFlag(IndexDataMessage::UsedPCH);
 
@@ -2009,6 +2107,14 @@ bool ClangIndexer::parse()
         if (!unit) {
             unit = RTags::TranslationUnit::create(mSourceFile, args, &unsavedFiles[0], unsavedIndex, flags, false);
             warning() << "CI::parse loading unit:" << unit->clangLine << " " << (unit->unit != nullptr);
+            if (!unit->unit && usePreamble) {
+                // the preamble may be stale or incompatible, try again without it
+                args.resize(args.size() - 2);
+                --unsavedIndex;
+                usePreamble = false;
+                unit = RTags::TranslationUnit::create(mSourceFile, args, &unsavedFiles[0], unsavedIndex, flags, false);
+                warning() << "CI::parse loading unit without preamble:" << unit->clangLine << " " << (unit->unit != nullptr);
+            }
         }
 
         if (unit->unit) {
@@ -2086,7 +2192,7 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
         String unitRoot = root;
         unitRoot << unit->first;
         Path::mkdir(unitRoot, Path::Recursive);
-        const Path path = Location::path(unit->first);
+        const Path &path = Location::path(unit->first);
         if (unit->first != fileId) {
             FILE *f = fopen((unitRoot + "/info").constData(), "w");
             if (!f)
@@ -2102,7 +2208,17 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
         auto uit = mUnsavedFiles.find(path);
         if (uit == mUnsavedFiles.end()) {
             Path::rm(unitRoot + "/unsaved");
+            // lets rc --import-index verify a copied shard against the
+            // local file with a stat instead of rereading every header
+            FILE *f = fopen((unitRoot + "/stat").constData(), "w");
+            if (!f)
+                return false;
+            bytesWritten += fprintf(f, "%llu %llu\n",
+                                    static_cast<unsigned long long>(path.fileSize()),
+                                    static_cast<unsigned long long>(path.lastModifiedMs()));
+            fclose(f);
         } else {
+            Path::rm(unitRoot + "/stat");
             FILE *f = fopen((unitRoot + "/unsaved").constData(), "w");
             if (!f)
                 return false;
@@ -2214,6 +2330,33 @@ bool ClangIndexer::writeFiles(const Path &root, String &error)
     return true;
 }
 
+bool ClangIndexer::packShards(const Path &root)
+{
+    static const char *names[] = { "info", "unsaved", "stat", "symbols", "targets", "usrs", "symnames", "tokens" };
+    auto &shards = mIndexDataMessage.shards();
+    for (const auto &file : mIndexDataMessage.files()) {
+        if (!(file.second & IndexDataMessage::Visited))
+            continue;
+        const String dir = String::format<16>("%u/", file.first);
+        const Path unitRoot = root + dir;
+        if (!unitRoot.isDir())
+            continue;
+        for (const char *name : names) {
+            const Path path = unitRoot + name;
+            if (path.isFile()) {
+                String contents = path.readAll();
+                if (contents.isEmpty() && path.fileSize()) {
+                    error() << "Failed to read" << path;
+                    return false;
+                }
+                shards[dir + name] = std::move(contents);
+            }
+        }
+        Path::rmdir(unitRoot);
+    }
+    return true;
+}
+
 bool ClangIndexer::diagnose()
 {
     DiagnosticsProvider::diagnose();
@@ -2226,7 +2369,7 @@ bool ClangIndexer::diagnose()
         for (const auto &it : mIndexDataMessage.files()) {
             if (it.second & IndexDataMessage::Visited) {
                 const Location loc(it.first, 0, 0);
-                const Path path = loc.path();
+                const Path &path = loc.path();
                 CXFile file = clang_getFile(tu, path.constData());
                 if (file) {
                     tokenize(file, it.first, path);
@@ -2385,7 +2528,7 @@ CXChildVisitResult ClangIndexer::verboseVisitor(CXCursor cursor, CXCursor, CXCli
 void ClangIndexer::addFileSymbol(uint32_t file)
 {
     const Location loc(file, 1, 1);
-    const Path path = Location::path(file);
+    const Path &path = Location::path(file);
     auto ref = unit(loc);
     ref->symbolNames[path].insert(loc);
     const char *fn = path.fileName();
@@ -57,14 +57,26 @@ public:
         return sState;
     }
     Path sourceFile() const { return mSourceFile; }
+    // Used by remote workers. Connects to rdm over tcp and writes shards to
+    // dataDir, they're sent back with the IndexDataMessage. secret is sent
+    // in a WorkerMessage::Auth right after connecting.
+    void setRemote(const String &host, uint16_t port, const Path &dataDir, const String &secret)
+    {
+        mRemoteHost = host;
+        mRemotePort = port;
+        mRemoteDataDir = dataDir;
+        mRemoteSecret = secret;
+    }
     bool exec(const String &data);
     static Flags<Server::Option> serverOpts() { return sServerOpts; }
 private:
     bool diagnose();
     bool visit();
     bool parse();
+    bool buildPreamble(Flags<CXTranslationUnit_Flags> flags, Flags<Source::CommandLineFlag> commandLineFlags);
     void tokenize(CXFile file, uint32_t fileId, const Path &path);
     bool writeFiles(const Path &root, String &error);
+    bool packShards(const Path &root);
 
     void addFileSymbol(uint32_t file);
     int symbolLength(CXCursorKind kind, const CXCursor &cursor);
@@ -186,7 +198,13 @@ private:
     List<String> mDebugLocations;
     FILE *mLogFile;
     std::shared_ptr<Connection> mConnection;
+    std::shared_ptr<Connection> mVisitFileConnection; // rdm's VisitFileThread, if we could connect to it
     Path mDataDir;
+    Path mPreamble;
+    String mRemoteHost;
+    uint16_t mRemotePort;
+    Path mRemoteDataDir;
+    String mRemoteSecret;
     bool mUnionRecursion;
     bool mFromCache;
 
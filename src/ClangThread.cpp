@@ -273,7 +273,7 @@ static bool validateNeedsInclude(const Dep *source, const Dep *header, Set<uint3
 void ClangThread::checkIncludes()
 {
     for (const auto &it : mDependencies) {
-        const Path path = Location::path(it.first);
+        const Path &path = Location::path(it.first);
         if (path.isSystem())
             continue;
 
@@ -289,7 +289,7 @@ void ClangThread::checkIncludes()
         continue; // the rest of this doeesn't really work that well.
 
         for (const auto &ref : it.second->references) {
-            const Path refPath = Location::path(ref.first);
+            const Path &refPath = Location::path(ref.first);
             if (refPath.startsWith("/usr/include/sys/_types/_") || refPath.startsWith("/usr/include/_types/_"))
                 continue;
             Set<uint32_t> seen;
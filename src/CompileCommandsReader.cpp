@@ -0,0 +1,257 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "CompileCommandsReader.h"
+
+#include <ctype.h>
+
+#include "RTags.h"
+
+uint64_t CompileCommandsReader::Command::hash() const
+{
+    uint64_t ret = RTags::contentHash(directory);
+    ret = RTags::contentHash("", 1, ret);
+    ret = RTags::contentHash(command, ret);
+    for (const String &arg : arguments) {
+        ret = RTags::contentHash("", 1, ret);
+        ret = RTags::contentHash(arg, ret);
+    }
+    return ret;
+}
+
+CompileCommandsReader::CompileCommandsReader(const String &data)
+    : mData(data), mPos(0), mStarted(false), mDone(false)
+{
+}
+
+bool CompileCommandsReader::fail(const char *message)
+{
+    mError = String::format<128>("%s at offset %zu", message, mPos);
+    mDone = true;
+    return false;
+}
+
+bool CompileCommandsReader::skipSpace()
+{
+    while (mPos < mData.size() && isspace(static_cast<unsigned char>(mData.at(mPos))))
+        ++mPos;
+    return mPos < mData.size();
+}
+
+bool CompileCommandsReader::expect(char ch)
+{
+    if (!skipSpace() || mData.at(mPos) != ch)
+        return fail(String::format<32>("Expected '%c'", ch).constData());
+    ++mPos;
+    return true;
+}
+
+static inline void appendUtf8(String &out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        out.append(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out.append(static_cast<char>(0xc0 | (cp >> 6)));
+        out.append(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        out.append(static_cast<char>(0xe0 | (cp >> 12)));
+        out.append(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+        out.append(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else {
+        out.append(static_cast<char>(0xf0 | (cp >> 18)));
+        out.append(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+        out.append(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+        out.append(static_cast<char>(0x80 | (cp & 0x3f)));
+    }
+}
+
+bool CompileCommandsReader::readString(String &out)
+{
+    if (!expect('"'))
+        return false;
+    out.clear();
+    const char *data = mData.constData();
+    const size_t size = mData.size();
+    while (mPos < size) {
+        // copy runs without escapes in one go
+        size_t end = mPos;
+        while (end < size && data[end] != '"' && data[end] != '\\')
+            ++end;
+        out.append(data + mPos, end - mPos);
+        mPos = end;
+        if (mPos == size)
+            break;
+        if (data[mPos++] == '"')
+            return true;
+        if (mPos == size)
+            break;
+        const char ch = data[mPos++];
+        switch (ch) {
+        case 'b': out.append('\b'); break;
+        case 'f': out.append('\f'); break;
+        case 'n': out.append('\n'); break;
+        case 'r': out.append('\r'); break;
+        case 't': out.append('\t'); break;
+        case 'u': {
+            auto hex = [this, data, size](uint32_t &cp) {
+                if (mPos + 4 > size)
+                    return false;
+                char buf[5] = { data[mPos], data[mPos + 1], data[mPos + 2], data[mPos + 3], '\0' };
+                char *endPtr;
+                cp = static_cast<uint32_t>(strtoul(buf, &endPtr, 16));
+                if (endPtr != buf + 4)
+                    return false;
+                mPos += 4;
+                return true;
+            };
+            uint32_t cp;
+            if (!hex(cp))
+                return fail("Invalid \\u escape");
+            if (cp >= 0xd800 && cp < 0xdc00 && mPos + 1 < size && data[mPos] == '\\' && data[mPos + 1] == 'u') {
+                mPos += 2;
+                uint32_t low;
+                if (!hex(low))
+                    return fail("Invalid \\u escape");
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            }
+            appendUtf8(out, cp);
+            break; }
+        default: // \" \\ \/
+            out.append(ch);
+            break;
+        }
+    }
+    return fail("Unterminated string");
+}
+
+bool CompileCommandsReader::readStringArray(List<String> &out)
+{
+    if (!expect('['))
+        return false;
+    if (!skipSpace())
+        return fail("Unexpected end of file");
+    if (mData.at(mPos) == ']') {
+        ++mPos;
+        return true;
+    }
+    while (true) {
+        String str;
+        if (!readString(str))
+            return false;
+        out.append(std::move(str));
+        if (!skipSpace())
+            return fail("Unexpected end of file");
+        const char ch = mData.at(mPos++);
+        if (ch == ']')
+            return true;
+        if (ch != ',')
+            return fail("Expected ',' or ']'");
+    }
+}
+
+bool CompileCommandsReader::skipValue()
+{
+    if (!skipSpace())
+        return fail("Unexpected end of file");
+    switch (mData.at(mPos)) {
+    case '"': {
+        String dummy;
+        return readString(dummy); }
+    case '{':
+    case '[': {
+        int depth = 0;
+        while (mPos < mData.size()) {
+            const char ch = mData.at(mPos);
+            if (ch == '"') {
+                String dummy;
+                if (!readString(dummy))
+                    return false;
+                continue;
+            }
+            ++mPos;
+            if (ch == '{' || ch == '[') {
+                ++depth;
+            } else if ((ch == '}' || ch == ']') && !--depth) {
+                return true;
+            }
+        }
+        return fail("Unexpected end of file"); }
+    default:
+        // numbers, true, false, null
+        while (mPos < mData.size()) {
+            const char ch = mData.at(mPos);
+            if (ch == ',' || ch == '}' || ch == ']' || isspace(static_cast<unsigned char>(ch)))
+                break;
+            ++mPos;
+        }
+        return true;
+    }
+}
+
+bool CompileCommandsReader::next(Command &command)
+{
+    if (mDone)
+        return false;
+    command.clear();
+    if (!mStarted) {
+        mStarted = true;
+        if (!expect('['))
+            return false;
+    } else {
+        if (!skipSpace())
+            return fail("Unexpected end of file");
+        if (mData.at(mPos) == ',')
+            ++mPos;
+    }
+    if (!skipSpace())
+        return fail("Unexpected end of file");
+    if (mData.at(mPos) == ']') {
+        ++mPos;
+        mDone = true;
+        return false;
+    }
+    if (!expect('{'))
+        return false;
+    if (!skipSpace())
+        return fail("Unexpected end of file");
+    if (mData.at(mPos) == '}') {
+        ++mPos;
+        return true;
+    }
+    String key;
+    while (true) {
+        if (!readString(key) || !expect(':'))
+            return false;
+        bool ok;
+        if (key == "directory") {
+            ok = readString(command.directory);
+        } else if (key == "command") {
+            ok = readString(command.command);
+        } else if (key == "arguments") {
+            ok = readStringArray(command.arguments);
+        } else {
+            ok = skipValue();
+        }
+        if (!ok)
+            return false;
+        if (!skipSpace())
+            return fail("Unexpected end of file");
+        const char ch = mData.at(mPos++);
+        if (ch == '}')
+            return true;
+        if (ch != ',')
+            return fail("Expected ',' or '}'");
+    }
+}
@@ -0,0 +1,67 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef CompileCommandsReader_h
+#define CompileCommandsReader_h
+
+#include "rct/List.h"
+#include "rct/Path.h"
+#include "rct/String.h"
+
+/*
+  Pull parser for compile_commands.json. Entries are handed out one at a time
+  so the caller can start parsing them before the whole file is tokenized.
+  Only "directory", "command" and "arguments" are kept, everything else is
+  skipped.
+*/
+
+class CompileCommandsReader
+{
+public:
+    struct Command {
+        Path directory;
+        String command; // set if the entry uses "command"
+        List<String> arguments; // set if the entry uses "arguments"
+
+        void clear()
+        {
+            directory.clear();
+            command.clear();
+            arguments.clear();
+        }
+        uint64_t hash() const;
+    };
+
+    CompileCommandsReader(const String &data);
+
+    // returns false at the end of the array or on error
+    bool next(Command &command);
+    bool hasError() const { return !mError.isEmpty(); }
+    const String &error() const { return mError; }
+private:
+    bool skipSpace();
+    bool expect(char ch);
+    bool readString(String &out);
+    bool readStringArray(List<String> &out);
+    bool skipValue();
+    bool fail(const char *message);
+
+    const String &mData;
+    size_t mPos;
+    bool mStarted, mDone;
+    String mError;
+};
+
+#endif
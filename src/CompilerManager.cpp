@@ -15,16 +15,32 @@
 
 #include "CompilerManager.h"
 
+#include <sys/stat.h>
+
+#include "rct/DataFile.h"
+#include "rct/EventLoop.h"
 #include "rct/Log.h"
 #include "rct/Process.h"
+#include "rct/Rct.h"
+#include "rct/ThreadPool.h"
+#include "RTags.h"
+#include "Server.h"
 #include "Source.h"
 
 static std::mutex sMutex;
 struct Compiler {
     Compiler()
-        : inited(false)
+        : state(Unprobed), lastModified(0), size(0)
     {}
-    bool inited;
+    enum State {
+        Unprobed,
+        Probing,
+        Probed
+    } state;
+
+    // identifies the binary the results came from
+    time_t lastModified;
+    off_t size;
 
     // There are three include-path-limiting options:
     //   1. -nostdinc      -- disables all default system include paths
@@ -38,157 +54,367 @@ struct Compiler {
     List<Source::Include> includePaths;
     List<Source::Include> stdincxxPaths;
     List<Source::Include> builtinPaths;
+
+    List<std::function<void()> > waiting; // CompilerManager::probe() callbacks
 };
 static Hash<Path, Compiler> sCompilers;
+static Path sCacheFile;
 
-namespace CompilerManager {
+template <> inline Serializer &operator<<(Serializer &s, const Compiler &c)
+{
+    s << static_cast<int64_t>(c.lastModified) << static_cast<int64_t>(c.size)
+      << c.defines << c.includePaths << c.stdincxxPaths << c.builtinPaths;
+    return s;
+}
 
-List<Path> compilers()
+template <> inline Deserializer &operator>>(Deserializer &s, Compiler &c)
 {
-    std::lock_guard<std::mutex> lock(sMutex);
-    return sCompilers.keys();
+    int64_t lastModified, size;
+    s >> lastModified >> size >> c.defines >> c.includePaths >> c.stdincxxPaths >> c.builtinPaths;
+    c.lastModified = static_cast<time_t>(lastModified);
+    c.size = static_cast<off_t>(size);
+    c.state = Compiler::Probed;
+    return s;
 }
 
-void applyToSource(Source &source, Flags<CompilerManager::Flag> flags)
+// probe() is called for every job, only stat each compiler once every
+// StatInterval ms. Never called with sMutex held.
+struct CompilerStat {
+    bool ok;
+    time_t lastModified;
+    off_t size;
+    uint64_t checked;
+};
+static Hash<Path, CompilerStat> sStats;
+static std::mutex sStatsMutex;
+enum { StatInterval = 1000 };
+
+static bool statCompiler(const Path &cpath, Compiler &compiler)
 {
-    std::lock_guard<std::mutex> lock(sMutex);
-    Path cpath = source.compiler();
-    Compiler &compiler = sCompilers[cpath];
-    if (!compiler.inited) {
-        compiler.inited = true;
-
-        List<String> overrides;
-        List<String> out, err;
-        List<String> args;
-        List<String> environ({"RTAGS_DISABLED=1"});
-        args << "-x" << "c++" << "-v" << "-E" << "-dM" << "-";
-
-        for (int i=0; i<4; /* see below */) {
-            Process proc;
-            proc.exec(cpath, args, environ);
-            assert(proc.isFinished());
-            if (!proc.returnCode()) {
-                out << proc.readAllStdOut().split('\n');
-                err << proc.readAllStdErr().split('\n');
-
-                // proc success. What's next?
-                switch (i) {
-                case 0:
-                    // C++ ok .. see which path is controlled by -nostdinc++
-                    args.prepend("-nostdinc++");
-                    err << "@@@@\n"; // magic separator
-                    i = 2;
-                    break;
-
-                case 1:
-                    // "-x c++" not ok. Goto -nobuiltininc.
-                    err << "@@@@\n";  // magic separator
-                    args.prepend("-nobuiltininc");
-                    i = 3;
-                    break;
-
-                case 2:
-                    args.removeFirst(); // clear -nostdinc++
-                    err << "@@@@\n";  // magic separator
-                    args.prepend("-nobuiltininc");
-                    i = 3;
-                    break;
-
-                default:
-                    err << "@@@@\n";  // magic separator
-                    i = 4;
-                    break;
-                }
-            } else if (i == 0) {
-                // Strip -x c++ and try again
-                args.removeFirst();
-                args.removeFirst();
-                i = 1;
-            } else if (i == 3) {
-                // GCC does not support -nobuiltininc flag.
-                // Remove and retry
-                args.removeFirst();
-            } else {
-                error() << "CompilerManager: Cannot extract standard include paths.\n";
-                return;
+    const uint64_t now = Rct::monoMs();
+    CompilerStat cached;
+    bool found;
+    {
+        std::lock_guard<std::mutex> lock(sStatsMutex);
+        const auto it = sStats.find(cpath);
+        found = it != sStats.end() && now - it->second.checked < StatInterval;
+        if (found)
+            cached = it->second;
+    }
+    if (!found) {
+        struct stat st;
+        cached.ok = !stat(cpath.constData(), &st);
+        cached.lastModified = cached.ok ? st.st_mtime : 0;
+        cached.size = cached.ok ? st.st_size : 0;
+        cached.checked = now;
+        std::lock_guard<std::mutex> lock(sStatsMutex);
+        sStats[cpath] = cached;
+    }
+    compiler.lastModified = cached.lastModified;
+    compiler.size = cached.size;
+    return cached.ok;
+}
+
+// the binary changed since it was probed, current comes from statCompiler
+static bool isStale(const Compiler &current, bool exists, const Compiler &compiler)
+{
+    return compiler.state == Compiler::Probed
+        && (!exists || current.lastModified != compiler.lastModified || current.size != compiler.size);
+}
+
+static void save()
+{
+    if (sCacheFile.isEmpty())
+        return;
+    Hash<Path, Compiler> probed;
+    {
+        std::lock_guard<std::mutex> lock(sMutex);
+        for (const auto &compiler : sCompilers) {
+            if (compiler.second.state == Compiler::Probed)
+                probed[compiler.first] = compiler.second;
+        }
+    }
+    Path::mkdir(sCacheFile.parentDir(), Path::Recursive);
+    DataFile file(sCacheFile, RTags::DatabaseVersion);
+    if (!file.open(DataFile::Write)) {
+        error("Save error %s: %s", sCacheFile.constData(), file.error().constData());
+        return;
+    }
+    file << probed;
+    if (!file.flush())
+        error("Save error %s: %s", sCacheFile.constData(), file.error().constData());
+}
+
+// Runs the compiler, doesn't touch sCompilers so no lock needed
+static Compiler probeCompiler(const Path &cpath)
+{
+    Compiler compiler;
+    compiler.state = Compiler::Probed;
+    statCompiler(cpath, compiler);
+
+    List<String> overrides;
+    List<String> out, err;
+    List<String> args;
+    List<String> environ({"RTAGS_DISABLED=1"});
+    args << "-x" << "c++" << "-v" << "-E" << "-dM" << "-";
+
+    for (int i=0; i<4; /* see below */) {
+        Process proc;
+        proc.exec(cpath, args, environ);
+        assert(proc.isFinished());
+        if (!proc.returnCode()) {
+            out << proc.readAllStdOut().split('\n');
+            err << proc.readAllStdErr().split('\n');
+
+            // proc success. What's next?
+            switch (i) {
+            case 0:
+                // C++ ok .. see which path is controlled by -nostdinc++
+                args.prepend("-nostdinc++");
+                err << "@@@@\n"; // magic separator
+                i = 2;
+                break;
+
+            case 1:
+                // "-x c++" not ok. Goto -nobuiltininc.
+                err << "@@@@\n";  // magic separator
+                args.prepend("-nobuiltininc");
+                i = 3;
+                break;
+
+            case 2:
+                args.removeFirst(); // clear -nostdinc++
+                err << "@@@@\n";  // magic separator
+                args.prepend("-nobuiltininc");
+                i = 3;
+                break;
+
+            default:
+                err << "@@@@\n";  // magic separator
+                i = 4;
+                break;
             }
+        } else if (i == 0) {
+            // Strip -x c++ and try again
+            args.removeFirst();
+            args.removeFirst();
+            i = 1;
+        } else if (i == 3) {
+            // GCC does not support -nobuiltininc flag.
+            // Remove and retry
+            args.removeFirst();
+        } else {
+            error() << "CompilerManager: Cannot extract standard include paths.\n";
+            return compiler;
         }
-        for (size_t i=0; i<out.size(); ++i) {
-            const String &line = out.at(i);
-            // error() << c << line;
-            if (line.startsWith("#define ")) {
-                Source::Define def;
-                const int space = line.indexOf(' ', 8);
-                if (space == -1) {
-                    def.define = line.mid(8);
-                } else {
-                    def.define = line.mid(8, space - 8);
-                    def.value = line.mid(space + 1);
-                }
-                compiler.defines.insert(def);
+    }
+    for (size_t i=0; i<out.size(); ++i) {
+        const String &line = out.at(i);
+        // error() << c << line;
+        if (line.startsWith("#define ")) {
+            Source::Define def;
+            const int space = line.indexOf(' ', 8);
+            if (space == -1) {
+                def.define = line.mid(8);
+            } else {
+                def.define = line.mid(8, space - 8);
+                def.value = line.mid(space + 1);
             }
+            compiler.defines.insert(def);
         }
+    }
 
-        enum { eNormal, eNoStdInc, eNoBuiltin } mode = eNormal;
-        List<Source::Include> copy;
-        for (size_t i=0; i<err.size(); ++i) {
-            const String &line = err.at(i);
-            if (line.startsWith("@@@@")) { // magic separator
-                if (mode == eNoStdInc) {
-                    // What's left in copy are the std c++ paths
-                    compiler.stdincxxPaths = copy;
-                    mode = eNoBuiltin;
-                } else if (mode == eNoBuiltin) {
-                    // What's left in copy are the builtin paths
-                    compiler.builtinPaths = copy;
-                    // Set the includePaths exclusive of stdinc/builtin
-                    for (auto& inc : compiler.stdincxxPaths)
-                        compiler.includePaths.remove(inc);
-                    for (auto& inc : compiler.builtinPaths)
-                        compiler.includePaths.remove(inc);
-                    break; // we're done
-                } else {
-                    mode = eNoStdInc;
-                }
-                copy = compiler.includePaths;
+    enum { eNormal, eNoStdInc, eNoBuiltin } mode = eNormal;
+    List<Source::Include> copy;
+    for (size_t i=0; i<err.size(); ++i) {
+        const String &line = err.at(i);
+        if (line.startsWith("@@@@")) { // magic separator
+            if (mode == eNoStdInc) {
+                // What's left in copy are the std c++ paths
+                compiler.stdincxxPaths = copy;
+                mode = eNoBuiltin;
+            } else if (mode == eNoBuiltin) {
+                // What's left in copy are the builtin paths
+                compiler.builtinPaths = copy;
+                // Set the includePaths exclusive of stdinc/builtin
+                for (auto& inc : compiler.stdincxxPaths)
+                    compiler.includePaths.remove(inc);
+                for (auto& inc : compiler.builtinPaths)
+                    compiler.includePaths.remove(inc);
+                break; // we're done
+            } else {
+                mode = eNoStdInc;
             }
-            size_t j = 0;
-            while (j < line.size() && isspace(line.at(j)))
-                ++j;
-            int end = line.lastIndexOf(" (framework directory)");
-            Source::Include::Type type = Source::Include::Type::Type_System;
-            if (end != -1) {
-                end = end - j;
-                type = Source::Include::Type_SystemFramework;
+            copy = compiler.includePaths;
+        }
+        size_t j = 0;
+        while (j < line.size() && isspace(line.at(j)))
+            ++j;
+        int end = line.lastIndexOf(" (framework directory)");
+        Source::Include::Type type = Source::Include::Type::Type_System;
+        if (end != -1) {
+            end = end - j;
+            type = Source::Include::Type_SystemFramework;
+        }
+        Path path = line.mid(j, end);
+        // error() << "looking at" << line << path << path.isDir();
+        if (path.isDir()) {
+            path.resolve();
+            if (mode == eNormal) {
+                compiler.includePaths.append(Source::Include(type, path));
+            } else {
+                copy.remove(Source::Include(type, path));
             }
-            Path path = line.mid(j, end);
-            // error() << "looking at" << line << path << path.isDir();
-            if (path.isDir()) {
-                path.resolve();
-                if (mode == eNormal) {
-                    compiler.includePaths.append(Source::Include(type, path));
-                } else {
-                    copy.remove(Source::Include(type, path));
-                }
+        }
+    }
+    debug() << "[CompilerManager]" << cpath << "got includepaths\n" << compiler.includePaths;
+    debug() << "StdInc++: " << compiler.stdincxxPaths << "\nBuiltin: " << compiler.builtinPaths;
+    debug() << "[CompilerManager] returning.\n";
+    return compiler;
+}
+
+// called with sMutex held
+static inline bool isProbed(const Path &cpath)
+{
+    const auto it = sCompilers.find(cpath);
+    return it != sCompilers.end() && it->second.state == Compiler::Probed;
+}
+
+// called with sMutex held, returns the callbacks waiting for cpath
+static List<std::function<void()> > setProbed(const Path &cpath, Compiler &&result)
+{
+    Compiler &compiler = sCompilers[cpath];
+    List<std::function<void()> > waiting = std::move(compiler.waiting);
+    compiler = std::move(result);
+    return waiting;
+}
+
+namespace CompilerManager {
+
+void load(const Path &cacheFile)
+{
+    sCacheFile = cacheFile;
+    if (!sCacheFile.isFile())
+        return;
+    DataFile file(sCacheFile, RTags::DatabaseVersion);
+    if (!file.open(DataFile::Read)) {
+        error("Load error %s: %s", sCacheFile.constData(), file.error().constData());
+        return;
+    }
+    Hash<Path, Compiler> compilers;
+    file >> compilers;
+    for (auto it = compilers.begin(); it != compilers.end(); ) {
+        Compiler current;
+        const bool exists = statCompiler(it->first, current);
+        if (isStale(current, exists, it->second)) {
+            it = compilers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    std::lock_guard<std::mutex> lock(sMutex);
+    for (auto &compiler : compilers)
+        sCompilers[compiler.first] = std::move(compiler.second);
+    debug() << "[CompilerManager] loaded" << sCompilers.size() << "compilers from" << sCacheFile;
+}
+
+List<Path> compilers()
+{
+    std::lock_guard<std::mutex> lock(sMutex);
+    return sCompilers.keys();
+}
+
+class ProbeJob : public ThreadPool::Job
+{
+public:
+    ProbeJob(const Path &cpath)
+        : mPath(cpath)
+    {}
+protected:
+    virtual void run() override
+    {
+        auto result = std::make_shared<Compiler>(probeCompiler(mPath));
+        const Path cpath = mPath;
+        if (std::shared_ptr<EventLoop> loop = EventLoop::mainEventLoop()) {
+            loop->callLater([cpath, result]() {
+                    List<std::function<void()> > waiting;
+                    {
+                        std::lock_guard<std::mutex> lock(sMutex);
+                        waiting = setProbed(cpath, std::move(*result));
+                    }
+                    save();
+                    for (const auto &cb : waiting)
+                        cb();
+                });
+        }
+    }
+private:
+    const Path mPath;
+};
+
+bool probe(const Path &cpath, std::function<void()> &&ready)
+{
+    Compiler current;
+    const bool exists = statCompiler(cpath, current);
+    {
+        std::lock_guard<std::mutex> lock(sMutex);
+        Compiler &compiler = sCompilers[cpath];
+        if (isStale(current, exists, compiler))
+            compiler = Compiler();
+        switch (compiler.state) {
+        case Compiler::Probed:
+            return true;
+        case Compiler::Probing:
+            compiler.waiting.append(std::move(ready));
+            return false;
+        case Compiler::Unprobed:
+            compiler.state = Compiler::Probing;
+            compiler.waiting.append(std::move(ready));
+            break;
+        }
+    }
+
+    // on the server's pool so shutdown waits for it rather than the
+    // result arriving after the event loop is gone
+    Server::instance()->backgroundPool()->start(std::make_shared<ProbeJob>(cpath));
+    return false;
+}
+
+void applyToSource(Source &source, Flags<CompilerManager::Flag> flags)
+{
+    const Path cpath = source.compiler();
+    std::unique_lock<std::mutex> lock(sMutex);
+    if (!isProbed(cpath)) {
+        // Nobody went through probe() for this one, e.g. rc --status
+        // compilers, so probe synchronously.
+        lock.unlock();
+        Compiler result = probeCompiler(cpath);
+        lock.lock();
+        if (!isProbed(cpath)) {
+            const List<std::function<void()> > waiting = setProbed(cpath, std::move(result));
+            if (!waiting.isEmpty()) {
+                EventLoop::mainEventLoop()->callLater([waiting]() {
+                        for (const auto &cb : waiting)
+                            cb();
+                    });
             }
         }
-        debug() << "[CompilerManager]" << cpath << "got includepaths\n" << compiler.includePaths;
-        debug() << "StdInc++: " << compiler.stdincxxPaths << "\nBuiltin: " << compiler.builtinPaths;
-        debug() << "[CompilerManager] returning.\n";
     }
+    const Compiler &compiler = sCompilers[cpath];
     if (flags & IncludeDefines)
-        source.defines << compiler.defines;
+        source.defines.write() << compiler.defines;
     if (flags & IncludeIncludePaths) {
-        if (!source.arguments.contains("-nostdinc")) {
-            source.includePaths << compiler.includePaths;
-            if (!source.arguments.contains("-nostdinc++"))
-                source.includePaths << compiler.stdincxxPaths;
-            if (!source.arguments.contains("-nobuiltininc"))
-                source.includePaths << compiler.builtinPaths;
+        if (!source.arguments->contains("-nostdinc")) {
+            List<Source::Include> &includePaths = source.includePaths.write();
+            includePaths << compiler.includePaths;
+            if (!source.arguments->contains("-nostdinc++"))
+                includePaths << compiler.stdincxxPaths;
+            if (!source.arguments->contains("-nobuiltininc"))
+                includePaths << compiler.builtinPaths;
         } else if (!strncmp("clang", cpath.fileName(), 5)) {
             // Module.map causes errors when -nostdinc is used, as it
             // can't find some mappings to compiler provided headers
-            source.arguments.append("-fno-modules");
+            source.arguments.write().append("-fno-modules");
         }
     }
 }
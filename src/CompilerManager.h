@@ -16,6 +16,8 @@
 #ifndef CompilerManager_h
 #define CompilerManager_h
 
+#include <functional>
+
 #include "rct/List.h"
 #include "rct/Path.h"
 #include "rct/Serializer.h"
@@ -25,7 +27,13 @@ struct Source;
 
 namespace CompilerManager
 {
+// loads probe results from an earlier run, they're written back whenever a
+// compiler is probed
+void load(const Path &cacheFile);
 List<Path> compilers();
+// Returns true if cpath has been probed. Otherwise the compiler is probed on
+// the server's background pool and ready is called on the main thread once it's done.
+bool probe(const Path &cpath, std::function<void()> &&ready);
 enum Flag {
     None = 0x0,
     IncludeDefines = 0x1,
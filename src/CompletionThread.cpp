@@ -222,7 +222,7 @@ void CompletionThread::process(Request *request)
     assert(!cache->translationUnit || cache->source == request->source);
     if (!cache->translationUnit) {
         cache->source = std::move(request->source);
-        assert(!cache->source.defines.contains(Source::Define("RTAGS", String(), Source::Define::NoValue)));
+        assert(!cache->source.defines->contains(Source::Define("RTAGS", String(), Source::Define::NoValue)));
     }
 
     const Path sourceFile = cache->source.sourceFile();
@@ -0,0 +1,150 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "DependencyGraph.h"
+
+#include "Project.h"
+
+DependencyGraph::DependencyGraph(const Dependencies &dependencies)
+    : mClosureBytes(0)
+{
+    mFileIds.reserve(dependencies.size());
+    for (const auto &it : dependencies) {
+        mIndexes[it.first] = mFileIds.size();
+        mFileIds.push_back(it.first);
+    }
+
+    auto build = [this, &dependencies](Adjacency &adjacency, Dependencies DependencyNode::*member) {
+        adjacency.offsets.reserve(mFileIds.size() + 1);
+        for (uint32_t fileId : mFileIds) {
+            adjacency.offsets.push_back(adjacency.edges.size());
+            for (const auto &edge : (dependencies.value(fileId)->*member)) {
+                const uint32_t idx = index(edge.first);
+                if (idx != NoIndex)
+                    adjacency.edges.push_back(idx);
+            }
+        }
+        adjacency.offsets.push_back(adjacency.edges.size());
+        adjacency.edges.shrink_to_fit();
+    };
+    build(mAdjacency[Includes], &DependencyNode::includes);
+    build(mAdjacency[Dependents], &DependencyNode::dependents);
+}
+
+// calls visitor with the index of every node reachable from idx, including
+// idx itself, until it returns false
+template <typename Visitor>
+void DependencyGraph::traverse(uint32_t idx, Direction direction, Visitor visitor) const
+{
+    const Adjacency &adjacency = mAdjacency[direction];
+    std::vector<uint64_t> seen((mFileIds.size() + 63) / 64);
+    std::vector<uint32_t> stack;
+    seen[idx / 64] |= (1ull << (idx % 64));
+    stack.push_back(idx);
+    while (!stack.empty()) {
+        const uint32_t node = stack.back();
+        stack.pop_back();
+        if (!visitor(node))
+            return;
+        for (uint32_t e = adjacency.offsets[node]; e < adjacency.offsets[node + 1]; ++e) {
+            const uint32_t next = adjacency.edges[e];
+            uint64_t &word = seen[next / 64];
+            const uint64_t bit = 1ull << (next % 64);
+            if (!(word & bit)) {
+                word |= bit;
+                stack.push_back(next);
+            }
+        }
+    }
+}
+
+std::shared_ptr<DependencyGraph::Closure> DependencyGraph::reachable(uint32_t idx, Direction direction) const
+{
+    const uint64_t key = (static_cast<uint64_t>(idx) << 1) | direction;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mClosures.find(key);
+        if (it != mClosures.end())
+            return it->second;
+    }
+
+    std::shared_ptr<Closure> ret = std::make_shared<Closure>();
+    ret->bits.resize((mFileIds.size() + 63) / 64);
+    traverse(idx, direction, [&ret](uint32_t node) {
+            ret->bits[node / 64] |= (1ull << (node % 64));
+            return true;
+        });
+
+    const size_t bytes = ret->bits.size() * sizeof(uint64_t);
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mClosureBytes + bytes > MaxClosureBytes) {
+        mClosures.clear();
+        mClosureBytes = 0;
+    }
+    std::shared_ptr<Closure> &ref = mClosures[key];
+    if (!ref) {
+        ref = ret;
+        mClosureBytes += bytes;
+    }
+    return ref;
+}
+
+std::shared_ptr<const Set<uint32_t> > DependencyGraph::closure(uint32_t fileId, Direction direction) const
+{
+    const uint32_t idx = index(fileId);
+    if (idx == NoIndex)
+        return std::shared_ptr<const Set<uint32_t> >();
+    const std::shared_ptr<Closure> reach = reachable(idx, direction);
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!reach->fileIds) {
+        std::shared_ptr<Set<uint32_t> > fileIds = std::make_shared<Set<uint32_t> >();
+        for (size_t word = 0; word < reach->bits.size(); ++word) {
+            uint64_t bits = reach->bits[word];
+            while (bits) {
+                const int bit = __builtin_ctzll(bits);
+                fileIds->insert(mFileIds[word * 64 + bit]);
+                bits &= bits - 1;
+            }
+        }
+        reach->fileIds = fileIds;
+    }
+    return reach->fileIds;
+}
+
+bool DependencyGraph::reaches(uint32_t from, uint32_t to, Direction direction) const
+{
+    const uint32_t idx = index(from), target = index(to);
+    if (idx == NoIndex || target == NoIndex)
+        return false;
+    const std::shared_ptr<Closure> reach = reachable(idx, direction);
+    return reach->bits[target / 64] & (1ull << (target % 64));
+}
+
+bool DependencyGraph::any(uint32_t fileId, Direction direction, const std::function<bool(uint32_t)> &match) const
+{
+    const uint32_t idx = index(fileId);
+    if (idx == NoIndex)
+        return false;
+    const std::shared_ptr<Closure> reach = reachable(idx, direction);
+    for (size_t word = 0; word < reach->bits.size(); ++word) {
+        uint64_t bits = reach->bits[word];
+        while (bits) {
+            if (match(mFileIds[word * 64 + __builtin_ctzll(bits)]))
+                return true;
+            bits &= bits - 1;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,88 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef DependencyGraph_h
+#define DependencyGraph_h
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "rct/Hash.h"
+#include "rct/Set.h"
+#include "RTags.h"
+
+/*
+  Read-only snapshot of a project's DependencyNode graph. Files get dense
+  indexes and both edge directions are stored as CSR arrays (an offsets
+  array into one flat edge array) so traversals are a bitset and a stack
+  instead of hash lookups and recursion.
+
+  The first query from a file memoizes everything reachable from it as a
+  bitset over the dense indexes, after that reaches() is a bit test. The
+  graph is thrown away and rebuilt when the dependencies change.
+
+  Safe to use from several threads.
+*/
+
+class DependencyGraph
+{
+public:
+    DependencyGraph(const Dependencies &dependencies);
+
+    enum Direction {
+        Includes, // files the argument includes, directly or not
+        Dependents // files that include the argument, directly or not
+    };
+
+    // fileId and everything reachable from it, null if fileId isn't in the graph
+    std::shared_ptr<const Set<uint32_t> > closure(uint32_t fileId, Direction direction) const;
+    // whether to is reachable from from, O(1) once from's closure is memoized
+    bool reaches(uint32_t from, uint32_t to, Direction direction) const;
+    // whether match returns true for fileId or anything reachable from it
+    bool any(uint32_t fileId, Direction direction, const std::function<bool(uint32_t)> &match) const;
+    size_t size() const { return mFileIds.size(); }
+    // every file in the graph, in no particular order
+    const std::vector<uint32_t> &fileIds() const { return mFileIds; }
+private:
+    enum { NoIndex = 0xffffffff };
+    enum { MaxClosureBytes = 64 * 1024 * 1024 };
+    uint32_t index(uint32_t fileId) const { return mIndexes.value(fileId, NoIndex); }
+
+    struct Closure {
+        std::vector<uint64_t> bits; // by dense index
+        std::shared_ptr<const Set<uint32_t> > fileIds; // made by closure() on demand
+    };
+    std::shared_ptr<Closure> reachable(uint32_t idx, Direction direction) const;
+
+    struct Adjacency {
+        std::vector<uint32_t> offsets, edges; // edges of n are edges[offsets[n]..offsets[n + 1]]
+    };
+
+    template <typename Visitor>
+    void traverse(uint32_t idx, Direction direction, Visitor visitor) const;
+
+    std::vector<uint32_t> mFileIds;
+    Hash<uint32_t, uint32_t> mIndexes;
+    Adjacency mAdjacency[2];
+
+    mutable std::mutex mMutex;
+    mutable Hash<uint64_t, std::shared_ptr<Closure> > mClosures;
+    mutable size_t mClosureBytes;
+};
+
+#endif
@@ -0,0 +1,94 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "FileIndex.h"
+
+#include <algorithm>
+
+enum { CompactThreshold = 4096 };
+
+FileIndex::FileIndex()
+    : mIndex(CompactThreshold)
+{
+}
+
+void FileIndex::clear()
+{
+    mDirs.clear();
+    mDirIds.clear();
+    mIds.clear();
+    mIndex.clear();
+}
+
+void FileIndex::insert(const Path &dir, const String &name)
+{
+    uint32_t &dirId = mDirIds[dir];
+    if (!dirId) {
+        mDirs.append(dir);
+        dirId = mDirs.size(); // 0 means new, the index is dirId - 1
+    }
+    uint32_t &id = mIds[dirId - 1][name];
+    if (!id)
+        id = mIndex.insert(dir + name, File { dirId - 1, name }) + 1;
+}
+
+void FileIndex::remove(const Path &dir, const String &name)
+{
+    const uint32_t dirId = mDirIds.value(dir);
+    if (!dirId)
+        return;
+    auto ids = mIds.find(dirId - 1);
+    if (ids == mIds.end())
+        return;
+    auto it = ids->second.find(name);
+    if (it == ids->second.end())
+        return;
+    mIndex.remove(it->second - 1);
+    ids->second.erase(it);
+    if (ids->second.isEmpty())
+        mIds.erase(ids);
+    compact();
+}
+
+void FileIndex::removeDirectory(const Path &dir)
+{
+    const uint32_t dirId = mDirIds.value(dir);
+    if (!dirId)
+        return;
+    auto ids = mIds.find(dirId - 1);
+    if (ids == mIds.end())
+        return;
+    for (const auto &it : ids->second)
+        mIndex.remove(it.second - 1);
+    mIds.erase(ids);
+    compact();
+}
+
+void FileIndex::compact()
+{
+    if (!mIndex.needsCompact())
+        return;
+    mIndex.compact([this](const File &file) { return mDirs.at(file.dir) + file.name; },
+                   [this](const File &file, uint32_t id) { mIds[file.dir][file.name] = id + 1; });
+}
+
+bool FileIndex::candidates(const List<String> &literals, List<std::pair<Path, String> > &out) const
+{
+    const size_t start = out.size();
+    if (!mIndex.candidates(literals, [this, &out](const File &file) { out.append(std::make_pair(mDirs.at(file.dir), file.name)); }))
+        return false;
+    std::sort(out.begin() + start, out.end());
+    return true;
+}
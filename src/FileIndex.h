@@ -0,0 +1,61 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef FileIndex_h
+#define FileIndex_h
+
+#include <cstdint>
+
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Path.h"
+#include "rct/String.h"
+#include "TrigramIndex.h"
+
+/*
+  Trigram index over the paths of a project's files, relative to the
+  project root, see TrigramIndex.
+*/
+
+class FileIndex
+{
+public:
+    FileIndex();
+
+    void clear();
+    // dir is relative to the project root and ends with a slash, or is empty
+    void insert(const Path &dir, const String &name);
+    void remove(const Path &dir, const String &name);
+    void removeDirectory(const Path &dir);
+    size_t size() const { return mIndex.size(); }
+
+    // Appends (dir, name) for every file whose path might contain all of
+    // literals, sorted the same way as Files. Returns false if the literals
+    // are too short to rule anything out.
+    bool candidates(const List<String> &literals, List<std::pair<Path, String> > &out) const;
+private:
+    struct File {
+        uint32_t dir;
+        String name;
+    };
+    void compact();
+
+    List<Path> mDirs;
+    Hash<Path, uint32_t> mDirIds;
+    Hash<uint32_t, Hash<String, uint32_t> > mIds; // dir -> name -> id + 1
+    TrigramIndex<File> mIndex;
+};
+
+#endif
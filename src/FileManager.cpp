@@ -20,8 +20,17 @@
 #include "ScanThread.h"
 #include "Server.h"
 
+// the part of path below root, false if it isn't below root
+static inline bool relativePath(const Path &path, const Path &root, Path &relative)
+{
+    if (!path.startsWith(root))
+        return false;
+    relative = path.mid(root.size());
+    return true;
+}
+
 FileManager::FileManager(const std::shared_ptr<Project> &project)
-    : mProject(project), mLastReloadTime(0)
+    : mProject(project), mLastReloadTime(0), mIndexed(false)
 {
 }
 
@@ -36,35 +45,76 @@ void FileManager::load(Mode mode)
     if (mode == Asynchronous) {
         startScanThread();
     } else {
-        const Set<Path> paths = ScanThread::paths(project->path());
-        onRecurseJobFinished(paths);
+        onRecurseJobFinished(ScanThread::scan(project->path(), Server::instance()->options().excludeFilters,
+                                              snapshotFile(project)));
     }
 }
 
-void FileManager::onRecurseJobFinished(const Set<Path> &paths)
+Path FileManager::snapshotFile(const std::shared_ptr<Project> &project)
+{
+    return project->projectDataDir() + "files";
+}
+
+void FileManager::onRecurseJobFinished(Files &&files)
 {
     std::lock_guard<std::mutex> lock(mMutex); // ### is this needed now?
 
     std::shared_ptr<Project> project = mProject.lock();
     if (!project)
         return;
+    // Only touch the watches that need it. Compare against what's watched
+    // rather than against files(), clearFileSystemWatcher() drops the
+    // watches but leaves files() alone.
     Files &map = project->files();
-    map.clear();
-    clearFileSystemWatcher();
-    for (Set<Path>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
-        const Path parent = it->parentDir();
-        if (parent.isEmpty()) {
-            error() << "Got empty parent here" << *it;
-            continue;
+    const Hash<Path, Flags<Project::WatchMode> > watched = project->watchedPaths();
+    for (const auto &dir : map) {
+        if (!files.contains(dir.first) && watched.value(dir.first) & Project::Watch_FileManager)
+            project->unwatch(dir.first, Project::Watch_FileManager);
+    }
+    for (const auto &dir : files) {
+        if (!(watched.value(dir.first) & Project::Watch_FileManager))
+            watch(dir.first);
+    }
+
+    // mIndex mirrors files() once it's been built, after that only the
+    // files that came or went are touched
+    const Path &root = project->path();
+    Path relative;
+    if (!mIndexed) {
+        mIndex.clear();
+        for (const auto &dir : files) {
+            if (relativePath(dir.first, root, relative)) {
+                for (const String &name : dir.second)
+                    mIndex.insert(relative, name);
+            }
         }
-        assert(!parent.isEmpty());
-        Set<String> &dir = map[parent];
-        if (dir.isEmpty()) {
-            watch(parent);
-            // error() << "Watching parent" << parent;
+        mIndexed = true;
+    } else {
+        for (const auto &dir : map) {
+            if (!files.contains(dir.first) && relativePath(dir.first, root, relative))
+                mIndex.removeDirectory(relative);
+        }
+        for (const auto &dir : files) {
+            if (!relativePath(dir.first, root, relative))
+                continue;
+            auto old = map.find(dir.first);
+            if (old == map.end()) {
+                for (const String &name : dir.second)
+                    mIndex.insert(relative, name);
+            } else if (old->second != dir.second) {
+                for (const String &name : old->second) {
+                    if (!dir.second.contains(name))
+                        mIndex.remove(relative, name);
+                }
+                for (const String &name : dir.second) {
+                    if (!old->second.contains(name))
+                        mIndex.insert(relative, name);
+                }
+            }
         }
-        dir.insert(it->fileName());
     }
+
+    map = std::move(files);
     assert(!map.contains(Path()));
 }
 
@@ -95,6 +145,9 @@ void FileManager::onFileAdded(const Path &path)
         Set<String> &dir = map[parent];
         watch(parent);
         dir.insert(path.fileName());
+        Path relative;
+        if (relativePath(parent, project->path(), relative))
+            mIndex.insert(relative, path.fileName());
     } else {
         error() << "Got empty parent here" << path;
         load(Asynchronous);
@@ -112,8 +165,14 @@ void FileManager::onFileRemoved(const Path &path)
     if (!project)
         return;
     Files &map = project->files();
-    if (!map.remove(path)) {
+    Path relative;
+    if (map.remove(path)) {
+        if (relativePath(path, project->path(), relative))
+            mIndex.removeDirectory(relative);
+    } else {
         const Path parent = path.parentDir();
+        if (relativePath(parent, project->path(), relative))
+            mIndex.remove(relative, path.fileName());
         if (map.contains(parent)) {
             Set<String> &dir = map[parent];
             dir.remove(String(path.fileName()));
@@ -145,6 +204,12 @@ bool FileManager::contains(const Path &path) const
     return false;
 }
 
+bool FileManager::candidates(const List<String> &literals, List<std::pair<Path, String> > &out) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mIndex.candidates(literals, out);
+}
+
 void FileManager::watch(const Path &path)
 {
     if (Server::instance()->options().options & Server::NoFileManagerWatch)
@@ -161,12 +226,12 @@ void FileManager::startScanThread()
 {
     std::shared_ptr<Project> project = mProject.lock();
     assert(project);
-    ScanThread *thread = new ScanThread(project->path());
+    ScanThread *thread = new ScanThread(project->path(), snapshotFile(project));
     thread->setAutoDelete(true);
     std::weak_ptr<FileManager> that = shared_from_this();
-    thread->finished().connect<EventLoop::Move>([that](const Set<Path> &paths) {
+    thread->finished().connect<EventLoop::Move>([that](Files files) {
             if (auto strong = that.lock())
-                strong->onRecurseJobFinished(paths);
+                strong->onRecurseJobFinished(std::move(files));
         });
 
     thread->start();
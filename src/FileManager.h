@@ -18,8 +18,10 @@
 
 #include <mutex>
 
+#include "FileIndex.h"
 #include "rct/Path.h"
 #include "rct/Timer.h"
+#include "RTags.h"
 
 class Project;
 class FileManager : public std::enable_shared_from_this<FileManager>
@@ -35,14 +37,19 @@ public:
     uint64_t lastReloadTime() const { return mLastReloadTime; }
     void onFileAdded(const Path &path);
     void onFileRemoved(const Path &path);
-    void onRecurseJobFinished(const Set<Path> &mPaths);
+    void onRecurseJobFinished(Files &&files);
     bool contains(const Path &path) const;
+    // see FileIndex::candidates, dirs are relative to the project root
+    bool candidates(const List<String> &literals, List<std::pair<Path, String> > &out) const;
     void clearFileSystemWatcher();
 private:
     void startScanThread();
+    static Path snapshotFile(const std::shared_ptr<Project> &project);
     void watch(const Path &path);
     std::weak_ptr<Project> mProject;
     uint64_t mLastReloadTime;
+    FileIndex mIndex;
+    bool mIndexed; // mIndex has been built from a full scan
     mutable std::mutex mMutex;
 };
 
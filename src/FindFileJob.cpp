@@ -15,6 +15,13 @@
 
 #include "FindFileJob.h"
 
+#include <algorithm>
+#include <climits>
+#include <ctype.h>
+#include <queue>
+#include <string.h>
+#include <vector>
+
 #include "FileManager.h"
 #include "Project.h"
 #include "rct/SignalSlot.h"
@@ -29,6 +36,137 @@ static Flags<QueryJob::JobFlag> flags(Flags<QueryMessage::Flag> queryFlags)
     return flags;
 }
 
+namespace {
+// Scores pattern as a case insensitive subsequence of a path. Every matched
+// character is worth Match plus a bonus for starting a path segment, a word
+// or a camel case hump, and Consecutive more if it follows the previous
+// match directly. Skipped characters between matches cost Gap each.
+class FuzzyScorer
+{
+public:
+    enum {
+        Match = 16,
+        Consecutive = 8,
+        SegmentBonus = 12, // after '/'
+        WordBonus = 8, // after '_', '-', '.' or ' '
+        CamelBonus = 6, // upper case after lower case
+        Gap = 1
+    };
+
+    FuzzyScorer(const String &pattern)
+        : mMask(0)
+    {
+        mPattern.resize(pattern.size());
+        for (size_t i=0; i<pattern.size(); ++i) {
+            mPattern[i] = fold(pattern.at(i));
+            mMask |= bit(mPattern[i]);
+        }
+    }
+
+    // An upper bound for score(path) from the m best bonuses in path, INT_MIN
+    // if pattern isn't a subsequence of path. Leaves mPath and mBonus set up
+    // for score().
+    int bound(const String &path)
+    {
+        const int m = mPattern.size(), n = path.size();
+        if (n < m)
+            return INT_MIN;
+        const char *str = path.constData();
+        mPath.resize(n);
+        uint64_t mask = 0;
+        for (int j=0; j<n; ++j) {
+            mPath[j] = fold(str[j]);
+            mask |= bit(mPath[j]);
+        }
+        if (mMask & ~mask)
+            return INT_MIN;
+        int matched = 0;
+        for (int j=0; j<n && matched<m; ++j)
+            matched += mPath[j] == mPattern[matched];
+        if (matched < m)
+            return INT_MIN;
+
+        // Bound the score with the m best bonuses before doing the real work
+        mBonus.resize(n);
+        int counts[3] = { 0, 0, 0 };
+        for (int j=0; j<n; ++j) {
+            mBonus[j] = bonus(j ? str[j - 1] : '/', str[j]);
+            counts[0] += mBonus[j] == SegmentBonus;
+            counts[1] += mBonus[j] == WordBonus;
+            counts[2] += mBonus[j] == CamelBonus;
+        }
+        int bound = m * Match + (m - 1) * Consecutive, left = m;
+        const int bonuses[] = { SegmentBonus, WordBonus, CamelBonus };
+        for (int i=0; i<3 && left; ++i) {
+            const int count = std::min(left, counts[i]);
+            bound += count * bonuses[i];
+            left -= count;
+        }
+        return bound;
+    }
+
+    // INT_MIN if pattern isn't a subsequence of path or can't score more
+    // than floor
+    int score(const String &path, int floor = INT_MIN)
+    {
+        if (bound(path) <= floor)
+            return INT_MIN;
+        const int m = mPattern.size(), n = path.size();
+
+        // Row i has the best scores for the first i + 1 characters of the
+        // pattern. matches[j + 1] is the best one with character i matched
+        // at j, best[j + 1] the best one with it matched anywhere up to j.
+        // The first loop only looks at the previous row so it vectorizes,
+        // the second is a running max.
+        enum { None = INT_MIN / 2 };
+        mPrevMatches.assign(n + 1, None);
+        mPrevBest.assign(n + 1, 0);
+        mMatches.resize(n + 1);
+        mBest.resize(n + 1);
+        for (int i=0; i<m; ++i) {
+            const char ch = mPattern[i];
+            mMatches[0] = None;
+            for (int j=0; j<n; ++j) {
+                const int score = std::max(mPrevBest[j], mPrevMatches[j] + Consecutive) + Match + mBonus[j];
+                mMatches[j + 1] = mPath[j] == ch ? score : None;
+            }
+            mBest[0] = None;
+            for (int j=0; j<n; ++j)
+                mBest[j + 1] = std::max(mMatches[j + 1], mBest[j] - Gap);
+            mPrevMatches.swap(mMatches);
+            mPrevBest.swap(mBest);
+        }
+        const int ret = *std::max_element(mPrevMatches.begin() + 1, mPrevMatches.end());
+        return ret > floor ? ret : INT_MIN;
+    }
+private:
+    static inline char fold(char ch)
+    {
+        return ch >= 'A' && ch <= 'Z' ? ch + ('a' - 'A') : ch;
+    }
+
+    static inline uint64_t bit(char ch)
+    {
+        return 1ull << (static_cast<unsigned char>(ch) & 63);
+    }
+
+    static inline int bonus(char prev, char ch)
+    {
+        if (prev == '/')
+            return SegmentBonus;
+        if (prev == '_' || prev == '-' || prev == '.' || prev == ' ')
+            return WordBonus;
+        if (islower(static_cast<unsigned char>(prev)) && isupper(static_cast<unsigned char>(ch)))
+            return CamelBonus;
+        return 0;
+    }
+
+    std::vector<char> mPattern, mPath;
+    uint64_t mMask;
+    std::vector<int> mBonus, mPrevMatches, mPrevBest, mMatches, mBest;
+};
+}
+
 FindFileJob::FindFileJob(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Project> &project)
     : QueryJob(query, project, ::flags(query->flags()))
 {
@@ -40,6 +178,7 @@ FindFileJob::FindFileJob(const std::shared_ptr<QueryMessage> &query, const std::
             } else {
                 mRegex.assign(q.ref());
             }
+            mRequired = RTags::requiredLiterals(q);
         } else {
             mPattern = q;
         }
@@ -82,7 +221,8 @@ int FindFileJob::execute()
     assert(proj->fileManager());
     if (dirs.isEmpty())
         proj->fileManager()->load(FileManager::Synchronous);
-    Files::const_iterator dirit = dirs.begin();
+    if (queryFlags() & QueryMessage::FindFileFuzzy && !mPattern.isEmpty())
+        return findFuzzy(srcRoot, dirs);
     bool foundExact = false;
     const int patternSize = mPattern.size();
     List<String> matches;
@@ -98,70 +238,104 @@ int FindFileJob::execute()
         }
         return write(path);
     };
-    while (dirit != dirs.end()) {
-        const Path &dir = dirit->first;
-        if (dir.size() < srcRoot.size()) {
-            continue;
-        } else {
-            out.append(dir.constData() + srcRoot.size(), dir.size() - srcRoot.size());
-        }
-
-        const Set<String> &files = dirit->second;
-        for (Set<String>::const_iterator it = files.begin(); it != files.end(); ++it) {
-            const String &key = *it;
-            out.append(key);
-            bool ok = false;
-            switch (mode) {
-            case All:
-                ok = true;
-                break;
-            case Regex:
-                ok = Rct::contains(out, mRegex);
-                break;
-            case FilePath:
-            case Pattern:
-                if (!preferExact) {
-                    ok = out.contains(mPattern, cs);
-                } else {
-                    const int outSize = out.size();
-                    const bool exact = (outSize > patternSize && out.endsWith(mPattern) && out.at(outSize - (patternSize + 1)) == '/');
-                    if (exact) {
-                        ok = true;
-                        if (!foundExact) {
-                            matches.clear();
-                            foundExact = true;
-                        }
-                    } else {
-                        ok = !foundExact && out.contains(mPattern, cs);
+    // out is the path of a file, returns false if writing failed
+    auto match = [&]() {
+        bool ok = false;
+        switch (mode) {
+        case All:
+            ok = true;
+            break;
+        case Regex:
+            ok = Rct::contains(out, mRegex);
+            break;
+        case FilePath:
+        case Pattern:
+            if (!preferExact) {
+                ok = out.contains(mPattern, cs);
+            } else {
+                const int outSize = out.size();
+                const bool exact = (outSize > patternSize && out.endsWith(mPattern) && out.at(outSize - (patternSize + 1)) == '/');
+                if (exact) {
+                    ok = true;
+                    if (!foundExact) {
+                        matches.clear();
+                        foundExact = true;
                     }
-                }
-                if (!ok && mode == FilePath) {
-                    Path p(out);
-                    if (!absolutePath)
-                        p.prepend(srcRoot);
-                    p.resolve();
-                    if (p == mPattern)
-                        ok = true;
-                }
-                break;
-            }
-            if (ok) {
-                ret = 0;
-
-                Path matched = out;
-                if (absolutePath)
-                    matched.resolve();
-                if (preferExact && !foundExact) {
-                    matches.append(matched);
                 } else {
-                    if (!writeFile(matched))
-                        return 1;
+                    ok = !foundExact && out.contains(mPattern, cs);
                 }
             }
-            out.chop(key.size());
+            if (!ok && mode == FilePath) {
+                Path p(out);
+                if (!absolutePath)
+                    p.prepend(srcRoot);
+                p.resolve();
+                if (p == mPattern)
+                    ok = true;
+            }
+            break;
+        }
+        if (ok) {
+            ret = 0;
+
+            Path matched = out;
+            if (absolutePath)
+                matched.resolve();
+            if (preferExact && !foundExact) {
+                matches.append(matched);
+            } else {
+                if (!writeFile(matched))
+                    return false;
+            }
+        }
+        return true;
+    };
+
+    // Narrow things down with the trigram index when the query has
+    // literals that have to be in the path. FilePath can match through
+    // symlinks so it always looks at everything.
+    List<std::pair<Path, String> > candidates;
+    bool indexed = false;
+    if (mode == Pattern || mode == Regex) {
+        List<String> literals = mode == Pattern ? List<String>(1, mPattern) : mRequired;
+        if (absolutePath) {
+            // out starts with srcRoot, the index only knows what comes after it
+            const String root = srcRoot.toLower();
+            List<String> below;
+            for (const String &literal : literals) {
+                const String lower = literal.toLower();
+                bool overlaps = root.contains(lower);
+                for (size_t i=1; !overlaps && i<lower.size() && i<=root.size(); ++i)
+                    overlaps = root.endsWith(lower.left(i));
+                if (!overlaps)
+                    below.append(literal);
+            }
+            literals = std::move(below);
+        }
+        indexed = proj->fileManager()->candidates(literals, candidates);
+    }
+
+    if (indexed) {
+        for (const auto &candidate : candidates) {
+            out.append(candidate.first);
+            out.append(candidate.second);
+            if (!match())
+                return 1;
+            out.chop(candidate.first.size() + candidate.second.size());
+        }
+    } else {
+        for (const auto &dir : dirs) {
+            if (dir.first.size() < srcRoot.size())
+                continue;
+            out.append(dir.first.constData() + srcRoot.size(), dir.first.size() - srcRoot.size());
+            for (const String &key : dir.second) {
+                out.append(key);
+                if (!match())
+                    return 1;
+                out.chop(key.size());
+            }
+            out.chop(dir.first.size() - srcRoot.size());
         }
-        out.chop(dir.size() - srcRoot.size());
-        ++dirit;
     }
     for (List<String>::const_iterator it = matches.begin(); it != matches.end(); ++it) {
         if (!writeFile(*it)) {
@@ -172,3 +346,83 @@ int FindFileJob::execute()
         return 1;
     return ret;
 }
+
+int FindFileJob::findFuzzy(const Path &srcRoot, const Files &dirs)
+{
+    // The best files so far with the worst on top, a file has to beat that
+    // one to get in. Ties go to the file that was seen first.
+    struct Ranked {
+        int score;
+        size_t order;
+        String path;
+        bool operator<(const Ranked &other) const
+        {
+            return score > other.score || (score == other.score && order < other.order);
+        }
+    };
+    const int queryMax = queryMessage()->max();
+    const size_t max = queryMax > 0 ? queryMax : DefaultFuzzyMax;
+    FuzzyScorer scorer(mPattern);
+
+    // Collect the files the pattern is a subsequence of with a cheap upper
+    // bound for their score and score them best bound first. Once a full
+    // heap's worst entry beats the next bound nothing after it can get in.
+    List<Ranked> candidates;
+    String path;
+    path.reserve(PATH_MAX);
+    size_t order = 0;
+    for (const auto &dir : dirs) {
+        if (dir.first.size() < srcRoot.size())
+            continue;
+        path.assign(dir.first.constData() + srcRoot.size(), dir.first.size() - srcRoot.size());
+        for (const String &name : dir.second) {
+            path.append(name);
+            const int bound = scorer.bound(path);
+            if (bound != INT_MIN)
+                candidates.append(Ranked { bound, order, path });
+            ++order;
+            path.chop(name.size());
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    std::priority_queue<Ranked> best;
+    for (Ranked &candidate : candidates) {
+        const bool full = best.size() == max;
+        if (full && !(candidate < best.top()))
+            break;
+        const int score = scorer.score(candidate.path, full ? best.top().score - 1 : INT_MIN);
+        if (score == INT_MIN)
+            continue;
+        candidate.score = score;
+        if (full) {
+            if (!(candidate < best.top()))
+                continue;
+            best.pop();
+        }
+        best.push(std::move(candidate));
+    }
+
+    List<String> ranked(best.size());
+    for (size_t i=ranked.size(); i>0; --i) {
+        ranked[i - 1] = best.top().path;
+        best.pop();
+    }
+    if (ranked.isEmpty())
+        return 1;
+    const bool elisp = queryFlags() & QueryMessage::Elisp;
+    if (elisp && !write("(list", DontQuote))
+        return 1;
+    for (const String &file : ranked) {
+        Path matched = file;
+        if (queryFlags() & QueryMessage::AbsolutePath) {
+            matched.prepend(srcRoot);
+            matched.resolve();
+        }
+        if (!write(matched))
+            return 1;
+    }
+    if (elisp && !write(")", DontQuote))
+        return 1;
+    return 0;
+}
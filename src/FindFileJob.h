@@ -28,8 +28,13 @@ public:
 protected:
     virtual int execute() override;
 private:
+    enum { DefaultFuzzyMax = 100 };
+    // --find-file-fuzzy, the best max() files by FuzzyScorer
+    int findFuzzy(const Path &srcRoot, const Files &dirs);
+
     String mPattern;
     std::regex mRegex;
+    List<String> mRequired; // literals every match of mRegex contains
 };
 
 #endif
@@ -42,7 +42,7 @@ static inline List<Path> headersForSymbol(const std::shared_ptr<Project> &projec
         ret.append(path);
         if (const DependencyNode *node = project->dependencies().value(loc.fileId())) {
             for (const auto &dependent : node->dependents) {
-                const Path p = Location::path(dependent.first);
+                const Path &p = Location::path(dependent.first);
                 if (p.isHeader() && dependent.second->includes.size() == 1) {
                     ret.append(p);
                     // allow headers that only include one header if we don't
@@ -82,7 +82,7 @@ int IncludeFileJob::execute()
                     List<String> alternatives;
                     if (path.startsWith(directory))
                         alternatives << String::format<256>("#include \"%s\"", path.mid(directory.size()).constData());
-                    for (const Source::Include &inc : mSource.includePaths) {
+                    for (const Source::Include &inc : *mSource.includePaths) {
                         const Path p = inc.path.ensureTrailingSlash();
                         if (path.startsWith(p)) {
                             const String str = String::format<256>("#include <%s>", path.mid(p.size()).constData());
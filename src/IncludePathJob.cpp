@@ -58,8 +58,9 @@ int IncludePathJob::execute()
     if (!proj)
         return 1;
     const Path projectPath = proj->path();
+    const std::shared_ptr<const DependencyGraph> graph = proj->dependencyGraph();
     for (const auto &target : targets) {
-        DependencyNode *depNode = project()->dependencyNode(location.fileId());
+        DependencyNode *depNode = proj->dependencyNode(location.fileId());
         if (depNode) {
             List<uint32_t> paths;
             bool done = false;
@@ -82,7 +83,9 @@ int IncludePathJob::execute()
                             done = true;
                     } else if (paths.size() < static_cast<size_t>(maxDepth)) {
                         for (const auto &includeNode : n->includes) {
-                            process(includeNode.second);
+                            // no point going down includes that can't lead to the target
+                            if (graph->reaches(includeNode.first, target.location.fileId(), DependencyGraph::Includes))
+                                process(includeNode.second);
                         }
                     }
                     paths.removeLast();
@@ -29,11 +29,13 @@ public:
     enum { MessageId = IndexDataMessageId };
 
     IndexDataMessage(const std::shared_ptr<IndexerJob> &job)
-        : RTagsMessage(MessageId), mParseTime(0), mId(0), mIndexerJobFlags(job->flags), mBytesWritten(0)
+        : RTagsMessage(MessageId), mParseTime(0), mId(0), mIndexerJobFlags(job->flags), mBytesWritten(0),
+          mVisitFileQueries(0), mVisitFileTime(0)
     {}
 
     IndexDataMessage()
-        : RTagsMessage(MessageId), mParseTime(0), mId(0), mBytesWritten(0)
+        : RTagsMessage(MessageId), mParseTime(0), mId(0), mBytesWritten(0),
+          mVisitFileQueries(0), mVisitFileTime(0)
     {}
 
     void encode(Serializer &serializer) const override;
@@ -42,7 +44,8 @@ public:
     enum Flag {
         None = 0x0,
         ParseFailure = 0x1,
-        UsedPCH = 0x2
+        UsedPCH = 0x2,
+        BuiltPreamble = 0x4
     };
     Flags<Flag> flags() const { return mFlags; }
     void setFlags(Flags<Flag> f) { mFlags = f; }
@@ -77,6 +80,11 @@ public:
     uint64_t parseTime() const { return mParseTime; }
     void setParseTime(uint64_t time) { mParseTime = time; }
 
+    // how many VisitFileMessages rp sent and how long it waited for the answers
+    uint32_t visitFileQueries() const { return mVisitFileQueries; }
+    uint32_t visitFileTime() const { return mVisitFileTime; } // ms
+    void setVisitFileTime(uint32_t queries, uint32_t time) { mVisitFileQueries = queries; mVisitFileTime = time; }
+
     Flags<IndexerJob::Flag> indexerJobFlags() const { return mIndexerJobFlags; }
     void setIndexerJobFlags(Flags<IndexerJob::Flag> flags) { mIndexerJobFlags = flags; }
 
@@ -97,6 +105,10 @@ public:
     size_t bytesWritten() const { return mBytesWritten; }
     void setBytesWritten(size_t bytes) { mBytesWritten = bytes; }
 
+    // Files written by a remote rp, relative to the project's data dir
+    Hash<Path, String> &shards() { return mShards; }
+    const Hash<Path, String> &shards() const { return mShards; }
+
     void clear()
     {
         clearCache();
@@ -111,6 +123,8 @@ public:
         mFiles.clear();
         mFlags.clear();
         mBytesWritten = 0;
+        mShards.clear();
+        mVisitFileQueries = mVisitFileTime = 0;
     }
 private:
     Path mProject;
@@ -123,6 +137,8 @@ private:
     Hash<uint32_t, Flags<FileFlag> > mFiles;
     Flags<Flag> mFlags;
     size_t mBytesWritten;
+    Hash<Path, String> mShards;
+    uint32_t mVisitFileQueries, mVisitFileTime;
 };
 
 RCT_FLAGS(IndexDataMessage::Flag);
@@ -131,13 +147,15 @@ RCT_FLAGS(IndexDataMessage::FileFlag);
 inline void IndexDataMessage::encode(Serializer &serializer) const
 {
     serializer << mProject << mParseTime << mId << mIndexerJobFlags << mMessage
-               << mFixIts << mIncludes << mDiagnostics << mFiles << mFlags << mBytesWritten;
+               << mFixIts << mIncludes << mDiagnostics << mFiles << mFlags << mBytesWritten << mShards
+               << mVisitFileQueries << mVisitFileTime;
 }
 
 inline void IndexDataMessage::decode(Deserializer &deserializer)
 {
     deserializer >> mProject >> mParseTime >> mId >> mIndexerJobFlags >> mMessage
-                 >> mFixIts >> mIncludes >> mDiagnostics >> mFiles >> mFlags >> mBytesWritten;
+                 >> mFixIts >> mIncludes >> mDiagnostics >> mFiles >> mFlags >> mBytesWritten >> mShards
+                 >> mVisitFileQueries >> mVisitFileTime;
 }
 
 #endif
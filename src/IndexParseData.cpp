@@ -24,7 +24,7 @@ bool IndexParseData::write(const std::function<bool(const String &)> &write, con
                 return false;
 
             for (const auto &ss : sss) {
-                const Path file = Location::path(ss.first);
+                const Path &file = Location::path(ss.first);
                 if (match.isEmpty() || match.match(file)) {
                     write("  " + file + ":");
                     for (const auto &s : ss.second) {
@@ -35,12 +35,14 @@ public:
             : lastModifiedMs(0)
         {}
         CompileCommands(CompileCommands &&other)
-            : lastModifiedMs(other.lastModifiedMs), sources(std::move(other.sources)), environment(std::move(other.environment))
+            : lastModifiedMs(other.lastModifiedMs), sources(std::move(other.sources)), environment(std::move(other.environment)),
+              entries(std::move(other.entries))
         {
             other.lastModifiedMs = 0;
         }
         CompileCommands(const CompileCommands &other)
-            : lastModifiedMs(other.lastModifiedMs), sources(other.sources), environment(other.environment)
+            : lastModifiedMs(other.lastModifiedMs), sources(other.sources), environment(other.environment),
+              entries(other.entries)
         {}
 
         CompileCommands &operator=(CompileCommands &&other)
@@ -48,6 +50,7 @@ public:
             lastModifiedMs = other.lastModifiedMs;
             sources = std::move(other.sources);
             environment = std::move(other.environment);
+            entries = std::move(other.entries);
             other.lastModifiedMs = 0;
             return *this;
         }
@@ -57,6 +60,7 @@ public:
             lastModifiedMs = other.lastModifiedMs;
             sources = other.sources;
             environment = other.environment;
+            entries = other.entries;
             return *this;
         }
 
@@ -64,11 +68,13 @@ public:
         {
             lastModifiedMs = 0;
             sources.clear();
+            entries.clear();
         }
 
         uint64_t lastModifiedMs;
         Sources sources;
         List<String> environment;
+        Hash<uint64_t, Set<uint32_t> > entries; // CompileCommandsReader::Command::hash() -> source files
     };
     Hash<uint32_t, CompileCommands> compileCommands; // fileId for compile_commands.json -> CompileCommands
     List<String> environment;
@@ -80,13 +86,13 @@ public:
 
 inline Serializer &operator<<(Serializer &s, const IndexParseData::CompileCommands &commands)
 {
-    s << commands.lastModifiedMs << commands.sources << Sandbox::encoded(commands.environment);
+    s << commands.lastModifiedMs << commands.sources << Sandbox::encoded(commands.environment) << commands.entries;
     return s;
 }
 
 inline Deserializer &operator>>(Deserializer &s, IndexParseData::CompileCommands &commands)
 {
-    s >> commands.lastModifiedMs >> commands.sources >> commands.environment;
+    s >> commands.lastModifiedMs >> commands.sources >> commands.environment >> commands.entries;
     Sandbox::decode(commands.environment);
     return s;
 }
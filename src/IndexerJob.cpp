@@ -15,6 +15,8 @@
 
 #include "IndexerJob.h"
 
+#include <algorithm>
+
 #include "CompilerManager.h"
 #include "Project.h"
 #include "rct/Process.h"
@@ -29,7 +31,7 @@ IndexerJob::IndexerJob(const SourceList &s,
                        const std::shared_ptr<Project> &p,
                        const UnsavedFiles &u)
     : id(0), flags(f),
-      project(p->path()), unsavedFiles(u), crashCount(0), mCachedPriority(INT_MIN)
+      project(p->path()), unsavedFiles(u), crashCount(0), mCachedPriority(INT_MIN), mPreambleKey(UINT64_MAX)
 {
     sources.append(s.front());
     for (size_t i=1; i<s.size(); ++i) {
@@ -82,21 +84,13 @@ int IndexerJob::priority() const
             ret += 3;
             break;
         case Server::Inactive:
-            if (DependencyNode *node = p->dependencyNode(fileId)) {
-                Set<DependencyNode*> seen;
-                seen.insert(node);
-                std::function<bool(const DependencyNode *node)> func = [&seen, server, &func](const DependencyNode *n) {
-                    for (const auto &inc : n->includes) {
-                        if (seen.insert(inc.second)
-                            && !Location::path(n->fileId).isSystem()
-                            && (server->activeBufferType(n->fileId) != Server::Inactive || func(inc.second))) {
-                            return true;
-                        }
-                    }
-                    return false;
-                };
-                if (func(node))
-                    ret += 2;
+            // bump it if it includes a file that's open
+            if (p && p->dependencyGraph()->any(fileId, DependencyGraph::Includes, [fileId, server](uint32_t inc) {
+                        return (inc != fileId
+                                && server->activeBufferType(inc) != Server::Inactive
+                                && !Location::path(inc).isSystem());
+                    })) {
+                ret += 2;
             }
         }
 
@@ -107,6 +101,110 @@ int IndexerJob::priority() const
     return mCachedPriority;
 }
 
+static inline void hashCombine(uint64_t &hash, size_t h)
+{
+    hash ^= h + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+}
+
+static const char *skipSpace(const char *ch, const char *end)
+{
+    while (ch < end && isspace(static_cast<unsigned char>(*ch)))
+        ++ch;
+    return ch;
+}
+
+String IndexerJob::leadingIncludeBlock(const String &contents, size_t *length)
+{
+    String block;
+    const char *start = contents.constData();
+    const char *ch = start;
+    const char *end = ch + contents.size();
+    const char *stop = end;
+    bool inComment = false;
+    while (ch < end) {
+        const char *eol = static_cast<const char *>(memchr(ch, '\n', end - ch));
+        if (!eol)
+            eol = end;
+        const char *line = skipSpace(ch, eol);
+        ch = eol + 1;
+        while (line < eol) {
+            if (inComment) {
+                const char *close = std::search(line, eol, "*/", "*/" + 2);
+                if (close == eol) {
+                    line = eol;
+                } else {
+                    inComment = false;
+                    line = skipSpace(close + 2, eol);
+                }
+            } else if (eol - line >= 2 && line[0] == '/' && line[1] == '*') {
+                inComment = true;
+                line += 2;
+            } else {
+                break;
+            }
+        }
+        if (line == eol || (eol - line >= 2 && line[0] == '/' && line[1] == '/'))
+            continue;
+        if (*line == '#') {
+            const char *directive = skipSpace(line + 1, eol);
+            if (!strncmp(directive, "include", 7) || !strncmp(directive, "import", 6)) {
+                block.append(line, eol - line);
+                block.append('\n');
+                continue;
+            }
+        }
+        stop = line;
+        break;
+    }
+    if (length)
+        *length = std::min(stop, end) - start;
+    return block;
+}
+
+uint64_t IndexerJob::preambleKey() const
+{
+    if (mPreambleKey == UINT64_MAX) {
+        mPreambleKey = 0;
+        mPreambleBlock.clear();
+        if (sources.size() != 1 || unsavedFiles.contains(sourceFile))
+            return mPreambleKey;
+        const Source &source = sources.front();
+        switch (source.language) {
+        case Source::C:
+        case Source::CPlusPlus:
+        case Source::CPlusPlus11:
+            break;
+        default:
+            return mPreambleKey;
+        }
+
+        if (std::shared_ptr<Project> proj = Server::instance()->project(project)) {
+            mPreambleBlock = proj->includeBlock(sourceFileId(), sourceFile);
+        } else {
+            mPreambleBlock = leadingIncludeBlock(sourceFile.readAll(MaxPreambleScan));
+        }
+        if (mPreambleBlock.isEmpty())
+            return mPreambleKey;
+
+        std::hash<String> hasher;
+        uint64_t hash = source.includePathHash;
+        hashCombine(hash, hasher(mPreambleBlock));
+        hashCombine(hash, hasher(sourceFile.parentDir())); // quoted includes are relative to the source file
+        hashCombine(hash, source.compilerId);
+        hashCombine(hash, source.language);
+        for (const String &arg : *source.arguments)
+            hashCombine(hash, hasher(arg));
+        for (const Source::Define &def : *source.defines)
+            hashCombine(hash, hasher(def.toString()));
+        for (const Source::Include &inc : *source.includePaths) {
+            hashCombine(hash, hasher(inc.path));
+            hashCombine(hash, inc.type);
+        }
+        mPreambleKey = hash ? hash : 1;
+    }
+    return mPreambleKey;
+}
+
 String IndexerJob::encode() const
 {
     String ret;
@@ -119,23 +217,25 @@ String IndexerJob::encode() const
                    << options.sandboxRoot
                    << id
                    << options.socketFile
+                   << Server::instance()->visitFileSocketFile()
                    << project
                    << static_cast<uint32_t>(sources.size());
         for (Source copy : sources) {
+            List<String> &arguments = copy.arguments.write();
             if (!(options.options & Server::AllowWErrorAndWFatalErrors)) {
-                int idx = copy.arguments.indexOf("-Werror");
+                int idx = arguments.indexOf("-Werror");
                 if (idx != -1)
-                    copy.arguments.removeAt(idx);
-                idx = copy.arguments.indexOf("-Wfatal-errors");
+                    arguments.removeAt(idx);
+                idx = arguments.indexOf("-Wfatal-errors");
                 if (idx != -1)
-                    copy.arguments.removeAt(idx);
+                    arguments.removeAt(idx);
             }
-            copy.arguments << options.defaultArguments;
+            arguments << options.defaultArguments;
 
             if (!(options.options & Server::AllowPedantic)) {
-                const int idx = copy.arguments.indexOf("-Wpedantic");
+                const int idx = arguments.indexOf("-Wpedantic");
                 if (idx != -1) {
-                    copy.arguments.removeAt(idx);
+                    arguments.removeAt(idx);
                 }
             }
 
@@ -146,14 +246,15 @@ String IndexerJob::encode() const
             Server::instance()->filterBlockedArguments(copy);
 
             for (const auto &inc : options.includePaths) {
-                copy.includePaths << inc;
+                copy.includePaths.write() << inc;
             }
             if (Server::instance()->options().options & Server::PCHEnabled)
                 proj->fixPCH(copy);
 
-            copy.defines << options.defines;
+            Set<Source::Define> &defines = copy.defines.write();
+            defines << options.defines;
             if (!(options.options & Server::EnableNDEBUG)) {
-                copy.defines.remove(Source::Define("NDEBUG"));
+                defines.remove(Source::Define("NDEBUG"));
             }
             assert(!sourceFile.isEmpty());
             copy.encode(serializer, Source::IgnoreSandbox);
@@ -169,7 +270,8 @@ String IndexerJob::encode() const
                    << options.options
                    << unsavedFiles
                    << options.dataDir
-                   << options.debugLocations;
+                   << options.debugLocations
+                   << preamble;
 
         proj->encodeVisitedFiles(serializer);
     }
@@ -202,6 +304,12 @@ String IndexerJob::dumpFlags(Flags<Flag> flags)
     if (flags & Complete) {
         ret += "Complete";
     }
+    if (flags & BuildPreamble) {
+        ret += "BuildPreamble";
+    }
+    if (flags & UsePreamble) {
+        ret += "UsePreamble";
+    }
 
     return String::join(ret, ", ");
 }
@@ -36,6 +36,8 @@ public:
         NoAbort = 0x100,
         EditorOpen = 0x200, // opened in editor, the values of these are significant, EditorActive must be more than EditorOpen
         EditorActive = 0x400, // visible in editor
+        BuildPreamble = 0x800, // build the shared preamble for jobs with the same preambleKey()
+        UsePreamble = 0x1000, // parse with a shared preamble built by another job
         Type_Mask = Dirty|Compile|Reindex
     };
 
@@ -55,6 +57,16 @@ public:
     int priority() const;
     void recalculatePriority();
 
+    // Jobs with the same non-zero key have identical compile flags, live in
+    // the same directory and start with the same block of #include lines.
+    uint64_t preambleKey() const;
+    const String &preambleBlock() const { preambleKey(); return mPreambleBlock; }
+    // The #include/#import lines at the top of contents, blank lines and
+    // comments are skipped and anything else ends the block. length is set
+    // to where the first thing that isn't part of the block starts.
+    static String leadingIncludeBlock(const String &contents, size_t *length = nullptr);
+    enum { MaxPreambleScan = 64 * 1024 }; // bytes of a source leadingIncludeBlock() gets to see
+
     uint64_t id;
     SourceList sources;
     Path sourceFile;
@@ -63,10 +75,13 @@ public:
     UnsavedFiles unsavedFiles;
     Set<uint32_t> visited;
     int crashCount;
+    Path preamble;
     Signal<std::function<void(IndexerJob *)> > destroyed;
 
 private:
     mutable int mCachedPriority;
+    mutable uint64_t mPreambleKey;
+    mutable String mPreambleBlock;
     static uint64_t sNextId;
 };
 
@@ -0,0 +1,173 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef Interned_h
+#define Interned_h
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Serializer.h"
+
+/*
+  Hash-consed, reference counted, copy-on-write value. Equal values assigned
+  to an Interned<T> share one allocation, copying an Interned<T> copies a
+  pointer. write() detaches a private copy which is shared again by the next
+  intern(). Interned<T>::hash() has to be specialized for each T.
+
+  The table only holds weak references, values go away with their last
+  user.
+*/
+
+template <typename T>
+class Interned
+{
+public:
+    Interned()
+        : mData(empty()), mInterned(true)
+    {}
+    Interned(const T &t)
+        : mData(find(T(t))), mInterned(true)
+    {}
+    Interned(T &&t)
+        : mData(find(std::move(t))), mInterned(true)
+    {}
+
+    Interned &operator=(const T &t)
+    {
+        mData = find(T(t));
+        mInterned = true;
+        return *this;
+    }
+    Interned &operator=(T &&t)
+    {
+        mData = find(std::move(t));
+        mInterned = true;
+        return *this;
+    }
+
+    const T &operator*() const { return *mData; }
+    const T *operator->() const { return mData.get(); }
+
+    T &write()
+    {
+        if (mInterned || mData.use_count() > 1) {
+            mData = std::make_shared<T>(*mData);
+            mInterned = false;
+        }
+        // only reachable through this object, see above
+        return const_cast<T &>(*mData);
+    }
+
+    void intern()
+    {
+        if (!mInterned) {
+            mData = find(T(*mData));
+            mInterned = true;
+        }
+    }
+
+    void clear() { mData = empty(); mInterned = true; }
+
+    bool isShared(const Interned &other) const { return mData == other.mData; }
+    bool operator==(const Interned &other) const { return mData == other.mData || *mData == *other.mData; }
+    bool operator!=(const Interned &other) const { return !operator==(other); }
+
+    // identifies the shared value, for statistics
+    const void *id() const { return mData.get(); }
+
+    static uint64_t hash(const T &t);
+private:
+    struct Table {
+        std::mutex mutex;
+        Hash<uint64_t, List<std::weak_ptr<const T> > > buckets;
+        size_t size { 0 }, pruneAt { 1024 };
+    };
+    static Table &table()
+    {
+        static Table *sTable = new Table; // outlives static Sources
+        return *sTable;
+    }
+    static const std::shared_ptr<const T> &empty()
+    {
+        static const std::shared_ptr<const T> sEmpty = std::make_shared<const T>();
+        return sEmpty;
+    }
+    static std::shared_ptr<const T> find(T &&t)
+    {
+        if (t == *empty())
+            return empty();
+        const uint64_t h = hash(t);
+        Table &tab = table();
+        std::lock_guard<std::mutex> lock(tab.mutex);
+        List<std::weak_ptr<const T> > &bucket = tab.buckets[h];
+        for (size_t i=0; i<bucket.size(); ) {
+            if (std::shared_ptr<const T> existing = bucket.at(i).lock()) {
+                if (*existing == t)
+                    return existing;
+                ++i;
+            } else {
+                bucket.removeAt(i);
+                --tab.size;
+            }
+        }
+        std::shared_ptr<const T> ret = std::make_shared<const T>(std::move(t));
+        bucket.append(ret);
+        if (++tab.size >= tab.pruneAt) {
+            for (auto it = tab.buckets.begin(); it != tab.buckets.end(); ) {
+                auto &b = it->second;
+                for (size_t i=0; i<b.size(); ) {
+                    if (b.at(i).expired()) {
+                        b.removeAt(i);
+                        --tab.size;
+                    } else {
+                        ++i;
+                    }
+                }
+                if (b.isEmpty()) {
+                    it = tab.buckets.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            tab.pruneAt = std::max<size_t>(1024, tab.size * 2);
+        }
+        return ret;
+    }
+
+    std::shared_ptr<const T> mData;
+    bool mInterned;
+};
+
+template <typename T>
+inline Serializer &operator<<(Serializer &s, const Interned<T> &t)
+{
+    s << *t;
+    return s;
+}
+
+template <typename T>
+inline Deserializer &operator>>(Deserializer &s, Interned<T> &t)
+{
+    T value;
+    s >> value;
+    t = std::move(value);
+    return s;
+}
+
+#endif
@@ -15,14 +15,18 @@
 
 #include "JobScheduler.h"
 
+#include "CompilerManager.h"
 #include "IndexDataMessage.h"
 #include "IndexerJob.h"
 #include "Project.h"
 #include "rct/Connection.h"
 #include "rct/Process.h"
 #include "Server.h"
+#include "WorkerMessage.h"
 
 enum { MaxPriority = 10 };
+// the job that builds the preamble counts too
+enum { MinPreambleGroupSize = 3 };
 // we set the priority to be this when a job has been requested and we couldn't load it
 JobScheduler::JobScheduler()
     : mProcrastination(0), mStopped(false)
@@ -93,6 +97,10 @@ void JobScheduler::add(const std::shared_ptr<IndexerJob> &job)
     }
     assert(!mInactiveById.contains(job->id));
     mInactiveById[job->id] = node;
+    if (Server::instance()->options().options & Server::SharedPreambles) {
+        if (const uint64_t key = job->preambleKey())
+            ++mPreambles[key].pending;
+    }
     // error() << "procrash" << mProcrastination << job->sourceFile;
     if (!mProcrastination)
         startJobs();
@@ -109,10 +117,15 @@ void JobScheduler::startJobs()
     const auto &options = server->options();
     int slots = std::max<int>(0, options.jobCount - mActiveByProcess.size());
     int daemonSlots = std::max<int>(0, options.daemonCount - mActiveDaemonsByProcess.size());
+    size_t workerSlots = 0;
+    for (const auto &worker : mWorkers) {
+        if (worker.second->active.size() < worker.second->capacity)
+            workerSlots += worker.second->capacity - worker.second->active.size();
+    }
 
     debug() << "JobScheduler::startJobs" << "jobCount" << options.jobCount << "active" << mActiveByProcess.size() << "\n"
             << "slots" << slots << "daemonCount" << options.daemonCount << "active daemons" << mActiveDaemonsByProcess.size() << "\n"
-            << "daemonSlots" << daemonSlots;
+            << "daemonSlots" << daemonSlots << "workerSlots" << workerSlots;
 
     if (options.jobCount < mActiveByProcess.size()) {
         List<std::shared_ptr<Node> > nodes;
@@ -130,7 +143,11 @@ void JobScheduler::startJobs()
         }
     }
     std::shared_ptr<Node> node = mPendingJobs.first();
-    while (node && (slots || daemonSlots)) {
+    while (node && (slots || daemonSlots || workerSlots)) {
+        if (!probeCompilers(node->job)) {
+            node = node->next;
+            continue;
+        }
         const Server::ActiveBufferType type = Server::instance()->activeBufferType(node->job->sourceFileId());
         if (daemonSlots && type == Server::Active) {
             auto cand = mDaemons.end();
@@ -165,11 +182,14 @@ void JobScheduler::startJobs()
                 --daemonSlots;
                 std::shared_ptr<Node> tmp = node;
                 node = node->next;
-                mPendingJobs.remove(tmp);
+                removePending(tmp);
                 continue;
             }
         }
-        if (slots) {
+        if (slots && !preparePreamble(node->job)) {
+            // another job is building the preamble for this one
+            node = node->next;
+        } else if (slots) {
             Process *process = new Process;
             debug() << "Starting process for" << node->job->id << node->job->sourceFile << node->job.get();
             List<String> arguments;
@@ -213,7 +233,40 @@ void JobScheduler::startJobs()
             mInactiveById.remove(node->job->id);
             std::shared_ptr<Node> tmp = node;
             node = node->next;
-            mPendingJobs.remove(tmp);
+            removePending(tmp);
+        } else if (workerSlots && type != Server::Active) {
+            Worker *worker = nullptr;
+            for (const auto &w : mWorkers) {
+                const size_t available = w.second->capacity - std::min(w.second->capacity, w.second->active.size());
+                if (available && (!worker || available > worker->capacity - worker->active.size()))
+                    worker = w.second.get();
+            }
+            assert(worker);
+            // shared preambles live in the local data dir
+            node->job->flags &= ~(IndexerJob::BuildPreamble|IndexerJob::UsePreamble);
+            node->job->preamble.clear();
+            assert(!(node->job->flags & (IndexerJob::Crashed|IndexerJob::Aborted|IndexerJob::Complete|IndexerJob::Running)));
+            node->job->flags |= IndexerJob::Running;
+            WorkerMessage msg(WorkerMessage::Job, node->job->id);
+            msg.setPayload(node->job->encode());
+            if (!worker->connection->send(msg)) {
+                error() << "Couldn't send job to worker" << worker->name;
+                node->job->flags &= ~IndexerJob::Running;
+                workerSlots -= worker->capacity - worker->active.size();
+                worker->capacity = 0; // it's going away
+                node = node->next;
+                continue;
+            }
+            debug() << "Starting remote job for" << node->job->id << node->job->sourceFile << "on" << worker->name;
+            node->worker = worker;
+            node->started = Rct::monoMs();
+            worker->active[node->job->id] = node;
+            mActiveById[node->job->id] = node;
+            mInactiveById.remove(node->job->id);
+            --workerSlots;
+            std::shared_ptr<Node> tmp = node;
+            node = node->next;
+            removePending(tmp);
         } else {
             node = node->next;
         }
@@ -227,15 +280,123 @@ void JobScheduler::handleIndexDataMessage(const std::shared_ptr<IndexDataMessage
         warning() << "Got IndexDataMessage for unknown job" << message->id() << mActiveById.keys();
         return;
     }
-    debug() << "job got index data message" << node->job->id << node->job->sourceFileId() << node->job.get();
+    debug() << "job got index data message" << node->job->id << node->job->sourceFileId() << node->job.get()
+            << "waited" << message->visitFileTime() << "ms for" << message->visitFileQueries() << "visit file queries";
+    if (message->visitFileQueries()) {
+        ++mVisitFileWait.jobs;
+        mVisitFileWait.queries += message->visitFileQueries();
+        mVisitFileWait.time += message->visitFileTime();
+        mVisitFileWait.max = std::max(mVisitFileWait.max, message->visitFileTime());
+    }
+    if (!message->shards().isEmpty())
+        writeShards(message);
     jobFinished(node->job, message);
 }
 
+void JobScheduler::writeShards(const std::shared_ptr<IndexDataMessage> &message)
+{
+    const Path root = RTags::encodeSourceFilePath(Server::instance()->options().dataDir, message->project());
+    for (uint32_t fileId : message->visitedFiles()) {
+        const Path dir = root + String::number(fileId);
+        Path::rm(dir + "/unsaved");
+        Path::rm(dir + "/stat");
+    }
+    for (const auto &shard : message->shards()) {
+        if (shard.first.startsWith('/') || shard.first.contains("..")) {
+            error() << "Invalid shard path" << shard.first << "from" << message->project();
+            continue;
+        }
+        const Path path = root + shard.first;
+        Path::mkdir(path.parentDir(), Path::Recursive);
+        Path tmp = path;
+        tmp << ".tmp";
+        FILE *f = fopen(tmp.constData(), "w");
+        if (!f) {
+            error() << "Failed to open" << tmp << "for writing";
+            continue;
+        }
+        const bool ok = shard.second.isEmpty() || fwrite(shard.second.constData(), shard.second.size(), 1, f);
+        fclose(f);
+        if (!ok || rename(tmp.constData(), path.constData())) {
+            error() << "Failed to write" << path;
+            Path::rm(tmp);
+        }
+    }
+}
+
+void JobScheduler::handleWorkerMessage(const std::shared_ptr<WorkerMessage> &message, const std::shared_ptr<Connection> &conn)
+{
+    switch (message->type()) {
+    case WorkerMessage::Auth: // checked by Server
+        break;
+    case WorkerMessage::Hello: {
+        if (mWorkers.contains(conn.get())) {
+            error() << "Duplicate hello from worker" << message->name();
+            return;
+        }
+        auto worker = std::make_shared<Worker>();
+        worker->connection = conn;
+        worker->name = message->name();
+        worker->capacity = std::max(0, message->capacity());
+        mWorkers[conn.get()] = worker;
+        error() << "Worker" << worker->name << "connected with capacity" << worker->capacity;
+        startJobs();
+        break; }
+    case WorkerMessage::Finished: {
+        const std::shared_ptr<Worker> worker = mWorkers.value(conn.get());
+        if (!worker) {
+            error() << "Finished message from unknown worker";
+            return;
+        }
+        std::shared_ptr<Node> node = worker->active.take(message->jobId());
+        if (!node)
+            return;
+        node->worker = nullptr;
+        if (mActiveById.remove(message->jobId())) {
+            // rp exited without sending an IndexDataMessage
+            node->job->flags |= IndexerJob::Crashed;
+            debug() << "remote job crashed" << node->job->id << node->job->sourceFileId()
+                    << "on" << worker->name << "with" << message->returnCode();
+            auto msg = std::make_shared<IndexDataMessage>(node->job);
+            msg->setFlag(IndexDataMessage::ParseFailure);
+            jobFinished(node->job, msg);
+        }
+        startJobs();
+        break; }
+    default:
+        error() << "Unexpected worker message" << static_cast<int>(message->type());
+        break;
+    }
+}
+
+void JobScheduler::onConnectionDisconnected(Connection *conn)
+{
+    const std::shared_ptr<Worker> worker = mWorkers.take(conn);
+    if (!worker)
+        return;
+    error() << "Worker" << worker->name << "disconnected with" << worker->active.size() << "active jobs";
+    for (const auto &active : worker->active) {
+        const std::shared_ptr<Node> &node = active.second;
+        node->worker = nullptr;
+        if (mActiveById.remove(active.first)) {
+            node->job->flags |= IndexerJob::Crashed;
+            auto msg = std::make_shared<IndexDataMessage>(node->job);
+            msg->setFlag(IndexDataMessage::ParseFailure);
+            jobFinished(node->job, msg);
+        }
+    }
+    if (!mStopped)
+        startJobs();
+}
+
 void JobScheduler::jobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &message)
 {
     assert(!(job->flags & IndexerJob::Aborted));
     assert(job);
     assert(message);
+    if (job->flags & IndexerJob::BuildPreamble)
+        finishPreamble(job, message->flags() & IndexDataMessage::BuiltPreamble);
+    releasePreamble(job);
     std::shared_ptr<Project> project = Server::instance()->project(job->project);
     if (!project)
         return;
@@ -289,6 +450,34 @@ void JobScheduler::dumpJobs(const std::shared_ptr<Connection> &conn)
 
         }
     }
+
+    if (!mWorkers.isEmpty()) {
+        conn->write<1024>("Workers: %zu", mWorkers.size());
+        for (const auto &worker : mWorkers) {
+            conn->write<1024>("%s: %zu/%zu",
+                              worker.second->name.constData(),
+                              worker.second->active.size(),
+                              worker.second->capacity);
+        }
+    }
+
+    if (mVisitFileWait.jobs) {
+        conn->write<1024>("VisitFile: %zu queries from %zu jobs, waited %llums (%.1fms per job, %ums at most)",
+                          mVisitFileWait.queries, mVisitFileWait.jobs, mVisitFileWait.time,
+                          static_cast<double>(mVisitFileWait.time) / mVisitFileWait.jobs, mVisitFileWait.max);
+    }
+
+    if (!mPreambles.isEmpty()) {
+        static const char *states[] = { "Pending", "Building", "Ready", "Failed" };
+        conn->write<1024>("Shared preambles: %zu", mPreambles.size());
+        for (const auto &group : mPreambles) {
+            conn->write<1024>("%llx: %s %zu pending %zu running %s",
+                              static_cast<unsigned long long>(group.first),
+                              states[group.second.state],
+                              group.second.pending, group.second.running,
+                              group.second.file.constData());
+        }
+    }
 }
 
 void JobScheduler::dumpDaemons(const std::shared_ptr<Connection> &conn)
@@ -313,6 +502,9 @@ void JobScheduler::abort(const std::shared_ptr<IndexerJob> &job)
 {
     assert(!(job->flags & IndexerJob::Aborted));
     job->flags |= IndexerJob::Aborted;
+    if (job->flags & IndexerJob::BuildPreamble)
+        finishPreamble(job, false);
+    releasePreamble(job);
     if (job->flags & IndexerJob::Crashed) {
         return;
     }
@@ -322,11 +514,14 @@ void JobScheduler::abort(const std::shared_ptr<IndexerJob> &job)
         debug() << "Aborting inactive job" << job->sourceFile << job->sourceFileId() << job->id << job.get();
         node = mInactiveById.take(job->id);
         assert(node);
-        mPendingJobs.remove(node);
+        removePending(node);
     } else {
         debug() << "Aborting active job" << job->sourceFile << job->sourceFileId() << job->id << job.get();
     }
-    if (node->process) {
+    if (node->worker) {
+        debug() << "Aborting remote job on" << node->worker->name;
+        node->worker->connection->send(WorkerMessage(WorkerMessage::Abort, job->id));
+    } else if (node->process) {
         if (node->daemon) {
             debug() << "Killing process with SIGALRM" << node->process;
             node->process->kill(SIGALRM);
@@ -357,6 +552,130 @@ void JobScheduler::sort()
     }
 }
 
+void JobScheduler::removePending(const std::shared_ptr<Node> &node)
+{
+    mPendingJobs.remove(node);
+    if (mPreambles.isEmpty())
+        return;
+    auto it = mPreambles.find(node->job->preambleKey());
+    if (it != mPreambles.end()) {
+        assert(it->second.pending);
+        --it->second.pending;
+        evictPreamble(it);
+    }
+}
+
+bool JobScheduler::probeCompilers(const std::shared_ptr<IndexerJob> &job)
+{
+    if (!(Server::instance()->options().options & Server::EnableCompilerManager))
+        return true;
+    bool ready = true;
+    for (const Source &source : job->sources) {
+        const Path compiler = source.compiler();
+        if (mProbingCompilers.contains(compiler)) {
+            ready = false;
+            continue;
+        }
+        std::weak_ptr<JobScheduler> weak = shared_from_this();
+        if (!CompilerManager::probe(compiler, [weak, compiler]() {
+                    if (std::shared_ptr<JobScheduler> scheduler = weak.lock()) {
+                        scheduler->mProbingCompilers.remove(compiler);
+                        scheduler->startJobs();
+                    }
+                })) {
+            debug() << "Waiting for" << compiler << "to be probed before starting" << job->sourceFile;
+            mProbingCompilers.insert(compiler);
+            ready = false;
+        }
+    }
+    return ready;
+}
+
+bool JobScheduler::preparePreamble(const std::shared_ptr<IndexerJob> &job)
+{
+    job->flags &= ~(IndexerJob::BuildPreamble|IndexerJob::UsePreamble);
+    job->preamble.clear();
+    if (mPreambles.isEmpty())
+        return true;
+    auto it = mPreambles.find(job->preambleKey());
+    if (it == mPreambles.end())
+        return true;
+
+    PreambleGroup &group = it->second;
+    switch (group.state) {
+    case PreambleGroup::Pending: {
+        if (group.pending < MinPreambleGroupSize)
+            return true;
+        Path file = RTags::encodeSourceFilePath(Server::instance()->options().dataDir, job->project) + "preambles/";
+        Path::mkdir(file, Path::Recursive);
+        // the extension decides whether clang treats the preamble as a C or C++ header
+        file << String::format<32>("%llx.%s", static_cast<unsigned long long>(it->first),
+                                   job->sources.front().language == Source::C ? "h" : "hpp");
+        const String &block = job->preambleBlock();
+        FILE *f = fopen(file.constData(), "w");
+        const bool ok = f && fwrite(block.constData(), block.size(), 1, f);
+        if (f)
+            fclose(f);
+        if (!ok) {
+            error() << "Failed to write preamble" << file;
+            group.state = PreambleGroup::Failed;
+            return true;
+        }
+        debug() << "Building shared preamble" << file << "for" << group.pending << "jobs with" << job->sourceFile;
+        group.file = std::move(file);
+        group.state = PreambleGroup::Building;
+        job->flags |= IndexerJob::BuildPreamble;
+        break; }
+    case PreambleGroup::Building:
+        return false;
+    case PreambleGroup::Ready:
+        job->flags |= IndexerJob::UsePreamble;
+        break;
+    case PreambleGroup::Failed:
+        return true;
+    }
+    ++group.running;
+    job->preamble = group.file;
+    return true;
+}
+
+void JobScheduler::finishPreamble(const std::shared_ptr<IndexerJob> &job, bool ok)
+{
+    job->flags &= ~IndexerJob::BuildPreamble;
+    auto it = mPreambles.find(job->preambleKey());
+    if (it == mPreambles.end() || it->second.state != PreambleGroup::Building)
+        return;
+    debug() << "Shared preamble" << it->second.file << (ok ? "built by" : "failed for") << job->sourceFile;
+    it->second.state = ok ? PreambleGroup::Ready : PreambleGroup::Failed;
+}
+
+void JobScheduler::releasePreamble(const std::shared_ptr<IndexerJob> &job)
+{
+    if (job->preamble.isEmpty())
+        return;
+    job->flags &= ~(IndexerJob::BuildPreamble|IndexerJob::UsePreamble);
+    job->preamble.clear();
+    auto it = mPreambles.find(job->preambleKey());
+    if (it != mPreambles.end()) {
+        assert(it->second.running);
+        --it->second.running;
+        evictPreamble(it);
+    }
+}
+
+void JobScheduler::evictPreamble(Hash<uint64_t, PreambleGroup>::iterator it)
+{
+    if (it->second.pending || it->second.running)
+        return;
+    // nobody is left to use it, a later group with the same key builds a
+    // new one
+    if (!it->second.file.isEmpty()) {
+        Path::rm(it->second.file);
+        Path::rm(it->second.file + ".gch");
+    }
+    mPreambles.erase(it);
+}
+
 void JobScheduler::onProcessReadyReadStdErr(Process *proc)
 {
     std::shared_ptr<Node> n = mActiveByProcess.value(proc);
@@ -27,6 +27,7 @@
 
 class Connection;
 class IndexDataMessage;
+class WorkerMessage;
 class IndexerJob;
 class Process;
 class Project;
@@ -59,6 +60,8 @@ public:
 
     void add(const std::shared_ptr<IndexerJob> &job);
     void handleIndexDataMessage(const std::shared_ptr<IndexDataMessage> &message);
+    void handleWorkerMessage(const std::shared_ptr<WorkerMessage> &message, const std::shared_ptr<Connection> &conn);
+    void onConnectionDisconnected(Connection *conn);
     void dumpJobs(const std::shared_ptr<Connection> &conn);
     void dumpDaemons(const std::shared_ptr<Connection> &conn);
     void abort(const std::shared_ptr<IndexerJob> &job);
@@ -73,6 +76,14 @@ private:
     void onProcessFinished(Process *process, pid_t pid);
     void connectProcess(Process *process);
     void jobFinished(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &message);
+    void writeShards(const std::shared_ptr<IndexDataMessage> &message);
+    struct Node;
+    struct Worker {
+        std::shared_ptr<Connection> connection;
+        String name;
+        size_t capacity { 0 };
+        Hash<uint64_t, std::shared_ptr<Node> > active;
+    };
     struct Node {
         unsigned long long started { 0 };
         std::shared_ptr<IndexerJob> job;
@@ -80,7 +91,14 @@ private:
         std::shared_ptr<Node> next, prev;
         String stdOut, stdErr;
         bool daemon { false };
+        Worker *worker { nullptr };
     };
+    void removePending(const std::shared_ptr<Node> &node);
+    // false if a compiler the job needs is still being probed by CompilerManager
+    bool probeCompilers(const std::shared_ptr<IndexerJob> &job);
+    bool preparePreamble(const std::shared_ptr<IndexerJob> &job);
+    void finishPreamble(const std::shared_ptr<IndexerJob> &job, bool ok);
+    void releasePreamble(const std::shared_ptr<IndexerJob> &job);
 
     int mProcrastination;
     bool mStopped;
@@ -92,6 +110,33 @@ private:
     EmbeddedLinkedList<std::shared_ptr<Node> > mPendingJobs;
     Hash<Process *, std::shared_ptr<Node> > mActiveByProcess, mActiveDaemonsByProcess;
     Hash<uint64_t, std::shared_ptr<Node> > mActiveById, mInactiveById;
+    Hash<Connection *, std::shared_ptr<Worker> > mWorkers;
+    Set<Path> mProbingCompilers;
+
+    // Pending jobs keyed by IndexerJob::preambleKey(). Once a group is big
+    // enough one job builds the preamble and the others wait for it.
+    struct PreambleGroup {
+        enum State {
+            Pending,
+            Building,
+            Ready,
+            Failed
+        } state { Pending };
+        size_t pending { 0 };
+        size_t running { 0 }; // jobs building or using the preamble
+        Path file;
+    };
+    Hash<uint64_t, PreambleGroup> mPreambles;
+    // removes the group and its files once no job needs them anymore
+    void evictPreamble(Hash<uint64_t, PreambleGroup>::iterator it);
+
+    // time rps spent blocked on VisitFileMessages, from their IndexDataMessages
+    struct VisitFileWait {
+        size_t jobs { 0 };
+        size_t queries { 0 };
+        unsigned long long time { 0 }; // ms
+        uint32_t max { 0 }; // ms, the longest any one job waited
+    } mVisitFileWait;
 };
 
 #endif
@@ -15,16 +15,43 @@
 
 #include "Location.h"
 
+#include <mutex>
+
 #include "rct/Rct.h"
 #include "RTags.h"
 #include "Server.h"
 #include "Project.h"
 #include "ClangIndexer.h"
 
-Hash<Path, uint32_t> Location::sPathsToIds;
-Hash<uint32_t, Path> Location::sIdsToPaths;
-uint32_t Location::sLastId = 0;
-std::mutex Location::sMutex;
+std::atomic<Location::Chunk *> Location::sChunks[Location::ChunkCount];
+std::atomic<uint32_t> Location::sLastId(0);
+std::atomic<uint32_t> Location::sCount(0);
+const Path Location::sEmptyPath;
+
+// path -> fileId is split into shards so lookups from different threads
+// rarely contend
+namespace {
+struct Shard {
+    std::mutex mutex;
+    Hash<Path, uint32_t> ids;
+};
+enum { ShardCount = 64 };
+Shard sShards[ShardCount];
+
+// Every path an id has been published with. Location::path() hands out
+// references so these are never freed, but an id that's published with the
+// same path again (rp's Location::init for every job) reuses its entry.
+std::mutex sArenaMutex;
+Hash<uint32_t, List<const Path *> > sArena;
+
+std::mutex sInsertedMutex;
+List<uint32_t> sInserted;
+
+inline Shard &shard(const Path &path)
+{
+    return sShards[std::hash<Path>()(path) % ShardCount];
+}
+}
 static inline uint64_t createMask(int startBit, int bitCount)
 {
     uint64_t mask = 0;
@@ -52,21 +79,29 @@ String Location::toString(Flags<ToStringFlag> flags, Hash<Path, String> *context
         extra += ctx.size();
     }
 
-    Path p = path();
+    const Path &p = path();
+    const char *str = p.constData();
+    size_t size = p.size();
+    Path encoded;
     if (flags & ConvertToRelative) {
-        Sandbox::encode(p);
+        encoded = p;
+        Sandbox::encode(encoded);
+        str = encoded.constData();
+        size = encoded.size();
     } else if (!(flags & AbsolutePath) && Server::instance()) {
         Server *server = Server::instance();
         if (std::shared_ptr<Project> pp = server->currentProject()) {
-            const Path projectPath = pp->path();
-            if (!projectPath.isEmpty() && p.startsWith(projectPath))
-                p.remove(0, projectPath.size());
+            const Path &projectPath = pp->path();
+            if (!projectPath.isEmpty() && p.startsWith(projectPath)) {
+                str += projectPath.size();
+                size -= projectPath.size();
+            }
         }
     }
 
-    String ret(p.size() + extra, ' ');
+    String ret(size + extra, ' ');
 
-    const int w = snprintf(ret.data(), ret.size() + extra + 1, "%s:%d:%d:", p.constData(), l, c);
+    const int w = snprintf(ret.data(), ret.size() + extra + 1, "%s:%d:%d:", str, l, c);
     if (!ctx.isEmpty()) {
         memcpy(ret.data() + w, ctx.constData(), ctx.size());
     }
@@ -139,42 +174,198 @@ String Location::context(Flags<ToStringFlag> flags, Hash<Path, String> *cache) c
     return ret;
 }
 
-void Location::saveFileIds()
+void Location::saveFileIds(uint32_t id)
 {
     assert(Server::instance());
+    {
+        std::lock_guard<std::mutex> lock(sInsertedMutex);
+        sInserted.append(id);
+    }
     Server::instance()->saveFileIds();
 }
 
+List<uint32_t> Location::takeInserted()
+{
+    std::lock_guard<std::mutex> lock(sInsertedMutex);
+    List<uint32_t> ret;
+    std::swap(ret, sInserted);
+    return ret;
+}
+
+static inline void updateLastId(std::atomic<uint32_t> &lastId, uint32_t id)
+{
+    uint32_t last = lastId.load(std::memory_order_relaxed);
+    while (last < id && !lastId.compare_exchange_weak(last, id, std::memory_order_release, std::memory_order_relaxed));
+}
+
+static const Path *intern(uint32_t id, const Path &path)
+{
+    std::lock_guard<std::mutex> lock(sArenaMutex);
+    List<const Path *> &paths = sArena[id];
+    for (const Path *interned : paths) {
+        if (*interned == path)
+            return interned;
+    }
+    paths.append(new Path(path));
+    return paths.back();
+}
+
+std::atomic<const Path *> &Location::slot(uint32_t id)
+{
+    assert(id && id < (1u << FileBits));
+    std::atomic<Chunk *> &chunkSlot = sChunks[id >> ChunkBits];
+    Chunk *chunk = chunkSlot.load(std::memory_order_acquire);
+    if (!chunk) {
+        Chunk *created = new Chunk;
+        if (chunkSlot.compare_exchange_strong(chunk, created, std::memory_order_acq_rel)) {
+            chunk = created;
+        } else {
+            delete created; // someone beat us to it, chunk is theirs
+        }
+    }
+    return chunk->paths[id & (ChunkSize - 1)];
+}
+
+const Path *Location::publish(uint32_t id, const Path &path)
+{
+    std::atomic<const Path *> &ref = slot(id);
+    const Path *current = ref.load(std::memory_order_acquire);
+    if (current)
+        return current;
+    const Path *interned = intern(id, path);
+    if (!ref.compare_exchange_strong(current, interned, std::memory_order_acq_rel))
+        return current; // lost to another thread, current is the winner
+    sCount.fetch_add(1, std::memory_order_acq_rel);
+    return interned;
+}
+
+uint32_t Location::fileId(const Path &path)
+{
+    Shard &s = shard(path);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    return s.ids.value(path);
+}
+
+uint32_t Location::insert(const Path &path, bool *added)
+{
+    Shard &s = shard(path);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    uint32_t &id = s.ids[path];
+    if (!id) {
+        // a concurrent set() may have claimed the id we got, take the next one
+        while (true) {
+            const uint32_t next = sLastId.fetch_add(1, std::memory_order_acq_rel) + 1;
+            if (next >= (1u << FileBits)) {
+                error() << "Location::insert ran out of file ids for" << path;
+                s.ids.remove(path);
+                return 0;
+            }
+            if (*publish(next, path) == path) {
+                id = next;
+                break;
+            }
+        }
+        *added = true;
+    }
+    return id;
+}
+
+void Location::set(const Path &path, uint32_t fileId)
+{
+    if (!fileId || fileId >= (1u << FileBits)) {
+        error() << "Location::set invalid file id" << fileId << "for" << path;
+        return;
+    }
+    Shard &s = shard(path);
+    std::lock_guard<std::mutex> lock(s.mutex);
+    uint32_t &refId = s.ids[path];
+    assert(!refId || refId == fileId);
+    refId = fileId;
+    const Path *winner = publish(fileId, path);
+    if (*winner != path && path.resolved() != *winner)
+        error() << "Location::set" << path << fileId << "is already taken by" << *winner;
+    updateLastId(sLastId, fileId);
+}
+
+Hash<uint32_t, Path> Location::idsToPaths()
+{
+    Hash<uint32_t, Path> ret;
+    const uint32_t last = lastId();
+    for (uint32_t id=1; id<=last; ++id) {
+        if (const Path *path = entry(id))
+            ret[id] = *path;
+    }
+    return ret;
+}
+
+Hash<Path, uint32_t> Location::pathsToIds()
+{
+    Hash<Path, uint32_t> ret;
+    for (Shard &s : sShards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (const auto &it : s.ids)
+            ret[it.first] = it.second;
+    }
+    return ret;
+}
+
+void Location::iterate(std::function<void(const Path &, uint32_t)> func)
+{
+    for (Shard &s : sShards) {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (const auto &it : s.ids)
+            func(it.first, it.second);
+    }
+}
+
+// Swaps in a new table. Ids that keep their path are overwritten in place
+// so lock-free readers never see them empty, only ids that are gone from
+// the table read as empty afterwards.
+void Location::replace(const Hash<uint32_t, Path> &idsToPaths)
+{
+    uint32_t last = 0, count = 0;
+    Hash<Path, uint32_t> ids[ShardCount];
+    for (const auto &it : idsToPaths) {
+        assert(!it.second.isEmpty());
+        if (!it.first || it.first >= (1u << FileBits)) {
+            error() << "Location::replace invalid file id" << it.first << "for" << it.second;
+            continue;
+        }
+        slot(it.first).store(intern(it.first, it.second), std::memory_order_release);
+        ids[std::hash<Path>()(it.second) % ShardCount][it.second] = it.first;
+        last = std::max(last, it.first);
+        ++count;
+    }
+    const uint32_t oldLast = sLastId.load(std::memory_order_acquire);
+    for (uint32_t id=1; id<=oldLast && id < (1u << FileBits); ++id) {
+        if (idsToPaths.contains(id))
+            continue;
+        if (Chunk *chunk = sChunks[id >> ChunkBits].load(std::memory_order_acquire))
+            chunk->paths[id & (ChunkSize - 1)].store(nullptr, std::memory_order_release);
+    }
+    for (int i=0; i<ShardCount; ++i) {
+        std::lock_guard<std::mutex> lock(sShards[i].mutex);
+        sShards[i].ids = std::move(ids[i]);
+    }
+    sLastId.store(last, std::memory_order_release);
+    sCount.store(count, std::memory_order_release);
+}
+
 bool Location::init(const Hash<Path, uint32_t> &pathsToIds)
 {
-    LOCK();
-    sPathsToIds = pathsToIds;
-    sIdsToPaths.clear();
-    sLastId = 0;
-    for (const auto &it : sPathsToIds) {
+    Hash<uint32_t, Path> idsToPaths;
+    for (const auto &it : pathsToIds) {
         assert(!it.first.isEmpty());
-        Path &ref = sIdsToPaths[it.second];
-        if (!ref.isEmpty())  {
-            sPathsToIds.clear();
-            sIdsToPaths.clear();
-            sLastId = 0;
+        if (!it.second || it.second >= (1u << FileBits) || idsToPaths.contains(it.second))
             return false;
-        }
-        ref = it.first;
-        sLastId = std::max(sLastId, it.second);
+        idsToPaths[it.second] = it.first;
     }
+    replace(idsToPaths);
     return true;
 }
 
 void Location::init(const Hash<uint32_t, Path> &idsToPaths)
 {
-    LOCK();
-    sIdsToPaths = idsToPaths;
-    sPathsToIds.clear();
-    sLastId = 0;
-    for (const auto &it : sIdsToPaths) {
-        sPathsToIds[it.second] = it.first;
-        assert(!it.second.isEmpty());
-        sLastId = std::max(sLastId, it.first);
-    }
+    replace(idsToPaths);
+}
 }
@@ -17,6 +17,7 @@
 #define Location_h
 
 #include <algorithm>
+#include <atomic>
 #include <assert.h>
 #include <clang-c/Index.h>
 #include <stdio.h>
@@ -25,12 +26,6 @@
 #elif defined(OS_Darwin)
 #include <sys/syslimits.h>
 #endif
-#ifndef RTAGS_SINGLE_THREAD
-#include <mutex>
-#define LOCK() const std::lock_guard<std::mutex> lock(sMutex)
-#else
-#define LOCK() do {} while (0)
-#endif
 
 #include "rct/Flags.h"
 #include "rct/Log.h"
@@ -69,50 +64,36 @@ public:
     {
     }
 
-    static inline uint32_t fileId(const Path &path)
-    {
-        LOCK();
-        return sPathsToIds.value(path);
-    }
-    static inline Path path(uint32_t id)
+    static uint32_t fileId(const Path &path);
+    // Paths are never removed from the table so the reference stays valid,
+    // copy it if you need to modify it. Doesn't take a lock.
+    static inline const Path &path(uint32_t id)
     {
-        LOCK();
-        return sIdsToPaths.value(id);
+        const Path *ret = entry(id);
+        return ret ? *ret : sEmptyPath;
     }
 
     static uint32_t lastId()
     {
-        LOCK();
-        return sLastId;
+        return sLastId.load(std::memory_order_acquire);
     }
 
     static uint32_t count()
     {
-        LOCK();
-        return sIdsToPaths.size();
+        return sCount.load(std::memory_order_acquire);
     }
 
+    // returns 0 once all 1 << FileBits ids are taken
     static inline uint32_t insertFile(const Path &path)
     {
-        bool save = false;
-        (void)save;
         assert(path.isAbsolute());
         assert(!path.contains("/../"));
         // in the case of Source::compilerId path can be a symlink
-        uint32_t ret;
-        {
-            LOCK();
-            uint32_t &id = sPathsToIds[path];
-            if (!id) {
-                id = ++sLastId;
-                sIdsToPaths[id] = path;
-                save = true;
-            }
-            ret = id;
-        }
+        bool added = false;
+        const uint32_t ret = insert(path, &added);
 #ifndef RTAGS_SINGLE_THREAD
-        if (save)
-            saveFileIds();
+        if (added)
+            saveFileIds(ret);
 #endif
         return ret;
     }
@@ -121,10 +102,9 @@ public:
     inline uint32_t line() const { return static_cast<uint32_t>((value & LINE_MASK) >> FileBits); }
     inline uint32_t column() const { return static_cast<uint32_t>((value & COLUMN_MASK) >> (FileBits + LineBits)); }
 
-    inline Path path() const
+    inline const Path &path() const
     {
-        LOCK();
-        return sIdsToPaths.value(fileId());
+        return path(fileId());
     }
     inline bool isNull() const { return !value; }
     inline bool isValid() const { return value; }
@@ -247,54 +227,59 @@ public:
             return Location();
         return Location(fileId, line, col);
     }
-    static Hash<uint32_t, Path> idsToPaths()
-    {
-        LOCK();
-        return sIdsToPaths;
-    }
-    static Hash<Path, uint32_t> pathsToIds()
-    {
-        LOCK();
-        return sPathsToIds;
-    }
+    static Hash<uint32_t, Path> idsToPaths();
+    static Hash<Path, uint32_t> pathsToIds();
 
-    static void iterate(std::function<void(const Path &, uint32_t)> func)
-    {
-        LOCK();
-        for (const auto &it : sPathsToIds) {
-            func(it.first, it.second);
-        }
-    }
+    static void iterate(std::function<void(const Path &, uint32_t)> func);
     static bool init(const Hash<Path, uint32_t> &pathsToIds);
     static void init(const Hash<uint32_t, Path> &idsToPaths);
 
-    static void set(const Path &path, uint32_t fileId)
-    {
-        LOCK();
-        uint32_t &refId = sPathsToIds[path];
-        assert(!refId || refId == fileId);
-        refId = fileId;
-        Path &p = sIdsToPaths[fileId];
-        if (p.isEmpty()) {
-            p = path;
-        } else {
-            assert(p == path || path.resolved() == p);
-        }
-        sLastId = std::max(sLastId, fileId);
-    }
+    static void set(const Path &path, uint32_t fileId);
+    // ids added by insertFile() since the last call, for the fileids journal
+    static List<uint32_t> takeInserted();
 private:
 #ifndef RTAGS_SINGLE_THREAD
-    static std::mutex sMutex;
-    static void saveFileIds();
+    static void saveFileIds(uint32_t id);
 #endif
-    static Hash<Path, uint32_t> sPathsToIds;
-    static Hash<uint32_t, Path> sIdsToPaths;
-    static uint32_t sLastId;
+    static uint32_t insert(const Path &path, bool *added);
     enum {
         FileBits = 22,
         LineBits = 21,
         ColumnBits = 64 - FileBits - LineBits
     };
+
+    // fileId -> path is a two level table of pointers into an arena that
+    // keeps every path an id has had. Chunks are allocated on demand and
+    // never freed so readers don't need a lock.
+    enum {
+        ChunkBits = 12,
+        ChunkSize = 1 << ChunkBits,
+        ChunkCount = (1 << FileBits) >> ChunkBits
+    };
+    struct Chunk {
+        Chunk()
+        {
+            for (auto &path : paths)
+                path.store(nullptr, std::memory_order_relaxed);
+        }
+        std::atomic<const Path *> paths[ChunkSize];
+    };
+    static inline const Path *entry(uint32_t id)
+    {
+        if (id >= (1u << FileBits))
+            return nullptr;
+        const Chunk *chunk = sChunks[id >> ChunkBits].load(std::memory_order_acquire);
+        return chunk ? chunk->paths[id & (ChunkSize - 1)].load(std::memory_order_acquire) : nullptr;
+    }
+    static std::atomic<const Path *> &slot(uint32_t id);
+    // returns the path that ended up in id's slot, which isn't path if
+    // another thread got there first
+    static const Path *publish(uint32_t id, const Path &path);
+    static void replace(const Hash<uint32_t, Path> &idsToPaths);
+
+    static std::atomic<Chunk *> sChunks[ChunkCount];
+    static std::atomic<uint32_t> sLastId, sCount;
+    static const Path sEmptyPath;
     static const uint64_t FILEID_MASK;
     static const uint64_t LINE_MASK;
     static const uint64_t COLUMN_MASK;
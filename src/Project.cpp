@@ -15,24 +15,31 @@
 
 #include "Project.h"
 
+#include <dirent.h>
 #include <fnmatch.h>
+#include <string.h>
+#include <unistd.h>
+#include <condition_variable>
 #include <memory>
 #include <regex>
 #include <utility>
 
 #include "Diagnostic.h"
 #include "FileManager.h"
+#include "CompileCommandsReader.h"
 #include "CompilerManager.h"
 #include "IndexDataMessage.h"
 #include "JobScheduler.h"
 #include "LogOutputMessage.h"
 #include "rct/DataFile.h"
+#include "rct/EventLoop.h"
 #include "rct/Log.h"
 #include "rct/MemoryMonitor.h"
 #include "rct/Path.h"
 #include "rct/Rct.h"
 #include "rct/ReadLocker.h"
 #include "rct/Thread.h"
+#include "rct/ThreadPool.h"
 #include "rct/Value.h"
 #include "RTags.h"
 #include "RTagsLogOutput.h"
@@ -44,7 +51,9 @@ enum
     DirtyTimeout         = 100,
     CheckExplicitTimeout = 500,
     CheckRetryTimeout    = 5  * 60 * 1000,
-    CheckPeriodicTimeout = 60 * 60 * 1000
+    CheckPeriodicTimeout = 60 * 60 * 1000,
+    SymbolNameInterval   = 100,
+    SymbolNameSlice      = 10
 };
 
 class Dirty
@@ -244,35 +253,226 @@ static bool loadDependencies(DataFile &file, Dependencies &dependencies)
     return true;
 }
 
-static void saveDependencies(DataFile &file, const Dependencies &dependencies)
+typedef List<std::pair<uint32_t, List<uint32_t> > > DependentsList;
+
+static void saveDependencies(DataFile &file, const DependentsList &dependencies)
 {
     file << static_cast<int>(dependencies.size());
     for (const auto &it : dependencies) {
         file << it.first;
     }
     for (const auto &it : dependencies) {
-        file << static_cast<int>(it.second->dependents.size());
-        if (!it.second->dependents.isEmpty()) {
+        file << static_cast<int>(it.second.size());
+        if (!it.second.isEmpty()) {
             file << it.first;
-            for (const auto &dep : it.second->dependents) {
-                file << dep.first;
+            for (uint32_t dep : it.second) {
+                file << dep;
+            }
+        }
+    }
+}
+
+template <typename T>
+static bool writeDataFile(const Path &path, int version, const T &write)
+{
+    const Path tmp = path + ".tmp";
+    DataFile file(tmp, version);
+    if (!file.open(DataFile::Write)) {
+        error("Save error %s: %s", path.constData(), file.error().constData());
+        return false;
+    }
+    write(file);
+    if (!file.flush() || rename(tmp.constData(), path.constData())) {
+        error("Save error %s: %s", path.constData(), file.error().constData());
+        Path::rm(tmp);
+        return false;
+    }
+    return true;
+}
+
+static DependentsList dependentsList(const Dependencies &dependencies)
+{
+    DependentsList ret;
+    ret.reserve(dependencies.size());
+    for (const auto &it : dependencies)
+        ret.append(std::make_pair(it.first, it.second->dependents.keys()));
+    return ret;
+}
+
+// Everything save() writes, copied so it can be written from another thread
+struct Project::State
+{
+    IndexParseData parseData;
+    Set<uint32_t> visitedFiles;
+    Diagnostics diagnostics;
+    DependentsList dependents;
+
+    // reads what write() wrote, the dependencies are returned as a graph
+    // so a journal can be replayed on top
+    bool read(const Path &sourcesFile, const Path &projectFile, Dependencies &dependencies)
+    {
+        if (!Project::readSources(sourcesFile, parseData, nullptr))
+            return false;
+        DataFile file(projectFile, RTags::DatabaseVersion);
+        if (!file.open(DataFile::Read))
+            return false;
+        file >> visitedFiles >> diagnostics;
+        return loadDependencies(file, dependencies);
+    }
+
+    bool write(const Path &sourcesFile, const Path &projectFile) const
+    {
+        Path::mkdir(sourcesFile.parentDir(), Path::Recursive);
+        return (writeDataFile(sourcesFile, RTags::SourcesFileVersion, [this](DataFile &file) { file << parseData; })
+                && writeDataFile(projectFile, RTags::DatabaseVersion, [this](DataFile &file) {
+                        file << visitedFiles << diagnostics;
+                        saveDependencies(file, dependents);
+                    }));
+    }
+};
+
+// Replaces the diagnostics produced by sourceFileId, returns the files that
+// had or now have diagnostics
+static Set<uint32_t> replaceDiagnostics(Diagnostics &all, uint32_t sourceFileId, const Diagnostics &diagnostics)
+{
+    Set<uint32_t> files;
+    {
+        auto it = all.begin();
+        const auto end = all.end();
+        uint32_t lastFileId = 0;
+        while (it != end) {
+            if (it->second.sourceFileId == sourceFileId) {
+                const uint32_t f = it->first.fileId();
+                if (f != lastFileId) {
+                    files.insert(f);
+                    lastFileId = f;
+                }
+                all.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    uint32_t lastFileId = 0;
+    for (const auto &it : diagnostics) {
+        const uint32_t f = it.first.fileId();
+        if (lastFileId != f) {
+            files.insert(f);
+            lastFileId = f;
+        }
+        all[it.first] = it.second;
+    }
+    return files;
+}
+
+enum {
+    JournalMagic = 0x4a4a5250, // "PRJJ"
+    JournalCheckpointMinSize = 8 * 1024 * 1024
+};
+
+/*
+  project.journal is a header followed by one record per finished job: size,
+  payload, checksum. The payload is the state the job left behind for the
+  files it touched, not the operations that got there, so replaying a record
+  on top of a checkpoint that already has it is harmless. A record that was
+  cut short ends the replay and, if truncate is set, is cut off the file.
+*/
+static size_t replayJournal(const Path &path, Set<uint32_t> &visitedFiles, Diagnostics &diagnostics,
+                            Dependencies &dependencies, IndexParseData *parseData, bool truncate)
+{
+    const String data = path.readAll();
+    if (data.isEmpty())
+        return 0;
+    uint32_t header[2] = { 0, 0 };
+    if (data.size() >= sizeof(header))
+        memcpy(header, data.constData(), sizeof(header));
+    if (header[0] != JournalMagic || header[1] != static_cast<uint32_t>(RTags::DatabaseVersion)) {
+        error() << "Ignoring invalid journal" << path;
+        if (truncate)
+            Path::rm(path);
+        return 0;
+    }
+
+    auto node = [&dependencies](uint32_t fileId) {
+        DependencyNode *&ret = dependencies[fileId];
+        if (!ret)
+            ret = new DependencyNode(fileId);
+        return ret;
+    };
+
+    const char *ch = data.constData();
+    size_t pos = sizeof(header);
+    size_t count = 0;
+    while (pos + sizeof(uint32_t) <= data.size()) {
+        uint32_t size, checksum;
+        memcpy(&size, ch + pos, sizeof(size));
+        const size_t payload = pos + sizeof(size);
+        if (payload + size + sizeof(checksum) > data.size())
+            break;
+        memcpy(&checksum, ch + payload + size, sizeof(checksum));
+        if (checksum != static_cast<uint32_t>(RTags::contentHash(ch + payload, size)))
+            break;
+
+        uint32_t sourceFileId;
+        uint64_t parsed;
+        Hash<uint32_t, bool> visited;
+        Hash<uint32_t, List<uint32_t> > includes;
+        Diagnostics diags;
+        Deserializer in(ch + payload, size);
+        in >> sourceFileId >> parsed >> visited >> includes >> diags;
+
+        for (const auto &it : visited) {
+            if (it.second) {
+                visitedFiles.insert(it.first);
+            } else {
+                visitedFiles.remove(it.first);
             }
         }
+        for (const auto &it : includes) {
+            DependencyNode *includer = node(it.first);
+            for (const auto &old : includer->includes)
+                old.second->dependents.remove(it.first);
+            includer->includes.clear();
+            for (uint32_t inc : it.second)
+                includer->include(node(inc));
+        }
+        replaceDiagnostics(diagnostics, sourceFileId, diags);
+        if (parsed && parseData) {
+            Project::forEachSources(*parseData, [sourceFileId, parsed](Sources &sources) -> Project::VisitResult {
+                    if (sources.contains(sourceFileId))
+                        sources[sourceFileId].parsed = parsed;
+                    return Project::Continue;
+                });
+        }
+        pos = payload + size + sizeof(checksum);
+        ++count;
     }
+    if (pos < data.size()) {
+        warning() << "Dropping" << (data.size() - pos) << "bytes from the end of" << path;
+        if (truncate && ::truncate(path.constData(), pos))
+            error() << "Failed to truncate" << path << Rct::strerror();
+    }
+    return count;
 }
 
 Project::Project(const Path &path)
     : mPath(path), mProjectDataDir(RTags::encodeSourceFilePath(Server::instance()->options().dataDir, path)),
-      mJobCounter(0), mJobsStarted(0), mLastIdleTime(time(nullptr)), mBytesWritten(0), mSaveDirty(false)
+      mJobCounter(0), mJobsStarted(0), mLastIdleTime(time(nullptr)), mBytesWritten(0), mLoaded(false),
+      mLastUsed(mLastIdleTime), mSaveDirty(false),
+      mJournal(nullptr), mJournalSize(0), mCheckpointSize(0)
 {
     mProjectFilePath = mProjectDataDir + "project";
     mSourcesFilePath = mProjectDataDir + "sources";
+    mJournalPath = mProjectDataDir + "project.journal";
 }
 
 Project::~Project()
 {
     if (mSaveDirty)
         save();
+    waitForCheckpoint();
+    closeJournal();
     for (const auto &job : mActiveJobs) {
         assert(job.second);
         Server::instance()->jobScheduler()->abort(job.second);
@@ -282,26 +482,17 @@ Project::~Project()
     assert(EventLoop::isMainThread());
     mDirtyTimer.stop();
     mCheckTimer.stop();
+    mSymbolNameTimer.stop();
 }
 
-static bool hasSourceDependency(const DependencyNode *node, const std::shared_ptr<Project> &project, Set<uint32_t> &seen)
+static inline bool hasSourceDependency(uint32_t fileId, const std::shared_ptr<Project> &project)
 {
-    const Path path = Location::path(node->fileId);
-    // error("%s %d %d", path.constData(), path.isFile(), path.isSource());
-    if (path.isFile() && path.isSource() && project->hasSource(node->fileId)) {
-        return true;
-    }
-    for (auto it : node->dependents) {
-        if (seen.insert(it.first) && hasSourceDependency(it.second, project, seen))
-            return true;
-    }
-    return false;
-}
-
-static inline bool hasSourceDependency(const DependencyNode *node, const std::shared_ptr<Project> &project)
-{
-    Set<uint32_t> seen;
-    return hasSourceDependency(node, project, seen);
+    return project->dependencyGraph()->any(fileId, DependencyGraph::Dependents, [&project](uint32_t dep) {
+            if (!project->hasSource(dep))
+                return false;
+            const Path &path = Location::path(dep);
+            return path.isFile() && path.isSource();
+        });
 }
 
 bool Project::readSources(const Path &path, IndexParseData &data, String *err)
@@ -318,9 +509,10 @@ bool Project::readSources(const Path &path, IndexParseData &data, String *err)
 
     if (Sandbox::hasRoot()) {
         forEachSource(data, [](Source &source) {
-            for (String &arg : source.arguments) {
+            for (String &arg : source.arguments.write()) {
                 Sandbox::decode(arg);
             }
+            source.arguments.intern();
             return Continue;
         });
     }
@@ -329,6 +521,8 @@ bool Project::readSources(const Path &path, IndexParseData &data, String *err)
 
 bool Project::init()
 {
+    mLoaded = true;
+    touch();
     const JobScheduler::JobScope scope(Server::instance()->jobScheduler());
     const Server::Options &options = Server::instance()->options();
     if (!(options.options & Server::NoFileSystemWatch)) {
@@ -344,6 +538,13 @@ bool Project::init()
 
     mDirtyTimer.timeout().connect(std::bind(&Project::onDirtyTimeout, this, std::placeholders::_1));
     mCheckTimer.timeout().connect([this](Timer *) { check(Check_Explicit); });
+    mSymbolNameTimer.timeout().connect(std::bind(&Project::onSymbolNameTimeout, this, std::placeholders::_1));
+
+    // shared preambles only live as long as the jobs that use them and
+    // imports are staged here until they're moved into place, these are
+    // left over from a previous run
+    Path::rmdir(mProjectDataDir + "preambles/");
+    Path::rmdir(mProjectDataDir + "import/");
 
     String err;
     if (!Project::readSources(mSourcesFilePath, mIndexParseData, &err)) {
@@ -395,6 +596,16 @@ bool Project::init()
         return true;
     }
 
+    {
+        // project.journal.old is left behind if we died during a checkpoint
+        std::lock_guard<std::mutex> lock(mMutex);
+        replayJournal(mJournalPath + ".old", mVisitedFiles, mDiagnostics, mDependencies, &mIndexParseData, true);
+        replayJournal(mJournalPath, mVisitedFiles, mDiagnostics, mDependencies, &mIndexParseData, true);
+    }
+    dependenciesChanged();
+    mJournalSize = mJournalPath.isFile() ? mJournalPath.fileSize() : 0;
+    mCheckpointSize = mSourcesFilePath.fileSize() + mProjectFilePath.fileSize();
+
     for (const auto &dep : mDependencies) {
         watchFile(dep.first);
     }
@@ -403,6 +614,99 @@ bool Project::init()
     return true;
 }
 
+struct Project::CheckResult
+{
+    List<uint32_t> missing; // dependencies that are gone
+    List<std::pair<uint32_t, String> > invalid; // dependencies without valid file maps
+    Set<uint32_t> missingSources;
+    Hash<uint32_t, uint64_t> lastModified; // for IfModifiedDirty, so finishCheck doesn't stat
+};
+
+// The files are handed out in batches to whoever calls work()
+struct Project::Verify
+{
+    enum { BatchSize = 64 };
+
+    Verify(const Path &dir, uint32_t opts, ValidateMode m, List<uint32_t> &&f, List<uint32_t> &&s)
+        : projectDataDir(dir), fileMapOptions(opts), mode(m), files(std::move(f)), sources(std::move(s)),
+          next(0), running(0)
+    {}
+
+    void work()
+    {
+        CheckResult local;
+        const size_t count = files.size() + sources.size();
+        while (true) {
+            const size_t start = next.fetch_add(BatchSize);
+            if (start >= count)
+                break;
+            const size_t end = std::min<size_t>(start + BatchSize, count);
+            for (size_t i=start; i<end; ++i) {
+                const bool source = i >= files.size();
+                const uint32_t fileId = source ? sources.at(i - files.size()) : files.at(i);
+                const Path &path = Location::path(fileId);
+                const uint64_t lastModified = path.isFile() ? path.lastModifiedMs() : 0;
+                local.lastModified[fileId] = lastModified;
+                String err;
+                if (source) {
+                    if (!lastModified)
+                        local.missingSources.insert(fileId);
+                } else if (!lastModified) {
+                    local.missing.append(fileId);
+                } else if (!validate(projectDataDir, fileMapOptions, fileId, mode, &err)) {
+                    local.invalid.append(std::make_pair(fileId, std::move(err)));
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        result.missing += local.missing;
+        result.invalid += local.invalid;
+        result.missingSources += local.missingSources;
+        for (const auto &it : local.lastModified)
+            result.lastModified[it.first] = it.second;
+    }
+
+    const Path projectDataDir;
+    const uint32_t fileMapOptions;
+    const ValidateMode mode;
+    const List<uint32_t> files, sources;
+    std::atomic<size_t> next;
+    std::atomic<int> running;
+    std::mutex mutex;
+    CheckResult result;
+    std::weak_ptr<Project> project;
+    StopWatch stopWatch;
+};
+
+// The last one to finish hands the result to the main thread
+class Project::VerifyJob : public ThreadPool::Job
+{
+public:
+    VerifyJob(const std::shared_ptr<Verify> &verify)
+        : mVerify(verify)
+    {}
+protected:
+    virtual void run() override
+    {
+        mVerify->work();
+        if (--mVerify->running)
+            return;
+        const std::shared_ptr<Verify> verify = std::move(mVerify);
+        if (std::shared_ptr<EventLoop> loop = EventLoop::mainEventLoop()) {
+            loop->callLater([verify]() {
+                    if (std::shared_ptr<Project> project = verify->project.lock()) {
+                        logDirect(LogLevel::Error, String::format<128>("Verified %s in %dms", project->path().constData(),
+                                                                       verify->stopWatch.elapsed()),
+                                  LogOutput::StdOut|LogOutput::TrailingNewLine);
+                        project->finishCheck(verify->result);
+                    }
+                });
+        }
+    }
+private:
+    std::shared_ptr<Verify> mVerify;
+};
+
 void Project::check(CheckMode checkMode)
 {
     if ((checkMode == Check_Explicit) && isIndexing()) {
@@ -413,6 +717,37 @@ void Project::check(CheckMode checkMode)
     }
 
     const Server::Options &options = Server::instance()->options();
+    const ValidateMode mode = options.options & Server::ValidateFileMaps ? Validate : StatOnly;
+    List<uint32_t> sources;
+    forEachSourceList([&sources](SourceList &src) -> VisitResult {
+        sources.append(src.fileId());
+        return Continue;
+    });
+    auto verify = std::make_shared<Verify>(mProjectDataDir, fileMapOptions(), mode, mDependencies.keys(), std::move(sources));
+
+    if (verify->files.size() < 100) {
+        verify->work();
+        finishCheck(verify->result);
+        return;
+    }
+
+    // Stat and validate on the background pool and let the main thread
+    // serve queries from what we have in the meantime.
+    if (checkMode == Check_Init) {
+        logDirect(LogLevel::Error, String::format<128>("Restoring %s, verifying %zu files in the background",
+                                                       mPath.constData(), verify->files.size()),
+                  LogOutput::StdOut|LogOutput::TrailingNewLine);
+    }
+    verify->project = shared_from_this();
+    const int jobs = std::max(2, ThreadPool::idealThreadCount());
+    verify->running = jobs;
+    ThreadPool *pool = Server::instance()->backgroundPool();
+    for (int i=0; i<jobs; ++i)
+        pool->start(std::make_shared<VerifyJob>(verify));
+}
+
+void Project::finishCheck(CheckResult &result)
+{
     bool needsSave = false;
     std::unique_ptr<ComplexDirty> dirty;
 
@@ -420,66 +755,51 @@ void Project::check(CheckMode checkMode)
         dirty.reset(new SuspendedDirty);
     } else {
         dirty.reset(new IfModifiedDirty(shared_from_this()));
+        // stat'ed by verify, files that showed up since are stat'ed as needed
+        dirty->mLastModified = std::move(result.lastModified);
     }
 
     Set<uint32_t> missingFileMaps;
     {
+        // Things may have been reindexed or removed since result was
+        // collected, only look at what's still there.
         List<uint32_t> removed;
-        int idx = 0;
-        bool outputDirty = false;
-        if (checkMode == Check_Init && mDependencies.size() >= 100) {
-            logDirect(LogLevel::Error, String::format<128>("Restoring %s ", mPath.constData()), LogOutput::StdOut);
-            outputDirty = true;
+        for (uint32_t fileId : result.missing) {
+            if (!mDependencies.contains(fileId))
+                continue;
+            warning() << Location::path(fileId) << "seems to have disappeared";
+            dirty.get()->insertDirtyFile(fileId);
+
+            const Set<uint32_t> dependents = dependencies(fileId, DependsOnArg);
+            for (auto dependent : dependents) {
+                dirty.get()->insertDirtyFile(dependent);
+            }
+            removed << fileId;
+            needsSave = true;
         }
         const std::shared_ptr<Project> project = shared_from_this();
-        for (auto it : mDependencies) {
-            const Path path = Location::path(it.first);
-            if (!path.isFile()) {
-                warning() << path << "seems to have disappeared";
-                dirty.get()->insertDirtyFile(it.first);
-
-                const Set<uint32_t> dependents = dependencies(it.first, DependsOnArg);
-                for (auto dependent : dependents) {
-                    dirty.get()->insertDirtyFile(dependent);
-                }
-                removed << it.first;
-                needsSave = true;
+        for (const auto &invalid : result.invalid) {
+            const uint32_t fileId = invalid.first;
+            if (!mDependencies.contains(fileId))
+                continue;
+            if (!invalid.second.isEmpty())
+                error() << invalid.second;
+            if (hasSource(fileId) || hasSourceDependency(fileId, project)) {
+                missingFileMaps.insert(fileId);
             } else {
-                String errorString;
-                if (!validate(it.first,  options.options & Server::ValidateFileMaps ? Validate : StatOnly, &errorString)) {
-                    if (!errorString.isEmpty()) {
-                        if (checkMode == Check_Init && outputDirty) {
-                            outputDirty = false;
-                            logDirect(LogLevel::Error, String("\n"), LogOutput::StdOut);
-                        }
-                        error() << errorString;
-                    }
-                    if (hasSource(it.first) || hasSourceDependency(it.second, project)) {
-                        missingFileMaps.insert(it.first);
-                    } else {
-                        removed << it.first;
-                        needsSave = true;
-                    }
-                }
-            }
-            if (checkMode == Check_Init && ++idx % 100 == 0) {
-                outputDirty = true;
-                logDirect(LogLevel::Error, ".", 1, LogOutput::StdOut);
-                // error("%d/%d (%.2f%%)", idx, count, (idx / static_cast<double>(count)) * 100.0);
+                removed << fileId;
+                needsSave = true;
             }
         }
-        if (checkMode == Check_Init && outputDirty)
-            logDirect(LogLevel::Error, "\n", 1, LogOutput::StdOut);
         for (uint32_t r : removed) {
             removeDependencies(r);
         }
     }
 
-    forEachSourceList([&dirty, this, &needsSave](SourceList &src) -> VisitResult {
+    forEachSourceList([&dirty, this, &needsSave, &result](SourceList &src) -> VisitResult {
         uint32_t fileId = src.fileId();
-        const Path sourceFile = Location::path(fileId);
-        if (!sourceFile.isFile()) {
-            warning() << sourceFile << "seems to have disappeared";
+        if (result.missingSources.contains(fileId)) {
+            warning() << Location::path(fileId) << "seems to have disappeared";
             removeDependencies(fileId);
             dirty.get()->insertDirtyFile(fileId);
             needsSave = true;
@@ -501,6 +821,7 @@ void Project::check(CheckMode checkMode)
         startDirtyJobs(&simple, IndexerJob::Dirty);
     }
     mCheckTimer.restart(CheckPeriodicTimeout); // always checking every 1 hour
+    mSymbolNameTimer.restart(SymbolNameInterval);
 }
 
 bool Project::match(const Match &p, bool *indexed) const
@@ -512,6 +833,12 @@ bool Project::match(const Match &p, bool *indexed) const
     const Path resolvedPath = mPath.resolved();
     for (int i=0; i<count; ++i) {
         const Path &path = paths[i];
+        if (!mLoaded && (path.startsWith(mPath) || path.startsWith(resolvedPath))) {
+            // we don't know the files of a project that isn't loaded yet
+            if (indexed)
+                *indexed = false;
+            return true;
+        }
         const uint32_t id = Location::fileId(path);
         if (id && isIndexed(id)) {
             if (indexed)
@@ -750,7 +1077,7 @@ static String formatDiagnostics(const Diagnostics &diagnostics, Flags<QueryMessa
     }
 
     for (uint32_t f : filter) {
-        const Path path = Location::path(f);
+        const Path &path = Location::path(f);
         // error() << "empty diags for" << path;
         first = true;
         ret << header[format]
@@ -776,7 +1103,11 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
     mBytesWritten += msg->bytesWritten();
     std::shared_ptr<IndexerJob> restart;
     const uint32_t fileId = job->sourceFileId();
-    auto j = mActiveJobs.take(fileId);
+    std::shared_ptr<IndexerJob> j;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        j = mActiveJobs.take(fileId);
+    }
     if (!j) {
         error() << "Couldn't find JobData for" << Location::path(fileId) << msg->id() << job->id << job.get();
         return;
@@ -785,6 +1116,31 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
         return;
     }
 
+    // Cached queries that looked at a file this job wrote are stale. So are
+    // the ones that looked at something it includes, a new include can add
+    // to what they find, and a file the project hasn't seen before could
+    // show up anywhere.
+    {
+        Set<uint32_t> changed = job->visited;
+        for (const auto &inc : msg->includes())
+            changed.insert(inc.second);
+        bool added = false;
+        for (uint32_t file : changed) {
+            if (!mDependencies.contains(file)) {
+                added = true;
+                break;
+            }
+        }
+        if (added) {
+            mQueryCache.clear();
+        } else {
+            mQueryCache.invalidate(changed);
+        }
+        for (uint32_t file : job->visited)
+            mSymbolNameIndex.dirty(file);
+        mSymbolNameTimer.restart(SymbolNameInterval);
+    }
+
     const bool success = job->flags & IndexerJob::Complete;
     assert(!(job->flags & IndexerJob::Aborted));
     assert(((job->flags & (IndexerJob::Complete|IndexerJob::Crashed)) == IndexerJob::Complete)
@@ -856,9 +1212,16 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
                   LogOutput::StdOut|LogOutput::TrailingNewLine);
     }
 
+    if (!appendJournal(job, msg, success ? msg->parseTime() : 0))
+        mSaveDirty = true;
+
     if (mActiveJobs.isEmpty()) {
         mLastIdleTime = time(nullptr);
-        save();
+        if (mSaveDirty) {
+            save();
+        } else if (mJournalSize > std::max<size_t>(JournalCheckpointMinSize, mCheckpointSize / 2)) {
+            checkpoint();
+        }
         double timerElapsed = (mTimer.elapsed() / 1000.0);
         const double averageJobTime = timerElapsed / mJobsStarted;
         const String m = String::format<1024>("Jobs took %.2fs%s. We're using %lldmb of memory. ",
@@ -868,8 +1231,6 @@ void Project::onJobFinished(const std::shared_ptr<IndexerJob> &job, const std::s
         mJobsStarted = mJobCounter = 0;
 
         // error() << "Finished this
-    } else {
-        mSaveDirty = true;
     }
 }
 
@@ -908,38 +1269,220 @@ String Project::diagnosticsToString(Flags<QueryMessage::Flag> flags, uint32_t fi
 
 bool Project::save()
 {
-    Path::mkdir(mSourcesFilePath.parentDir(), Path::Recursive);
+    waitForCheckpoint();
+    if (!state()->write(mSourcesFilePath, mProjectFilePath))
+        return false;
+    closeJournal();
+    Path::rm(mJournalPath);
+    Path::rm(mJournalPath + ".old");
+    mJournalSize = 0;
+    mCheckpointSize = mSourcesFilePath.fileSize() + mProjectFilePath.fileSize();
+    mSaveDirty = false;
+    return true;
+}
+
+void Project::destroy()
+{
+    mSaveDirty = false;
+    waitForCheckpoint();
+    closeJournal();
+}
+
+std::shared_ptr<Project::State> Project::state() const
+{
+    std::shared_ptr<State> ret = std::make_shared<State>();
+    ret->parseData = mIndexParseData;
     {
-        DataFile file(mSourcesFilePath, RTags::SourcesFileVersion);
-        if (!file.open(DataFile::Write)) {
-            error("Save error %s: %s", mSourcesFilePath.constData(), file.error().constData());
+        std::lock_guard<std::mutex> lock(mMutex);
+        ret->visitedFiles = mVisitedFiles;
+    }
+    ret->diagnostics = mDiagnostics;
+    ret->dependents = dependentsList(mDependencies);
+    return ret;
+}
+
+bool Project::appendJournal(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &msg, uint64_t parsed)
+{
+    if (!mJournal) {
+        Path::mkdir(mProjectDataDir, Path::Recursive);
+        const bool created = !mJournalPath.isFile();
+        mJournal = fopen(mJournalPath.constData(), "a");
+        if (!mJournal) {
+            error("Can't open %s: %s", mJournalPath.constData(), Rct::strerror().constData());
             return false;
         }
-        file << mIndexParseData;
-        if (!file.flush()) {
-            error("Save error %s: %s", mSourcesFilePath.constData(), file.error().constData());
-            return false;
+        if (created) {
+            const uint32_t header[] = { JournalMagic, static_cast<uint32_t>(RTags::DatabaseVersion) };
+            if (fwrite(header, sizeof(header), 1, mJournal) != 1) {
+                closeJournal();
+                return false;
+            }
+            mJournalSize = sizeof(header);
         }
     }
+
+    Hash<uint32_t, bool> visited;
     {
-        DataFile file(mProjectFilePath, RTags::DatabaseVersion);
-        if (!file.open(DataFile::Write)) {
-            error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
-            return false;
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (uint32_t file : job->visited)
+            visited[file] = mVisitedFiles.contains(file);
+    }
+    Hash<uint32_t, List<uint32_t> > includes;
+    auto add = [this, &includes](uint32_t file) {
+        if (!includes.contains(file)) {
+            if (const DependencyNode *node = mDependencies.value(file))
+                includes[file] = node->includes.keys();
         }
+    };
+    for (const auto &file : msg->files())
+        add(file.first);
+    for (const auto &inc : msg->includes())
+        add(inc.first);
+
+    String record(sizeof(uint32_t), '\0');
+    {
+        Serializer serializer(record);
+        serializer << job->sourceFileId() << parsed << visited << includes << msg->diagnostics();
+    }
+    const uint32_t size = record.size() - sizeof(uint32_t);
+    const uint32_t checksum = static_cast<uint32_t>(RTags::contentHash(record.constData() + sizeof(uint32_t), size));
+    memcpy(record.data(), &size, sizeof(size));
+    record.append(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+    if (fwrite(record.constData(), record.size(), 1, mJournal) != 1 || fflush(mJournal)) {
+        // the torn record is dropped when the journal is replayed
+        error("Can't write to %s: %s", mJournalPath.constData(), Rct::strerror().constData());
+        closeJournal();
+        return false;
+    }
+    mJournalSize += record.size();
+    return true;
+}
+
+void Project::closeJournal()
+{
+    if (mJournal) {
+        fclose(mJournal);
+        mJournal = nullptr;
+    }
+}
+
+// Folds project.journal.old into project and sources. Whoever calls run()
+// first does the work, that's usually a CheckpointJob on the background
+// pool but waitForCheckpoint() does it on the main thread if the pool
+// hasn't started it yet.
+struct Project::Checkpoint
+{
+    Checkpoint(const Path &sources, const Path &project, const Path &old)
+        : sourcesFile(sources), projectFile(project), journal(old), started(false), done(false), size(0)
+    {}
+
+    // returns false if someone else got to it first
+    bool run()
+    {
         {
-            std::lock_guard<std::mutex> lock(mMutex);
-            file << mVisitedFiles;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (started)
+                return false;
+            started = true;
         }
-        file << mDiagnostics;
-        saveDependencies(file, mDependencies);
-        if (!file.flush()) {
-            error("Save error %s: %s", mProjectFilePath.constData(), file.error().constData());
-            return false;
+        State state;
+        Dependencies dependencies;
+        if (!state.read(sourcesFile, projectFile, dependencies)) {
+            // project.journal.old stays, the next checkpoint does a full save()
+            error() << "Failed to read checkpoint" << projectFile;
+        } else {
+            replayJournal(journal, state.visitedFiles, state.diagnostics, dependencies, &state.parseData, false);
+            state.dependents = dependentsList(dependencies);
+            if (state.write(sourcesFile, projectFile)) {
+                Path::rm(journal);
+                size = sourcesFile.fileSize() + projectFile.fileSize();
+            }
         }
+        dependencies.deleteAll();
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        cond.notify_all();
+        return true;
     }
-    mSaveDirty = false;
-    return true;
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!done)
+            cond.wait(lock);
+    }
+
+    const Path sourcesFile, projectFile, journal;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool started, done;
+    size_t size; // of the new checkpoint, 0 if it failed
+    std::weak_ptr<Project> project;
+};
+
+class Project::CheckpointJob : public ThreadPool::Job
+{
+public:
+    CheckpointJob(const std::shared_ptr<Checkpoint> &checkpoint)
+        : mCheckpoint(checkpoint)
+    {}
+protected:
+    virtual void run() override
+    {
+        if (!mCheckpoint->run())
+            return;
+        const std::shared_ptr<Checkpoint> checkpoint = std::move(mCheckpoint);
+        if (std::shared_ptr<EventLoop> loop = EventLoop::mainEventLoop()) {
+            loop->callLater([checkpoint]() {
+                    if (std::shared_ptr<Project> project = checkpoint->project.lock())
+                        project->finishCheckpoint(checkpoint);
+                });
+        }
+    }
+private:
+    std::shared_ptr<Checkpoint> mCheckpoint;
+};
+
+void Project::checkpoint()
+{
+    waitForCheckpoint();
+    const Path old = mJournalPath + ".old";
+    closeJournal();
+    if (old.isFile() || !mSourcesFilePath.isFile() || !mProjectFilePath.isFile()
+        || rename(mJournalPath.constData(), old.constData())) {
+        // the last checkpoint failed or there's nothing to fold the
+        // journal into, don't risk losing it
+        save();
+        return;
+    }
+    mJournalSize = 0;
+
+    // Records appended from now on go to a new project.journal. The old one
+    // is needed until the checkpoint is on disk. Since mSaveDirty isn't set
+    // the last checkpoint plus the old journal is exactly our state, so the
+    // job folds one into the other and the main thread copies nothing.
+    mCheckpoint = std::make_shared<Checkpoint>(mSourcesFilePath, mProjectFilePath, old);
+    mCheckpoint->project = shared_from_this();
+    Server::instance()->backgroundPool()->start(std::make_shared<CheckpointJob>(mCheckpoint));
+}
+
+void Project::waitForCheckpoint()
+{
+    if (!mCheckpoint)
+        return;
+    // the pool may not have gotten to it yet, no point waiting for that
+    if (!mCheckpoint->run())
+        mCheckpoint->wait();
+    finishCheckpoint(mCheckpoint);
+}
+
+void Project::finishCheckpoint(const std::shared_ptr<Checkpoint> &checkpoint)
+{
+    if (checkpoint != mCheckpoint)
+        return; // already waited for
+    if (checkpoint->size)
+        mCheckpointSize = checkpoint->size;
+    mCheckpoint.reset();
 }
 
 void Project::index(const std::shared_ptr<IndexerJob> &job)
@@ -956,14 +1499,19 @@ void Project::index(const std::shared_ptr<IndexerJob> &job)
         return;
     }
 
-    std::shared_ptr<IndexerJob> &ref = mActiveJobs[job->sourceFileId()];
-    if (ref) {
-        // warning() << "Aborting a job" << ref.get() << Location::path(job->fileId());
-        releaseFileIds(ref->visited);
-        Server::instance()->jobScheduler()->abort(ref);
+    std::shared_ptr<IndexerJob> previous;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::shared_ptr<IndexerJob> &ref = mActiveJobs[job->sourceFileId()];
+        previous = std::move(ref);
+        ref = job;
+    }
+    if (previous) {
+        // warning() << "Aborting a job" << previous.get() << Location::path(job->fileId());
+        releaseFileIds(previous->visited);
+        Server::instance()->jobScheduler()->abort(previous);
         --mJobCounter;
     }
-    ref = job;
 
     ++mJobsStarted;
     if (!mJobCounter++) {
@@ -1066,42 +1614,42 @@ Set<uint32_t> Project::dependencies(uint32_t fileId, DependencyMode mode) const
 {
     Set<uint32_t> ret;
     if (mode == All) {
-        for (const auto &node : mDependencies) {
-            ret.insert(node.first);
+        for (uint32_t file : dependencyGraph()->fileIds()) {
+            ret.insert(file);
         }
         return ret;
     }
-    ret.insert(fileId);
-    std::function<void(uint32_t)> fill = [&](uint32_t file) {
-        if (DependencyNode *node = mDependencies.value(file)) {
-            const auto &nodes = (mode == ArgDependsOn ? node->includes : node->dependents);
-            for (const auto &it : nodes) {
-                if (ret.insert(it.first))
-                    fill(it.first);
-            }
-        }
-    };
-    fill(fileId);
+    const auto closure = dependencyGraph()->closure(fileId, mode == ArgDependsOn ? DependencyGraph::Includes : DependencyGraph::Dependents);
+    if (closure) {
+        ret = *closure;
+    } else {
+        ret.insert(fileId);
+    }
     return ret;
 }
 
 bool Project::dependsOn(uint32_t source, uint32_t header) const
 {
-    Set<uint32_t> seen;
-    std::function<bool(DependencyNode *node)> dep = [&](DependencyNode *node) {
-        assert(node);
-        if (!seen.insert(node->fileId))
-            return false;
-        if (node->dependents.contains(source))
-            return true;
-        for (const auto &n : node->dependents) {
-            if (dep(n.second))
-                return true;
-        }
-        return false;
-    };
-    DependencyNode *node = mDependencies.value(header);
-    return node && dep(node);
+    return source != header && dependencyGraph()->reaches(source, header, DependencyGraph::Includes);
+}
+
+std::shared_ptr<const DependencyGraph> Project::dependencyGraph() const
+{
+    // queries running off the main thread see the graph they started with
+    if (const std::shared_ptr<FileMapScope> scope = fileMapScope()) {
+        if (scope->dependencyGraph)
+            return scope->dependencyGraph;
+    }
+    std::lock_guard<std::mutex> lock(mDependencyGraphMutex);
+    if (!mDependencyGraph)
+        mDependencyGraph = std::make_shared<DependencyGraph>(mDependencies);
+    return mDependencyGraph;
+}
+
+void Project::dependenciesChanged()
+{
+    std::lock_guard<std::mutex> lock(mDependencyGraphMutex);
+    mDependencyGraph.reset();
 }
 
 void Project::removeDependencies(uint32_t fileId)
@@ -1113,6 +1661,9 @@ void Project::removeDependencies(uint32_t fileId)
         for (auto it : node->dependents)
             it.second->includes.remove(fileId);
         delete node;
+        dependenciesChanged();
+        mQueryCache.clear();
+        mSymbolNameIndex.remove(fileId);
     }
 }
 
@@ -1153,6 +1704,7 @@ void Project::updateDependencies(uint32_t fileId, const std::shared_ptr<IndexDat
             inclusiary = new DependencyNode(it.second);
         includer->include(inclusiary);
     }
+    dependenciesChanged();
 
     // for (auto node : mDependencies) {
     //     for (auto inc : node.second->includes) {
@@ -1336,48 +1888,7 @@ void Project::updateFixIts(const Set<uint32_t> &visited, FixIts &fixIts)
 
 void Project::updateDiagnostics(uint32_t fileId, const Diagnostics &diagnostics)
 {
-    // const bool debug = (Location::path(fileId) == "/home/abakken/temp/compl1/main.cpp");
-    // if (debug) {
-    //     error() << "GOT HERE" << diagnostics;
-    // }
-    Set<uint32_t> files;
-    {
-        auto it = mDiagnostics.begin();
-        const auto end = mDiagnostics.end();
-        uint32_t lastFileId = 0;
-        while (it != end) {
-            if (it->second.sourceFileId == fileId) {
-                const uint32_t f = it->first.fileId();
-                if (f != lastFileId) {
-                    files.insert(f);
-                    lastFileId = f;
-                }
-                // if (debug) {
-                //     error() << "erasing" << it->first << "for" << Location::path(fileId);
-                // }
-                mDiagnostics.erase(it++);
-            } else {
-                ++it;
-            }
-        }
-    }
-
-    {
-        uint32_t lastFileId = 0;
-        for (const auto &it : diagnostics) {
-            const uint32_t f = it.first.fileId();
-            if (lastFileId != f) {
-                files.insert(f);
-                lastFileId = f;
-            }
-            // if (debug) {
-            //     error() << "inserting" << it.first << "for" << Location::path(fileId);
-            // }
-
-            mDiagnostics[it.first] = it.second;
-        }
-    }
-
+    const Set<uint32_t> files = replaceDiagnostics(mDiagnostics, fileId, diagnostics);
     if (!files.isEmpty() || !diagnostics.isEmpty()) {
         // if (debug) {
         //     error() << "got stuff" << files.size() << diagnostics.size() << mDiagnostics.size();
@@ -1436,7 +1947,9 @@ void Project::findSymbols(const String &unencoded,
         if (!caseInsensitive) {
             const size_t size = string.size();
             for (size_t i=0; i<size; ++i) {
-                if (string.at(i) == '?' || string.at(i) == '*') {
+                // the prefix before the first character that isn't itself
+                const char ch = string.at(i);
+                if (ch == '?' || ch == '*' || ch == '[' || ch == '\\') {
                     lowerBound = string.left(i);
                     break;
                 }
@@ -1446,7 +1959,28 @@ void Project::findSymbols(const String &unencoded,
         lowerBound = string;
     }
 
-    auto processFile = [this, &lowerBound, &string, wildcard, regex, &rx, cs, &inserter](uint32_t file) {
+    // Whether entry matches, stop is set when nothing after it in a
+    // symnames map can match either.
+    auto matches = [&string, wildcard, regex, &rx, cs](const String &entry, SymbolMatchType &type, bool &stop) -> bool {
+        type = Exact;
+        if (string.isEmpty())
+            return true;
+        if (wildcard) {
+            type = Wildcard;
+            return Rct::wildCmp(string.constData(), entry.constData(), cs);
+        } else if (regex) {
+            type = Regexp;
+            return std::regex_search(entry.ref(), rx);
+        } else if (!entry.startsWith(string, cs)) {
+            stop = cs == String::CaseSensitive;
+            return false;
+        } else if (entry.size() != string.size()) {
+            type = StartsWith;
+        }
+        return true;
+    };
+
+    auto processFile = [this, &lowerBound, &matches, &inserter](uint32_t file) {
         auto symNames = openSymbolNames(file);
         if (!symNames)
             return;
@@ -1464,39 +1998,94 @@ void Project::findSymbols(const String &unencoded,
         for (int i=idx; i<count; ++i) {
             const String entry = symNames->keyAt(i);
             // error() << i << count << entry;
-            SymbolMatchType type = Exact;
-            if (!string.isEmpty()) {
-                if (wildcard) {
-                    if (!Rct::wildCmp(string.constData(), entry.constData(), cs)) {
-                        continue;
-                    }
-                    type = Wildcard;
-                } else if (regex) {
-                    if (!std::regex_search(entry.ref(), rx)) {
-                        continue;
-                    }
-                    type = Regexp;
-                } else if (!entry.startsWith(string, cs)) {
-                    if (cs == String::CaseInsensitive) {
-                        continue;
-                    } else {
-                        break;
-                    }
-                } else if (entry.size() != string.size()) {
-                    type = StartsWith;
-                }
+            SymbolMatchType type;
+            bool stop = false;
+            if (matches(entry, type, stop)) {
+                inserter(type, entry, symNames->valueAt(i));
+            } else if (stop) {
+                break;
             }
-            inserter(type, entry, symNames->valueAt(i));
         }
     };
 
     if (fileFilter) {
         processFile(fileFilter);
-    } else {
-        for (const auto &dep : mDependencies) {
-            processFile(dep.first);
+        return;
+    }
+
+    // Without a lower bound every name in the project would have to be
+    // matched, the trigram index narrows it down to the names that contain
+    // the pattern's literals.
+    if (lowerBound.isEmpty() && !string.isEmpty()) {
+        List<String> literals;
+        if (regex) {
+            literals = RTags::requiredLiterals(string);
+        } else if (wildcard) {
+            literals = RTags::wildcardLiterals(string);
+        } else {
+            literals.append(string); // case insensitive prefix
+        }
+        Hash<uint32_t, List<String> > candidates;
+        if (!literals.isEmpty() && updateSymbolNameIndex() && mSymbolNameIndex.candidates(literals, candidates)) {
+            for (const auto &file : candidates) {
+                if (isQueryAborted())
+                    break;
+                auto symNames = openSymbolNames(file.first);
+                if (!symNames)
+                    continue;
+                for (const String &entry : file.second) {
+                    bool found;
+                    const uint32_t idx = symNames->lowerBound(entry, &found);
+                    SymbolMatchType type;
+                    bool stop = false;
+                    if (found && matches(entry, type, stop))
+                        inserter(type, entry, symNames->valueAt(idx));
+                }
+            }
+            return;
         }
     }
+
+    const std::shared_ptr<const DependencyGraph> graph = dependencyGraph();
+    for (uint32_t file : graph->fileIds()) {
+        if (isQueryAborted())
+            break;
+        processFile(file);
+    }
+}
+
+bool Project::updateSymbolNameIndex(int budget)
+{
+    StopWatch sw;
+    const std::shared_ptr<const DependencyGraph> graph = dependencyGraph();
+    const std::shared_ptr<FileMapScope> scope = fileMapScope();
+    for (uint32_t file : graph->fileIds()) {
+        if (isQueryAborted() || (budget >= 0 && sw.elapsed() >= static_cast<uint64_t>(budget)))
+            return false;
+        // whatever the index answers depends on every file's names, not
+        // just the candidates that get opened, see QueryCache
+        if (scope)
+            scope->fileIds.insert(file);
+        uint64_t version;
+        if (!mSymbolNameIndex.needsUpdate(file, &version))
+            continue;
+        List<String> names;
+        if (auto symNames = openSymbolNames(file)) {
+            const uint32_t count = symNames->count();
+            names.reserve(count);
+            for (uint32_t i=0; i<count; ++i)
+                names.append(symNames->keyAt(i));
+        }
+        mSymbolNameIndex.update(file, version, names);
+    }
+    return true;
+}
+
+void Project::onSymbolNameTimeout(Timer *)
+{
+    FileMapScopeScope scope(this);
+    if (updateSymbolNameIndex(SymbolNameSlice))
+        mSymbolNameTimer.stop();
 }
 
 List<RTags::SortedSymbol> Project::sort(const Set<Symbol> &symbols, Flags<QueryMessage::Flag> flags)
@@ -1599,7 +2188,7 @@ String Project::toCompileCommands() const
     Value ret;
     forEachSource([&ret, flags](const Source &source) -> VisitResult {
         Value unit;
-        unit["directory"] = source.directory;
+        unit["directory"] = *source.directory;
         unit["file"] = source.sourceFile();
         unit["command"] = String::join(source.toCommandLine(flags), " ").constData();
         ret.push_back(unit);
@@ -1759,13 +2348,18 @@ static Set<Symbol> findReferences(const Set<Symbol> &inputs,
             }
         };
         const Set<uint32_t> deps = project->dependencies(input.location.fileId(), Project::DependsOnArg);
-        for (auto dep : deps)
+        for (auto dep : deps) {
+            if (project->isQueryAborted())
+                return ret;
             process(dep);
+        }
 
         if (ret.isEmpty()) {
-            for (auto dep : project->dependencies()) {
-                if (!deps.contains(dep.first))
-                    process(dep.first);
+            for (uint32_t dep : project->dependencyGraph()->fileIds()) {
+                if (project->isQueryAborted())
+                    return ret;
+                if (!deps.contains(dep))
+                    process(dep);
             }
         }
     }
@@ -1973,16 +2567,44 @@ Set<Symbol> Project::findSubclasses(const Symbol &symbol)
     return ret;
 }
 
-void Project::beginScope(Flags<ScopeFlag> flags)
+void Project::beginScope(Flags<ScopeFlag> flags, const std::shared_ptr<const DependencyGraph> &graph)
 {
-    assert(!mFileMapScope);
-    mFileMapScope.reset(new FileMapScope(shared_from_this(), Server::instance()->options().maxFileMapScopeCacheSize, flags));
+    std::shared_ptr<FileMapScope> scope = std::make_shared<FileMapScope>(shared_from_this(), Server::instance()->options().maxFileMapScopeCacheSize, flags);
+    scope->dependencyGraph = graph;
+    std::lock_guard<std::mutex> lock(mFileMapScopesMutex);
+    std::shared_ptr<FileMapScope> &ref = mFileMapScopes[std::this_thread::get_id()];
+    assert(!ref);
+    ref = std::move(scope);
 }
 
 void Project::endScope()
 {
-    assert(mFileMapScope);
-    mFileMapScope.reset();
+    std::shared_ptr<FileMapScope> scope;
+    {
+        std::lock_guard<std::mutex> lock(mFileMapScopesMutex);
+        scope = mFileMapScopes.take(std::this_thread::get_id());
+    }
+    assert(scope);
+    // destroyed outside the lock, ~FileMapScope may validate
+}
+
+void Project::setQueryAbortCallback(std::function<bool()> &&callback)
+{
+    const std::shared_ptr<FileMapScope> scope = fileMapScope();
+    assert(scope);
+    scope->aborted = std::move(callback);
+}
+
+bool Project::isQueryAborted() const
+{
+    const std::shared_ptr<FileMapScope> scope = fileMapScope();
+    return scope && scope->aborted && scope->aborted();
+}
+
+Set<uint32_t> Project::scopeFileIds() const
+{
+    const std::shared_ptr<FileMapScope> scope = fileMapScope();
+    return scope ? scope->fileIds : Set<uint32_t>();
 }
 
 static String addDeps(const Dependencies &deps)
@@ -2130,30 +2752,35 @@ void Project::dirty(uint32_t fileId)
 
 bool Project::validate(uint32_t fileId, ValidateMode mode, String *err) const
 {
+    return validate(mProjectDataDir, fileMapOptions(), fileId, mode, err);
+}
+
+bool Project::validate(const Path &projectDataDir, uint32_t opts, uint32_t fileId, ValidateMode mode, String *err)
+{
+    const Path dir = String::format<1024>("%s%d/", projectDataDir.constData(), fileId);
     if (mode == Validate || mode == ValidateSilent) {
         Path path;
         String error;
-        const uint32_t opts = fileMapOptions();
         {
-            path = sourceFilePath(fileId, fileMapName(SymbolNames));
+            path = dir + fileMapName(SymbolNames);
             FileMap<String, Set<Location> > fileMap;
             if (!fileMap.load(path, opts, &error))
                 goto error;
         }
         {
-            path = sourceFilePath(fileId, fileMapName(Symbols));
+            path = dir + fileMapName(Symbols);
             FileMap<Location, Symbol> fileMap;
             if (!fileMap.load(path, opts, &error))
                 goto error;
         }
         {
-            path = sourceFilePath(fileId, fileMapName(Targets));
+            path = dir + fileMapName(Targets);
             FileMap<String, Set<Location> > fileMap;
             if (!fileMap.load(path, opts, &error))
                 goto error;
         }
         {
-            path = sourceFilePath(fileId, fileMapName(Usrs));
+            path = dir + fileMapName(Usrs);
             FileMap<String, Set<Location> > fileMap;
             if (!fileMap.load(path, opts, &error))
                 goto error;
@@ -2165,10 +2792,22 @@ bool Project::validate(uint32_t fileId, ValidateMode mode, String *err) const
         return false;
     } else {
         assert(mode == StatOnly);
-        for (auto type : { Symbols, SymbolNames, Targets, Usrs }) {
-            const Path p = sourceFilePath(fileId, fileMapName(type));
-            if (!p.isFile()) {
-                Log(err) << "Error during validation:" << Location::path(fileId) << p << "doesn't exist";
+        // one readdir instead of a stat per file map, this runs for every
+        // file in the project at startup
+        const FileMapType types[] = { Symbols, SymbolNames, Targets, Usrs };
+        bool found[sizeof(types) / sizeof(types[0])] = { false };
+        if (DIR *d = opendir(dir.constData())) {
+            while (const dirent *entry = readdir(d)) {
+                for (size_t i=0; i<sizeof(types) / sizeof(types[0]); ++i) {
+                    if (!strcmp(entry->d_name, fileMapName(types[i])))
+                        found[i] = true;
+                }
+            }
+            closedir(d);
+        }
+        for (size_t i=0; i<sizeof(types) / sizeof(types[0]); ++i) {
+            if (!found[i]) {
+                Log(err) << "Error during validation:" << Location::path(fileId) << (dir + fileMapName(types[i])) << "doesn't exist";
                 return false;
             }
         }
@@ -2413,14 +3052,31 @@ size_t estimateMemory(const Source::Include &include)
 
 size_t estimateMemory(const Source &source)
 {
+    // the interned blocks are accounted for in Project::estimateMemory
     size_t ret = sizeof(Source);
     ret += estimateMemory(source.extraCompiler);
-    ret += estimateMemory(source.defines);
-    ret += estimateMemory(source.includePaths);
-    ret += estimateMemory(source.directory);
+    ret += estimateMemory(source.outputFilename);
     return ret;
 }
 
+struct SourceBlocks
+{
+    size_t references { 0 }, blocks { 0 }, memory { 0 }, unsharedMemory { 0 };
+    Set<const void *> seen;
+
+    template <typename T>
+    void add(const Interned<T> &block)
+    {
+        const size_t size = estimateMemory(*block) + sizeof(size_t) * 2; // refcounts
+        ++references;
+        unsharedMemory += size;
+        if (seen.insert(block.id())) {
+            ++blocks;
+            memory += size;
+        }
+    }
+};
+
 template <typename T>
 size_t estimateMemory(const std::shared_ptr<T> &ptr)
 {
@@ -2497,38 +3153,176 @@ String Project::estimateMemory() const
     add("Active jobs", ::estimateMemory(mActiveJobs));
     add("Fixits", ::estimateMemory(mFixIts));
     add("Pending dirty files", ::estimateMemory(mPendingDirtyFiles));
-    add("Sources", ::estimateMemory(mIndexParseData.sources));
+    SourceBlocks blocks;
+    size_t sources = 0;
+    forEachSource([&blocks, &sources](const Source &source) {
+            sources += ::estimateMemory(source);
+            blocks.add(source.defines);
+            blocks.add(source.includePaths);
+            blocks.add(source.arguments);
+            blocks.add(source.directory);
+            return Continue;
+        });
+    add("Sources", sources);
+    add("Source blocks", blocks.memory);
+    ret << String::format<128>("Source blocks: %zu references to %zu blocks (%.2fmb unshared, %.1fx)",
+                               blocks.references, blocks.blocks, blocks.unsharedMemory / (1024.0 * 1024.0),
+                               blocks.memory ? static_cast<double>(blocks.unsharedMemory) / blocks.memory : 1.0);
     add("Suspended files", ::estimateMemory(mSuspendedFiles));
     size_t deps = ::estimateMemory(mDependencies);
     for (const auto &dep : mDependencies) {
         deps += ::estimateMemory(*dep.second);
     }
     add("Dependencies", deps);
+    ret << String::format<128>("Symbol name index: %zu names", mSymbolNameIndex.size());
+    const QueryCache::Stats cache = mQueryCache.stats();
+    add("Query cache", cache.bytes);
+    ret << String::format<128>("Query cache: %zu entries, %zu hits, %zu misses, %zu invalidated",
+                               cache.entries, cache.hits, cache.misses, cache.invalidated);
     add("Total", total);
     return String::join(ret, "\n");
 }
 
+static inline bool sameSources(const SourceList &l, const SourceList &r)
+{
+    if (l.size() != r.size())
+        return false;
+    for (size_t idx=0; idx<l.size(); ++idx) {
+        if (!l.at(idx).compareArguments(r.at(idx)))
+            return false;
+    }
+    return true;
+}
+
+bool Project::updateCompileCommands(uint32_t fileId, IndexParseData::CompileCommands &commands, SourceCache *cache,
+                                    Set<uint32_t> &index, Hash<uint32_t, uint32_t> &removed)
+{
+    if (commands.entries.isEmpty() && !commands.sources.isEmpty())
+        return false; // no entry hashes recorded, needs a full reload
+
+    const Path &file = Location::path(fileId);
+    const String contents = file.readAll();
+    CompileCommandsReader reader(contents);
+    Hash<uint64_t, CompileCommandsReader::Command> current;
+    CompileCommandsReader::Command command;
+    while (reader.next(command)) {
+        const uint64_t hash = command.hash();
+        current[hash] = std::move(command);
+        command = CompileCommandsReader::Command();
+    }
+    if (reader.hasError()) {
+        error("Error parsing %s: %s", file.constData(), reader.error().constData());
+        return true; // keep what we have until the file is fixed
+    }
+
+    // Files produced by entries that are gone have to be looked at again,
+    // so do files produced by the new entries.
+    Set<uint32_t> affected;
+    List<uint64_t> gone;
+    for (const auto &entry : commands.entries) {
+        if (!current.contains(entry.first)) {
+            affected += entry.second;
+            gone << entry.first;
+        }
+    }
+    List<uint64_t> added;
+    for (const auto &entry : current) {
+        if (!commands.entries.contains(entry.first))
+            added << entry.first;
+    }
+    debug() << "Reloading" << file << added.size() << "added and" << gone.size() << "removed entries";
+    if (added.isEmpty() && gone.isEmpty())
+        return true;
+
+    IndexParseData data;
+    data.project = mPath;
+    data.environment = mIndexParseData.environment;
+    data.compileCommands[fileId].environment = commands.environment;
+    auto parseEntries = [&](const List<uint64_t> &hashes) {
+        size_t idx = 0;
+        Server::instance()->parseCompileCommands(data, fileId, [&](CompileCommandsReader::Command &cmd) {
+                if (idx == hashes.size())
+                    return false;
+                cmd = std::move(current[hashes.at(idx++)]);
+                return true;
+            }, cache);
+    };
+    parseEntries(added);
+    const IndexParseData::CompileCommands &fresh = data.compileCommands[fileId];
+    for (const auto &entry : fresh.entries)
+        affected += entry.second;
+
+    // Entries we still have that contribute to an affected file need to be
+    // parsed too, the affected SourceLists are rebuilt from scratch.
+    List<uint64_t> related;
+    for (const auto &entry : commands.entries) {
+        if (!current.contains(entry.first))
+            continue;
+        for (uint32_t sourceFileId : entry.second) {
+            if (affected.contains(sourceFileId)) {
+                related << entry.first;
+                break;
+            }
+        }
+    }
+    if (!related.isEmpty())
+        parseEntries(related);
+
+    for (uint64_t hash : gone)
+        commands.entries.remove(hash);
+    for (const auto &entry : fresh.entries)
+        commands.entries[entry.first] = entry.second;
+
+    const bool watch = !(Server::instance()->options().options & Server::NoFileSystemWatch);
+    for (uint32_t sourceFileId : affected) {
+        auto old = commands.sources.find(sourceFileId);
+        auto it = fresh.sources.find(sourceFileId);
+        if (it == fresh.sources.end()) {
+            if (old != commands.sources.end()) {
+                commands.sources.erase(old);
+                removed[sourceFileId] = fileId;
+            }
+            continue;
+        }
+        if (old == commands.sources.end()) {
+            index.insert(sourceFileId);
+        } else if (sameSources(old->second, it->second)) {
+            continue; // don't want to reparse these, maintain parseTime
+        } else if (watch) {
+            index.insert(sourceFileId);
+        }
+        SourceList &list = commands.sources[sourceFileId];
+        list = it->second;
+        list.parsed = 0;
+    }
+    return true;
+}
+
 void Project::reloadCompileCommands()
 {
     if (!Server::instance()->suspended()) {
         SourceCache cache;
         Hash<uint32_t, uint32_t> removed;
+        Set<uint32_t> index;
         IndexParseData data;
         data.project = mPath;
         data.environment = mIndexParseData.environment;
         bool found = false;
 
         for (auto it = mIndexParseData.compileCommands.begin(); it != mIndexParseData.compileCommands.end(); ++it) {
-            const Path file = Location::path(it->first);
+            const Path &file = Location::path(it->first);
             const uint64_t lastModified = file.lastModifiedMs();
             if (!lastModified) {
                 for (auto src : it->second.sources) {
                     removed[src.first] = it->first;
                 }
                 it->second.clearSources();
-            } else {
-                if (lastModified != it->second.lastModifiedMs
-                    && Server::instance()->loadCompileCommands(data, file, it->second.environment, &cache)) {
+                mSaveDirty = true;
+            } else if (lastModified != it->second.lastModifiedMs) {
+                if (updateCompileCommands(it->first, it->second, &cache, index, removed)) {
+                    it->second.lastModifiedMs = lastModified;
+                    mSaveDirty = true;
+                } else if (Server::instance()->loadCompileCommands(data, file, it->second.environment, &cache)) {
                     found = true;
                 }
             }
@@ -2536,6 +3330,8 @@ void Project::reloadCompileCommands()
         removeSources(removed);
         if (found)
             processParseData(std::move(data));
+        for (uint32_t fileId : index)
+            reindex(fileId, IndexerJob::Compile);
     }
 }
 
@@ -2549,7 +3345,7 @@ uint32_t Project::fileMapOptions() const
 
 void Project::fixPCH(Source &source)
 {
-    for (Source::Include &inc : source.includePaths) {
+    for (Source::Include &inc : source.includePaths.write()) {
         if (inc.type == Source::Include::Type_PCH) {
             const uint32_t fileId = Location::insertFile(inc.path);
             inc.path = RTags::encodeSourceFilePath(Server::instance()->options().dataDir, mPath, fileId) + "pch.h";
@@ -2561,13 +3357,14 @@ void Project::fixPCH(Source &source)
 void Project::includeCompletions(Flags<QueryMessage::Flag> flags, const std::shared_ptr<Connection> &conn, Source &&source) const
 {
     CompilerManager::applyToSource(source, CompilerManager::IncludeIncludePaths);
-    source.includePaths.append(Server::instance()->options().includePaths);
-    source.includePaths.sort();
+    List<Source::Include> &includePaths = source.includePaths.write();
+    includePaths.append(Server::instance()->options().includePaths);
+    includePaths.sort();
     Set<Path> seen;
     if (flags & QueryMessage::Elisp) {
         conn->write("(list");
     }
-    for (const Source::Include &inc : source.includePaths) {
+    for (const Source::Include &inc : includePaths) {
         Path root;
         switch (inc.type) {
         case Source::Include::Type_Framework:
@@ -2711,6 +3508,7 @@ void Project::processParseData(IndexParseData &&data)
         }
     }
     removeSources(removed);
+    mSaveDirty = true;
 
     for (const auto &info : mIndexParseData.compileCommands)
         watch(Location::path(info.first), Watch_CompileCommands);
@@ -2890,7 +3688,11 @@ void Project::removeSources(const Hash<uint32_t, uint32_t> &removed)
 
 void Project::removeSource(uint32_t fileId)
 {
-    std::shared_ptr<IndexerJob> job = mActiveJobs.take(fileId);
+    std::shared_ptr<IndexerJob> job;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        job = mActiveJobs.take(fileId);
+    }
     if (job) {
         releaseFileIds(job->visited);
         Server::instance()->jobScheduler()->abort(job);
@@ -2900,9 +3702,346 @@ void Project::removeSource(uint32_t fileId)
     dirty(fileId);
     releaseFileIds(file);
     removeDependencies(fileId);
+    mIncludeBlocks.remove(fileId);
     Path::rmdir(sourceFilePath(fileId));
 }
 
+String Project::includeBlock(uint32_t fileId, const Path &path)
+{
+    assert(EventLoop::isMainThread());
+    const uint64_t lastModified = path.lastModifiedMs();
+    IncludeBlock &cached = mIncludeBlocks[fileId];
+    if (!lastModified || cached.lastModified != lastModified) {
+        cached.lastModified = lastModified;
+        cached.block = IndexerJob::leadingIncludeBlock(path.readAll(IndexerJob::MaxPreambleScan));
+    }
+    return cached.block;
+}
+
+static inline Location remapLocation(Location location, const Hash<uint32_t, uint32_t> &fileIds)
+{
+    if (location.isNull())
+        return location;
+    const uint32_t fileId = fileIds.value(location.fileId());
+    return fileId ? Location(fileId, location.line(), location.column()) : Location();
+}
+
+static inline void remapLocations(Set<Location> &locations, const Hash<uint32_t, uint32_t> &fileIds)
+{
+    Set<Location> ret;
+    for (Location loc : locations) {
+        loc = remapLocation(loc, fileIds);
+        if (!loc.isNull())
+            ret.insert(loc);
+    }
+    locations = std::move(ret);
+}
+
+template <typename Key, typename Value>
+static bool remapFileMap(const Path &from, const Path &to, uint32_t options,
+                         const std::function<bool(Key &, Value &)> &remap, String *err)
+{
+    FileMap<Key, Value> in;
+    if (!in.load(from, options, err))
+        return false;
+    Map<Key, Value> out;
+    for (uint32_t i=0; i<in.count(); ++i) {
+        Key key = in.keyAt(i);
+        Value value = in.valueAt(i);
+        if (remap(key, value))
+            out[key] = std::move(value);
+    }
+    if (!FileMap<Key, Value>::write(to, out, options)) {
+        if (err)
+            *err = "Failed to write " + to;
+        return false;
+    }
+    return true;
+}
+
+// Always copies the bytes. A hard link would share the inode with the
+// foreign database and FileMap::write truncates and rewrites in place.
+static bool copyShard(const Path &from, const Path &to)
+{
+    const String data = from.readAll();
+    FILE *f = fopen(to.constData(), "w");
+    if (!f)
+        return false;
+    const bool ok = data.isEmpty() || fwrite(data.constData(), data.size(), 1, f);
+    fclose(f);
+    return ok;
+}
+
+// A missing map only sets *incomplete, the file is imported without it and
+// reindexed.
+static bool importShards(const Path &from, const Path &to, const Hash<uint32_t, uint32_t> &fileIds,
+                         bool identity, uint32_t options, bool *incomplete, String *err)
+{
+    Path::rmdir(to);
+    if (!Path::mkdir(to, Path::Recursive)) {
+        if (err)
+            *err = "Failed to create " + to;
+        return false;
+    }
+    for (const char *name : { "info", "stat" }) {
+        if (Path(from + name).isFile() && !copyShard(from + name, to + name)) {
+            if (err)
+                *err = "Failed to copy " + from + name;
+            return false;
+        }
+    }
+
+    auto remapSetMap = [&fileIds](String &, Set<Location> &locations) {
+        remapLocations(locations, fileIds);
+        return !locations.isEmpty();
+    };
+    for (auto type : { Project::Symbols, Project::SymbolNames, Project::Targets, Project::Usrs, Project::Tokens }) {
+        const char *name = Project::fileMapName(type);
+        const Path src = from + name, dest = to + name;
+        if (!src.isFile()) {
+            *incomplete = true;
+            continue;
+        }
+        bool ok;
+        if (identity) {
+            ok = copyShard(src, dest);
+            if (!ok && err)
+                *err = "Failed to copy " + src;
+        } else {
+            switch (type) {
+            case Project::Symbols:
+                ok = remapFileMap<Location, Symbol>(src, dest, options, [&fileIds](Location &location, Symbol &symbol) {
+                        location = remapLocation(location, fileIds);
+                        symbol.location = location;
+                        for (auto &arg : symbol.arguments) {
+                            arg.location = remapLocation(arg.location, fileIds);
+                            arg.cursor = remapLocation(arg.cursor, fileIds);
+                        }
+                        auto &usage = symbol.argumentUsage;
+                        usage.invocation = remapLocation(usage.invocation, fileIds);
+                        usage.invokedFunction = remapLocation(usage.invokedFunction, fileIds);
+                        usage.argument.location = remapLocation(usage.argument.location, fileIds);
+                        usage.argument.cursor = remapLocation(usage.argument.cursor, fileIds);
+                        return !location.isNull();
+                    }, err);
+                break;
+            case Project::Tokens:
+                ok = remapFileMap<uint32_t, Token>(src, dest, options, [&fileIds](uint32_t &, Token &token) {
+                        token.location = remapLocation(token.location, fileIds);
+                        return true;
+                    }, err);
+                break;
+            default:
+                ok = remapFileMap<String, Set<Location> >(src, dest, options, remapSetMap, err);
+                break;
+            }
+        }
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+struct ProjectImport
+{
+    ~ProjectImport() { deps.deleteAll(); }
+
+    Path dir, staging;
+    Hash<uint32_t, uint32_t> fileIds; // foreign -> local
+    bool identity;
+    uint32_t options;
+    Set<uint32_t> visited; // foreign ids
+    Diagnostics diagnostics;
+    Dependencies deps;
+    Set<uint32_t> candidates, staged, mismatched; // local ids
+    Project::ImportCallback callback;
+};
+
+// Copies or remaps the shards into a staging dir off the main thread,
+// Project::finishImport moves them into place.
+class ImportJob : public ThreadPool::Job
+{
+public:
+    ImportJob(const std::shared_ptr<Project> &project, const std::shared_ptr<ProjectImport> &import)
+        : mProject(project), mImport(import)
+    {}
+protected:
+    virtual void run() override
+    {
+        ProjectImport &import = *mImport;
+        for (uint32_t foreignId : import.visited) {
+            const uint32_t fileId = import.fileIds.value(foreignId);
+            if (!import.candidates.contains(fileId))
+                continue;
+            const Path from = String::format<1024>("%s%u/", import.dir.constData(), foreignId);
+            const Path to = String::format<1024>("%s%u/", import.staging.constData(), fileId);
+            String shardError;
+            bool incomplete = false;
+            if (!importShards(from, to, import.fileIds, import.identity, import.options, &incomplete, &shardError)) {
+                error() << "Failed to import" << Location::path(fileId) << shardError;
+                Path::rmdir(to);
+                continue;
+            }
+            import.staged.insert(fileId);
+
+            const Path path = Location::path(fileId);
+            unsigned long long size = 0, lastModified = 0;
+            if (incomplete
+                || sscanf(Path(from + "stat").readAll().constData(), "%llu %llu", &size, &lastModified) != 2
+                || size != static_cast<unsigned long long>(path.fileSize())
+                || lastModified != static_cast<unsigned long long>(path.lastModifiedMs())) {
+                import.mismatched.insert(fileId);
+            }
+        }
+
+        const std::weak_ptr<Project> weak = mProject;
+        const std::shared_ptr<ProjectImport> ptr = std::move(mImport);
+        if (std::shared_ptr<EventLoop> loop = EventLoop::mainEventLoop()) {
+            loop->callLater([weak, ptr]() {
+                    if (std::shared_ptr<Project> project = weak.lock()) {
+                        project->finishImport(ptr);
+                    } else {
+                        ptr->callback(-1, "Project was unloaded");
+                    }
+                    Path::rmdir(ptr->staging);
+                });
+        }
+    }
+private:
+    const std::weak_ptr<Project> mProject;
+    std::shared_ptr<ProjectImport> mImport;
+};
+
+void Project::importIndex(const Path &dir, const Hash<uint32_t, uint32_t> &fileIds, ImportCallback &&callback)
+{
+    assert(EventLoop::isMainThread());
+    auto import = std::make_shared<ProjectImport>();
+    import->callback = std::move(callback);
+    {
+        DataFile file(dir + "project", RTags::DatabaseVersion);
+        if (!file.open(DataFile::Read)) {
+            import->callback(-1, file.error().isEmpty() ? String("Can't open " + dir + "project") : file.error());
+            return;
+        }
+        file >> import->visited >> import->diagnostics;
+        if (!loadDependencies(file, import->deps)) {
+            import->callback(-1, "Failed to load dependencies");
+            return;
+        }
+        replayJournal(dir + "project.journal.old", import->visited, import->diagnostics, import->deps, nullptr, false);
+        replayJournal(dir + "project.journal", import->visited, import->diagnostics, import->deps, nullptr, false);
+    }
+
+    import->identity = true;
+    for (const auto &id : fileIds) {
+        if (id.first != id.second) {
+            import->identity = false;
+            break;
+        }
+    }
+
+    // Files we've already visited here are owned by the local index (or
+    // by a job that's running right now) and win over the imported copy.
+    const Set<uint32_t> localVisited = visitedFiles();
+    for (uint32_t foreignId : import->visited) {
+        const uint32_t fileId = fileIds.value(foreignId);
+        if (fileId && !localVisited.contains(fileId))
+            import->candidates.insert(fileId);
+    }
+    static int sImportCount = 0;
+    import->dir = dir;
+    import->staging = mProjectDataDir + String::format<32>("import/%d/", ++sImportCount);
+    import->fileIds = fileIds;
+    import->options = fileMapOptions();
+    Server::instance()->backgroundPool()->start(std::make_shared<ImportJob>(shared_from_this(), import));
+}
+
+void Project::finishImport(const std::shared_ptr<ProjectImport> &import)
+{
+    assert(EventLoop::isMainThread());
+    // Jobs may have visited some of these while we were copying
+    const Set<uint32_t> localVisited = visitedFiles();
+    Set<uint32_t> imported;
+    const Set<uint32_t> &mismatched = import->mismatched;
+    for (uint32_t fileId : import->staged) {
+        if (localVisited.contains(fileId))
+            continue;
+        const Path to = sourceFilePath(fileId);
+        Path::rmdir(to);
+        if (rename(String::format<1024>("%s%u", import->staging.constData(), fileId).constData(), to.constData())) {
+            error() << "Failed to move imported shards into place" << to << Rct::strerror();
+            continue;
+        }
+        imported.insert(fileId);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mVisitedFiles += imported;
+    }
+
+    auto node = [this](uint32_t fileId) {
+        DependencyNode *ret = mDependencies.value(fileId);
+        if (!ret) {
+            ret = new DependencyNode(fileId);
+            mDependencies[fileId] = ret;
+        }
+        return ret;
+    };
+    for (const auto &dep : import->deps) {
+        const uint32_t fileId = import->fileIds.value(dep.first);
+        if (!imported.contains(fileId))
+            continue;
+        DependencyNode *includer = node(fileId);
+        for (const auto &inc : dep.second->includes) {
+            if (const uint32_t includeId = import->fileIds.value(inc.first))
+                includer->include(node(includeId));
+        }
+        watchFile(fileId);
+    }
+    dependenciesChanged();
+    mQueryCache.clear();
+    mSymbolNameIndex.clear();
+
+    // A source is up to date when it and everything it includes came from
+    // the import with matching contents. Foreign parse times are
+    // meaningless against local mtimes so these get stamped with now.
+    const uint64_t now = Rct::currentTimeMs();
+    forEachSourceList([&](SourceList &list) -> VisitResult {
+        const uint32_t fileId = list.fileId();
+        if (!imported.contains(fileId) || mismatched.contains(fileId))
+            return Continue;
+        for (uint32_t dep : dependencies(fileId, ArgDependsOn)) {
+            if (!imported.contains(dep) || mismatched.contains(dep))
+                return Continue;
+        }
+        list.parsed = now;
+        std::shared_ptr<IndexerJob> job;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            job = mActiveJobs.take(fileId);
+        }
+        if (job) {
+            releaseFileIds(job->visited);
+            Server::instance()->jobScheduler()->abort(job);
+        }
+        return Continue;
+    });
+
+    Set<uint32_t> dirtyFiles;
+    for (uint32_t fileId : mismatched) {
+        if (imported.contains(fileId))
+            dirtyFiles.insert(fileId);
+    }
+    if (!dirtyFiles.isEmpty()) {
+        SimpleDirty dirty;
+        dirty.init(shared_from_this(), dirtyFiles);
+        startDirtyJobs(&dirty, IndexerJob::Dirty);
+    }
+    save();
+    import->callback(imported.size(), String());
+}
+
 void Project::validateAll()
 {
     SimpleDirty dirty;
@@ -2930,20 +4069,25 @@ Set<Symbol> Project::findDeadFunctions(uint32_t fileId)
 
         const int count = symbols->count();
         for (int i=0; i<count; ++i) {
+            if (isQueryAborted())
+                return;
             Symbol s = symbols->valueAt(i);
             if (RTags::isFunction(s.kind)
                 && s.kind != CXCursor_Destructor
                 && s.kind != CXCursor_LambdaExpr
                 && !s.symbolName.startsWith("int main(")
                 && (!seen || seen->insert(s.usr))
-                && findCallers(s, 1).isEmpty()) {
+                && findCallers(s, 1).isEmpty()
+                && !isQueryAborted()) { // an aborted findCallers() proves nothing
                 ret.insert(std::move(s));
             }
         }
     };
     if (!fileId) {
         Set<String> seenUsrs;
-        for (uint32_t id : mVisitedFiles) {
+        for (uint32_t id : visitedFiles()) {
+            if (isQueryAborted())
+                break;
             processFile(id, &seenUsrs);
         }
     } else {
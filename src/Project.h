@@ -16,30 +16,37 @@
 #ifndef Project_h
 #define Project_h
 
+#include <atomic>
 #include <cstdint>
 #include <mutex>
+#include <thread>
 
+#include "DependencyGraph.h"
 #include "Diagnostic.h"
 #include "FileMap.h"
 #include "IndexerJob.h"
 #include "IndexMessage.h"
+#include "QueryCache.h"
 #include "QueryMessage.h"
 #include "IndexParseData.h"
 #include "rct/EmbeddedLinkedList.h"
-#include "rct/FileSystemWatcher.h"
+#include "rct/EventLoop.h"
 #include "rct/Flags.h"
 #include "rct/Path.h"
 #include "rct/StopWatch.h"
 #include "rct/Timer.h"
 #include "rct/Serializer.h"
 #include "RTags.h"
+#include "SymbolNameIndex.h"
 #include "Token.h"
+#include "WatchManager.h"
 
 class Connection;
 class Dirty;
 class FileManager;
 class IndexDataMessage;
 class Match;
+struct ProjectImport;
 class RestoreThread;
 struct DependencyNode
 {
@@ -64,6 +71,10 @@ public:
     Project(const Path &path);
     ~Project();
     bool init();
+    // false until init() has read the project from disk, see --lazy-projects
+    bool isLoaded() const { return mLoaded; }
+    void touch() { mLastUsed = time(nullptr); }
+    time_t lastUsed() const { return mLastUsed; }
 
     std::shared_ptr<FileManager> fileManager() const { return mFileManager; }
 
@@ -91,29 +102,34 @@ public:
     }
     std::shared_ptr<FileMap<String, Set<Location> > > openSymbolNames(uint32_t fileId, String *err = nullptr)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(SymbolNames, fileId, mFileMapScope->symbolNames, err);
+        const std::shared_ptr<FileMapScope> scope = fileMapScope();
+        assert(scope);
+        return scope->openFileMap<String, Set<Location> >(SymbolNames, fileId, scope->symbolNames, err);
     }
     std::shared_ptr<FileMap<Location, Symbol> > openSymbols(uint32_t fileId, String *err = nullptr)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<Location, Symbol>(Symbols, fileId, mFileMapScope->symbols, err);
+        const std::shared_ptr<FileMapScope> scope = fileMapScope();
+        assert(scope);
+        return scope->openFileMap<Location, Symbol>(Symbols, fileId, scope->symbols, err);
     }
     std::shared_ptr<FileMap<String, Set<Location> > > openTargets(uint32_t fileId, String *err = nullptr)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(Targets, fileId, mFileMapScope->targets, err);
+        const std::shared_ptr<FileMapScope> scope = fileMapScope();
+        assert(scope);
+        return scope->openFileMap<String, Set<Location> >(Targets, fileId, scope->targets, err);
     }
     std::shared_ptr<FileMap<String, Set<Location> > > openUsrs(uint32_t fileId, String *err = nullptr)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<String, Set<Location> >(Usrs, fileId, mFileMapScope->usrs, err);
+        const std::shared_ptr<FileMapScope> scope = fileMapScope();
+        assert(scope);
+        return scope->openFileMap<String, Set<Location> >(Usrs, fileId, scope->usrs, err);
     }
 
     std::shared_ptr<FileMap<uint32_t, Token> > openTokens(uint32_t fileId, String *err = nullptr)
     {
-        assert(mFileMapScope);
-        return mFileMapScope->openFileMap<uint32_t, Token>(Tokens, fileId, mFileMapScope->tokens, err);
+        const std::shared_ptr<FileMapScope> scope = fileMapScope();
+        assert(scope);
+        return scope->openFileMap<uint32_t, Token>(Tokens, fileId, scope->tokens, err);
     }
 
 
@@ -131,6 +147,8 @@ public:
                             Flags<QueryMessage::Flag> flags = Flags<QueryMessage::Flag>()) const;
     const Hash<uint32_t, DependencyNode*> &dependencies() const { return mDependencies; }
     DependencyNode *dependencyNode(uint32_t fileId) const { return mDependencies.value(fileId); }
+    // built on demand, replaced whenever mDependencies changes
+    std::shared_ptr<const DependencyGraph> dependencyGraph() const;
 
     static bool readSources(const Path &path, IndexParseData &data, String *error);
     enum SymbolMatchType {
@@ -189,7 +207,13 @@ public:
     SourceList sources(uint32_t fileId) const;
     Source source(uint32_t fileId, int buildIndex) const;
     bool hasSource(uint32_t fileId) const;
-    bool isActiveJob(uint32_t sourceFileId) { return !sourceFileId || mActiveJobs.contains(sourceFileId); }
+    bool isActiveJob(uint32_t sourceFileId) const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return !sourceFileId || mActiveJobs.contains(sourceFileId);
+    }
+    // Claims fileId for the job indexing sourceFileId, true if that job
+    // should index it. Called by VisitFileThread.
     inline bool visitFile(uint32_t fileId, uint32_t sourceFileId);
     inline void releaseFileIds(const Set<uint32_t> &fileIds);
     String fixIts(uint32_t fileId) const;
@@ -210,6 +234,7 @@ public:
     void unwatch(const Path &dir, WatchMode mode);
     void clearWatch(Flags<WatchMode> mode);
     Hash<Path, Flags<WatchMode> > watchedPaths() const { return mWatchedPaths; }
+    const WatchManager &watchManager() const { return mWatcher; }
 
     time_t lastIdleTime() const { return mLastIdleTime; }
     bool isIndexing() const { return !mActiveJobs.isEmpty(); }
@@ -238,11 +263,12 @@ public:
     class FileMapScopeScope
     {
     public:
-        FileMapScopeScope(Project *p, Flags<ScopeFlag> flags = NullFlags)
+        FileMapScopeScope(Project *p, Flags<ScopeFlag> flags = NullFlags,
+                          const std::shared_ptr<const DependencyGraph> &graph = std::shared_ptr<const DependencyGraph>())
             : mProject(p)
         {
             if (mProject)
-                mProject->beginScope(flags);
+                mProject->beginScope(flags, graph);
         }
         FileMapScopeScope(const std::shared_ptr<Project> &p)
             : FileMapScopeScope(p.get())
@@ -257,10 +283,30 @@ public:
         Project *mProject;
     };
 
-    void beginScope(Flags<ScopeFlag> flags = NullFlags);
+    // Scopes belong to the calling thread so queries on different threads
+    // each get their own. A graph passed to beginScope() is what
+    // dependencyGraph() returns on this thread until endScope().
+    void beginScope(Flags<ScopeFlag> flags = NullFlags,
+                    const std::shared_ptr<const DependencyGraph> &graph = std::shared_ptr<const DependencyGraph>());
     void endScope();
+    // Lookups that go through many files (findSymbols, findReferences,
+    // findDeadFunctions) stop early once the callback set for this
+    // thread's scope returns true and return what they found so far.
+    void setQueryAbortCallback(std::function<bool()> &&callback);
+    bool isQueryAborted() const;
+    // files this thread's scope has asked for maps of so far
+    Set<uint32_t> scopeFileIds() const;
+    QueryCache &queryCache() { return mQueryCache; }
+    // IndexerJob::leadingIncludeBlock() of a source, only read again when
+    // the file changed. Main thread only.
+    String includeBlock(uint32_t fileId, const Path &path);
     void dirty(uint32_t fileId);
     bool save();
+    // Imports the shards of another database in the background, callback
+    // is called on the main thread with the number of imported files or -1.
+    typedef std::function<void(int imported, const String &error)> ImportCallback;
+    void importIndex(const Path &dir, const Hash<uint32_t, uint32_t> &fileIds, ImportCallback &&callback);
+    void finishImport(const std::shared_ptr<ProjectImport> &import);
     void prepare(uint32_t fileId);
     String estimateMemory() const;
     String diagnosticsToString(Flags<QueryMessage::Flag> flags, uint32_t fileId);
@@ -270,7 +316,7 @@ public:
     void fixPCH(Source &source);
     void includeCompletions(Flags<QueryMessage::Flag> flags, const std::shared_ptr<Connection> &conn, Source &&source) const;
     size_t bytesWritten() const { return mBytesWritten; }
-    void destroy() { mSaveDirty = false; }
+    void destroy();
     enum VisitResult {
         Stop,
         Continue,
@@ -304,6 +350,8 @@ public:
     void check(CheckMode mode);
 private:
     void reloadCompileCommands();
+    bool updateCompileCommands(uint32_t fileId, IndexParseData::CompileCommands &commands, SourceCache *cache,
+                               Set<uint32_t> &index, Hash<uint32_t, uint32_t> &removed);
     void onFileAddedOrModified(const Path &path, uint32_t fileId);
     void watchFile(uint32_t fileId);
     enum ValidateMode {
@@ -312,6 +360,13 @@ private:
         ValidateSilent
     };
     bool validate(uint32_t fileId, ValidateMode mode, String *error = nullptr) const;
+    static bool validate(const Path &projectDataDir, uint32_t fileMapOptions, uint32_t fileId, ValidateMode mode, String *error);
+    // what check() found on disk, collected by VerifyJobs on the server's
+    // background pool for larger projects
+    struct CheckResult;
+    struct Verify;
+    class VerifyJob;
+    void finishCheck(CheckResult &result);
     void removeDependencies(uint32_t fileId);
     void updateDependencies(uint32_t fileId, const std::shared_ptr<IndexDataMessage> &msg);
     void loadFailed(uint32_t fileId);
@@ -321,6 +376,7 @@ private:
                        const UnsavedFiles &unsavedFiles = UnsavedFiles(),
                        const std::shared_ptr<Connection> &wait = std::shared_ptr<Connection>());
     void onDirtyTimeout(Timer *);
+    void onSymbolNameTimeout(Timer *);
 
     struct FileMapScope {
         FileMapScope(const std::shared_ptr<Project> &proj, int m, Flags<ScopeFlag> f)
@@ -329,8 +385,17 @@ private:
         ~FileMapScope()
         {
             warning() << "Query opened" << totalOpened << "files for project" << project->path();
-            if (loadFailed && !(flags & NoValidate))
-                project->validateAll();
+            if (loadFailed && !(flags & NoValidate)) {
+                if (EventLoop::isMainThread()) {
+                    project->validateAll();
+                } else {
+                    std::weak_ptr<Project> weak = project;
+                    EventLoop::mainEventLoop()->callLater([weak]() {
+                            if (std::shared_ptr<Project> proj = weak.lock())
+                                proj->validateAll();
+                        });
+                }
+            }
         }
 
         struct LRUKey {
@@ -364,6 +429,7 @@ private:
                                                           Hash<uint32_t, std::shared_ptr<FileMap<Key, Value> > > &cache,
                                                           String *errPtr)
         {
+            fileIds.insert(fileId);
             auto it = cache.find(fileId);
             if (it != cache.end()) {
                 poke(type, fileId);
@@ -430,12 +496,21 @@ private:
         const int max;
         bool loadFailed;
         Flags<ScopeFlag> flags;
+        std::shared_ptr<const DependencyGraph> dependencyGraph; // pinned for the scope, may be null
+        std::function<bool()> aborted;
+        Set<uint32_t> fileIds; // every file a map was asked for, loaded or not
 
         EmbeddedLinkedList<std::shared_ptr<LRUEntry> > entryList;
         Map<LRUKey, std::shared_ptr<LRUEntry> > entryMap;
     };
 
-    std::shared_ptr<FileMapScope> mFileMapScope;
+    std::shared_ptr<FileMapScope> fileMapScope() const
+    {
+        std::lock_guard<std::mutex> lock(mFileMapScopesMutex);
+        return mFileMapScopes.value(std::this_thread::get_id());
+    }
+    Hash<std::thread::id, std::shared_ptr<FileMapScope> > mFileMapScopes;
+    mutable std::mutex mFileMapScopesMutex;
 
     const Path mPath, mProjectDataDir;
     Path mProjectFilePath, mSourcesFilePath;
@@ -449,23 +524,60 @@ private:
 
     Diagnostics mDiagnostics;
 
+    // changed on the main thread with mMutex held, the VisitFileThread
+    // reads it with mMutex held
     Hash<uint32_t, std::shared_ptr<IndexerJob> > mActiveJobs;
 
     Timer mDirtyTimer, mCheckTimer;
     Set<uint32_t> mPendingDirtyFiles;
 
     StopWatch mTimer;
-    FileSystemWatcher mWatcher;
+    WatchManager mWatcher;
     IndexParseData mIndexParseData;
     Hash<Path, Flags<WatchMode> > mWatchedPaths;
     std::shared_ptr<FileManager> mFileManager;
     FixIts mFixIts;
 
     Hash<uint32_t, DependencyNode*> mDependencies;
+    void dependenciesChanged();
+    mutable std::shared_ptr<const DependencyGraph> mDependencyGraph;
+    mutable std::mutex mDependencyGraphMutex;
+    QueryCache mQueryCache;
+    SymbolNameIndex mSymbolNameIndex;
+    struct IncludeBlock {
+        IncludeBlock() : lastModified(0) {}
+        uint64_t lastModified;
+        String block;
+    };
+    Hash<uint32_t, IncludeBlock> mIncludeBlocks; // by source, dropped in removeSource()
+    // reads the names of the files mSymbolNameIndex doesn't have yet,
+    // false if the query was aborted or more than budget ms went by
+    bool updateSymbolNameIndex(int budget = -1);
+    // fills mSymbolNameIndex a slice at a time between events so the
+    // first pattern search doesn't have to
+    Timer mSymbolNameTimer;
     Set<uint32_t> mSuspendedFiles;
 
     size_t mBytesWritten;
-    bool mSaveDirty;
+    bool mLoaded;
+    time_t mLastUsed;
+    bool mSaveDirty; // changed in ways project.journal doesn't cover
+
+    // Every finished job appends the state it left behind to project.journal,
+    // checkpoint() folds it into project and sources on the background pool.
+    struct State;
+    std::shared_ptr<State> state() const;
+    bool appendJournal(const std::shared_ptr<IndexerJob> &job, const std::shared_ptr<IndexDataMessage> &msg, uint64_t parsed);
+    void closeJournal();
+    void checkpoint();
+    void waitForCheckpoint();
+    struct Checkpoint;
+    class CheckpointJob;
+    void finishCheckpoint(const std::shared_ptr<Checkpoint> &checkpoint);
+    Path mJournalPath;
+    FILE *mJournal;
+    size_t mJournalSize, mCheckpointSize;
+    std::shared_ptr<Checkpoint> mCheckpoint;
 
     mutable std::mutex mMutex;
 };
@@ -476,12 +588,12 @@ RCT_FLAGS(Project::ScopeFlag);
 inline bool Project::visitFile(uint32_t visitFileId, uint32_t id)
 {
     assert(id);
-    std::lock_guard<std::mutex> lock(mMutex);
     assert(visitFileId);
-    assert(id);
-    assert(mActiveJobs.contains(id));
-    std::shared_ptr<IndexerJob> &job = mActiveJobs[id];
-    assert(job);
+    std::lock_guard<std::mutex> lock(mMutex);
+    // the job may have finished or been aborted since the caller checked
+    const std::shared_ptr<IndexerJob> job = mActiveJobs.value(id);
+    if (!job)
+        return false;
     if (mVisitedFiles.insert(visitFileId)) {
         job->visited.insert(visitFileId);
         return true;
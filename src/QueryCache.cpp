@@ -0,0 +1,110 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "QueryCache.h"
+
+QueryCache::QueryCache()
+    : mGeneration(0), mBytes(0), mHits(0), mMisses(0), mInvalidated(0)
+{
+}
+
+uint64_t QueryCache::generation() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mGeneration;
+}
+
+std::shared_ptr<const QueryCache::Result> QueryCache::find(const String &key)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mEntries.find(key);
+    if (it == mEntries.end()) {
+        ++mMisses;
+        return std::shared_ptr<const Result>();
+    }
+    ++mHits;
+    return it->second.result;
+}
+
+void QueryCache::insert(const String &key, uint64_t generation, Result &&result, const Set<uint32_t> &fileIds)
+{
+    size_t bytes = key.size();
+    for (const String &line : result.lines)
+        bytes += line.size() + 1;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (generation != mGeneration || bytes > MaxBytes)
+        return;
+    if (mBytes + bytes > MaxBytes) {
+        mEntries.clear();
+        mKeysByFile.clear();
+        mBytes = 0;
+    }
+    remove(key);
+    Entry &entry = mEntries[key];
+    entry.result = std::make_shared<const Result>(std::move(result));
+    entry.fileIds = fileIds;
+    entry.bytes = bytes;
+    mBytes += bytes;
+    for (uint32_t fileId : fileIds)
+        mKeysByFile[fileId].insert(key);
+}
+
+void QueryCache::remove(const String &key)
+{
+    auto it = mEntries.find(key);
+    if (it == mEntries.end())
+        return;
+    for (uint32_t fileId : it->second.fileIds) {
+        auto keys = mKeysByFile.find(fileId);
+        if (keys != mKeysByFile.end()) {
+            keys->second.remove(key);
+            if (keys->second.isEmpty())
+                mKeysByFile.erase(keys);
+        }
+    }
+    mBytes -= it->second.bytes;
+    mEntries.erase(it);
+}
+
+void QueryCache::invalidate(const Set<uint32_t> &fileIds)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mGeneration;
+    for (uint32_t fileId : fileIds) {
+        const Set<String> keys = mKeysByFile.value(fileId);
+        for (const String &key : keys) {
+            remove(key);
+            ++mInvalidated;
+        }
+    }
+}
+
+void QueryCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mGeneration;
+    mInvalidated += mEntries.size();
+    mEntries.clear();
+    mKeysByFile.clear();
+    mBytes = 0;
+}
+
+QueryCache::Stats QueryCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    const Stats ret = { mEntries.size(), mBytes, mHits, mMisses, mInvalidated };
+    return ret;
+}
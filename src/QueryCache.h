@@ -0,0 +1,79 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef QueryCache_h
+#define QueryCache_h
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Set.h"
+#include "rct/String.h"
+
+/*
+  Output of queries that editors repeat a lot (--follow-location,
+  --references, --symbol-info) while nothing changes. Entries are keyed by
+  QueryMessage::cacheKey() and remember every file the query looked at.
+  A finished indexer job bumps the generation and drops the entries that
+  looked at one of the files it wrote, everything else stays.
+
+  A query takes the generation before it starts reading file maps and
+  hands it back to insert(), results that raced with a reindex are thrown
+  away instead of cached.
+
+  Safe to use from several threads.
+*/
+
+class QueryCache
+{
+public:
+    QueryCache();
+
+    struct Result {
+        List<String> lines;
+        int ret;
+    };
+
+    uint64_t generation() const;
+    std::shared_ptr<const Result> find(const String &key);
+    void insert(const String &key, uint64_t generation, Result &&result, const Set<uint32_t> &fileIds);
+    void invalidate(const Set<uint32_t> &fileIds);
+    void clear();
+
+    struct Stats {
+        size_t entries, bytes;
+        size_t hits, misses, invalidated;
+    };
+    Stats stats() const;
+private:
+    enum { MaxBytes = 16 * 1024 * 1024 };
+    struct Entry {
+        std::shared_ptr<const Result> result;
+        Set<uint32_t> fileIds;
+        size_t bytes;
+    };
+    void remove(const String &key); // called with mMutex held
+
+    mutable std::mutex mMutex;
+    uint64_t mGeneration;
+    Hash<String, Entry> mEntries;
+    Hash<uint32_t, Set<String> > mKeysByFile;
+    size_t mBytes, mHits, mMisses, mInvalidated;
+};
+
+#endif
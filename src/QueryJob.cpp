@@ -23,15 +23,20 @@
 #include "Server.h"
 #include "rct/Connection.h"
 #include "rct/EventLoop.h"
+#include "rct/Rct.h"
+#include "rct/ThreadPool.h"
 
 QueryJob::QueryJob(const std::shared_ptr<QueryMessage> &query,
                    const std::shared_ptr<Project> &proj,
                    Flags<JobFlag> jobFlags)
-    : Project::FileMapScopeScope(proj), mAborted(false), mLinesWritten(0), mQueryMessage(query), mJobFlags(jobFlags), mProject(proj), mFileFilter(0)
+    : mAborted(false), mTimedOut(false), mDeadline(0), mLinesWritten(0), mQueryMessage(query), mJobFlags(jobFlags), mProject(proj), mFileFilter(0),
+      mCacheGeneration(0)
 {
     assert(query);
     if (query->flags() & QueryMessage::SilentQuery)
         setJobFlag(QuietJob);
+    if (query->maxTime() > 0)
+        mDeadline = Rct::monoMs() + query->maxTime(); // time spent queued counts too
     const List<QueryMessage::PathFilter> &pathFilters = query->pathFilters();
     if (!pathFilters.isEmpty()) {
         if (pathFilters.size() == 1 && pathFilters.first().mode == QueryMessage::PathFilter::Self) {
@@ -92,7 +97,7 @@ bool QueryJob::write(const String &out, Flags<WriteFlag> flags)
 
 bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
 {
-    assert(mConnection);
+    assert(mConnection || mAsyncOutput);
     if (!(flags & IgnoreMax) && mQueryMessage) {
         const int max = mQueryMessage->max();
         if (max != -1 && mLinesWritten == max) {
@@ -102,9 +107,33 @@ bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
         ++mLinesWritten;
     }
 
+    if (!mCacheKey.isEmpty())
+        mCachedLines.append(out);
+
     if (!(mJobFlags & QuietJob))
         warning("=> %s", out.constData());
 
+    if (mAsyncOutput) {
+        if (mAsyncOutput->failed) {
+            abort();
+            return false;
+        }
+        bool schedule = false;
+        {
+            std::lock_guard<std::mutex> lock(mAsyncOutput->mutex);
+            mAsyncOutput->lines.append(out);
+            if (!mAsyncOutput->scheduled)
+                schedule = mAsyncOutput->scheduled = true;
+        }
+        if (schedule) {
+            // everything written until the main thread gets to it goes out
+            // in one batch
+            std::shared_ptr<AsyncOutput> output = mAsyncOutput;
+            EventLoop::mainEventLoop()->callLater([output]() { output->flush(); });
+        }
+        return true;
+    }
+
     if (mConnection) {
         if (!mConnection->write(out)) {
             abort();
@@ -116,6 +145,28 @@ bool QueryJob::writeRaw(const String &out, Flags<WriteFlag> flags)
     return true;
 }
 
+void QueryJob::AsyncOutput::flush()
+{
+    assert(EventLoop::isMainThread());
+    List<String> pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::swap(pending, lines);
+        scheduled = false;
+    }
+    const std::shared_ptr<Connection> conn = connection.lock();
+    if (!conn) {
+        failed = true;
+        return;
+    }
+    for (const String &line : pending) {
+        if (!conn->write(line)) {
+            failed = true;
+            break;
+        }
+    }
+}
+
 bool QueryJob::locationToString(Location location,
                                 const std::function<void(LocationPiece, const String &)> &cb,
                                 Flags<WriteFlag>
@@ -283,15 +334,136 @@ bool QueryJob::filter(const String &value) const
     return false;
 }
 
+void QueryJob::setCacheable()
+{
+    assert(EventLoop::isMainThread());
+    mCacheKey = mQueryMessage->cacheKey();
+    // Location::toString() makes paths relative to the current project so
+    // the same query gives different output once that changes
+    if (!mCacheKey.isEmpty()) {
+        if (std::shared_ptr<Project> current = Server::instance()->currentProject())
+            mCacheKey += current->path();
+    }
+}
+
+bool QueryJob::isAborted() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mAborted && mDeadline && Rct::monoMs() >= mDeadline)
+        mAborted = mTimedOut = true;
+    return mAborted;
+}
+
+int QueryJob::exec()
+{
+    Project::FileMapScopeScope scope(mProject.get(), NullFlags, mDependencyGraph);
+    if (mProject)
+        mProject->setQueryAbortCallback([this]() { return isAborted(); });
+    int ret = execute();
+    if (isTimedOut()) {
+        warning() << "Query timed out after" << mQueryMessage->maxTime() << "ms:" << mQueryMessage->commandLine();
+        // elisp and json output have to stay parseable, they only get the
+        // exit code
+        if (!(queryFlags() & (QueryMessage::Elisp|QueryMessage::JSON)))
+            writeRaw(String::format<64>("(truncated, --max-time %dms)", mQueryMessage->maxTime()), IgnoreMax);
+        if (ret == RTags::Success)
+            ret = RTags::Truncated;
+    } else if (!mCacheKey.isEmpty() && mProject && !isAborted()) {
+        QueryCache::Result result = { std::move(mCachedLines), ret };
+        mProject->queryCache().insert(mCacheKey, mCacheGeneration, std::move(result), mProject->scopeFileIds());
+    }
+    return ret;
+}
+
+bool QueryJob::replayCached(const std::shared_ptr<Connection> &connection, int *ret)
+{
+    if (mCacheKey.isEmpty() || !mProject)
+        return false;
+    const std::shared_ptr<const QueryCache::Result> cached = mProject->queryCache().find(mCacheKey);
+    if (!cached) {
+        // taken before the job reads any file maps, see QueryCache::insert()
+        mCacheGeneration = mProject->queryCache().generation();
+        return false;
+    }
+    for (const String &line : cached->lines) {
+        if (!connection->write(line))
+            break;
+    }
+    *ret = cached->ret;
+    return true;
+}
+
 int QueryJob::run(const std::shared_ptr<Connection> &connection)
 {
     assert(connection);
+    int ret;
+    if (replayCached(connection, &ret))
+        return ret;
     mConnection = connection;
-    const int ret = execute();
+    ret = exec();
     mConnection = nullptr;
     return ret;
 }
 
+// Jobs handed to the pool by start(), only touched on the main thread.
+// Everyone else holds weak references so the last reference to a job, and
+// maybe to its project, is always dropped on the main thread while the
+// server is still around.
+static Set<std::shared_ptr<QueryJob> > sStarted;
+
+class QueryJob::Runner : public ThreadPool::Job
+{
+public:
+    Runner(const std::shared_ptr<QueryJob> &job)
+        : mJob(job)
+    {}
+protected:
+    virtual void run() override
+    {
+        int ret;
+        {
+            const std::shared_ptr<QueryJob> job = mJob.lock();
+            if (!job)
+                return;
+            ret = job->exec();
+        }
+        std::weak_ptr<QueryJob> weak = mJob;
+        EventLoop::mainEventLoop()->callLater([weak, ret]() {
+                const std::shared_ptr<QueryJob> job = weak.lock();
+                if (!job)
+                    return;
+                sStarted.remove(job);
+                job->mAsyncOutput->flush();
+                if (std::shared_ptr<Connection> conn = job->mAsyncOutput->connection.lock())
+                    conn->finish(ret);
+            });
+    }
+private:
+    std::weak_ptr<QueryJob> mJob;
+};
+
+void QueryJob::start(ThreadPool *pool, const std::shared_ptr<QueryJob> &job, const std::shared_ptr<Connection> &connection)
+{
+    assert(EventLoop::isMainThread());
+    assert(connection);
+    int ret;
+    if (job->replayCached(connection, &ret)) {
+        connection->finish(ret);
+        return;
+    }
+    job->mAsyncOutput = std::make_shared<AsyncOutput>(connection);
+    if (job->mProject)
+        job->mDependencyGraph = job->mProject->dependencyGraph();
+    sStarted.insert(job);
+    pool->start(std::make_shared<Runner>(job));
+}
+
+void QueryJob::releaseStarted()
+{
+    assert(EventLoop::isMainThread());
+    sStarted.clear();
+}
+
 bool QueryJob::filterLocation(Location loc) const
 {
     if (mFileFilter && loc.fileId() != mFileFilter)
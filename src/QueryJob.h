@@ -16,6 +16,7 @@
 #ifndef QueryJob_h
 #define QueryJob_h
 
+#include <atomic>
 #include <regex>
 #include <mutex>
 
@@ -30,7 +31,8 @@ class Location;
 class QueryMessage;
 class Connection;
 struct Symbol;
-class QueryJob : public Project::FileMapScopeScope
+class ThreadPool;
+class QueryJob
 {
 public:
     enum JobFlag {
@@ -94,8 +96,22 @@ public:
     std::shared_ptr<Project> project() const { return mProject; }
     virtual int execute() = 0;
     int run(const std::shared_ptr<Connection> &connection = nullptr);
-    bool isAborted() const { std::lock_guard<std::mutex> lock(mMutex); return mAborted; }
+    // Like run() but executes the job on pool. Output is handed to the
+    // main thread in batches and written there, the main thread also
+    // finishes connection with the return value. The job sees the
+    // project's dependencies as they were when it was started.
+    static void start(ThreadPool *pool, const std::shared_ptr<QueryJob> &job, const std::shared_ptr<Connection> &connection);
+    // Drops the jobs start() has handed to the pool. Callbacks still queued
+    // on the main loop find their job gone and do nothing. Must be called
+    // once the pool is done, before the projects go away.
+    static void releaseStarted();
+    // run() and start() answer from the project's QueryCache when they
+    // can and cache the output otherwise
+    void setCacheable();
+    // also true once the query's --max-time has run out
+    bool isAborted() const;
     void abort() { std::lock_guard<std::mutex> lock(mMutex); mAborted = true; }
+    bool isTimedOut() const { std::lock_guard<std::mutex> lock(mMutex); return mTimedOut; }
     std::mutex &mutex() const { return mMutex; }
     const std::shared_ptr<Connection> &connection() const { return mConnection; }
     bool filterLocation(Location loc) const;
@@ -127,15 +143,35 @@ private:
     class DependencyFilter : public Filter
     {
     public:
-        DependencyFilter(uint32_t f, const std::shared_ptr<Project> &p) : fileId(f), project(p) {}
-        virtual bool match(uint32_t f, const Path &) const override { return project->dependsOn(fileId, f); }
+        DependencyFilter(uint32_t f, const std::shared_ptr<Project> &p) : fileId(f), graph(p->dependencyGraph()) {}
+        virtual bool match(uint32_t f, const Path &) const override
+        {
+            return f != fileId && graph->reaches(fileId, f, DependencyGraph::Includes);
+        }
 
         const uint32_t fileId;
-        const std::shared_ptr<Project> project;
+        const std::shared_ptr<const DependencyGraph> graph;
     };
 
+    struct AsyncOutput {
+        AsyncOutput(const std::shared_ptr<Connection> &conn)
+            : connection(conn), scheduled(false), failed(false)
+        {}
+        void flush(); // main thread only
+
+        std::weak_ptr<Connection> connection;
+        std::mutex mutex;
+        List<String> lines; // written by the job, taken by flush()
+        bool scheduled;
+        std::atomic<bool> failed; // the connection went away or a write failed
+    };
+    class Runner;
+    int exec();
+    bool replayCached(const std::shared_ptr<Connection> &connection, int *ret);
+
     mutable std::mutex mMutex;
-    bool mAborted;
+    mutable bool mAborted, mTimedOut;
+    unsigned long long mDeadline; // Rct::monoMs(), 0 for none
     int mLinesWritten;
     bool writeRaw(const String &out, Flags<WriteFlag> flags);
     std::shared_ptr<QueryMessage> mQueryMessage;
@@ -148,7 +184,12 @@ private:
     Set<String> mPieceFilters;
     String mBuffer;
     std::shared_ptr<Connection> mConnection;
+    std::shared_ptr<AsyncOutput> mAsyncOutput;
+    std::shared_ptr<const DependencyGraph> mDependencyGraph;
     Hash<Path, String> mContextCache;
+    String mCacheKey; // empty unless cacheable
+    uint64_t mCacheGeneration;
+    List<String> mCachedLines;
 };
 
 RCT_FLAGS(QueryJob::JobFlag);
@@ -19,7 +19,7 @@
 #include "RTags.h"
 
 QueryMessage::QueryMessage(Type type)
-    : RTagsMessage(MessageId), mType(type), mMax(-1), mMaxDepth(-1), mMinLine(-1), mMaxLine(-1), mBuildIndex(0), mTerminalWidth(-1)
+    : RTagsMessage(MessageId), mType(type), mMax(-1), mMaxDepth(-1), mMaxTime(-1), mMinLine(-1), mMaxLine(-1), mBuildIndex(0), mTerminalWidth(-1)
 {
 }
 
@@ -27,14 +27,26 @@ void QueryMessage::encode(Serializer &serializer) const
 {
     serializer << mCommandLine << mQuery << mCodeCompletePrefix << mType << mFlags << mMax
                << mMaxDepth << mMinLine << mMaxLine << mBuildIndex << mPathFilters << mKindFilters
-               << mCurrentFile << mUnsavedFiles << mTerminalWidth;
+               << mCurrentFile << mUnsavedFiles << mTerminalWidth << mMaxTime;
 }
 
 void QueryMessage::decode(Deserializer &deserializer)
 {
     deserializer >> mCommandLine >> mQuery >> mCodeCompletePrefix >> mType >> mFlags >> mMax
                  >> mMaxDepth >> mMinLine >> mMaxLine >> mBuildIndex >> mPathFilters >> mKindFilters
-                 >> mCurrentFile >> mUnsavedFiles >> mTerminalWidth;
+                 >> mCurrentFile >> mUnsavedFiles >> mTerminalWidth >> mMaxTime;
+}
+
+String QueryMessage::cacheKey() const
+{
+    String ret;
+    if (mUnsavedFiles.isEmpty()) {
+        Serializer serializer(ret);
+        serializer << mQuery << mCodeCompletePrefix << mType << mFlags << mMax
+                   << mMaxDepth << mMinLine << mMaxLine << mBuildIndex << mPathFilters << mKindFilters
+                   << mCurrentFile << mTerminalWidth;
+    }
+    return ret;
 }
 
 Flags<Location::ToStringFlag> QueryMessage::locationToStringFlags(Flags<Flag> queryFlags)
@@ -84,6 +96,8 @@ QueryMessage::Flag QueryMessage::flagFromString(const String &string)
         return AbsolutePath;
     } else if (string == "find-file-prefer-exact") {
         return FindFilePreferExact;
+    } else if (string == "find-file-fuzzy") {
+        return FindFileFuzzy;
     } else if (string == "symbol-info-include-parents") {
         return SymbolInfoIncludeParents;
     } else if (string == "symbol-info-include-targets") {
@@ -73,7 +73,8 @@ public:
         SymbolInfo,
         Validate,
         Tokens,
-        IncludePath
+        IncludePath,
+        ImportIndex
     };
 
     enum Flag {
@@ -127,6 +128,7 @@ public:
         CodeCompleteNoWait = (1ull << 46),
         SymbolInfoIncludeSourceCode = (1ull << 47),
         AllTargets = (1ull << 48),
+        FindFileFuzzy = (1ull << 49),
         HasMatch = (1ull << 29)
     };
 
@@ -197,6 +199,9 @@ public:
     void setTerminalWidth(int w) { mTerminalWidth = w; }
 
     Match match() const;
+    // Everything that decides what the query prints, empty when it has
+    // unsaved files since their contents aren't indexed
+    String cacheKey() const;
 
     void setRangeFilter(int min, int max)
     {
@@ -213,6 +218,10 @@ public:
     int max() const { return mMax; }
     void setMax(int max) { mMax = max; }
 
+    // ms, -1 means no limit
+    int maxTime() const { return mMaxTime; }
+    void setMaxTime(int maxTime) { mMaxTime = maxTime; }
+
     Flags<Flag> flags() const { return mFlags; }
     void setFlags(Flags<Flag> flags)
     {
@@ -249,7 +258,7 @@ private:
     String mQuery, mCodeCompletePrefix;
     Type mType;
     Flags<QueryMessage::Flag> mFlags;
-    int mMax, mMaxDepth, mMinLine, mMaxLine, mBuildIndex;
+    int mMax, mMaxDepth, mMaxTime, mMinLine, mMaxLine, mBuildIndex;
     List<PathFilter> mPathFilters;
     KindFilters mKindFilters;
     Path mCurrentFile;
@@ -62,6 +62,7 @@ std::initializer_list<CommandLineParser::Option<RClient::OptionType> > opts = {
     { RClient::Compile, "compile", 'c', CommandLineParser::Optional, "Pass compilation arguments to rdm." },
     { RClient::GuessFlags, "guess-flags", 0, CommandLineParser::NoValue, "Guess compile flags (used with -c)." },
     { RClient::LoadCompileCommands, "load-compile-commands", 'J', CommandLineParser::Optional, "Load compile_commands.json from directory" },
+    { RClient::ImportIndex, "import-index", 0, CommandLineParser::Required, "Merge a database produced by another rdm (e.g. rdm --index-only or --sandbox-root) into the loaded projects." },
     { RClient::Suspend, "suspend", 'X', CommandLineParser::Optional, "Dump suspended files (don't track changes in these files) with no arg. Otherwise toggle suspension for arg." },
 
     { RClient::None, String(), 0, CommandLineParser::NoValue, "" },
@@ -118,6 +119,7 @@ std::initializer_list<CommandLineParser::Option<RClient::OptionType> > opts = {
     { RClient::None, String(), 0, CommandLineParser::NoValue, "Command flags:" },
     { RClient::StripParen, "strip-paren", 'p', CommandLineParser::NoValue, "Strip parens in various contexts." },
     { RClient::Max, "max", 'M', CommandLineParser::Required, "Max lines of output for queries." },
+    { RClient::MaxTime, "max-time", 0, CommandLineParser::Required, "Max time in ms rdm spends on a query. The results found until then are returned, marked as truncated, and rc exits with 41." },
     { RClient::ReverseSort, "reverse-sort", 'O', CommandLineParser::NoValue, "Sort output reversed." },
     { RClient::Rename, "rename", 0, CommandLineParser::NoValue, "Used for --references to indicate that we're using the results to rename symbols." },
     { RClient::UnsavedFile, "unsaved-file", 0, CommandLineParser::Required, "Pass unsaved file on command line. E.g. --unsaved-file=main.cpp:1200 then write 1200 bytes on stdin." },
@@ -142,6 +144,7 @@ std::initializer_list<CommandLineParser::Option<RClient::OptionType> > opts = {
     { RClient::Timeout, "timeout", 'y', CommandLineParser::Required, "Max time in ms to wait for job to finish (default no timeout)." },
     { RClient::FindVirtuals, "find-virtuals", 'k', CommandLineParser::NoValue, "Use in combinations with -R or -r to show other implementations of this function." },
     { RClient::FindFilePreferExact, "find-file-prefer-exact", 'A', CommandLineParser::NoValue, "Use to make --find-file prefer exact matches over partial matches." },
+    { RClient::FindFileFuzzy, "find-file-fuzzy", 0, CommandLineParser::NoValue, "Use to make --find-file rank files by fuzzy match and only print the best ones (--max, default 100)." },
     { RClient::SymbolInfoIncludeParents, "symbol-info-include-parents", 0, CommandLineParser::NoValue, "Use to make --symbol-info include parent symbols." },
     { RClient::SymbolInfoIncludeTargets, "symbol-info-include-targets", 0, CommandLineParser::NoValue, "Use to make --symbol-info include target symbols." },
     { RClient::SymbolInfoIncludeReferences, "symbol-info-include-references", 0, CommandLineParser::NoValue, "Use to make --symbol-info include reference symbols." },
@@ -225,6 +228,7 @@ public:
         msg.setCurrentFile(rc->currentFile());
         msg.setCodeCompletePrefix(rc->codeCompletePrefix());
         msg.setMaxDepth(rc->maxDepth());
+        msg.setMaxTime(rc->maxTime());
         return connection->send(msg) ? RTags::Success : RTags::NetworkFailure;
     }
 
@@ -317,7 +321,7 @@ public:
 };
 
 RClient::RClient()
-    : mMax(-1), mMaxDepth(-1), mTimeout(-1), mMinOffset(-1), mMaxOffset(-1),
+    : mMax(-1), mMaxDepth(-1), mMaxTime(-1), mTimeout(-1), mMinOffset(-1), mMaxOffset(-1),
       mConnectTimeout(DEFAULT_CONNECT_TIMEOUT), mBuildIndex(0),
       mLogLevel(LogLevel::Error), mTcpPort(0), mGuessFlags(false),
       mTerminalWidth(-1), mExitCode(RTags::ArgumentParseError)
@@ -524,6 +528,9 @@ CommandLineParser::ParseStatus RClient::parse(size_t argc, char **argv)
         case FindFilePreferExact: {
             mQueryFlags |= QueryMessage::FindFilePreferExact;
             break; }
+        case FindFileFuzzy: {
+            mQueryFlags |= QueryMessage::FindFileFuzzy;
+            break; }
         case SymbolInfoIncludeParents: {
             mQueryFlags |= QueryMessage::SymbolInfoIncludeParents;
             break; }
@@ -1056,6 +1063,19 @@ CommandLineParser::ParseStatus RClient::parse(size_t argc, char **argv)
 
             addCompile(std::move(path));
             break; }
+        case ImportIndex: {
+            Path dir = std::move(value);
+            dir.resolve(Path::MakeAbsolute);
+            if (!dir.isDir()) {
+                return { String::format<1024>("%s is not a directory", dir.constData()), CommandLineParser::Parse_Error };
+            }
+            if (!dir.endsWith('/'))
+                dir.append('/');
+            if (!Path(dir + "fileids").isFile()) {
+                return { String::format<1024>("%s doesn't contain an rtags database", dir.constData()), CommandLineParser::Parse_Error };
+            }
+            addQuery(QueryMessage::ImportIndex, std::move(dir));
+            break; }
         case HasFileManager: {
             Path p;
             if (!value.isEmpty()) {
@@ -1315,6 +1335,14 @@ CommandLineParser::ParseStatus RClient::parse(size_t argc, char **argv)
 
             mMaxDepth = depth;
             break; }
+        case MaxTime: {
+            bool ok;
+            const unsigned long long maxTime = value.toULongLong(&ok);
+            if (!ok || !maxTime || maxTime > static_cast<unsigned long long>(std::numeric_limits<int>::max())) {
+                return { String::format<1024>("--max-time [arg] must be > 0 and <= %d", std::numeric_limits<int>::max()), CommandLineParser::Parse_Error };
+            }
+            mMaxTime = static_cast<int>(maxTime);
+            break; }
 
         }
         return { String(), CommandLineParser::Parse_Exec };
@@ -80,6 +80,7 @@ public:
         FilterSystemHeaders,
         FindFile,
         FindFilePreferExact,
+        FindFileFuzzy,
         FindProjectBuildRoot,
         FindProjectRoot,
         FindSymbols,
@@ -90,6 +91,7 @@ public:
         GuessFlags,
         HasFileManager,
         Help,
+        ImportIndex,
         IncludeFile,
         IncludePath,
         IsIndexed,
@@ -108,6 +110,7 @@ public:
         MatchRegex,
         Max,
         MaxDepth,
+        MaxTime,
         NoColor,
         NoContext,
         NoRealPath,
@@ -171,6 +174,7 @@ public:
 
     int max() const { return mMax; }
     int maxDepth() const { return mMaxDepth; }
+    int maxTime() const { return mMaxTime; }
     LogLevel logLevel() const { return mLogLevel; }
     int timeout() const { return mTimeout; }
     int buildIndex() const { return mBuildIndex; }
@@ -207,7 +211,7 @@ private:
     void addCompile(Path &&compileCommands);
 
     Flags<QueryMessage::Flag> mQueryFlags;
-    int mMax, mMaxDepth, mTimeout, mMinOffset, mMaxOffset, mConnectTimeout, mBuildIndex;
+    int mMax, mMaxDepth, mMaxTime, mTimeout, mMinOffset, mMaxOffset, mConnectTimeout, mBuildIndex;
     LogLevel mLogLevel;
     Set<QueryMessage::PathFilter> mPathFilters;
     QueryMessage::KindFilters mKindFilters;
@@ -15,6 +15,7 @@
 
 #include "RTags.h"
 
+#include <ctype.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <fnmatch.h>
@@ -37,6 +38,7 @@
 #include "Project.h"
 #include "VisitFileMessage.h"
 #include "VisitFileResponseMessage.h"
+#include "WorkerMessage.h"
 #include "RTagsVersion.h"
 #include <clang-c/CXCompilationDatabase.h>
 
@@ -101,6 +103,167 @@ String decodeUrlComponent(const String &str)
     return ret;
 }
 
+uint64_t contentHash(const char *data, size_t size, uint64_t hash)
+{
+    // FNV-1a, std::hash isn't guaranteed to be stable between builds
+    const unsigned char *ch = reinterpret_cast<const unsigned char*>(data);
+    for (size_t i=0; i<size; ++i) {
+        hash ^= ch[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+List<String> requiredLiterals(const String &regex)
+{
+    List<String> ret;
+    if (regex.contains('|'))
+        return ret;
+    String run;
+    auto flush = [&ret, &run]() {
+        if (run.size() >= 3)
+            ret.append(run);
+        run.clear();
+    };
+    const size_t size = regex.size();
+    for (size_t i=0; i<size; ++i) {
+        char ch = regex.at(i);
+        switch (ch) {
+        case '\\':
+            if (++i == size)
+                return List<String>();
+            ch = regex.at(i);
+            if (!isalnum(static_cast<unsigned char>(ch))) {
+                run.append(ch);
+                break;
+            }
+            // \d, \w, \b, backreferences and so on aren't literals, skip
+            // their payload too so \x41 doesn't leave "41" behind
+            flush();
+            switch (ch) {
+            case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+            case 'b': case 'B': case 'n': case 'r': case 't': case 'f': case 'v':
+                break;
+            case 'c':
+                if (++i == size)
+                    return List<String>();
+                break;
+            case 'x':
+            case 'u': {
+                const size_t digits = ch == 'x' ? 2 : 4;
+                for (size_t d=0; d<digits; ++d) {
+                    if (++i == size || !isxdigit(static_cast<unsigned char>(regex.at(i))))
+                        return List<String>();
+                }
+                break; }
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+                while (i + 1 < size && isdigit(static_cast<unsigned char>(regex.at(i + 1))))
+                    ++i;
+                break;
+            default:
+                // don't guess at escapes we don't know
+                return List<String>();
+            }
+            break;
+        case '[':
+            flush();
+            if (i + 1 < size && regex.at(i + 1) == '^')
+                ++i;
+            if (i + 1 < size && regex.at(i + 1) == ']')
+                ++i;
+            while (++i < size && regex.at(i) != ']') {
+                if (regex.at(i) == '\\')
+                    ++i;
+            }
+            break;
+        case ')':
+            // an optional group could take anything with it
+            if (i + 1 < size && strchr("*?{", regex.at(i + 1)))
+                return List<String>();
+            flush();
+            break;
+        case '*':
+        case '?':
+        case '{':
+            // the atom before this may not be there at all
+            if (!run.isEmpty())
+                run.chop(1);
+            flush();
+            if (ch == '{') {
+                while (i < size && regex.at(i) != '}')
+                    ++i;
+            }
+            break;
+        case '(':
+            flush();
+            if (i + 1 < size && regex.at(i + 1) == '?') {
+                // (?:...) is just a group, lookaheads can be negative
+                if (i + 2 == size || regex.at(i + 2) != ':')
+                    return List<String>();
+                i += 2;
+            }
+            break;
+        case '+':
+        case '.':
+        case '^':
+        case '$':
+            flush();
+            break;
+        default:
+            run.append(ch);
+            break;
+        }
+    }
+    flush();
+    return ret;
+}
+
+List<String> wildcardLiterals(const String &pattern)
+{
+    List<String> ret;
+    String run;
+    for (size_t i=0; i<=pattern.size(); ++i) {
+        const char ch = i < pattern.size() ? pattern.at(i) : '\0';
+        switch (ch) {
+        case '\0':
+        case '*':
+        case '?':
+        case '[':
+        case '\\':
+            if (run.size() >= 3)
+                ret.append(run);
+            run.clear();
+            if (ch == '\\') {
+                // whether the next character is a literal or a wildcard,
+                // it isn't part of a run
+                ++i;
+            } else if (ch == '[') {
+                // a bracket expression is one character out of a set, skip
+                // it. A ']' right after the '[' or '[!' is part of the set.
+                if (i + 1 < pattern.size() && (pattern.at(i + 1) == '!' || pattern.at(i + 1) == '^'))
+                    ++i;
+                if (i + 1 < pattern.size() && pattern.at(i + 1) == ']')
+                    ++i;
+                while (++i < pattern.size() && pattern.at(i) != ']') {}
+            }
+            break;
+        default:
+            run.append(ch);
+            break;
+        }
+    }
+    return ret;
+}
+
+void trigrams(const String &str, List<uint32_t> &out)
+{
+    auto fold = [](char ch) { return static_cast<uint32_t>(tolower(static_cast<unsigned char>(ch))); };
+    const char *data = str.constData();
+    for (size_t i=0; i + 3 <= str.size(); ++i)
+        out.append((fold(data[i]) << 16) | (fold(data[i + 1]) << 8) | fold(data[i + 2]));
+}
+
 void encodePath(Path &path)
 {
     if (Sandbox::encode(path))
@@ -130,12 +293,15 @@ Path encodeSourceFilePath(const Path &dataDir, const Path &project, uint32_t fil
 
 Path findAncestor(const Path& path, const String &fn, Flags<FindAncestorFlag> flags, SourceCache *cache)
 {
-    Path *cacheResult = nullptr;
+    Path parent;
     if (cache) {
-        const Path parent = path.parentDir();
-        cacheResult = &cache->ancestorCache[parent][SourceCache::AncestorCacheKey { fn, flags }];
-        if (!cacheResult->isEmpty()) {
-            return *cacheResult;
+        parent = path.parentDir();
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        auto dir = cache->ancestorCache.find(parent);
+        if (dir != cache->ancestorCache.end()) {
+            auto it = dir->second.find(SourceCache::AncestorCacheKey { fn, flags });
+            if (it != dir->second.end() && !it->second.isEmpty())
+                return it->second;
         }
     }
     Path ret;
@@ -190,8 +356,9 @@ Path findAncestor(const Path& path, const String &fn, Flags<FindAncestorFlag> fl
     }
 
     ret = ret.ensureTrailingSlash();
-    if (cacheResult) {
-        *cacheResult = ret;
+    if (cache) {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        cache->ancestorCache[parent][SourceCache::AncestorCacheKey { fn, flags }] = ret;
     }
     return ret;
 }
@@ -204,6 +371,7 @@ Map<String, String> rtagsConfig(const Path &path, SourceCache *cache)
     while (dir.size() > 1) {
         assert(dir.endsWith('/'));
         if (cache) {
+            std::lock_guard<std::mutex> lock(cache->mutex);
             auto it = cache->rtagsConfigCache.find(dir);
             if (it != cache->rtagsConfigCache.end()) {
                 for (const auto &entry : it->second) {
@@ -215,11 +383,7 @@ Map<String, String> rtagsConfig(const Path &path, SourceCache *cache)
                 continue;
             }
         }
-        Map<String, String> *cacheEntry = nullptr;
-        if (cache) {
-            cacheEntry = &cache->rtagsConfigCache[dir];
-            // we want to cache empty entries
-        }
+        Map<String, String> entries; // we want to cache empty entries
         snprintf(buf, sizeof(buf), "%s.rtags-config", dir.constData());
         if (FILE *f = fopen(buf, "r")) {
             while ((fgets(buf, sizeof(buf), f))) {
@@ -242,13 +406,16 @@ Map<String, String> rtagsConfig(const Path &path, SourceCache *cache)
                     if (!key.isEmpty()) {
                         if (!ret.contains(key))
                             ret[key] = value;
-                        if (cacheEntry)
-                            (*cacheEntry)[key] = value;
+                        entries[key] = value;
                     }
                 }
             }
             fclose(f);
         }
+        if (cache) {
+            std::lock_guard<std::mutex> lock(cache->mutex);
+            cache->rtagsConfigCache[dir] = std::move(entries);
+        }
         dir = dir.parentDir();
     }
     return ret;
@@ -469,6 +636,7 @@ void initMessages()
     Message::registerMessage<QueryMessage>();
     Message::registerMessage<VisitFileMessage>();
     Message::registerMessage<VisitFileResponseMessage>();
+    Message::registerMessage<WorkerMessage>();
 }
 String eatString(CXString str)
 {
@@ -884,7 +1052,7 @@ void DiagnosticsProvider::diagnose()
         for (const auto &it : indexData.files()) {
             if (it.second & IndexDataMessage::Visited) {
                 const Location loc(it.first, 0, 0);
-                const Path path = loc.path();
+                const Path &path = loc.path();
                 CXFile file = getFile(u, path.constData());
                 if (file) {
                     CXSourceRangeList *s = clang_getSkippedRanges(unit(u), file);
@@ -34,6 +34,7 @@
 #include <utility>
 #include <unistd.h>
 #include <initializer_list>
+#include <mutex>
 
 #include <clang-c/Index.h>
 
@@ -119,7 +120,8 @@ enum ExitCode {
     ProtocolFailure = 37,
     ArgumentParseError = 38,
     UnexpectedMessageError = 39,
-    UnknownMessageError = 40
+    UnknownMessageError = 40,
+    Truncated = 41 // --max-time ran out, the output is incomplete
 };
 enum UnitType {
     CompileC,
@@ -701,6 +703,16 @@ struct SortedSymbol
 Path encodeSourceFilePath(const Path &dataDir, const Path &project, uint32_t fileId = 0);
 String encodeUrlComponent(const String &string);
 String decodeUrlComponent(const String &string);
+static const uint64_t ContentHashSeed = 14695981039346656037ull;
+uint64_t contentHash(const char *data, size_t size, uint64_t seed = ContentHashSeed);
+inline uint64_t contentHash(const String &data, uint64_t seed = ContentHashSeed) { return contentHash(data.constData(), data.size(), seed); }
+// Runs of at least three plain characters that every match of a regex or a
+// wildcard pattern has to contain. Errs on the side of returning nothing,
+// anything that isn't understood ends a run and unknown escapes end it all.
+List<String> requiredLiterals(const String &regex);
+List<String> wildcardLiterals(const String &pattern);
+// every trigram of str, case folded, for FileIndex and SymbolNameIndex
+void trigrams(const String &str, List<uint32_t> &out);
 
 template <typename Container, typename Value>
 inline bool addTo(Container &container, const Value &value)
@@ -1029,6 +1041,7 @@ inline String dumpFileIds(const Container &container)
 
 struct SourceCache
 {
+    std::mutex mutex; // Server::loadCompileCommands parses on several threads
     Hash<Path, Map<String, String> > rtagsConfigCache;
     Hash<Path, std::pair<Path, bool> > compilerCache; // bool signifies isCompiler, not just executable
     struct AncestorCacheKey {
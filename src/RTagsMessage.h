@@ -38,7 +38,8 @@ public:
         ProxyJobAnnouncementId,
         ClientMessageId,
         ClientConnectedId,
-        ExitMessageId
+        ExitMessageId,
+        WorkerId
     };
 
     RTagsMessage(uint8_t id) : Message(id) {}
@@ -15,38 +15,245 @@
 
 #include "ScanThread.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <dirent.h>
+#include <mutex>
+#include <string.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+
 #include "Filter.h"
 #include "Project.h"
+#include "rct/DataFile.h"
+#include "rct/Log.h"
+#include "rct/Map.h"
+#include "rct/StopWatch.h"
+#include "rct/ThreadPool.h"
 #include "Server.h"
 
-ScanThread::ScanThread(const Path &path)
-    : Thread(), mPath(path), mFilters(Server::instance()->options().excludeFilters)
+namespace {
+struct Directory {
+    Directory() : mtime(0) {}
+    uint64_t mtime; // ns, 0 if it may have changed while it was read
+    List<String> files, dirs; // names, dirs are the ones to descend into
+};
+typedef Hash<Path, Directory> Snapshot;
+}
+
+template <> inline Serializer &operator<<(Serializer &s, const Directory &dir)
+{
+    s << dir.mtime << dir.files << dir.dirs;
+    return s;
+}
+
+template <> inline Deserializer &operator>>(Deserializer &s, Directory &dir)
+{
+    s >> dir.mtime >> dir.files >> dir.dirs;
+    return s;
+}
+
+static std::mutex sSnapshotMutex; // two scans of the same project may overlap
+
+enum { RacyMargin = 1000000000 }; // ns, filesystem clocks can be coarser than ours
+
+static inline uint64_t mtime(const struct stat &st)
 {
+#ifdef __APPLE__
+    return static_cast<uint64_t>(st.st_mtimespec.tv_sec) * 1000000000ull + st.st_mtimespec.tv_nsec;
+#else
+    return static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+#endif
 }
 
-Set<Path> ScanThread::paths(const Path &path, const List<String> &filters)
+namespace {
+class Walker
 {
-    Set<Path> paths;
-    path.visit([&paths, filters](const Path &p) {
-            const Filter::Result result = Filter::filter(p, filters);
-            switch (result) {
+public:
+    Walker(const Path &root, const List<String> &filters, const Snapshot &previous)
+        : mRoot(root), mFilters(filters), mPrevious(previous), mStart(0), mBusy(0), mReused(0)
+    {
+        mQueue.append(root);
+        timespec now;
+        if (!clock_gettime(CLOCK_REALTIME, &now)) {
+            const uint64_t ns = static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+            mStart = ns > RacyMargin ? ns - RacyMargin : 0;
+        }
+    }
+
+    void run(int threadCount)
+    {
+        List<std::thread> threads;
+        for (int i=1; i<threadCount; ++i)
+            threads.append(std::thread([this]() { work(); }));
+        work();
+        for (auto &thread : threads)
+            thread.join();
+
+        // a directory reached through several paths belongs to the smallest
+        // one, drop what was recorded under the others
+        for (auto it = mSnapshot.begin(); it != mSnapshot.end(); ) {
+            const auto inode = mInodes.find(it->first);
+            if (inode != mInodes.end() && mSeen.value(inode->second) != it->first) {
+                it = mSnapshot.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    Snapshot &snapshot() { return mSnapshot; }
+    size_t reused() const { return mReused; }
+private:
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true) {
+            while (mQueue.isEmpty() && mBusy)
+                mCondition.wait(lock);
+            if (mQueue.isEmpty())
+                break;
+            const Path dir = mQueue.takeLast();
+            ++mBusy;
+            lock.unlock();
+            Directory directory;
+            const bool ok = visit(dir, directory);
+            lock.lock();
+            --mBusy;
+            if (ok) {
+                for (const String &sub : directory.dirs)
+                    mQueue.append(dir + sub + '/');
+                mSnapshot[dir] = std::move(directory);
+            }
+            mCondition.notify_all();
+        }
+    }
+
+    bool visit(const Path &dir, Directory &directory)
+    {
+        struct stat st;
+        if (stat(dir.constData(), &st) || !S_ISDIR(st.st_mode))
+            return false;
+        {
+            // Symlinks can make the same directory show up more than once,
+            // whichever path is smallest wins no matter which thread got
+            // there first. The losers are weeded out when the walk is done.
+            const Inode inode(static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino));
+            std::lock_guard<std::mutex> lock(mMutex);
+            Path &owner = mSeen[inode];
+            if (!owner.isEmpty() && owner < dir)
+                return false;
+            owner = dir;
+            mInodes[dir] = inode;
+        }
+        directory.mtime = mtime(st);
+        // A directory that changed around the time it was read may change
+        // again without getting a new mtime, don't trust it next time.
+        if (directory.mtime >= mStart)
+            directory.mtime = 0;
+        const auto previous = mPrevious.find(dir);
+        if (directory.mtime && previous != mPrevious.end() && previous->second.mtime == directory.mtime) {
+            // nothing was added, removed or renamed in here
+            directory.files = previous->second.files;
+            directory.dirs = previous->second.dirs;
+            ++mReused;
+            return true;
+        }
+        if (dir != mRoot && Path::exists(dir + ".rtags-ignore"))
+            return true;
+
+        DIR *d = opendir(dir.constData());
+        if (!d)
+            return false;
+        while (const dirent *entry = readdir(d)) {
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+                continue;
+            switch (Filter::filter(dir + entry->d_name, mFilters)) {
             case Filter::Filtered:
-                return Path::Continue;
+                break;
             case Filter::Directory:
-                if (Path::exists(p + "/.rtags-ignore"))
-                    return Path::Continue;
-                return Path::Recurse;
+                directory.dirs.append(entry->d_name);
+                break;
             case Filter::File:
             case Filter::Source:
-                paths.insert(p);
+                directory.files.append(entry->d_name);
                 break;
             }
-            return Path::Continue;
-        });
-    return paths;
+        }
+        closedir(d);
+        return true;
+    }
+
+    const Path mRoot;
+    const List<String> &mFilters;
+    const Snapshot &mPrevious;
+    uint64_t mStart; // directories modified after this are racy
+
+    typedef std::pair<uint64_t, uint64_t> Inode; // st_dev, st_ino
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    List<Path> mQueue;
+    size_t mBusy;
+    std::atomic<size_t> mReused;
+    Map<Inode, Path> mSeen; // smallest path by directory
+    Hash<Path, Inode> mInodes;
+    Snapshot mSnapshot;
+};
+}
+
+ScanThread::ScanThread(const Path &path, const Path &snapshotFile)
+    : Thread(), mPath(path), mSnapshotFile(snapshotFile), mFilters(Server::instance()->options().excludeFilters)
+{
+}
+
+Files ScanThread::scan(const Path &path, const List<String> &filters, const Path &snapshotFile)
+{
+    StopWatch sw;
+    Snapshot previous;
+    if (!snapshotFile.isEmpty() && snapshotFile.isFile()) {
+        std::lock_guard<std::mutex> lock(sSnapshotMutex);
+        DataFile file(snapshotFile, RTags::DatabaseVersion);
+        List<String> previousFilters;
+        if (file.open(DataFile::Read)) {
+            file >> previousFilters;
+            // different filters, different files
+            if (previousFilters == filters)
+                file >> previous;
+        }
+    }
+
+    Walker walker(path.ensureTrailingSlash(), filters, previous);
+    walker.run(std::max(1, std::min(8, ThreadPool::idealThreadCount())));
+
+    Files files;
+    for (const auto &dir : walker.snapshot()) {
+        if (!dir.second.files.isEmpty()) {
+            Set<String> &names = files[dir.first];
+            for (const String &name : dir.second.files)
+                names.insert(name);
+        }
+    }
+    debug() << "Scanned" << path << walker.snapshot().size() << "directories," << walker.reused()
+            << "unchanged since the last scan, in" << sw.elapsed() << "ms";
+
+    if (!snapshotFile.isEmpty()) {
+        std::lock_guard<std::mutex> lock(sSnapshotMutex);
+        Path::mkdir(snapshotFile.parentDir(), Path::Recursive);
+        DataFile file(snapshotFile, RTags::DatabaseVersion);
+        if (file.open(DataFile::Write)) {
+            file << filters << walker.snapshot();
+            if (!file.flush())
+                error("Save error %s: %s", snapshotFile.constData(), file.error().constData());
+        } else {
+            error("Save error %s: %s", snapshotFile.constData(), file.error().constData());
+        }
+    }
+    return files;
 }
 
 void ScanThread::run()
 {
-    mFinished(paths(mPath, mFilters));
+    mFinished(scan(mPath, mFilters, mSnapshotFile));
 }
@@ -19,19 +19,27 @@
 #include "rct/Path.h"
 #include "rct/SignalSlot.h"
 #include "rct/Thread.h"
+#include "RTags.h"
+
+/*
+  Walks a project tree on several threads and returns the files in it by
+  directory. The directories seen by the previous scan are kept in
+  snapshotFile along with their mtimes, a directory whose mtime hasn't
+  changed since then isn't read again. Directories modified within a second
+  of the scan are stored without an mtime so they are always read again.
+*/
 
-class Project;
 class ScanThread : public Thread
 {
 public:
-    ScanThread(const Path &path);
+    ScanThread(const Path &path, const Path &snapshotFile);
     virtual void run() override;
-    Signal<std::function<void(Set<Path>)> > &finished() { return mFinished; }
-    static Set<Path> paths(const Path &path, const List<String> &filters = List<String>());
+    Signal<std::function<void(Files)> > &finished() { return mFinished; }
+    static Files scan(const Path &path, const List<String> &filters, const Path &snapshotFile);
 private:
-    Path mPath;
+    Path mPath, mSnapshotFile;
     const List<String> &mFilters;
-    Signal<std::function<void(Set<Path>)> > mFinished;
+    Signal<std::function<void(Files)> > mFinished;
 };
 
 #endif
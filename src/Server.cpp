@@ -19,12 +19,17 @@
 
 #include <arpa/inet.h>
 #include <clang-c/Index.h>
-#include <clang-c/CXCompilationDatabase.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
 #include <limits>
 #include <regex>
 
+#include "ArgTransformer.h"
 #include "ClassHierarchyJob.h"
+#include "CompileCommandsReader.h"
 #include "CompletionThread.h"
 #include "IncludePathJob.h"
 #include "DependenciesJob.h"
@@ -57,6 +62,7 @@
 #include "rct/QuitMessage.h"
 #include "rct/Rct.h"
 #include "rct/SocketClient.h"
+#include "rct/StopWatch.h"
 #include "rct/Value.h"
 #include "ReferencesJob.h"
 #include "RTags.h"
@@ -66,6 +72,8 @@
 #include "SymbolInfoJob.h"
 #include "VisitFileMessage.h"
 #include "VisitFileResponseMessage.h"
+#include "VisitFileThread.h"
+#include "WorkerMessage.h"
 #include "RTagsVersion.h"
 
 #define TO_STR1(x) #x
@@ -93,8 +101,8 @@ static const List<Path> sSystemIncludePaths = {
 
 Server *Server::sInstance = nullptr;
 Server::Server()
-    : mSuspended(false), mEnvironment(Rct::environment()), mPollTimer(-1), mExitCode(0),
-      mLastFileId(0), mCompletionThread(nullptr), mActiveBuffersSet(false)
+    : mSuspended(false), mEnvironment(Rct::environment()), mPollTimer(-1), mUnloadTimer(-1), mExitCode(0),
+      mFileIdsJournal(nullptr), mFileIdsJournalEntries(0), mFileIdsSnapshotEntries(0), mCompletionThread(nullptr), mVisitFileThread(nullptr), mQueryPool(nullptr), mBackgroundPool(nullptr), mActiveBuffersSet(false)
 {
     assert(!sInstance);
     sInstance = this;
@@ -104,6 +112,8 @@ Server::~Server()
 {
     if (mPollTimer >= 0)
         EventLoop::eventLoop()->unregisterTimer(mPollTimer);
+    if (mUnloadTimer >= 0)
+        EventLoop::eventLoop()->unregisterTimer(mUnloadTimer);
 
     if (mCompletionThread) {
         mCompletionThread->stop();
@@ -112,7 +122,22 @@ Server::~Server()
         mCompletionThread = nullptr;
     }
 
+    delete mQueryPool; // waits for running queries
+    mQueryPool = nullptr;
+    QueryJob::releaseStarted(); // their callbacks may still be queued
+    delete mBackgroundPool;
+    mBackgroundPool = nullptr;
+
+    if (mVisitFileThread) {
+        mVisitFileThread->stop();
+        mVisitFileThread->join();
+        delete mVisitFileThread;
+        mVisitFileThread = nullptr;
+    }
+
     stopServers();
+    if (mFileIdsJournal)
+        fclose(mFileIdsJournal);
     mProjects.clear(); // need to be destroyed before sInstance is set to 0
     assert(sInstance == this);
     sInstance = nullptr;
@@ -140,6 +165,7 @@ bool Server::init(const Options &options)
     mOptions.defines << Source::Define("RTAGS", String(), Source::Define::NoValue);
 
     if (mOptions.options & EnableCompilerManager) {
+        CompilerManager::load(mOptions.dataDir + "compilers");
 #ifndef OS_Darwin   // this causes problems on MacOS+clang
         // http://clang.llvm.org/compatibility.html#vector_builtins
         const char *gccBuiltIntVectorFunctionDefines[] = {
@@ -186,6 +212,17 @@ bool Server::init(const Options &options)
         return false;
     }
 
+    mVisitFileThread = new VisitFileThread(mOptions.socketFile + ".visit");
+    mVisitFileThread->start();
+    if (!mVisitFileThread->waitForListening()) {
+        mVisitFileThread->join();
+        delete mVisitFileThread;
+        mVisitFileThread = nullptr;
+    }
+
+    if (!mOptions.argTransform.isEmpty() && mOptions.argTransformJobs)
+        mArgTransformer.reset(new ArgTransformer(mOptions.argTransform, mOptions.argTransformJobs));
+
     mDefaultJobCount = options.jobCount;
     {
         Log l(LogLevel::Error, LogOutput::StdOut|LogOutput::TrailingNewLine);
@@ -229,10 +266,15 @@ bool Server::init(const Options &options)
     if (mOptions.pollTimer) {
         mPollTimer = EventLoop::eventLoop()->registerTimer([this](int) {
                 for (auto proj : mProjects) {
-                    proj.second->validateAll();
+                    if (proj.second->isLoaded())
+                        proj.second->validateAll();
                 }
             }, mOptions.pollTimer * 1000);
     }
+    if (mOptions.projectUnloadTimeout) {
+        mUnloadTimer = EventLoop::eventLoop()->registerTimer([this](int) { unloadIdleProjects(); },
+                                                             std::min(mOptions.projectUnloadTimeout, 60) * 1000);
+    }
     return true;
 }
 
@@ -335,13 +377,18 @@ bool Server::initServers()
     return true;
 }
 
-std::shared_ptr<Project> Server::addProject(const Path &path)
+std::shared_ptr<Project> Server::addProject(const Path &path, bool load)
 {
-    std::shared_ptr<Project> &project = mProjects[path];
+    std::shared_ptr<Project> project = mProjects.value(path);
     if (!project) {
         project.reset(new Project(path));
+        std::lock_guard<std::mutex> lock(mProjectsMutex);
+        mProjects[path] = project;
+    }
+    if (load && !project->isLoaded()) {
         if (!project->init()) {
             Path::rmdir(project->projectDataDir());
+            std::lock_guard<std::mutex> lock(mProjectsMutex);
             mProjects.erase(path);
             return std::shared_ptr<Project>();
         }
@@ -349,6 +396,36 @@ std::shared_ptr<Project> Server::addProject(const Path &path)
     return project;
 }
 
+void Server::unloadIdleProjects()
+{
+    // Replacing a project with a fresh unloaded one frees its state, it's
+    // loaded again by the next query that needs it.
+    const time_t now = time(nullptr);
+    const std::shared_ptr<Project> current = currentProject();
+    for (auto &it : mProjects) {
+        std::shared_ptr<Project> &project = it.second;
+        if (project == current || !project->isLoaded() || project->isIndexing())
+            continue;
+        if (now - std::max(project->lastUsed(), project->lastIdleTime()) < mOptions.projectUnloadTimeout)
+            continue;
+        // A query on the pool (or anything else) still holding on to it
+        // would keep the old instance around, saving into the same data dir
+        // as the one that's loaded next. Try again on the next round.
+        if (project.use_count() > 1) {
+            debug() << "Not unloading" << it.first << "it's still referenced";
+            continue;
+        }
+        warning() << "Unloading idle project" << it.first;
+        std::shared_ptr<Project> unloaded(new Project(it.first));
+        {
+            std::lock_guard<std::mutex> lock(mProjectsMutex);
+            project.swap(unloaded);
+        }
+        // ~Project saves, on this thread before anything can load it again
+        unloaded.reset();
+    }
+}
+
 void Server::onNewConnection(SocketServer *server)
 {
     while (true) {
@@ -369,18 +446,68 @@ void Server::onNewConnection(SocketServer *server)
             });
         conn->newMessage().connect(std::bind(&Server::onNewMessage, this, std::placeholders::_1, std::placeholders::_2));
         mConnections.insert(conn);
+        if (server == mTcpServer.get())
+            mUntrustedConnections.insert(conn.get());
         std::weak_ptr<Connection> weak = conn;
         conn->disconnected().connect(std::bind([this, weak]() {
                     if (std::shared_ptr<Connection> c = weak.lock()) {
                         c->disconnected().disconnect();
                         mConnections.remove(c);
+                        mUntrustedConnections.remove(c.get());
+                        if (mJobScheduler)
+                            mJobScheduler->onConnectionDisconnected(c.get());
+                        // nobody is listening anymore, e.g. an editor that
+                        // sent a newer query
+                        for (const std::weak_ptr<QueryJob> &query : mQueries.take(c.get())) {
+                            if (std::shared_ptr<QueryJob> job = query.lock())
+                                job->abort();
+                        }
                     }
                 }));
     }
 }
 
+bool Server::authenticate(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &connection)
+{
+    if (!mUntrustedConnections.contains(connection.get()))
+        return true;
+    const WorkerMessage::Type type = (message->messageId() == WorkerMessage::MessageId
+                                      ? std::static_pointer_cast<WorkerMessage>(message)->type()
+                                      : WorkerMessage::Invalid);
+    if (!mOptions.workerSecret.isEmpty() && (type == WorkerMessage::Hello || type == WorkerMessage::Auth)) {
+        // constant time so the secret can't be guessed a byte at a time
+        const String &secret = std::static_pointer_cast<WorkerMessage>(message)->secret();
+        const char *expected = mOptions.workerSecret.constData();
+        const size_t size = mOptions.workerSecret.size();
+        unsigned char diff = secret.size() != size;
+        for (size_t i=0; i<secret.size(); ++i)
+            diff |= secret[i] ^ expected[i % size];
+        if (!diff) {
+            mUntrustedConnections.remove(connection.get());
+            return true;
+        }
+    }
+    error() << "Rejecting unauthenticated worker message on tcp connection"
+            << (mOptions.workerSecret.isEmpty() ? "(no --worker-secret-file)" : "");
+    connection->finish(RTags::UnexpectedMessageError);
+    return false;
+}
+
 void Server::onNewMessage(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &connection)
 {
+    switch (message->messageId()) {
+    case IndexDataMessage::MessageId:
+    case VisitFileMessage::MessageId:
+    case WorkerMessage::MessageId:
+        // these let the sender write project data, only rps on this host
+        // and workers that know the secret get to send them
+        if (!authenticate(message, connection))
+            return;
+        break;
+    default:
+        break;
+    }
+
     switch (message->messageId()) {
     case IndexMessage::MessageId:
         handleIndexMessage(std::static_pointer_cast<IndexMessage>(message), connection);
@@ -404,6 +531,9 @@ void Server::onNewMessage(const std::shared_ptr<Message> &message, const std::sh
     case VisitFileMessage::MessageId:
         handleVisitFileMessage(std::static_pointer_cast<VisitFileMessage>(message), connection);
         break;
+    case WorkerMessage::MessageId:
+        mJobScheduler->handleWorkerMessage(std::static_pointer_cast<WorkerMessage>(message), connection);
+        break;
     case ResponseMessage::MessageId:
     case FinishMessage::MessageId:
     case VisitFileResponseMessage::MessageId:
@@ -492,78 +622,321 @@ String Server::guessArguments(const String &args, const Path &pwd, const Path &p
     return String::join(ret, ' ');
 }
 
+namespace {
+struct CompileCommandsEntry
+{
+    CompileCommandsEntry()
+        : hash(0), rejected(false)
+    {}
+    CompileCommandsReader::Command command;
+    uint64_t hash;
+    Path directory;
+    SourceList sources;
+    List<Path> unresolvedPaths;
+    bool rejected; // by --arg-transform
+};
+
+struct CompileCommandsChunk
+{
+    List<CompileCommandsEntry> entries;
+};
+
+// Shared by parseCompileCommands and the pool jobs working on its chunks. A
+// job may only get to run after parseCompileCommands has drained the queue
+// itself so they hold on to this rather than to anything on its stack.
+struct CompileCommandsQueue
+{
+    CompileCommandsQueue()
+        : active(0)
+    {}
+
+    // returns false when there was nothing left to do
+    bool work()
+    {
+        std::shared_ptr<CompileCommandsChunk> chunk;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (chunks.empty())
+                return false;
+            chunk = chunks.front();
+            chunks.pop_front();
+            ++active;
+        }
+        for (auto &entry : chunk->entries)
+            process(entry);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!--active)
+            cond.notify_all();
+        return true;
+    }
+
+    void finish()
+    {
+        while (work()) {}
+        std::unique_lock<std::mutex> lock(mutex);
+        while (active)
+            cond.wait(lock);
+        process = nullptr;
+    }
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::shared_ptr<CompileCommandsChunk> > chunks;
+    std::function<void(CompileCommandsEntry &)> process;
+    int active;
+};
+
+class CompileCommandsJob : public ThreadPool::Job
+{
+public:
+    CompileCommandsJob(const std::shared_ptr<CompileCommandsQueue> &queue)
+        : mQueue(queue)
+    {}
+protected:
+    virtual void run() override
+    {
+        while (mQueue->work()) {}
+    }
+private:
+    const std::shared_ptr<CompileCommandsQueue> mQueue;
+};
+
+String joinArguments(const CompileCommandsReader::Command &command)
+{
+    String args = command.command;
+    if (args.isEmpty()) {
+        for (const String &arg : command.arguments) {
+            if (!args.isEmpty())
+                args += ' ';
+            if (arg.contains(' ')) {
+                args += '"';
+                args += arg;
+                args += '"';
+            } else {
+                args += arg;
+            }
+        }
+    }
+    return args;
+}
+}
+
+// Entries that have been read and parsed but not added to an
+// IndexParseData yet. Matching sources against the loaded projects has to
+// happen on the main thread.
+struct Server::ParsedCompileCommands
+{
+    ParsedCompileCommands()
+        : fileId(0)
+    {}
+    uint32_t fileId;
+    List<std::shared_ptr<CompileCommandsChunk> > chunks;
+};
+
 bool Server::loadCompileCommands(IndexParseData &data, const Path &compileCommands, const List<String> &environment, SourceCache *cache) const
+{
+    const std::shared_ptr<ParsedCompileCommands> parsed = readCompileCommands(data, compileCommands, environment, cache);
+    return parsed && loadCompileCommands(data, parsed, cache);
+}
+
+bool Server::loadCompileCommands(IndexParseData &data, const std::shared_ptr<ParsedCompileCommands> &parsed, SourceCache *cache) const
+{
+    const bool ret = addCompileCommands(data, parsed, cache);
+    if (!ret)
+        data.compileCommands.remove(parsed->fileId);
+    return ret;
+}
+
+std::shared_ptr<Server::ParsedCompileCommands> Server::readCompileCommands(IndexParseData &data, const Path &compileCommands,
+                                                                           const List<String> &environment, SourceCache *cache) const
 {
     if (Sandbox::hasRoot() && !data.project.isEmpty() && !data.project.startsWith(Sandbox::root())) {
         error("Invalid --project-root '%s', must be inside --sandbox-root '%s'",
               data.project.constData(), Sandbox::root().constData());
-        return false;
+        return std::shared_ptr<ParsedCompileCommands>();
     }
 
-    CXCompilationDatabase_Error err;
-    CXCompilationDatabase db = clang_CompilationDatabase_fromDirectory(compileCommands.parentDir().constData(), &err);
-    if (err != CXCompilationDatabase_NoError) {
+    const String contents = compileCommands.readAll();
+    if (contents.isEmpty()) {
         error("Can't load compilation database from %s", compileCommands.constData());
-        return false;
+        return std::shared_ptr<ParsedCompileCommands>();
     }
     const uint32_t fileId = Location::insertFile(compileCommands);
-    bool ret = false;
-    CXCompileCommands cmds = clang_CompilationDatabase_getAllCompileCommands(db);
-    const unsigned int sz = clang_CompileCommands_getSize(cmds);
     auto &ref = data.compileCommands[fileId];
     ref.environment = environment;
     ref.lastModifiedMs = compileCommands.lastModifiedMs();
-    for (unsigned int i = 0; i < sz; ++i) {
-        CXCompileCommand cmd = clang_CompileCommands_getCommand(cmds, i);
-        String args;
-        CXString str = clang_CompileCommand_getDirectory(cmd);
-        Path compileDir = clang_getCString(str);
-        if (!compileDir.isAbsolute() || !compileDir.exists()) {
+
+    CompileCommandsReader reader(contents);
+    std::shared_ptr<ParsedCompileCommands> parsed = readCompileCommands(data, fileId, [&reader](CompileCommandsReader::Command &command) {
+            return reader.next(command);
+        }, cache);
+    if (reader.hasError())
+        error("Error parsing %s: %s", compileCommands.constData(), reader.error().constData());
+    return parsed;
+}
+
+bool Server::parseCompileCommands(IndexParseData &data, uint32_t compileCommandsFileId,
+                                  const std::function<bool(CompileCommandsReader::Command &)> &next,
+                                  SourceCache *cache) const
+{
+    assert(EventLoop::isMainThread());
+    return addCompileCommands(data, readCompileCommands(data, compileCommandsFileId, next, cache), cache);
+}
+
+std::shared_ptr<Server::ParsedCompileCommands> Server::readCompileCommands(const IndexParseData &data, uint32_t compileCommandsFileId,
+                                                                           const std::function<bool(CompileCommandsReader::Command &)> &next,
+                                                                           SourceCache *cache) const
+{
+    assert(data.compileCommands.contains(compileCommandsFileId));
+    const auto &ref = data.compileCommands.find(compileCommandsFileId)->second;
+
+    // Entries are handed out on this thread while jobs on the background
+    // pool run Source::parse on them in chunks, this thread helps out once
+    // it's done reading. A one-shot --arg-transform is run serially on this
+    // thread, with --arg-transform-jobs each chunk is piped through the
+    // coprocesses before it is queued.
+    enum { ChunkSize = 256 };
+    const bool transform = !mOptions.argTransform.isEmpty() && !mArgTransformer;
+    const Path &project = data.project;
+    const List<String> &environment = ref.environment;
+    auto queue = std::make_shared<CompileCommandsQueue>();
+    auto resolveDirectory = [&project](Path &&dir) {
+        if (!dir.isAbsolute() || !dir.exists()) {
             bool resolveOk = false;
-            debug() << "compileDir doesn't exist: " << compileDir;
-            Path resolvedCompileDir = compileDir.resolved(Path::MakeAbsolute, data.project, &resolveOk);
+            debug() << "compileDir doesn't exist: " << dir;
+            Path resolvedCompileDir = dir.resolved(Path::MakeAbsolute, project, &resolveOk);
             if (resolveOk) {
-                compileDir = resolvedCompileDir;
-                debug() << "    resolved to: " << compileDir;
+                dir = resolvedCompileDir;
+                debug() << "    resolved to: " << dir;
             }
         }
-        clang_disposeString(str);
-        const unsigned int num = clang_CompileCommand_getNumArgs(cmd);
-        for (unsigned int j = 0; j < num; ++j) {
-            str = clang_CompileCommand_getArg(cmd, j);
-            const char *ch = clang_getCString(str);
-            if (strchr(ch, ' ')) {
-                args += '"';
-                args += ch;
-                args += '"';
-            } else {
-                args += ch;
+        return dir.ensureTrailingSlash();
+    };
+    auto transformChunk = [this](CompileCommandsChunk &chunk) {
+        if (!mArgTransformer)
+            return;
+        List<String> commands(chunk.entries.size());
+        for (size_t i=0; i<chunk.entries.size(); ++i)
+            commands[i] = joinArguments(chunk.entries.at(i).command);
+        List<ArgTransformer::Result> results;
+        mArgTransformer->transform(commands, results);
+        for (size_t i=0; i<chunk.entries.size(); ++i) {
+            CompileCommandsEntry &entry = chunk.entries[i];
+            if (results.at(i) == ArgTransformer::Rejected) {
+                entry.rejected = true;
+            } else if (results.at(i) == ArgTransformer::Changed) {
+                entry.command.command = std::move(commands[i]);
+                entry.command.arguments.clear();
             }
-            clang_disposeString(str);
-            if (j < num - 1)
-                args += ' ';
         }
-        ret = parse(data, std::move(args), compileDir.ensureTrailingSlash(), fileId, cache) || ret;
+    };
+    queue->process = [&resolveDirectory, &environment, cache](CompileCommandsEntry &entry) {
+        if (entry.rejected)
+            return;
+        entry.directory = resolveDirectory(std::move(entry.command.directory));
+        if (!entry.command.arguments.isEmpty()) {
+            entry.sources = Source::parse(std::move(entry.command.arguments), entry.directory, environment, &entry.unresolvedPaths, cache);
+        } else {
+            entry.sources = Source::parse(entry.command.command, entry.directory, environment, &entry.unresolvedPaths, cache);
+        }
+    };
+    auto parsed = std::make_shared<ParsedCompileCommands>();
+    parsed->fileId = compileCommandsFileId;
+    List<std::shared_ptr<CompileCommandsChunk> > &chunks = parsed->chunks;
+    auto chunk = std::make_shared<CompileCommandsChunk>();
+    auto flush = [&]() {
+        if (chunk->entries.isEmpty())
+            return;
+        chunks.append(chunk);
+        if (!transform) {
+            transformChunk(*chunk);
+            {
+                std::lock_guard<std::mutex> lock(queue->mutex);
+                queue->chunks.push_back(chunk);
+            }
+            backgroundPool()->start(std::make_shared<CompileCommandsJob>(queue));
+        }
+        chunk = std::make_shared<CompileCommandsChunk>();
+    };
+
+    CompileCommandsEntry entry;
+    while (next(entry.command)) {
+        entry.hash = entry.command.hash();
+        chunk->entries.append(std::move(entry));
+        entry = CompileCommandsEntry();
+        if (chunk->entries.size() == ChunkSize)
+            flush();
+    }
+    if (!transform && chunks.isEmpty() && chunk->entries.size() < ChunkSize / 4) {
+        // not worth going through the pool for this
+        transformChunk(*chunk);
+        for (auto &e : chunk->entries)
+            queue->process(e);
+        chunks.append(chunk);
+    } else {
+        flush();
     }
-    clang_CompileCommands_dispose(cmds);
-    clang_CompilationDatabase_dispose(db);
-    if (!ret) {
-        data.compileCommands.remove(fileId);
+    queue->finish();
+
+    if (transform) {
+        for (const auto &c : chunks) {
+            for (auto &e : c->entries) {
+                e.directory = resolveDirectory(std::move(e.command.directory));
+                String arguments = joinArguments(e.command);
+                if (!transformArguments(arguments)) {
+                    e.rejected = true;
+                } else {
+                    e.sources = Source::parse(arguments, e.directory, environment, &e.unresolvedPaths, cache);
+                }
+            }
+        }
     }
-    return ret;
+    return parsed;
 }
 
-bool Server::parse(IndexParseData &data, String &&arguments, const Path &pwd, uint32_t compileCommandsFileId, SourceCache *cache) const
+bool Server::addCompileCommands(IndexParseData &data, const std::shared_ptr<ParsedCompileCommands> &parsed, SourceCache *cache) const
 {
-    if (Sandbox::hasRoot() && !data.project.isEmpty() && !data.project.startsWith(Sandbox::root())) {
-        error("Invalid --project-root '%s', must be inside --sandbox-root '%s'",
-              data.project.constData(), Sandbox::root().constData());
-        return false;
+    assert(EventLoop::isMainThread());
+    assert(data.compileCommands.contains(parsed->fileId));
+    auto &ref = data.compileCommands[parsed->fileId];
+
+    // Sources are added in file order once all chunks are done so the
+    // result doesn't depend on scheduling.
+    bool ret = false;
+    for (const auto &c : parsed->chunks) {
+        for (auto &e : c->entries) {
+            SourceList sources;
+            if (e.rejected) {
+                warning() << "--arg-transform rejected" << joinArguments(e.command);
+            } else {
+                sources = e.sources;
+                ret = addSources(data, std::move(e.sources), e.unresolvedPaths, e.directory, parsed->fileId, cache) || ret;
+            }
+            // remember which files each entry produced so a reload only
+            // needs to look at the entries that changed
+            Set<uint32_t> &fileIds = ref.entries[e.hash];
+            for (const Source &source : sources) {
+                if (ref.sources.contains(source.fileId))
+                    fileIds.insert(source.fileId);
+            }
+        }
     }
+    return ret;
+}
 
-    assert(pwd.endsWith('/'));
-    List<Path> unresolvedPaths;
-    if (!mOptions.argTransform.isEmpty()) {
+bool Server::transformArguments(String &arguments) const
+{
+    if (mArgTransformer) {
+        List<String> commands;
+        commands << std::move(arguments);
+        List<ArgTransformer::Result> results;
+        mArgTransformer->transform(commands, results);
+        if (results.front() == ArgTransformer::Rejected) {
+            warning() << "--arg-transform rejected" << commands.front();
+            return false;
+        }
+        arguments = std::move(commands.front());
+    } else if (!mOptions.argTransform.isEmpty()) {
         Process process;
         if (process.exec(mOptions.argTransform, List<String>() << arguments) == Process::Done) {
             if (process.returnCode() != 0) {
@@ -577,12 +950,38 @@ bool Server::parse(IndexParseData &data, String &&arguments, const Path &pwd, ui
             }
         }
     }
+    return true;
+}
+
+bool Server::parse(IndexParseData &data, String &&arguments, const Path &pwd, uint32_t compileCommandsFileId,
+                   SourceCache *cache, SourceList *parsed) const
+{
+    if (Sandbox::hasRoot() && !data.project.isEmpty() && !data.project.startsWith(Sandbox::root())) {
+        error("Invalid --project-root '%s', must be inside --sandbox-root '%s'",
+              data.project.constData(), Sandbox::root().constData());
+        return false;
+    }
 
+    assert(pwd.endsWith('/'));
+    if (!transformArguments(arguments))
+        return false;
+
+    List<Path> unresolvedPaths;
     assert(!compileCommandsFileId || data.compileCommands.contains(compileCommandsFileId));
     const auto &env = compileCommandsFileId ? data.compileCommands[compileCommandsFileId].environment : data.environment;
     SourceList sources = Source::parse(arguments, pwd, env, &unresolvedPaths, cache);
-    bool ret = (sources.isEmpty() && unresolvedPaths.size() == 1 && unresolvedPaths.front() == "-");
     debug() << "Got" << sources.size() << "sources, and" << unresolvedPaths << "from" << arguments;
+    if (parsed)
+        *parsed = sources;
+    return addSources(data, std::move(sources), unresolvedPaths, pwd, compileCommandsFileId, cache);
+}
+
+bool Server::addSources(IndexParseData &data, SourceList &&sources, const List<Path> &unresolvedPaths,
+                        const Path &pwd, uint32_t compileCommandsFileId, SourceCache *cache) const
+{
+    // matches against mProjects and the projects' files
+    assert(EventLoop::isMainThread());
+    bool ret = (sources.isEmpty() && unresolvedPaths.size() == 1 && unresolvedPaths.front() == "-");
     size_t idx = 0;
     for (Source &source : sources) {
         const Path path = source.sourceFile();
@@ -624,22 +1023,55 @@ bool Server::parse(IndexParseData &data, String &&arguments, const Path &pwd, ui
     return ret;
 }
 
+// Reads and parses a compilation database on the background pool, the
+// sources are matched to a project and handed to Server::finishIndexMessage
+// on the main thread.
+class LoadCompileCommandsJob : public ThreadPool::Job
+{
+public:
+    LoadCompileCommandsJob(const std::shared_ptr<IndexMessage> &message, const std::shared_ptr<Connection> &conn)
+        : mMessage(message), mConnection(conn)
+    {}
+protected:
+    virtual void run() override
+    {
+        Server *server = Server::instance();
+        if (!server)
+            return;
+        auto data = std::make_shared<IndexParseData>();
+        data->project = mMessage->projectRoot();
+        auto cache = std::make_shared<SourceCache>();
+        const std::shared_ptr<Server::ParsedCompileCommands> parsed = server->readCompileCommands(*data, mMessage->compileCommands(),
+                                                                                                 mMessage->environment(), cache.get());
+        const std::shared_ptr<Connection> conn = std::move(mConnection);
+        if (std::shared_ptr<EventLoop> loop = EventLoop::mainEventLoop()) {
+            loop->callLater([data, parsed, cache, conn]() {
+                    Server *s = Server::instance();
+                    if (!s)
+                        return;
+                    const bool ret = parsed && s->loadCompileCommands(*data, parsed, cache.get());
+                    if (conn)
+                        conn->write(ret ? "[Server] Compilation database loading..." : "[Server] Compilation failed to load.");
+                    s->finishIndexMessage(std::move(*data), conn, ret);
+                });
+        }
+    }
+private:
+    const std::shared_ptr<IndexMessage> mMessage;
+    std::shared_ptr<Connection> mConnection;
+};
+
 void Server::handleIndexMessage(const std::shared_ptr<IndexMessage> &message, const std::shared_ptr<Connection> &conn)
 {
     const Path path = message->compileCommands();
+    if (!path.isEmpty()) {
+        backgroundPool()->start(std::make_shared<LoadCompileCommandsJob>(message, conn));
+        return;
+    }
     IndexParseData data;
     data.project = message->projectRoot();
     bool ret = true;
-    if (!path.isEmpty()) {
-        SourceCache cache;
-        if (loadCompileCommands(data, path, message->environment(), &cache)) {
-            if (conn)
-                conn->write("[Server] Compilation database loading...");
-        } else if (conn) {
-            ret = false;
-            conn->write("[Server] Compilation failed to load.");
-        }
-    } else {
+    {
         data.environment = std::move(message->takeEnvironment());
         String arguments = std::move(message->takeArguments());
         if (message->flags() & IndexMessage::GuessFlags) {
@@ -652,6 +1084,11 @@ void Server::handleIndexMessage(const std::shared_ptr<IndexMessage> &message, co
         if (ret)
             ret = parse(data, std::move(arguments), message->workingDirectory());
     }
+    finishIndexMessage(std::move(data), conn, ret);
+}
+
+void Server::finishIndexMessage(IndexParseData &&data, const std::shared_ptr<Connection> &conn, bool ret)
+{
     if (conn)
         conn->finish(ret ? 0 : 1);
     if (ret) {
@@ -811,6 +1248,9 @@ void Server::handleQueryMessage(const std::shared_ptr<QueryMessage> &message, co
     case QueryMessage::IncludePath:
         includePath(message, conn);
         break;
+    case QueryMessage::ImportIndex:
+        importIndex(message, conn);
+        break;
     }
 }
 
@@ -834,6 +1274,7 @@ void Server::followLocation(const std::shared_ptr<QueryMessage> &query, const st
 
     {
         FollowLocationJob job(loc, query, project);
+        job.setCacheable();
         if (!job.run(conn)) {
             conn->finish();
             return;
@@ -848,23 +1289,31 @@ void Server::followLocation(const std::shared_ptr<QueryMessage> &query, const st
        - The file in question does start with another project's path
     */
 
-    const Path path = loc.path();
+    const Path &path = loc.path();
     if (!path.startsWith(project->path())) {
+        // loading a project can remove it from mProjects so collect them first
+        List<std::shared_ptr<Project> > candidates;
         for (const auto &proj : mProjects) {
             if (proj.second != project) {
                 Path paths[] = { proj.first, proj.first };
                 paths[1].resolve();
                 for (const Path &projectPath : paths) {
                     if (path.startsWith(projectPath)) {
-                        FollowLocationJob job(loc, query, proj.second);
-                        if (job.run(conn)) {
-                            conn->finish();
-                            return;
-                        }
+                        candidates.append(proj.second);
+                        break;
                     }
                 }
             }
         }
+        for (std::shared_ptr<Project> candidate : candidates) {
+            if (!candidate->isLoaded() && !(candidate = addProject(candidate->path())))
+                continue;
+            FollowLocationJob job(loc, query, candidate);
+            if (job.run(conn)) {
+                conn->finish();
+                return;
+            }
+        }
     }
     if (!project->dependencies().contains(loc.fileId())) {
         conn->write("Not indexed");
@@ -996,18 +1445,7 @@ void Server::dumpFileMaps(const std::shared_ptr<QueryMessage> &query, const std:
         return;
     }
 
-    std::shared_ptr<Project> project;
-    if (currentProject() && currentProject()->isIndexed(fileId)) {
-        project = currentProject();
-    } else {
-        for (const auto &p : mProjects) {
-            if (p.second->isIndexed(fileId)) {
-                project = p.second;
-                setCurrentProject(project);
-                break;
-            }
-        }
-    }
+    std::shared_ptr<Project> project = projectForFileId(fileId);
     if (!project) {
         conn->write<256>("%s is not indexed", query->query().constData());
         conn->finish();
@@ -1161,9 +1599,9 @@ void Server::symbolInfo(const std::shared_ptr<QueryMessage> &query, const std::s
     const Location start(fileId, line, column);
     const Location end = line2 ? Location(fileId, line2, column2) : Location();
 
-    SymbolInfoJob job(start, end, std::move(kinds), query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    std::shared_ptr<QueryJob> job = std::make_shared<SymbolInfoJob>(start, end, std::move(kinds), query, project);
+    job->setCacheable();
+    startQueryJob(job, conn);
 }
 
 void Server::includePath(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1208,17 +1646,7 @@ void Server::dependencies(const std::shared_ptr<QueryMessage> &query, const std:
 
     std::shared_ptr<Project> project;
     if (fileId) {
-        if (currentProject() && currentProject()->isIndexed(fileId)) {
-            project = currentProject();
-        } else {
-            for (const auto &p : mProjects) {
-                if (p.second->isIndexed(fileId)) {
-                    project = p.second;
-                    setCurrentProject(project);
-                    break;
-                }
-            }
-        }
+        project = projectForFileId(fileId);
     } else {
         project = currentProject();
     }
@@ -1274,9 +1702,9 @@ void Server::referencesForLocation(const std::shared_ptr<QueryMessage> &query, c
         return;
     }
 
-    ReferencesJob job(loc, query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    std::shared_ptr<QueryJob> job = std::make_shared<ReferencesJob>(loc, query, project);
+    job->setCacheable();
+    startQueryJob(job, conn);
 }
 
 void Server::referencesForName(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1293,9 +1721,9 @@ void Server::referencesForName(const std::shared_ptr<QueryMessage> &query, const
         return;
     }
 
-    ReferencesJob job(name, query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    std::shared_ptr<QueryJob> job = std::make_shared<ReferencesJob>(name, query, project);
+    job->setCacheable();
+    startQueryJob(job, conn);
 }
 
 void Server::findSymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1306,15 +1734,13 @@ void Server::findSymbols(const std::shared_ptr<QueryMessage> &query, const std::
     if (!project)
         project = currentProject();
 
-    int ret = 0;
     if (!project) {
-        ret = 1;
         error("No project");
-    } else {
-        FindSymbolsJob job(query, project);
-        ret = job.run(conn);
+        conn->finish(1);
+        return;
     }
-    conn->finish(ret);
+
+    startQueryJob(std::make_shared<FindSymbolsJob>(query, project), conn);
 }
 
 void Server::listSymbols(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1331,9 +1757,7 @@ void Server::listSymbols(const std::shared_ptr<QueryMessage> &query, const std::
         return;
     }
 
-    ListSymbolsJob job(query, project);
-    const int ret = job.run(conn);
-    conn->finish(ret);
+    startQueryJob(std::make_shared<ListSymbolsJob>(query, project), conn);
 }
 
 void Server::status(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1386,6 +1810,158 @@ void Server::reloadFileManager(const std::shared_ptr<QueryMessage> &query, const
     }
 }
 
+enum {
+    FileIdsJournalMagic = 0x4a444946, // "FIDJ"
+    FileIdsJournalMinEntries = 16384
+};
+
+/*
+  fileids.journal is a header followed by one record per file id added since
+  fileids was last written: id, size, path, checksum. A write that was cut
+  short leaves a record that fails the checksum, it and anything after it is
+  dropped and, if truncate is set, cut off the file so appends can continue.
+  Returns the number of records replayed into pathsToIds.
+*/
+static size_t replayFileIdsJournal(const Path &journal, Hash<Path, uint32_t> &pathsToIds, bool truncate)
+{
+    const String data = journal.readAll();
+    if (data.isEmpty())
+        return 0;
+    uint32_t header[2] = { 0, 0 };
+    if (data.size() >= sizeof(header))
+        memcpy(header, data.constData(), sizeof(header));
+    if (header[0] != FileIdsJournalMagic || header[1] != static_cast<uint32_t>(RTags::DatabaseVersion)) {
+        error() << "Ignoring invalid file ids journal" << journal;
+        if (truncate)
+            Path::rm(journal);
+        return 0;
+    }
+    const char *ch = data.constData();
+    size_t pos = sizeof(header);
+    size_t count = 0;
+    while (pos + sizeof(uint32_t) * 2 <= data.size()) {
+        uint32_t id, size, checksum;
+        memcpy(&id, ch + pos, sizeof(id));
+        memcpy(&size, ch + pos + sizeof(id), sizeof(size));
+        const size_t path = pos + sizeof(id) + sizeof(size);
+        if (path + size + sizeof(checksum) > data.size())
+            break;
+        memcpy(&checksum, ch + path + size, sizeof(checksum));
+        if (!id || checksum != static_cast<uint32_t>(RTags::contentHash(ch + path, size, id)))
+            break;
+        pathsToIds[Path(ch + path, size)] = id;
+        pos = path + size + sizeof(checksum);
+        ++count;
+    }
+    if (pos < data.size()) {
+        warning() << "Dropping" << (data.size() - pos) << "bytes from the end of" << journal;
+        if (truncate && ::truncate(journal.constData(), pos))
+            error() << "Failed to truncate" << journal << Rct::strerror();
+    }
+    return count;
+}
+
+void Server::importIndex(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
+{
+    const Path dir = query->query();
+    DataFile fileIdsFile(dir + "fileids", RTags::DatabaseVersion);
+    if (!fileIdsFile.open(DataFile::Read)) {
+        conn->write<1024>("Can't open %sfileids: %s", dir.constData(), fileIdsFile.error().constData());
+        conn->finish(RTags::GeneralFailure);
+        return;
+    }
+    Flags<FileIdsFileFlag> flags;
+    fileIdsFile >> flags;
+    if (flags & HasSandboxRoot && !Sandbox::hasRoot()) {
+        conn->write("This database was produced with --sandbox-root. You have to specify a sandbox-root argument to import it");
+        conn->finish(RTags::GeneralFailure);
+        return;
+    } else if ((flags & HasNoRealPath && !(mOptions.options & NoRealPath))
+               || (flags & HasRealPath && mOptions.options & NoRealPath)) {
+        conn->write("This database was produced with a different --no-realpath setting");
+        conn->finish(RTags::GeneralFailure);
+        return;
+    }
+
+    // SBROOT
+    Hash<Path, uint32_t> pathsToIds;
+    fileIdsFile >> pathsToIds;
+    replayFileIdsJournal(dir + "fileids.journal", pathsToIds, false);
+    Sandbox::decode(pathsToIds);
+
+    // only the projects we have locally take part in the import
+    List<std::pair<Path, std::shared_ptr<Project> > > targets;
+    const List<Path> projects = dir.files(Path::Directory);
+    for (Path file : projects) {
+        if (!file.endsWith('/'))
+            file.append('/');
+        Path projectPath = file.mid(dir.size());
+        projectPath.chop(1);
+        RTags::decodePath(projectPath);
+        if (!projectPath.endsWith('/'))
+            projectPath.append('/');
+        std::shared_ptr<Project> project = mProjects.contains(projectPath) ? addProject(projectPath) : std::shared_ptr<Project>();
+        if (!project) {
+            conn->write<1024>("No local project for %s, load its compile_commands.json first", projectPath.constData());
+            continue;
+        }
+        targets.append(std::make_pair(file, project));
+    }
+
+    // foreign fileId -> local fileId. New ids are only allocated for files
+    // under one of the target projects, anything else is mapped only if
+    // we already know it. The rest is dropped.
+    Hash<uint32_t, uint32_t> fileIds;
+    for (const auto &it : pathsToIds) {
+        if (!it.first.isFile())
+            continue;
+        uint32_t fileId = Location::fileId(it.first);
+        if (!fileId) {
+            bool inProject = false;
+            for (const auto &target : targets) {
+                if (it.first.startsWith(target.second->path())) {
+                    inProject = true;
+                    break;
+                }
+            }
+            if (inProject)
+                fileId = Location::insertFile(it.first);
+        }
+        if (fileId)
+            fileIds[it.second] = fileId;
+    }
+
+    // the shards are copied on the background pool, conn is finished when
+    // the last project is done
+    struct State {
+        int pending, imported;
+    };
+    auto state = std::make_shared<State>();
+    state->pending = 1;
+    state->imported = 0;
+    auto done = [this, state, conn]() {
+        if (--state->pending)
+            return;
+        saveFileIds();
+        conn->finish(state->imported ? RTags::Success : RTags::GeneralFailure);
+    };
+
+    for (const auto &target : targets) {
+        const Path projectPath = target.second->path();
+        ++state->pending;
+        target.second->importIndex(target.first, fileIds, [state, conn, projectPath, done](int count, const String &err) {
+                if (count == -1) {
+                    conn->write<1024>("Failed to import %s: %s", projectPath.constData(), err.constData());
+                } else {
+                    conn->write<1024>("Imported %d files into %s", count, projectPath.constData());
+                    state->imported += count;
+                }
+                done();
+            });
+    }
+    done();
+}
+
 void Server::hasFileManager(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
 {
     const Path path = query->query();
@@ -1444,12 +2020,20 @@ void Server::preprocessFile(const std::shared_ptr<QueryMessage> &query, const st
 
 void Server::clearProjects(ClearMode mode)
 {
-    Path::rmdir(mOptions.dataDir);
+    if (mFileIdsJournal) {
+        fclose(mFileIdsJournal);
+        mFileIdsJournal = nullptr;
+    }
+    mFileIdsJournalEntries = mFileIdsSnapshotEntries = 0;
     setCurrentProject(std::shared_ptr<Project>());
     for (auto p : mProjects) {
         p.second->destroy();
     }
-    mProjects.clear();
+    Path::rmdir(mOptions.dataDir);
+    {
+        std::lock_guard<std::mutex> lock(mProjectsMutex);
+        mProjects.clear();
+    }
     if (mode == Clear_All)
         Location::init(Hash<Path, uint32_t>());
 }
@@ -1512,6 +2096,11 @@ bool Server::shouldIndex(const Source &source, const Path &srcRoot) const
 
 void Server::setCurrentProject(const std::shared_ptr<Project> &project)
 {
+    if (project) {
+        if (!project->isLoaded() && !addProject(project->path()))
+            return;
+        project->touch();
+    }
     std::shared_ptr<Project> old = currentProject();
     if (project != old) {
         if (old && old->fileManager())
@@ -1563,15 +2152,50 @@ std::shared_ptr<Project> Server::projectForMatches(const List<Match> &matches)
     std::shared_ptr<Project> cur = currentProject();
     // give current a chance first to avoid switching project when using system headers etc
     for (const Match &match : matches) {
-        if (cur && cur->match(match))
+        if (cur && cur->match(match)) {
+            cur->touch();
             return cur;
+        }
 
+        // setCurrentProject loads it, which erases it from mProjects if
+        // that fails, so don't do that while iterating
+        std::shared_ptr<Project> found;
         for (const auto &it : mProjects) {
             if (it.second != cur && it.second->match(match)) {
-                setCurrentProject(it.second);
-                return it.second;
+                found = it.second;
+                break;
             }
         }
+        if (found) {
+            if (!found->isLoaded() && !(found = addProject(found->path())))
+                continue;
+            setCurrentProject(found);
+            return found;
+        }
+    }
+    return std::shared_ptr<Project>();
+}
+
+std::shared_ptr<Project> Server::projectForFileId(uint32_t fileId)
+{
+    std::shared_ptr<Project> cur = currentProject();
+    if (cur && cur->isIndexed(fileId))
+        return cur;
+    // unloaded projects don't know what they've indexed, load the ones the
+    // file is under to find out
+    const Path &path = Location::path(fileId);
+    List<std::shared_ptr<Project> > candidates;
+    for (const auto &it : mProjects) {
+        if (it.second != cur && (it.second->isLoaded() || it.second->match(path)))
+            candidates.append(it.second);
+    }
+    for (std::shared_ptr<Project> project : candidates) {
+        if (!project->isLoaded() && !(project = addProject(project->path())))
+            continue;
+        if (project->isIndexed(fileId)) {
+            setCurrentProject(project);
+            return project;
+        }
     }
     return std::shared_ptr<Project>();
 }
@@ -1591,9 +2215,10 @@ void Server::removeProject(const std::shared_ptr<QueryMessage> &query, const std
             Path path = cur->first;
             conn->write<128>("Deleted project: %s", path.constData());
             RTags::encodePath(path);
+            cur->second->destroy(); // waits for a checkpoint writing to the directory
             Path::rmdir(mOptions.dataDir + path);
             warning() << "Deleted" << (mOptions.dataDir + path);
-            cur->second->destroy();
+            std::lock_guard<std::mutex> lock(mProjectsMutex);
             mProjects.erase(cur);
         }
     }
@@ -1714,60 +2339,64 @@ void Server::deadFunctions(const std::shared_ptr<QueryMessage> &query, const std
     std::shared_ptr<Project> project = projectForQuery(query);
     if (!project)
         project = currentProject();
-    if (project) {
-        class DeadFunctionsJob : public QueryJob
+    if (!project) {
+        conn->finish();
+        return;
+    }
+
+    class DeadFunctionsJob : public QueryJob
+    {
+    public:
+        DeadFunctionsJob(const std::shared_ptr<QueryMessage> &msg, const std::shared_ptr<Project> &project)
+            : QueryJob(msg, project)
+        {}
+        virtual int execute() override
         {
-        public:
-            DeadFunctionsJob(const std::shared_ptr<QueryMessage> &msg, const std::shared_ptr<Project> &project)
-                : QueryJob(msg, project)
-            {}
-            virtual int execute() override
-            {
-                const uint32_t fileId = Location::fileId(queryMessage()->query());
-                if (fileId)
-                    Server::instance()->prepareCompletion(queryMessage(), fileId, project());
-                bool raw = false;
-                if (!(queryFlags() & (QueryMessage::JSON|QueryMessage::Elisp))) {
-                    raw = true;
-                    setPieceFilters(std::move(Set<String>() << "location"));
+            const uint32_t fileId = Location::fileId(queryMessage()->query());
+            bool raw = false;
+            if (!(queryFlags() & (QueryMessage::JSON|QueryMessage::Elisp))) {
+                raw = true;
+                setPieceFilters(std::move(Set<String>() << "location"));
+            }
+            bool failed = false;
+            const std::shared_ptr<Project> proj = project();
+            auto process = [this, proj, &failed](uint32_t file) {
+                for (const Symbol &symbol : proj->findDeadFunctions(file)) {
+                    if (!failed && !write(symbol))
+                        failed = true;
                 }
-                bool failed = false;
-                const std::shared_ptr<Project> proj = project();
-                auto process = [this, proj, &failed](uint32_t file) {
-                    for (const Symbol &symbol : proj->findDeadFunctions(file)) {
-                        if (!failed && !write(symbol))
+            };
+            if (!fileId) {
+                Set<uint32_t> all = proj->dependencies(0, Project::All);
+                all.remove([](uint32_t file) { return Location::path(file).isSystem(); });
+                size_t idx = 0;
+                const Path projectPath = proj->path();
+                for (uint32_t file : proj->dependencies(0, Project::All)) {
+                    if (raw) {
+                        Path p = Location::path(file);
+                        const char *ch = p.constData();
+                        if (!(queryFlags() & QueryMessage::AbsolutePath) && p.startsWith(projectPath))
+                            ch += projectPath.size();
+                        if (!write(String::format<256>("%zu/%zu %s", ++idx, all.size(), ch))) {
                             failed = true;
-                    }
-                };
-                if (!fileId) {
-                    Set<uint32_t> all = proj->dependencies(0, Project::All);
-                    all.remove([](uint32_t file) { return Location::path(file).isSystem(); });
-                    size_t idx = 0;
-                    const Path projectPath = proj->path();
-                    for (uint32_t file : proj->dependencies(0, Project::All)) {
-                        if (raw) {
-                            Path p = Location::path(file);
-                            const char *ch = p.constData();
-                            if (!(queryFlags() & QueryMessage::AbsolutePath) && p.startsWith(projectPath))
-                                ch += projectPath.size();
-                            if (!write(String::format<256>("%zu/%zu %s", ++idx, all.size(), ch))) {
-                                failed = true;
-                                break;
-                            }
-                        }
-                        process(file);
-                        if (failed)
                             break;
+                        }
                     }
-                } else {
-                    process(fileId);
+                    process(file);
+                    if (failed || isAborted())
+                        break;
                 }
-                return 0;
+            } else {
+                process(fileId);
             }
-        } job(query, project);
-        job.run(conn);
-    }
-    conn->finish();
+            return 0;
+        }
+    };
+
+    const uint32_t fileId = Location::fileId(query->query());
+    if (fileId)
+        prepareCompletion(query, fileId, project);
+    startQueryJob(std::make_shared<DeadFunctionsJob>(query, project), conn);
 }
 
 void Server::sendDiagnostics(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -1793,7 +2422,7 @@ void Server::sources(const std::shared_ptr<QueryMessage> &query, const std::shar
     auto format = [flagsOnly, splitLine, pwd](const Source &source) {
         String ret;
         if (pwd)
-            ret += "pwd: " + source.directory + "\n";
+            ret += "pwd: " + *source.directory + "\n";
         if (flagsOnly) {
             const Flags<Source::CommandLineFlag> flags = (Source::Default
                                                           |Source::ExcludeDefaultArguments
@@ -2067,8 +2696,7 @@ void Server::classHierarchy(const std::shared_ptr<QueryMessage> &query, const st
         return;
     }
 
-    ClassHierarchyJob job(loc, query, project);
-    conn->finish(job.run(conn));
+    startQueryJob(std::make_shared<ClassHierarchyJob>(loc, query, project), conn);
 }
 
 void Server::debugLocations(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -2104,26 +2732,14 @@ void Server::tokens(const std::shared_ptr<QueryMessage> &query, const std::share
         return;
     }
 
-    std::shared_ptr<Project> project;
-    if (currentProject() && currentProject()->isIndexed(fileId)) {
-        project = currentProject();
-    } else {
-        for (const auto &p : mProjects) {
-            if (p.second->isIndexed(fileId)) {
-                project = p.second;
-                setCurrentProject(project);
-                break;
-            }
-        }
-    }
+    std::shared_ptr<Project> project = projectForFileId(fileId);
     if (!project) {
         conn->write<256>("%s is not indexed", query->query().constData());
         conn->finish();
         return;
     }
 
-    TokensJob job(query, fileId, from, to, project);
-    conn->finish(job.run(conn));
+    startQueryJob(std::make_shared<TokensJob>(query, fileId, from, to, project), conn);
 }
 
 void Server::validate(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn)
@@ -2145,17 +2761,41 @@ void Server::validate(const std::shared_ptr<QueryMessage> &query, const std::sha
 void Server::handleVisitFileMessage(const std::shared_ptr<VisitFileMessage> &message, const std::shared_ptr<Connection> &conn)
 {
     uint32_t fileId = 0;
-    bool visit = false;
+    const bool visit = visitFile(*message, &fileId);
+    VisitFileResponseMessage msg(fileId, visit);
+    conn->send(msg);
+}
 
-    std::shared_ptr<Project> project = mProjects.value(message->project());
-    const uint32_t id = message->sourceFileId();
+bool Server::visitFile(const VisitFileMessage &message, uint32_t *fileId)
+{
+    *fileId = 0;
+    std::shared_ptr<Project> project;
+    {
+        std::lock_guard<std::mutex> lock(mProjectsMutex);
+        project = mProjects.value(message.project());
+    }
+    bool visit = false;
+    const uint32_t id = message.sourceFileId();
     if (project && project->isActiveJob(id)) {
-        assert(message->file() == message->file().resolved());
-        fileId = Location::insertFile(message->file());
-        visit = project->visitFile(fileId, id);
+        assert(message.file() == message.file().resolved());
+        *fileId = Location::insertFile(message.file());
+        visit = project->visitFile(*fileId, id);
     }
-    VisitFileResponseMessage msg(fileId, visit);
-    conn->send(msg);
+
+    if (project && !EventLoop::isMainThread()) {
+        // Projects are destroyed on the main thread. Ours can only be the
+        // last reference if the project was removed in the meantime.
+        std::lock_guard<std::mutex> lock(mProjectsMutex);
+        if (mProjects.value(message.project()) != project)
+            EventLoop::mainEventLoop()->callLater([project]() {});
+        project.reset();
+    }
+    return visit;
+}
+
+Path Server::visitFileSocketFile() const
+{
+    return mVisitFileThread ? mVisitFileThread->socketFile() : Path();
 }
 
 bool Server::load()
@@ -2188,6 +2828,8 @@ bool Server::load()
         // SBROOT
         Hash<Path, uint32_t> pathsToIds;
         fileIdsFile >> pathsToIds;
+        mFileIdsSnapshotEntries = pathsToIds.size();
+        mFileIdsJournalEntries = replayFileIdsJournal(mOptions.dataDir + "fileids.journal", pathsToIds, true);
 
         Sandbox::decode(pathsToIds);
 
@@ -2196,6 +2838,8 @@ bool Server::load()
             clearProjects(Clear_All);
             return true;
         }
+        if (mFileIdsJournalEntries > std::max<size_t>(FileIdsJournalMinEntries, mFileIdsSnapshotEntries))
+            compactFileIds();
         List<Path> projects = mOptions.dataDir.files(Path::Directory);
         for (size_t i=0; i<projects.size(); ++i) {
             const Path &file = projects.at(i);
@@ -2219,7 +2863,7 @@ bool Server::load()
                                   file.constData());
                             remove = true;
                         } else {
-                            addProject(filePath.ensureTrailingSlash());
+                            addProject(filePath.ensureTrailingSlash(), !(mOptions.options & LazyProjects));
                         }
                     } else {
                         remove = true;
@@ -2278,10 +2922,65 @@ bool Server::load()
 
 bool Server::saveFileIds()
 {
-    const uint32_t lastId = Location::lastId();
-    if (mLastFileId == lastId)
+    if (!EventLoop::isMainThread()) {
+        // Location::insertFile from one of the loadCompileCommands threads
+        EventLoop::mainEventLoop()->callLater([this]() { saveFileIds(); });
         return true;
-    DataFile fileIdsFile(mOptions.dataDir + "fileids", RTags::DatabaseVersion);
+    }
+    const Path journal = mOptions.dataDir + "fileids.journal";
+    if (!mFileIdsJournal && !(mOptions.dataDir + "fileids").isFile())
+        return compactFileIds();
+
+    const List<uint32_t> inserted = Location::takeInserted();
+    if (inserted.isEmpty())
+        return true;
+    if (mFileIdsJournalEntries + inserted.size() > std::max<size_t>(FileIdsJournalMinEntries, mFileIdsSnapshotEntries))
+        return compactFileIds();
+
+    if (!mFileIdsJournal) {
+        const bool created = !journal.isFile();
+        mFileIdsJournal = fopen(journal.constData(), "a");
+        if (!mFileIdsJournal) {
+            error("Can't open %s: %s", journal.constData(), Rct::strerror().constData());
+            return false;
+        }
+        if (created) {
+            const uint32_t header[] = { FileIdsJournalMagic, static_cast<uint32_t>(RTags::DatabaseVersion) };
+            fwrite(header, sizeof(header), 1, mFileIdsJournal);
+        }
+    }
+
+    String records;
+    size_t count = 0;
+    for (uint32_t id : inserted) {
+        const Path &original = Location::path(id);
+        if (original.isEmpty()) // cleared since
+            continue;
+        const Path path = Sandbox::encoded(original);
+        ++count;
+        const uint32_t size = path.size();
+        const uint32_t checksum = static_cast<uint32_t>(RTags::contentHash(path, id));
+        records.append(reinterpret_cast<const char *>(&id), sizeof(id));
+        records.append(reinterpret_cast<const char *>(&size), sizeof(size));
+        records.append(path);
+        records.append(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+    }
+    if (fwrite(records.constData(), records.size(), 1, mFileIdsJournal) != 1 || fflush(mFileIdsJournal)) {
+        error("Can't save file ids to %s: %s", journal.constData(), Rct::strerror().constData());
+        // a torn record is dropped on load, start over with a fresh snapshot
+        return compactFileIds();
+    }
+    mFileIdsJournalEntries += count;
+    return true;
+}
+
+bool Server::compactFileIds()
+{
+    Location::takeInserted(); // pathsToIds() below has all of them
+    const Path fileIds = mOptions.dataDir + "fileids";
+    const Path tmp = fileIds + ".tmp";
+    Path::mkdir(mOptions.dataDir, Path::Recursive);
+    DataFile fileIdsFile(tmp, RTags::DatabaseVersion);
     if (!fileIdsFile.open(DataFile::Write)) {
         error("Can't save file ids: %s", fileIdsFile.error().constData());
         return false;
@@ -2295,14 +2994,22 @@ bool Server::saveFileIds()
         flags |= HasRealPath;
     }
 
-    fileIdsFile << flags << Sandbox::encoded(Location::pathsToIds());
+    const Hash<Path, uint32_t> pathsToIds = Location::pathsToIds();
+    fileIdsFile << flags << Sandbox::encoded(pathsToIds);
 
-    if (!fileIdsFile.flush()) {
+    if (!fileIdsFile.flush() || rename(tmp.constData(), fileIds.constData())) {
         error("Can't save file ids: %s", fileIdsFile.error().constData());
+        Path::rm(tmp);
         return false;
     }
 
-    mLastFileId = lastId;
+    if (mFileIdsJournal) {
+        fclose(mFileIdsJournal);
+        mFileIdsJournal = nullptr;
+    }
+    Path::rm(mOptions.dataDir + "fileids.journal");
+    mFileIdsSnapshotEntries = pathsToIds.size();
+    mFileIdsJournalEntries = 0;
     return true;
 }
 
@@ -2393,6 +3100,11 @@ void Server::codeCompleteAt(const std::shared_ptr<QueryMessage> &query, const st
 void Server::dumpJobs(const std::shared_ptr<Connection> &conn)
 {
     mJobScheduler->dumpJobs(conn);
+    if (mVisitFileThread) {
+        const VisitFileThread::Stats stats = mVisitFileThread->stats();
+        conn->write<1024>("VisitFileThread: %zu answered on %s, %lluus busy",
+                          stats.requests, mVisitFileThread->socketFile().constData(), stats.busy);
+    }
 }
 
 void Server::dumpDaemons(const std::shared_ptr<Connection> &conn)
@@ -2429,6 +3141,58 @@ private:
     const Path mWorkingDirectory;
 };
 
+bool Server::runIndexOnly()
+{
+    assert(!mOptions.indexOnly.isEmpty());
+    StopWatch sw;
+    IndexParseData data;
+    SourceCache cache;
+    if (!loadCompileCommands(data, mOptions.indexOnly, mEnvironment, &cache)) {
+        error() << "Failed to load" << mOptions.indexOnly;
+        return false;
+    }
+    size_t sourceCount = 0;
+    for (const auto &commands : data.compileCommands)
+        sourceCount += commands.second.sources.size();
+    const int loadTime = sw.restart();
+
+    std::shared_ptr<Project> project = addProject(data.project.ensureTrailingSlash());
+    if (!project) {
+        error() << "Failed to create project" << data.project;
+        return false;
+    }
+    setCurrentProject(project);
+    project->processParseData(std::move(data));
+
+    // jobs that crash are retried on a timer so poll rather than waiting for the last IndexDataMessage
+    auto done = [this, project]() {
+        return !project->isIndexing() && !mJobScheduler->pendingJobCount() && !mJobScheduler->activeJobCount();
+    };
+    if (!done()) {
+        const int timer = EventLoop::eventLoop()->registerTimer([done](int) {
+                if (done())
+                    EventLoop::eventLoop()->quit();
+            }, 250);
+        EventLoop::eventLoop()->exec();
+        EventLoop::eventLoop()->unregisterTimer(timer);
+    }
+    const int indexTime = sw.elapsed();
+
+    const bool ret = project->save() && saveFileIds();
+    const double seconds = std::max(1, indexTime) / 1000.0;
+    // the paths can be arbitrarily long, keep them out of the fixed size buffers
+    String report = String::format<128>("Indexed %zu sources (%zu files, %zumb written) from ",
+                                        sourceCount, project->visitedFiles().size(),
+                                        project->bytesWritten() / (1024 * 1024));
+    report += mOptions.indexOnly + " into " + mOptions.dataDir;
+    report += String::format<256>(" in %.2fs (+%.2fs loading) with %zu jobs. %.2f sources/s, %.2fmb/s%s",
+                                  seconds, loadTime / 1000.0, mOptions.jobCount,
+                                  sourceCount / seconds, (project->bytesWritten() / (1024.0 * 1024.0)) / seconds,
+                                  ret ? "" : ". Failed to save project");
+    Log(LogLevel::Error, LogOutput::StdOut|LogOutput::TrailingNewLine) << report;
+    return ret;
+}
+
 bool Server::runTests()
 {
     assert(!mOptions.tests.isEmpty());
@@ -2616,6 +3380,36 @@ void Server::sourceFileModified(const std::shared_ptr<Project> &project, uint32_
     }
 }
 
+void Server::startQueryJob(const std::shared_ptr<QueryJob> &job, const std::shared_ptr<Connection> &conn)
+{
+    // Queries that read through the project's file maps can take a while,
+    // run them on the pool so the main thread keeps serving rp and
+    // completions. The ones that poke at mutable project state
+    // (dependencies, files, status) still run synchronously.
+    if (!mQueryPool)
+        mQueryPool = new ThreadPool(std::max(2, ThreadPool::idealThreadCount()));
+    if (std::shared_ptr<Project> project = job->project())
+        project->touch();
+    List<std::weak_ptr<QueryJob> > &queries = mQueries[conn.get()];
+    for (auto it = queries.begin(); it != queries.end(); ) {
+        if (it->expired()) {
+            it = queries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    queries.append(job);
+    QueryJob::start(mQueryPool, job, conn);
+}
+
+ThreadPool *Server::backgroundPool() const
+{
+    std::lock_guard<std::mutex> lock(mBackgroundPoolMutex);
+    if (!mBackgroundPool)
+        mBackgroundPool = new ThreadPool(std::max(2, ThreadPool::idealThreadCount()));
+    return mBackgroundPool;
+}
+
 void Server::prepareCompletion(const std::shared_ptr<QueryMessage> &query, uint32_t fileId, const std::shared_ptr<Project> &project)
 {
     if (query->flags() & QueryMessage::CodeCompletionEnabled && !mCompletionThread) {
@@ -2642,23 +3436,26 @@ void Server::prepareCompletion(const std::shared_ptr<QueryMessage> &query, uint3
 
 void Server::filterBlockedArguments(Source &source)
 {
+    if (mOptions.blockedArguments.isEmpty())
+        return;
+    List<String> &arguments = source.arguments.write();
     for (const String &blocked : mOptions.blockedArguments) {
         if (blocked.endsWith("=")) {
             size_t i = 0;
-            while (i<source.arguments.size()) {
-                if (source.arguments.at(i).startsWith(blocked)) {
-                    // error() << "Removing" << source.arguments.at(i);
-                    source.arguments.remove(i, 1);
-                } else if (!strncmp(blocked.constData(), source.arguments.at(i).constData(), blocked.size() - 1)) {
-                    const size_t count = (i + 1 < source.arguments.size()) ? 2 : 1;
-                    // error() << "Removing" << source.arguments.mid(i, count);
-                    source.arguments.remove(i, count);
+            while (i<arguments.size()) {
+                if (arguments.at(i).startsWith(blocked)) {
+                    // error() << "Removing" << arguments.at(i);
+                    arguments.remove(i, 1);
+                } else if (!strncmp(blocked.constData(), arguments.at(i).constData(), blocked.size() - 1)) {
+                    const size_t count = (i + 1 < arguments.size()) ? 2 : 1;
+                    // error() << "Removing" << arguments.mid(i, count);
+                    arguments.remove(i, count);
                 } else {
                     ++i;
                 }
             }
         } else {
-            source.arguments.remove(blocked);
+            arguments.remove(blocked);
         }
     }
 }
@@ -16,6 +16,9 @@
 #ifndef Server_h
 #define Server_h
 
+#include <mutex>
+
+#include "CompileCommandsReader.h"
 #include "IndexMessage.h"
 #include "rct/Flags.h"
 #include "rct/Hash.h"
@@ -33,6 +36,7 @@
 #endif
 #endif
 
+class ArgTransformer;
 class Match;
 class CompletionThread;
 class Connection;
@@ -44,7 +48,9 @@ class OutputMessage;
 class Project;
 class QueryMessage;
 class VisitFileMessage;
+class VisitFileThread;
 class JobScheduler;
+class ThreadPool;
 class IndexParseData;
 class Server
 {
@@ -87,7 +93,9 @@ public:
         Separate32BitAnd64Bit = (1ull << 31),
         SourceIgnoreIncludePathDifferencesInUsr = (1ull << 32),
         NoLibClangIncludePath = (1ull << 33),
-        CompletionDiagnostics = (1ull << 34)
+        CompletionDiagnostics = (1ull << 34),
+        SharedPreambles = (1ull << 35),
+        LazyProjects = (1ull << 36)
     };
     struct Options {
         Options()
@@ -96,7 +104,7 @@ public:
               rpConnectAttempts(0), rpNiceValue(0), maxCrashCount(0),
               completionCacheSize(0), testTimeout(60 * 1000 * 5),
               maxFileMapScopeCacheSize(512), pollTimer(0), maxSocketWriteBufferSize(0),
-              daemonCount(0), tcpPort(0)
+              daemonCount(0), projectUnloadTimeout(0), maxWatches(0), argTransformJobs(0), tcpPort(0)
         {
         }
 
@@ -106,27 +114,39 @@ public:
         int rpVisitFileTimeout, rpIndexDataMessageTimeout,
             rpConnectTimeout, rpConnectAttempts, rpNiceValue, maxCrashCount,
             completionCacheSize, testTimeout, maxFileMapScopeCacheSize, errorLimit,
-            pollTimer, maxSocketWriteBufferSize, daemonCount;
+            pollTimer, maxSocketWriteBufferSize, daemonCount, projectUnloadTimeout, maxWatches;
+        size_t argTransformJobs;
         uint16_t tcpPort;
+        String workerSecret;
         List<String> defaultArguments, excludeFilters;
         Set<String> blockedArguments;
         List<Source::Include> includePaths;
         Set<Source::Define> defines;
         List<Path> tests;
+        Path indexOnly;
         Set<Path> ignoredCompilers;
         Set<String> compilerWrappers;
         List<String> debugLocations;
     };
     bool init(const Options &options);
     bool runTests();
+    bool runIndexOnly();
     const Options &options() const { return mOptions; }
     bool suspended() const { return mSuspended; }
     std::shared_ptr<Project> project(const Path &path) const { return mProjects.value(path); }
+    // Answers a VisitFileMessage from rp, returns whether it should index
+    // the file. Safe to call from any thread.
+    bool visitFile(const VisitFileMessage &message, uint32_t *fileId);
+    // where rp sends VisitFileMessages, empty if they go to socketFile
+    Path visitFileSocketFile() const;
     bool shouldIndex(const Source &source, const Path &project) const;
     void stopServers();
     void dumpJobs(const std::shared_ptr<Connection> &conn);
     void dumpDaemons(const std::shared_ptr<Connection> &conn);
     std::shared_ptr<JobScheduler> jobScheduler() const { return mJobScheduler; }
+    // for maintenance work that shouldn't block the main thread, joined
+    // before the projects go away
+    ThreadPool *backgroundPool() const;
     enum ActiveBufferType {
         Inactive,
         Active,
@@ -152,11 +172,26 @@ public:
     void onNewMessage(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn);
     bool saveFileIds();
     bool loadCompileCommands(IndexParseData &data, const Path &compileCommands, const List<String> &environment, SourceCache *cache) const;
+    // readCompileCommands may run on any thread, the sources are matched to
+    // the loaded projects by loadCompileCommands on the main thread
+    struct ParsedCompileCommands;
+    std::shared_ptr<ParsedCompileCommands> readCompileCommands(IndexParseData &data, const Path &compileCommands,
+                                                               const List<String> &environment, SourceCache *cache) const;
+    bool loadCompileCommands(IndexParseData &data, const std::shared_ptr<ParsedCompileCommands> &parsed, SourceCache *cache) const;
+    // adds the result of an IndexMessage to its project, on the main thread
+    void finishIndexMessage(IndexParseData &&data, const std::shared_ptr<Connection> &conn, bool ret);
+    // data.compileCommands[compileCommandsFileId] must exist, sources and
+    // entry hashes for every command returned by next are added to it
+    bool parseCompileCommands(IndexParseData &data,
+                              uint32_t compileCommandsFileId,
+                              const std::function<bool(CompileCommandsReader::Command &)> &next,
+                              SourceCache *cache) const;
     bool parse(IndexParseData &data,
                String &&arguments,
                const Path &pwd,
                uint32_t compileCommandsFileId = 0,
-               SourceCache *cache = nullptr) const;
+               SourceCache *cache = nullptr,
+               SourceList *parsed = nullptr) const;
     enum FileIdsFileFlag {
         None = 0x0,
         HasSandboxRoot = 0x1,
@@ -168,8 +203,23 @@ public:
     void sourceFileModified(const std::shared_ptr<Project> &project, uint32_t fileId);
 private:
     String guessArguments(const String &args, const Path &pwd, const Path &projectRootOverride) const;
+    std::shared_ptr<ParsedCompileCommands> readCompileCommands(const IndexParseData &data,
+                                                               uint32_t compileCommandsFileId,
+                                                               const std::function<bool(CompileCommandsReader::Command &)> &next,
+                                                               SourceCache *cache) const;
+    bool addCompileCommands(IndexParseData &data, const std::shared_ptr<ParsedCompileCommands> &parsed, SourceCache *cache) const;
+    bool transformArguments(String &arguments) const;
+    bool addSources(IndexParseData &data,
+                    SourceList &&sources,
+                    const List<Path> &unresolvedPaths,
+                    const Path &pwd,
+                    uint32_t compileCommandsFileId,
+                    SourceCache *cache) const;
     bool load();
+    // rewrites fileids from Location and empties fileids.journal
+    bool compactFileIds();
     void onNewConnection(SocketServer *server);
+    bool authenticate(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &connection);
     void setCurrentProject(const std::shared_ptr<Project> &project);
     enum ClearMode {
         Clear_All,
@@ -199,6 +249,7 @@ private:
     void fixIts(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void followLocation(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void hasFileManager(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
+    void importIndex(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void includeFile(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void isIndexed(const std::shared_ptr<QueryMessage> &query, const std::shared_ptr<Connection> &conn);
     void isIndexing(const std::shared_ptr<QueryMessage> &, const std::shared_ptr<Connection> &conn);
@@ -226,14 +277,20 @@ private:
 
     std::shared_ptr<Project> projectForQuery(const std::shared_ptr<QueryMessage> &queryMessage);
     std::shared_ptr<Project> projectForMatches(const List<Match> &matches);
-    std::shared_ptr<Project> addProject(const Path &path);
+    std::shared_ptr<Project> projectForFileId(uint32_t fileId);
+    // With load false the project is only registered, see --lazy-projects
+    std::shared_ptr<Project> addProject(const Path &path, bool load = true);
+    void unloadIdleProjects();
 
     bool initServers();
     void removeSocketFile();
     void prepareCompletion(const std::shared_ptr<QueryMessage> &query, uint32_t fileId, const std::shared_ptr<Project> &project);
+    // runs job on mQueryPool, finishes conn when done
+    void startQueryJob(const std::shared_ptr<QueryJob> &job, const std::shared_ptr<Connection> &conn);
 
     typedef Hash<Path, std::shared_ptr<Project> > ProjectsMap;
-    ProjectsMap mProjects;
+    ProjectsMap mProjects; // changed on the main thread with mProjectsMutex held
+    mutable std::mutex mProjectsMutex;
     std::weak_ptr<Project> mCurrentProject;
 
     static Server *sInstance;
@@ -242,13 +299,22 @@ private:
     std::shared_ptr<SocketServer> mUnixServer, mTcpServer;
     List<String> mEnvironment;
 
-    int mPollTimer, mExitCode;
-    uint32_t mLastFileId;
+    int mPollTimer, mUnloadTimer, mExitCode;
+    FILE *mFileIdsJournal;
+    size_t mFileIdsJournalEntries, mFileIdsSnapshotEntries;
     std::shared_ptr<JobScheduler> mJobScheduler;
+    std::shared_ptr<ArgTransformer> mArgTransformer;
     CompletionThread *mCompletionThread;
+    VisitFileThread *mVisitFileThread;
+    ThreadPool *mQueryPool;
+    mutable ThreadPool *mBackgroundPool; // created on first use with mBackgroundPoolMutex held
+    mutable std::mutex mBackgroundPoolMutex;
     bool mActiveBuffersSet;
     Hash<uint32_t, ActiveBufferType> mActiveBuffers;
     Set<std::shared_ptr<Connection> > mConnections;
+    Set<Connection *> mUntrustedConnections; // tcp connections that haven't presented the worker secret
+    // queries running on mQueryPool, aborted when their connection goes away
+    Hash<Connection *, List<std::weak_ptr<QueryJob> > > mQueries;
 
     Signal<std::function<void()> > mIndexDataMessageReceived;
     size_t mDefaultJobCount { 0 };
@@ -21,6 +21,44 @@
 #include "RTags.h"
 #include "Server.h"
 
+template <> uint64_t Interned<Set<Source::Define> >::hash(const Set<Source::Define> &defines)
+{
+    uint64_t ret = RTags::ContentHashSeed;
+    for (const Source::Define &def : defines) {
+        ret = RTags::contentHash(def.define, ret);
+        ret = RTags::contentHash("=", 1, ret);
+        ret = RTags::contentHash(def.value, ret);
+        ret = RTags::contentHash(def.flags & Source::Define::NoValue ? "\1" : "", 1, ret);
+    }
+    return ret;
+}
+
+template <> uint64_t Interned<List<Source::Include> >::hash(const List<Source::Include> &includePaths)
+{
+    uint64_t ret = RTags::ContentHashSeed;
+    for (const Source::Include &inc : includePaths) {
+        const char type = static_cast<char>(inc.type);
+        ret = RTags::contentHash(&type, 1, ret);
+        ret = RTags::contentHash(inc.path, ret);
+    }
+    return ret;
+}
+
+template <> uint64_t Interned<List<String> >::hash(const List<String> &arguments)
+{
+    uint64_t ret = RTags::ContentHashSeed;
+    for (const String &arg : arguments) {
+        ret = RTags::contentHash(arg, ret);
+        ret = RTags::contentHash("", 1, ret);
+    }
+    return ret;
+}
+
+template <> uint64_t Interned<Path>::hash(const Path &path)
+{
+    return RTags::contentHash(path);
+}
+
 void Source::clear()
 {
     fileId = compilerId = buildRootId = compileCommandsFileId = 0;
@@ -288,11 +326,15 @@ static inline bool isCompiler(const Path &fullPath, const List<String> &environm
         return false;
 
     static Hash<Path, bool> sCache;
-
-    bool ok;
-    bool ret = sCache.value(fullPath, false, &ok);
-    if (ok)
-        return ret;
+    static std::mutex sMutex;
+
+    {
+        std::lock_guard<std::mutex> lock(sMutex);
+        bool ok;
+        const bool ret = sCache.value(fullPath, false, &ok);
+        if (ok)
+            return ret;
+    }
 
     char path[PATH_MAX];
     strcpy(path, "/tmp/rtags-compiler-check-XXXXXX");
@@ -324,7 +366,10 @@ static inline bool isCompiler(const Path &fullPath, const List<String> &environm
                   << "\nstdout:\n" << proc.readAllStdOut();
     }
     assert(proc.isFinished());
-    sCache[fullPath] = !proc.returnCode();
+    {
+        std::lock_guard<std::mutex> lock(sMutex);
+        sCache[fullPath] = !proc.returnCode();
+    }
     unlink(path);
     unlink(out.constData());
     return !proc.returnCode();
@@ -336,8 +381,11 @@ static std::pair<Path, bool> resolveCompiler(const Path &unresolved,
                                              const List<Path> &pathEnvironment,
                                              SourceCache *cache)
 {
-    std::pair<Path, bool> dummy;
-    auto &compiler = cache ? cache->compilerCache[unresolved] : dummy;
+    std::pair<Path, bool> compiler;
+    if (cache) {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        compiler = cache->compilerCache.value(unresolved);
+    }
     if (compiler.first.isEmpty()) {
         bool wrapper = false;
         // error() << "Coming in with" << unresolved << cwd << pathEnvironment;
@@ -380,6 +428,10 @@ static std::pair<Path, bool> resolveCompiler(const Path &unresolved,
                 compiler.first.canonicalize();
             compiler.second = wrapper || isCompiler(compiler.first, environment);
         }
+        if (cache) {
+            std::lock_guard<std::mutex> lock(cache->mutex);
+            cache->compilerCache[unresolved] = compiler;
+        }
     }
 
     return compiler;
@@ -439,6 +491,16 @@ SourceList Source::parse(const String &cmdLine,
                          const List<String> &environment,
                          List<Path> *unresolvedInputLocations,
                          SourceCache *cache)
+{
+    debug() << "Source::parse (" << cmdLine << ")";
+    return parse(splitCommandLine(cmdLine), cwd, environment, unresolvedInputLocations, cache);
+}
+
+SourceList Source::parse(List<String> &&split,
+                         const Path &cwd,
+                         const List<String> &environment,
+                         List<Path> *unresolvedInputLocations,
+                         SourceCache *cache)
 {
     List<Path> pathEnvironment;
     for (const String &env : environment) {
@@ -449,11 +511,10 @@ SourceList Source::parse(const String &cmdLine,
     }
     assert(cwd.endsWith('/'));
     assert(!unresolvedInputLocations || unresolvedInputLocations->isEmpty());
-    List<String> split = splitCommandLine(cmdLine);
     if (split.isEmpty())
         return SourceList();
 
-    debug() << "Source::parse (" << cmdLine << ") => " << split << cwd;
+    debug() << "Source::parse" << split << cwd;
     size_t idx = 0;
     if (split.size() > 1 && (split.at(0).endsWith("/ccache") || split.at(0) == "ccache"))
         ++idx;
@@ -496,7 +557,7 @@ SourceList Source::parse(const String &cmdLine,
     }
 
     if (split.isEmpty()) {
-        warning() << "Source::parse No args" << cmdLine;
+        warning() << "Source::parse No args";
         return SourceList();
     }
 
@@ -508,7 +569,7 @@ SourceList Source::parse(const String &cmdLine,
         path = cwd;
     }
     if (split.isEmpty()) {
-        warning() << "Source::parse No args" << cmdLine;
+        warning() << "Source::parse No args";
         return SourceList();
     }
 
@@ -562,7 +623,7 @@ SourceList Source::parse(const String &cmdLine,
         // ### is this even right?
         if (arg.size() > 1 && arg.startsWith('-')) {
             if (arg == "-E") {
-                warning() << "Preprocessing, ignore" << cmdLine;
+                warning() << "Preprocessing, ignore" << split;
                 return SourceList();
             } else if (arg.startsWith("-x")) {
                 String a;
@@ -754,7 +815,7 @@ SourceList Source::parse(const String &cmdLine,
     }
 
     if (inputs.isEmpty()) {
-        warning() << "Source::parse No file for" << cmdLine;
+        warning() << "Source::parse No file for" << split;
         return SourceList();
     }
 
@@ -768,22 +829,27 @@ SourceList Source::parse(const String &cmdLine,
         Flags<Server::Option> serverFlags = Server::instance() ? Server::instance()->options().options : NullFlags;
         includePathHash = ::hashIncludePaths(includePaths, buildRoot, serverFlags);
 
+        // all sources of this command line share these
+        const Interned<Path> internedDirectory(path);
+        const Interned<Set<Source::Define> > internedDefines(std::move(defines));
+        const Interned<List<Source::Include> > internedIncludePaths(std::move(includePaths));
+        const Interned<List<String> > internedArguments(std::move(arguments));
         ret.reserve(inputs.size());
         for (const auto& input : inputs) {
             unresolvedInputLocations->append(input.absolute);
             if (input.unmolested == "-")
                 continue;
             Source source;
-            source.directory = path;
+            source.directory = internedDirectory;
             source.fileId = Location::insertFile(input.realPath);
             source.extraCompiler = extraCompiler;
             source.compilerId = compilerId;
             source.buildRootId = buildRootId;
             source.includePathHash = includePathHash;
             source.flags = sourceFlags;
-            source.defines = defines;
-            source.includePaths = includePaths;
-            source.arguments = arguments;
+            source.defines = internedDefines;
+            source.includePaths = internedIncludePaths;
+            source.arguments = internedArguments;
             source.outputFilename = outputFilename;
             source.language = input.language;
             assert(source.language != NoLanguage);
@@ -864,15 +930,15 @@ bool Source::compareArguments(const Source &other) const
             warning() << "defines are different 1";
             return false;
         }
-    } else if (!compareDefinesNoNDEBUG(defines, other.defines)) {
+    } else if (!defines.isShared(other.defines) && !compareDefinesNoNDEBUG(*defines, *other.defines)) {
         warning() << "defines are different 2";
         return false;
     }
 
-    auto me = arguments.begin();
-    const auto myEnd = arguments.end();
-    auto him = other.arguments.begin();
-    const auto hisEnd = other.arguments.end();
+    auto me = arguments->begin();
+    const auto myEnd = arguments->end();
+    auto him = other.arguments->begin();
+    const auto hisEnd = other.arguments->end();
 
     while (me != him) {
         if (!nextArg(me, myEnd, serverFlags))
@@ -929,8 +995,8 @@ List<String> Source::toCommandLine(Flags<CommandLineFlag> f, bool *usedPch) cons
             ret.append(arg);
     }
 
-    for (size_t i=0; i<arguments.size(); ++i) {
-        const String &arg = arguments.at(i);
+    for (size_t i=0; i<arguments->size(); ++i) {
+        const String &arg = arguments->at(i);
         const bool hasValue = ::hasValue(arg);
         bool skip = false;
         if (f & FilterBlacklist && isBlacklisted(arg)) {
@@ -941,24 +1007,24 @@ List<String> Source::toCommandLine(Flags<CommandLineFlag> f, bool *usedPch) cons
         if (!skip) {
             ret.append(arg);
             if (hasValue)
-                ret.append(arguments.value(++i));
+                ret.append(arguments->value(++i));
         } else if (hasValue) {
             ++i;
         }
     }
 
     if (f & IncludeDefines) {
-        for (const auto &def : defines)
+        for (const auto &def : *defines)
             ret += def.toString(f);
         if (!(f & ExcludeDefaultDefines)) {
             assert(server);
             for (const auto &def : server->options().defines)
-                if (!defines.contains(def))
+                if (!defines->contains(def))
                     ret += def.toString(f);
         }
     }
     if (f & IncludeIncludePaths) {
-        for (const auto &inc : includePaths) {
+        for (const auto &inc : *includePaths) {
             switch (inc.type) {
             case Include::Type_None: assert(0 && "Impossible impossibility"); break;
 #define DECLARE_INCLUDE_TYPE(type, argument, space)                 \
@@ -1024,12 +1090,12 @@ void Source::encode(Serializer &s, EncodeMode mode) const
           << compileCommands() << compileCommandsFileId
           << static_cast<uint8_t>(language) << flags << defines;
 
-        auto incPaths = includePaths;
+        List<Include> incPaths = *includePaths;
         for (auto &inc : incPaths)
             Sandbox::encode(inc.path);
 
-        s << incPaths << Sandbox::encoded(arguments)
-          << Sandbox::encoded(directory) << includePathHash;
+        s << incPaths << Sandbox::encoded(*arguments)
+          << Sandbox::encoded(*directory) << includePathHash;
     } else {
         s << sourceFile() << fileId << compiler() << compilerId
           << extraCompiler << buildRoot() << buildRootId
@@ -1056,10 +1122,13 @@ void Source::decode(Deserializer &s, EncodeMode mode)
         Sandbox::decode(compileCommands);
         Sandbox::decode(compiler);
         Sandbox::decode(extraCompiler);
-        Sandbox::decode(directory);
-        for (auto &inc : includePaths)
+        Sandbox::decode(directory.write());
+        for (auto &inc : includePaths.write())
             Sandbox::decode(inc.path);
-        Sandbox::decode(arguments);
+        Sandbox::decode(arguments.write());
+        directory.intern();
+        includePaths.intern();
+        arguments.intern();
     }
 
     assert(fileId);
@@ -18,6 +18,7 @@
 
 #include <cstdint>
 
+#include "Interned.h"
 #include "Location.h"
 #include "rct/Flags.h"
 #include "rct/List.h"
@@ -99,7 +100,7 @@ struct Source
         }
     };
 
-    Set<Define> defines;
+    Interned<Set<Define> > defines;
     struct Include {
         enum Type {
             Type_None
@@ -139,10 +140,11 @@ struct Source
         inline bool operator<(const Include &other) const { return compare(other) < 0; }
         inline bool operator>(const Include &other) const { return compare(other) > 0; }
     };
-    List<Include> includePaths;
-    List<String> arguments;
+    // shared between sources with the same values, see Interned.h
+    Interned<List<Include> > includePaths;
+    Interned<List<String> > arguments;
     // int32_t sysRootIndex;
-    Path directory;
+    Interned<Path> directory;
     Path outputFilename;
 
     bool isValid() const { return fileId; }
@@ -171,6 +173,11 @@ struct Source
                             const List<String> &environment,
                             List<Path> *unresolvedInputLocation = nullptr,
                             SourceCache *cache = nullptr);
+    static SourceList parse(List<String> &&argv,
+                            const Path &pwd,
+                            const List<String> &environment,
+                            List<Path> *unresolvedInputLocation = nullptr,
+                            SourceCache *cache = nullptr);
     enum EncodeMode {
         IgnoreSandbox,
         EncodeSandbox
@@ -183,6 +190,11 @@ RCT_FLAGS(Source::Flag);
 RCT_FLAGS(Source::CommandLineFlag);
 RCT_FLAGS(Source::Define::Flag);
 
+template <> uint64_t Interned<Set<Source::Define> >::hash(const Set<Source::Define> &defines);
+template <> uint64_t Interned<List<Source::Include> >::hash(const List<Source::Include> &includePaths);
+template <> uint64_t Interned<List<String> >::hash(const List<String> &arguments);
+template <> uint64_t Interned<Path>::hash(const Path &path);
+
 inline Source::Source()
     : fileId(0), compilerId(0), buildRootId(0), includePathHash(0),
       language(NoLanguage)
@@ -242,16 +254,22 @@ inline int Source::compare(const Source &other) const
         return 1;
     }
 
-    if (int cmp = arguments.compare(other.arguments)) {
-        return cmp;
+    if (!arguments.isShared(other.arguments)) {
+        if (int cmp = arguments->compare(*other.arguments)) {
+            return cmp;
+        }
     }
 
-    if (int cmp = defines.compare(other.defines)) {
-        return cmp;
+    if (!defines.isShared(other.defines)) {
+        if (int cmp = defines->compare(*other.defines)) {
+            return cmp;
+        }
     }
 
-    if (int cmp = includePaths.compare(other.includePaths)) {
-        return cmp;
+    if (!includePaths.isShared(other.includePaths)) {
+        if (int cmp = includePaths->compare(*other.includePaths)) {
+            return cmp;
+        }
     }
 
     if (language < other.language) {
@@ -103,7 +103,6 @@ int StatusJob::execute()
         matched = true;
         if (!write(delimiter) || !write("watchedpaths") || !write(delimiter))
             return 1;
-        Hash<Path, Flags<Project::WatchMode> > watched = proj->watchedPaths();
         auto watchModeToString = [](Flags<Project::WatchMode> mode) {
             List<String> ret;
             if (mode & Project::Watch_FileManager)
@@ -116,22 +115,33 @@ int StatusJob::execute()
                 ret << "compilecommands";
             return String::join(ret, '|');
         };
-        for (const auto &it : watched) {
-            if (!write<256>("  %s (%s)", it.first.constData(), watchModeToString(it.second).constData())) {
-                return 1;
+        auto writeWatched = [this, &watchModeToString](const std::shared_ptr<Project> &project) {
+            const WatchManager &manager = project->watchManager();
+            const WatchManager::Stats stats = manager.stats();
+            const size_t total = stats.watched + stats.polled;
+            if (!write<256>("  %zu directories, %zu watched, %zu polled (%.1f%% coverage), %zu events (%zu from polling, %zu polled scans, last pass %llums)",
+                            total, stats.watched, stats.polled, total ? (100.0 * stats.watched / total) : 100.0,
+                            stats.events, stats.polledEvents, stats.scans, static_cast<unsigned long long>(stats.cycle))) {
+                return false;
             }
-        }
+            for (const auto &it : project->watchedPaths()) {
+                const WatchManager::DirectoryInfo info = manager.info(it.first);
+                if (!write<256>("  %s (%s) %s %zu hits", it.first.constData(), watchModeToString(it.second).constData(),
+                                info.polled ? "polled" : "watched", info.hits)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        if (!write<128>("  %zu of %zu watches in use", WatchManager::used(), WatchManager::budget()) || !writeWatched(proj))
+            return 1;
         for (auto p : Server::instance()->projects()) {
             if (p.second != proj) {
-                watched = p.second->watchedPaths();
-                if (watched.empty())
+                if (p.second->watchedPaths().empty())
                     continue;
                 write<256>("Project: %s", p.first.c_str());
-                for (const auto &it : watched) {
-                    if (!write<256>("  %s (%s)", it.first.constData(), watchModeToString(it.second).constData())) {
-                        return 1;
-                    }
-                }
+                if (!writeWatched(p.second))
+                    return 1;
             }
         }
     }
@@ -238,10 +248,10 @@ int StatusJob::execute()
             CompilerManager::applyToSource(source, CompilerManager::IncludeIncludePaths|CompilerManager::IncludeDefines);
             write(compiler);
             write("  Defines:");
-            for (const auto &it : source.defines)
+            for (const auto &it : *source.defines)
                 write<512>("    %s", it.toString().constData());
             write("  Includepaths:");
-            for (const auto &it : source.includePaths)
+            for (const auto &it : *source.includePaths)
                 write<512>("    %s", it.toString().constData());
             write(String());
         }
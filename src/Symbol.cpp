@@ -238,7 +238,7 @@ String Symbol::toString(const std::shared_ptr<Project> &project,
     }
 
     if (cursorInfoFlags & IncludeSourceCode && (endLine > startLine || (endLine == startLine && endColumn > startColumn))) {
-        const Path path = location.path();
+        const Path &path = location.path();
         String source = sourceCode(path, startLine, startColumn, endLine, endColumn);
         if (!source.isEmpty()) {
             ret.append(String::format<1024>("\nSource code: %s:%d:%d-%d:%d\n",
@@ -0,0 +1,111 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "SymbolNameIndex.h"
+
+enum { CompactThreshold = 65536 };
+
+SymbolNameIndex::SymbolNameIndex()
+    : mIndex(CompactThreshold)
+{
+}
+
+bool SymbolNameIndex::needsUpdate(uint32_t fileId, uint64_t *version) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mFiles.find(fileId);
+    if (it == mFiles.end()) {
+        *version = 0;
+        return true;
+    }
+    *version = it->second.version;
+    return !it->second.indexed;
+}
+
+void SymbolNameIndex::update(uint32_t fileId, uint64_t version, const List<String> &names)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    File &file = mFiles[fileId];
+    if (file.version != version)
+        return;
+    kill(file);
+    file.ids.reserve(names.size());
+    for (const String &name : names)
+        file.ids.append(mIndex.insert(name, Name { fileId, name }));
+    file.indexed = true;
+    compact();
+}
+
+void SymbolNameIndex::dirty(uint32_t fileId)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    File &file = mFiles[fileId];
+    ++file.version;
+    file.indexed = false;
+}
+
+void SymbolNameIndex::remove(uint32_t fileId)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mFiles.find(fileId);
+    if (it == mFiles.end())
+        return;
+    kill(it->second);
+    // keep the version so an update() that's already reading can't bring
+    // the file back
+    ++it->second.version;
+    it->second.indexed = false;
+    compact();
+}
+
+void SymbolNameIndex::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto &file : mFiles) {
+        file.second.ids.clear();
+        ++file.second.version;
+        file.second.indexed = false;
+    }
+    mIndex.clear();
+}
+
+size_t SymbolNameIndex::size() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mIndex.size();
+}
+
+void SymbolNameIndex::kill(File &file)
+{
+    for (uint32_t id : file.ids)
+        mIndex.remove(id);
+    file.ids.clear();
+}
+
+void SymbolNameIndex::compact()
+{
+    if (!mIndex.needsCompact())
+        return;
+    for (auto &file : mFiles)
+        file.second.ids.clear();
+    mIndex.compact([](const Name &name) { return name.name; },
+                   [this](const Name &name, uint32_t id) { mFiles[name.fileId].ids.append(id); });
+}
+
+bool SymbolNameIndex::candidates(const List<String> &literals, Hash<uint32_t, List<String> > &out) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mIndex.candidates(literals, [&out](const Name &name) { out[name.fileId].append(name.name); });
+}
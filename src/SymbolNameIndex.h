@@ -0,0 +1,77 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef SymbolNameIndex_h
+#define SymbolNameIndex_h
+
+#include <cstdint>
+#include <mutex>
+
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/String.h"
+#include "TrigramIndex.h"
+
+/*
+  Trigram index over the keys of every symnames FileMap in a project, for
+  the symbol lookups that can't use FileMap::lowerBound() (regexes,
+  wildcards that don't start with a literal and case insensitive
+  matches), see TrigramIndex.
+
+  Names are read from disk by whoever needs them, a file that was dirtied
+  since has to be read again.
+
+  Safe to use from several threads.
+*/
+
+class SymbolNameIndex
+{
+public:
+    SymbolNameIndex();
+
+    // Returns true if fileId's names have to be read and passed to update()
+    // with version. An update() with a version that was dirtied since is
+    // ignored.
+    bool needsUpdate(uint32_t fileId, uint64_t *version) const;
+    void update(uint32_t fileId, uint64_t version, const List<String> &names);
+    void dirty(uint32_t fileId);
+    void remove(uint32_t fileId);
+    void clear();
+    size_t size() const;
+
+    // Appends the names of fileId that might contain all of literals to
+    // out[fileId]. Returns false if the literals are too short to rule
+    // anything out.
+    bool candidates(const List<String> &literals, Hash<uint32_t, List<String> > &out) const;
+private:
+    struct Name {
+        uint32_t fileId;
+        String name;
+    };
+    struct File {
+        File() : version(0), indexed(false) {}
+        uint64_t version;
+        bool indexed;
+        List<uint32_t> ids;
+    };
+    void kill(File &file); // called with mMutex held
+    void compact(); // called with mMutex held
+
+    mutable std::mutex mMutex;
+    Hash<uint32_t, File> mFiles;
+    TrigramIndex<Name> mIndex;
+};
+
+#endif
@@ -0,0 +1,150 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef TrigramIndex_h
+#define TrigramIndex_h
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/String.h"
+#include "RTags.h"
+
+/*
+  The part FileIndex and SymbolNameIndex share. Every inserted value gets
+  an id and every (case folded) trigram of the text it was inserted with a
+  posting list of the ids that contain it. Ids only grow so posting lists
+  stay sorted and intersecting them is a merge.
+
+  Removed values are only marked dead, their postings go away when the
+  owner calls compact(), which it should do once needsCompact() says
+  enough of them have piled up. Not thread safe.
+*/
+
+template <typename T>
+class TrigramIndex
+{
+public:
+    TrigramIndex(size_t compactThreshold)
+        : mCompactThreshold(compactThreshold), mDead(0)
+    {}
+
+    void clear()
+    {
+        mEntries.clear();
+        mPostings.clear();
+        mDead = 0;
+    }
+    size_t size() const { return mEntries.size() - mDead; }
+
+    uint32_t insert(const String &text, T &&value)
+    {
+        const uint32_t id = mEntries.size();
+        mEntries.append(Entry { std::move(value), true });
+
+        List<uint32_t> grams;
+        RTags::trigrams(text, grams);
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+        for (uint32_t gram : grams)
+            mPostings[gram].append(id);
+        return id;
+    }
+
+    void remove(uint32_t id)
+    {
+        Entry &entry = mEntries[id];
+        entry.live = false;
+        entry.value = T();
+        ++mDead;
+    }
+
+    bool needsCompact() const { return mDead >= mCompactThreshold && mDead >= size(); }
+
+    // Inserts the live values again with new ids. text(value) has to
+    // return what value was inserted with, moved(value, id) is called with
+    // each new id.
+    template <typename Text, typename Moved>
+    void compact(Text text, Moved moved)
+    {
+        List<Entry> entries;
+        entries.swap(mEntries);
+        mPostings.clear();
+        mDead = 0;
+        for (Entry &entry : entries) {
+            if (entry.live) {
+                const String str = text(entry.value);
+                const uint32_t id = insert(str, std::move(entry.value));
+                moved(mEntries.at(id).value, id);
+            }
+        }
+    }
+
+    // Calls visit(value) for every live value whose text might contain all
+    // of literals. Returns false if the literals are too short to rule
+    // anything out.
+    template <typename Visit>
+    bool candidates(const List<String> &literals, Visit visit) const
+    {
+        List<uint32_t> grams;
+        for (const String &literal : literals)
+            RTags::trigrams(literal, grams);
+        if (grams.isEmpty())
+            return false;
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+
+        List<const List<uint32_t> *> postings;
+        for (uint32_t gram : grams) {
+            auto it = mPostings.find(gram);
+            if (it == mPostings.end())
+                return true;
+            postings.append(&it->second);
+        }
+        // start with the shortest list, it bounds the result
+        std::sort(postings.begin(), postings.end(), [](const List<uint32_t> *l, const List<uint32_t> *r) {
+                return l->size() < r->size();
+            });
+        List<uint32_t> ids = *postings.front(), intersection;
+        for (size_t i=1; i<postings.size() && !ids.isEmpty(); ++i) {
+            intersection.clear();
+            std::set_intersection(ids.begin(), ids.end(), postings.at(i)->begin(), postings.at(i)->end(),
+                                  std::back_inserter(intersection));
+            ids.swap(intersection);
+        }
+
+        for (uint32_t id : ids) {
+            const Entry &entry = mEntries.at(id);
+            if (entry.live)
+                visit(entry.value);
+        }
+        return true;
+    }
+private:
+    struct Entry {
+        T value;
+        bool live;
+    };
+
+    const size_t mCompactThreshold;
+    List<Entry> mEntries;
+    Hash<uint32_t, List<uint32_t> > mPostings;
+    size_t mDead;
+};
+
+#endif
@@ -0,0 +1,130 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "VisitFileThread.h"
+
+#include "RClient.h"
+#include "Server.h"
+#include "VisitFileMessage.h"
+#include "VisitFileResponseMessage.h"
+#include "rct/Connection.h"
+#include "rct/EventLoop.h"
+#include "rct/Log.h"
+#include "rct/SocketServer.h"
+#include "rct/StopWatch.h"
+
+VisitFileThread::VisitFileThread(const Path &socketFile)
+    : mSocketFile(socketFile), mState(Starting), mRequests(0), mBusy(0)
+{
+}
+
+VisitFileThread::~VisitFileThread()
+{
+}
+
+void VisitFileThread::run()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(0);
+
+    Path::rm(mSocketFile);
+    std::shared_ptr<SocketServer> server(new SocketServer);
+    const bool ok = server->listen(mSocketFile);
+    if (ok) {
+        server->newConnection().connect(std::bind(&VisitFileThread::onNewConnection, this, std::placeholders::_1));
+    } else {
+        error() << "Failed to listen on" << mSocketFile << "rp will send VisitFileMessages to the main socket";
+    }
+
+    bool stopped;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        stopped = mState == Stopped;
+        if (!stopped) {
+            mState = ok ? Listening : Failed;
+            mLoop = loop;
+        }
+    }
+    mCondition.notify_all();
+
+    if (ok && !stopped)
+        loop->exec();
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mLoop.reset();
+    }
+    mConnections.clear();
+    server.reset();
+    if (ok)
+        Path::rm(mSocketFile);
+}
+
+bool VisitFileThread::waitForListening()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mState == Starting)
+        mCondition.wait(lock);
+    return mState == Listening;
+}
+
+void VisitFileThread::stop()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mState = Stopped;
+    mCondition.notify_all();
+    if (std::shared_ptr<EventLoop> loop = mLoop) {
+        // quit() has to happen on the loop's own thread
+        loop->callLater([loop]() { loop->quit(); });
+    }
+}
+
+VisitFileThread::Stats VisitFileThread::stats() const
+{
+    const Stats ret = { mRequests, mBusy };
+    return ret;
+}
+
+void VisitFileThread::onNewConnection(SocketServer *server)
+{
+    while (std::shared_ptr<SocketClient> client = server->nextConnection()) {
+        std::shared_ptr<Connection> conn = Connection::create(client, RClient::NumOptions);
+        conn->newMessage().connect(std::bind(&VisitFileThread::onMessage, this, std::placeholders::_1, std::placeholders::_2));
+        mConnections.insert(conn);
+        std::weak_ptr<Connection> weak = conn;
+        conn->disconnected().connect(std::bind([this, weak]() {
+                    if (std::shared_ptr<Connection> c = weak.lock()) {
+                        c->disconnected().disconnect();
+                        mConnections.remove(c);
+                    }
+                }));
+    }
+}
+
+void VisitFileThread::onMessage(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn)
+{
+    if (message->messageId() != VisitFileMessage::MessageId) {
+        error() << "Unexpected message on" << mSocketFile << message->messageId();
+        conn->close();
+        return;
+    }
+    StopWatch sw(StopWatch::Microsecond);
+    uint32_t fileId = 0;
+    const bool visit = Server::instance()->visitFile(*std::static_pointer_cast<VisitFileMessage>(message), &fileId);
+    VisitFileResponseMessage msg(fileId, visit);
+    conn->send(msg);
+    ++mRequests;
+    mBusy += sw.elapsed();
+}
@@ -0,0 +1,80 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef VisitFileThread_h
+#define VisitFileThread_h
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#include "rct/Path.h"
+#include "rct/Set.h"
+#include "rct/Thread.h"
+
+class Connection;
+class EventLoop;
+class Message;
+class SocketServer;
+
+/*
+  rp blocks on every VisitFileMessage until rdm answers. This thread answers
+  them on its own event loop and socket, next to the main one, so a claim
+  never queues behind queries, index data or completions. rp falls back to
+  its main connection when it can't connect here, e.g. remote workers.
+*/
+
+class VisitFileThread : public Thread
+{
+public:
+    VisitFileThread(const Path &socketFile);
+    ~VisitFileThread();
+
+    virtual void run() override;
+    // waits until the thread is listening, false if it couldn't
+    bool waitForListening();
+    void stop();
+    const Path &socketFile() const { return mSocketFile; }
+
+    struct Stats {
+        size_t requests;
+        unsigned long long busy; // us spent answering them
+    };
+    Stats stats() const;
+private:
+    void onNewConnection(SocketServer *server);
+    void onMessage(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn);
+
+    const Path mSocketFile;
+
+    mutable std::mutex mMutex;
+    std::condition_variable mCondition;
+    enum State {
+        Starting,
+        Listening,
+        Failed,
+        Stopped
+    } mState;
+    std::shared_ptr<EventLoop> mLoop;
+
+    // only touched by the thread
+    Set<std::shared_ptr<Connection> > mConnections;
+
+    std::atomic<size_t> mRequests;
+    std::atomic<unsigned long long> mBusy;
+};
+
+#endif
@@ -0,0 +1,267 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "WatchManager.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "rct/Log.h"
+#include "rct/Rct.h"
+#include "rct/StopWatch.h"
+#include "Server.h"
+
+// only touched from the main thread
+static size_t sUsed = 0;
+static size_t sBudget = 0;
+
+static inline uint64_t mtime(const struct stat &st)
+{
+#ifdef __APPLE__
+    return static_cast<uint64_t>(st.st_mtimespec.tv_sec) * 1000000000ull + st.st_mtimespec.tv_nsec;
+#else
+    return static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + st.st_mtim.tv_nsec;
+#endif
+}
+
+size_t WatchManager::used()
+{
+    return sUsed;
+}
+
+size_t WatchManager::budget()
+{
+    if (!sBudget) {
+        const int max = Server::instance() ? Server::instance()->options().maxWatches : 0;
+        if (max > 0) {
+            sBudget = max;
+        } else {
+            // leave half of the user's inotify watches to everyone else
+            bool ok;
+            const unsigned long long system = Path("/proc/sys/fs/inotify/max_user_watches").readAll().trimmed().toULongLong(&ok);
+            sBudget = ok && system ? std::max<size_t>(1, system / 2) : std::numeric_limits<size_t>::max();
+        }
+    }
+    return sBudget;
+}
+
+WatchManager::WatchManager()
+    : mCycleStart(0), mLastCycle(0), mEvents(0), mPolledEvents(0), mScans(0)
+{
+    mWatcher.added().connect([this](const Path &path) { onEvent(path, mAdded); });
+    mWatcher.removed().connect([this](const Path &path) { onEvent(path, mRemoved); });
+    mWatcher.modified().connect([this](const Path &path) { onEvent(path, mModified); });
+    mPollTimer.timeout().connect([this](Timer *) { poll(); });
+}
+
+WatchManager::~WatchManager()
+{
+    mPollTimer.stop();
+    sUsed -= mWatched.size();
+}
+
+void WatchManager::watch(const Path &dir)
+{
+    if (mWatched.contains(dir) || mPolled.contains(dir) || addWatch(dir))
+        return;
+    debug() << "Polling" << dir << "instead of watching it," << used() << "of" << budget() << "watches in use";
+    scan(dir, mPolled[dir], nullptr);
+    if (mPolled.size() == 1)
+        mPollTimer.restart(PollInterval);
+}
+
+void WatchManager::unwatch(const Path &dir)
+{
+    if (mWatched.contains(dir)) {
+        removeWatch(dir);
+    } else if (mPolled.remove(dir) && mPolled.isEmpty()) {
+        mPollTimer.stop();
+    }
+}
+
+bool WatchManager::addWatch(const Path &dir)
+{
+    if (sUsed >= budget())
+        return false;
+    if (!mWatcher.watch(dir)) {
+        if (errno == ENOSPC) {
+            // the kernel ran out before we did, don't try again until
+            // someone gives one back
+            warning() << "Out of inotify watches at" << sUsed << "falling back to polling";
+            sBudget = std::max<size_t>(1, sUsed);
+        }
+        return false;
+    }
+    ++sUsed;
+    mWatched[dir] = 0;
+    return true;
+}
+
+void WatchManager::removeWatch(const Path &dir)
+{
+    mWatcher.unwatch(dir);
+    mWatched.remove(dir);
+    --sUsed;
+}
+
+void WatchManager::onEvent(const Path &path, FileSignal &signal)
+{
+    ++mEvents;
+    const Path dir = path.parentDir();
+    auto watched = mWatched.find(dir);
+    if (watched != mWatched.end()) {
+        ++watched->second;
+    } else {
+        auto polled = mPolled.find(dir);
+        if (polled != mPolled.end())
+            ++polled->second.hits;
+    }
+    signal(path);
+}
+
+void WatchManager::scan(const Path &dir, Polled &polled, Events *events)
+{
+    ++mScans;
+    Hash<String, uint64_t> mtimes;
+    if (DIR *d = opendir(dir.constData())) {
+        const int fd = dirfd(d);
+        while (const dirent *entry = readdir(d)) {
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+                continue;
+            struct stat st;
+            if (!fstatat(fd, entry->d_name, &st, 0))
+                mtimes[entry->d_name] = mtime(st);
+        }
+        closedir(d);
+    }
+    if (events) {
+        const Path base = dir.ensureTrailingSlash();
+        for (const auto &file : mtimes) {
+            auto old = polled.mtimes.find(file.first);
+            if (old == polled.mtimes.end()) {
+                events->append(std::make_pair(base + file.first, &mAdded));
+            } else if (old->second != file.second) {
+                events->append(std::make_pair(base + file.first, &mModified));
+            }
+        }
+        for (const auto &file : polled.mtimes) {
+            if (!mtimes.contains(file.first))
+                events->append(std::make_pair(base + file.first, &mRemoved));
+        }
+    }
+    polled.mtimes = std::move(mtimes);
+}
+
+void WatchManager::poll()
+{
+    if (mPollCursor.isEmpty()) {
+        rebalance();
+        mCycleStart = Rct::monoMs();
+    }
+
+    // Scan from where the last slice stopped until this slice is spent but
+    // never fewer directories than it takes to get around in MaxCoverage,
+    // emit afterwards since the handlers may watch or unwatch things.
+    const size_t ticks = MaxCoverage / PollInterval;
+    const size_t minimum = (mPolled.size() + ticks - 1) / ticks;
+    size_t scanned = 0;
+    Events events;
+    StopWatch sw;
+    auto it = mPolled.lower_bound(mPollCursor);
+    while (it != mPolled.end()) {
+        scan(it->first, it->second, &events);
+        ++it;
+        if (++scanned >= minimum && sw.elapsed() >= PollSlice)
+            break;
+    }
+    if (it == mPolled.end()) {
+        mPollCursor.clear();
+        mLastCycle = Rct::monoMs() - mCycleStart;
+    } else {
+        mPollCursor = it->first;
+    }
+
+    for (const auto &event : events) {
+        ++mPolledEvents;
+        onEvent(event.first, *event.second);
+    }
+}
+
+void WatchManager::rebalance()
+{
+    List<std::pair<size_t, Path> > hot, cold;
+    for (const auto &polled : mPolled) {
+        if (polled.second.hits)
+            hot.append(std::make_pair(polled.second.hits, polled.first));
+    }
+    if (!hot.isEmpty()) {
+        for (const auto &watched : mWatched)
+            cold.append(std::make_pair(watched.second, watched.first));
+        std::sort(hot.begin(), hot.end(), std::greater<std::pair<size_t, Path> >());
+        std::sort(cold.begin(), cold.end());
+
+        size_t victim = 0;
+        for (const auto &candidate : hot) {
+            if (sUsed >= budget()) {
+                if (victim == cold.size() || cold[victim].first >= candidate.first)
+                    break;
+                const std::pair<size_t, Path> &demoted = cold[victim++];
+                removeWatch(demoted.second);
+                Polled &polled = mPolled[demoted.second];
+                polled.hits = demoted.first;
+                scan(demoted.second, polled, nullptr);
+            }
+            if (!addWatch(candidate.second))
+                break;
+            mWatched[candidate.second] = candidate.first;
+            mPolled.remove(candidate.second);
+        }
+        if (mPolled.isEmpty())
+            mPollTimer.stop();
+    }
+
+    // decay so old activity doesn't pin a directory forever
+    for (auto &watched : mWatched)
+        watched.second /= 2;
+    for (auto &polled : mPolled)
+        polled.second.hits /= 2;
+}
+
+WatchManager::DirectoryInfo WatchManager::info(const Path &dir) const
+{
+    DirectoryInfo ret = { false, 0 };
+    auto watched = mWatched.find(dir);
+    if (watched != mWatched.end()) {
+        ret.hits = watched->second;
+    } else {
+        auto polled = mPolled.find(dir);
+        if (polled != mPolled.end()) {
+            ret.polled = true;
+            ret.hits = polled->second.hits;
+        }
+    }
+    return ret;
+}
+
+WatchManager::Stats WatchManager::stats() const
+{
+    const Stats ret = { mWatched.size(), mPolled.size(), mEvents, mPolledEvents, mScans, mLastCycle };
+    return ret;
+}
@@ -0,0 +1,102 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+#ifndef WatchManager_h
+#define WatchManager_h
+
+#include "rct/FileSystemWatcher.h"
+#include "rct/Hash.h"
+#include "rct/List.h"
+#include "rct/Map.h"
+#include "rct/Path.h"
+#include "rct/SignalSlot.h"
+#include "rct/Timer.h"
+
+/*
+  Drop-in for a project's FileSystemWatcher that stays within a budget of
+  kernel watches shared by all projects (see --max-watches). Directories
+  that don't get a watch, because the budget is spent or the kernel said
+  no, are polled instead: every PollInterval a time slice of them is
+  compared against an index of the mtimes seen last time and the
+  differences are emitted through the same added/removed/modified signals.
+  The slice grows with the number of polled directories so that all of
+  them are visited at least once every MaxCoverage.
+
+  Every event counts as a hit for its directory. Once per polling cycle the
+  busiest polled directories trade places with the quietest watched ones so
+  the kernel watches end up where the activity is.
+*/
+
+class WatchManager
+{
+public:
+    WatchManager();
+    ~WatchManager();
+
+    typedef Signal<std::function<void(const Path &)> > FileSignal;
+    FileSignal &added() { return mAdded; }
+    FileSignal &removed() { return mRemoved; }
+    FileSignal &modified() { return mModified; }
+
+    void watch(const Path &dir);
+    void unwatch(const Path &dir);
+
+    struct DirectoryInfo {
+        bool polled;
+        size_t hits;
+    };
+    DirectoryInfo info(const Path &dir) const;
+
+    struct Stats {
+        size_t watched, polled; // directories
+        size_t events, polledEvents; // polledEvents is the part found by polling
+        size_t scans; // directories polled
+        uint64_t cycle; // ms the last full pass over the polled directories took
+    };
+    Stats stats() const;
+    // watches in use by all projects and how many they may use
+    static size_t used();
+    static size_t budget();
+private:
+    enum {
+        PollInterval = 1000, // ms
+        PollSlice = 5, // ms per PollInterval, unless MaxCoverage needs more
+        MaxCoverage = 10000 // ms until every polled directory has been scanned
+    };
+    struct Polled {
+        Polled() : hits(0) {}
+        Hash<String, uint64_t> mtimes; // ns by file name
+        size_t hits;
+    };
+    typedef List<std::pair<Path, FileSignal *> > Events;
+
+    bool addWatch(const Path &dir);
+    void removeWatch(const Path &dir);
+    void onEvent(const Path &path, FileSignal &signal);
+    void poll();
+    void scan(const Path &dir, Polled &polled, Events *events); // null events just indexes
+    void rebalance();
+
+    FileSystemWatcher mWatcher;
+    FileSignal mAdded, mRemoved, mModified;
+    Hash<Path, size_t> mWatched; // hits by directory
+    Map<Path, Polled> mPolled;
+    Path mPollCursor; // where the last time slice stopped
+    uint64_t mCycleStart, mLastCycle;
+    Timer mPollTimer;
+    size_t mEvents, mPolledEvents, mScans;
+};
+
+#endif
@@ -0,0 +1,85 @@
+/* This file is part of RTags (https://github.com/Andersbakken/rtags).
+
+   RTags is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   RTags is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with RTags.  If not, see <https://www.gnu.org/licenses/>. */
+
+
+#ifndef WorkerMessage_h
+#define WorkerMessage_h
+
+#include "RTagsMessage.h"
+
+// Protocol between rdm and remote rp workers (rp --worker). The worker says
+// Hello with its capacity, rdm sends Job messages with an encoded IndexerJob
+// and may send Abort. The worker sends Finished when the rp for a job exits.
+// Hello carries the secret from rdm's --worker-secret-file, the rps a worker
+// starts send Auth with it before anything else.
+class WorkerMessage : public RTagsMessage
+{
+public:
+    enum { MessageId = WorkerId };
+    enum Type {
+        Invalid,
+        Hello,
+        Job,
+        Abort,
+        Finished,
+        Auth
+    };
+
+    WorkerMessage(Type type = Invalid, uint64_t jobId = 0)
+        : RTagsMessage(MessageId), mType(type), mJobId(jobId), mCapacity(0), mReturnCode(0)
+    {
+    }
+
+    Type type() const { return mType; }
+    uint64_t jobId() const { return mJobId; }
+
+    int capacity() const { return mCapacity; }
+    void setCapacity(int capacity) { mCapacity = capacity; }
+
+    const String &name() const { return mName; }
+    void setName(const String &name) { mName = name; }
+
+    const String &payload() const { return mPayload; }
+    void setPayload(String &&payload) { mPayload = std::move(payload); }
+
+    const String &secret() const { return mSecret; }
+    void setSecret(const String &secret) { mSecret = secret; }
+
+    int returnCode() const { return mReturnCode; }
+    void setReturnCode(int returnCode) { mReturnCode = returnCode; }
+
+    void encode(Serializer &serializer) const override
+    {
+        serializer << static_cast<uint8_t>(mType) << mJobId << static_cast<int32_t>(mCapacity)
+                   << mName << mPayload << static_cast<int32_t>(mReturnCode) << mSecret;
+    }
+    void decode(Deserializer &deserializer) override
+    {
+        uint8_t type;
+        int32_t capacity, returnCode;
+        deserializer >> type >> mJobId >> capacity >> mName >> mPayload >> returnCode >> mSecret;
+        mType = static_cast<Type>(type);
+        mCapacity = capacity;
+        mReturnCode = returnCode;
+    }
+private:
+    Type mType;
+    uint64_t mJobId;
+    int mCapacity;
+    String mName, mPayload, mSecret;
+    int mReturnCode;
+};
+
+#endif
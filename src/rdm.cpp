@@ -144,6 +144,8 @@ enum OptionType {
     TempDir,
     Test,
     TestTimeout,
+    IndexOnly,
+    Out,
     CleanSlate,
     DisableSigHandler,
     Silent,
@@ -195,8 +197,10 @@ enum OptionType {
     NoFileManager,
     NoFileLock,
     PchEnabled,
+    SharedPreambles,
     NoFilesystemWatcher,
     ArgTransform,
+    ArgTransformJobs,
     NoComments,
 #ifdef RTAGS_HAS_LAUNCHD
     Launchd,
@@ -208,11 +212,15 @@ enum OptionType {
     DebugLocations,
     ValidateFileMaps,
     TcpPort,
+    WorkerSecretFile,
     RPPath,
     LogTimestamp,
     LogFlushOption,
     SandboxRoot,
     PollTimer,
+    LazyProjects,
+    ProjectUnloadTimeout,
+    MaxWatches,
     NoRealPath,
     Noop
 };
@@ -305,6 +313,8 @@ int main(int argc, char** argv)
         { Test, "test", 't', CommandLineParser::Required, "Run this test." },
         { TempDir, "tempdir", 0, CommandLineParser::Required, "Use this directory for temporary files. Clang generates a lot of these and rtags will periodically clean out this directory (default is $TMPDIR/rtags/)" },
         { TestTimeout, "test-timeout", 'z', CommandLineParser::Required, "Timeout for test to complete." },
+        { IndexOnly, "index-only", 0, CommandLineParser::Required, "Index this compile_commands.json (or directory containing one), save the database and exit." },
+        { Out, "out", 0, CommandLineParser::Required, "Write the database for --index-only to this directory (same as --data-dir)." },
         { CleanSlate, "clean-slate", 'C', CommandLineParser::NoValue, "Clear out all data." },
         { DisableSigHandler, "disable-sighandler", 'x', CommandLineParser::NoValue, "Disable signal handler to dump stack for crashes." },
         { Silent, "silent", 'S', CommandLineParser::NoValue, "No logging to stdout/stderr." },
@@ -355,8 +365,10 @@ int main(int argc, char** argv)
         { NoFileManager, "no-filemanager", 0, CommandLineParser::NoValue, "Don't scan project directory for files. (rc -P won't work)." },
         { NoFileLock, "no-file-lock", 0, CommandLineParser::NoValue, "Disable file locking. Not entirely safe but might improve performance on certain systems." },
         { PchEnabled, "pch-enabled", 0, CommandLineParser::NoValue, "Enable PCH (experimental)." },
+        { SharedPreambles, "shared-preambles", 0, CommandLineParser::NoValue, "Build one precompiled preamble for source files sharing flags and leading includes and reuse it across rp jobs (experimental)." },
         { NoFilesystemWatcher, "no-filesystem-watcher", 'B', CommandLineParser::NoValue, "Disable file system watching altogether. Reindexing has to be triggered manually." },
         { ArgTransform, "arg-transform", 'V', CommandLineParser::Required, "Use arg to transform arguments. [arg] should be executable with (execv(3))." },
+        { ArgTransformJobs, "arg-transform-jobs", 0, CommandLineParser::Required, "Keep [arg] instances of --arg-transform running as coprocesses that read \"<length>\\n<command line>\" records on stdin and answer each in order with the same format (length 0 keeps the command, -1 drops it)." },
         { NoComments, "no-comments", 0, CommandLineParser::NoValue, "Don't parse/store doxygen comments." },
 #ifdef RTAGS_HAS_LAUNCHD
         { Launchd, "launchd", 0, CommandLineParser::NoValue, "Run as a launchd job (use launchd API to retrieve socket opened by launchd on rdm's behalf)." },
@@ -368,11 +380,15 @@ int main(int argc, char** argv)
         { DebugLocations, "debug-locations", 0, CommandLineParser::Required, "Set debug locations." },
         { ValidateFileMaps, "validate-file-maps", 0, CommandLineParser::NoValue, "Spend some time validating project data on startup." },
         { TcpPort, "tcp-port", 0, CommandLineParser::Required, "Listen on this tcp socket (default none)." },
+        { WorkerSecretFile, "worker-secret-file", 0, CommandLineParser::Required, "Remote workers (rp --worker) on the tcp socket must present the contents of this file (default no remote workers)." },
         { RPPath, "rp-path", 0, CommandLineParser::Required, String::format<256>("Path to rp (default %s).", defaultRP().constData()) },
         { LogTimestamp, "log-timestamp", 0, CommandLineParser::NoValue, "Add timestamp to logs." },
         { LogFlushOption, "log-flush", 0, CommandLineParser::NoValue, "Flush stderr/stdout after each log." },
         { SandboxRoot, "sandbox-root",  0, CommandLineParser::Required, "Create index using relative paths by stripping dir (enables copying of tag index db files without need to reindex)." },
         { PollTimer, "poll-timer", 0, CommandLineParser::Required, "Poll the database of the current project every <arg> seconds. " },
+        { LazyProjects, "lazy-projects", 0, CommandLineParser::NoValue, "Only register projects at startup and load each one the first time it's used." },
+        { ProjectUnloadTimeout, "project-unload-timeout", 0, CommandLineParser::Required, "Unload projects, other than the current one, that haven't been used or indexed in <arg> seconds. They're loaded again on demand." },
+        { MaxWatches, "max-watches", 0, CommandLineParser::Required, "Max file system watches for all projects, directories beyond that are polled. Defaults to half of /proc/sys/fs/inotify/max_user_watches." },
         { NoRealPath, "no-realpath", 0, CommandLineParser::NoValue, "Don't use realpath(3) for files" },
         { Noop, "config", 'c', CommandLineParser::Required, "Use this file (instead of ~/.rdmrc)." },
         { Noop, "no-rc", 'N', CommandLineParser::NoValue, "Don't load any rc files." }
@@ -448,6 +464,18 @@ int main(int argc, char** argv)
         case TempDir: {
             serverOpts.tempDir = value;
             break; }
+        case IndexOnly: {
+            Path path(value);
+            if (path.isDir())
+                path = path.ensureTrailingSlash() + "compile_commands.json";
+            if (!path.resolve() || !path.isFile()) {
+                return { String::format<1024>("%s doesn't seem to be a compilation database", value.constData()), CommandLineParser::Parse_Error };
+            }
+            serverOpts.indexOnly = path;
+            break; }
+        case Out: {
+            serverOpts.dataDir = Path::resolved(value);
+            break; }
         case TestTimeout: {
             serverOpts.testTimeout = atoi(value.constData());
             if (serverOpts.testTimeout <= 0) {
@@ -460,6 +488,21 @@ int main(int argc, char** argv)
                 return { String::format<1024>("Invalid argument to --poll-timer %s", value.constData()), CommandLineParser::Parse_Error };
             }
             break; }
+        case LazyProjects: {
+            serverOpts.options |= Server::LazyProjects;
+            break; }
+        case ProjectUnloadTimeout: {
+            serverOpts.projectUnloadTimeout = atoi(value.constData());
+            if (serverOpts.projectUnloadTimeout < 0) {
+                return { String::format<1024>("Invalid argument to --project-unload-timeout %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
+        case MaxWatches: {
+            serverOpts.maxWatches = atoi(value.constData());
+            if (serverOpts.maxWatches <= 0) {
+                return { String::format<1024>("Invalid argument to --max-watches %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
         case CleanSlate: {
             serverOpts.options |= Server::ClearProjects;
             break; }
@@ -656,6 +699,9 @@ int main(int argc, char** argv)
         case PchEnabled: {
             serverOpts.options |= Server::PCHEnabled;
             break; }
+        case SharedPreambles: {
+            serverOpts.options |= Server::SharedPreambles;
+            break; }
         case NoFilesystemWatcher: {
             serverOpts.options |= Server::NoFileSystemWatch;
             break; }
@@ -665,6 +711,13 @@ int main(int argc, char** argv)
                 return { String::format<1024>("Invalid argument to -V. Can't resolve %s", value.constData()), CommandLineParser::Parse_Error };
             }
             break; }
+        case ArgTransformJobs: {
+            bool ok;
+            serverOpts.argTransformJobs = String(value).toULong(&ok);
+            if (!ok || !serverOpts.argTransformJobs) {
+                return { String::format<1024>("Invalid argument to --arg-transform-jobs %s", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
         case NoComments: {
             serverOpts.options |= Server::NoComments;
             break; }
@@ -712,6 +765,12 @@ int main(int argc, char** argv)
                 return { String::format<1024>("Invalid port %s for --tcp-port", value.constData()), CommandLineParser::Parse_Error };
             }
             break; }
+        case WorkerSecretFile: {
+            serverOpts.workerSecret = Path(value).readAll().trimmed();
+            if (serverOpts.workerSecret.isEmpty()) {
+                return { String::format<1024>("Can't read secret from %s for --worker-secret-file", value.constData()), CommandLineParser::Parse_Error };
+            }
+            break; }
         case RPPath: {
             serverOpts.rp = std::move(value);
             if (serverOpts.rp.isFile()) {
@@ -801,6 +860,8 @@ int main(int argc, char** argv)
         signal(SIGILL, signalHandler);
         signal(SIGABRT, signalHandler);
     }
+    // writes to a dead --arg-transform coprocess fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
 
     if (!initLogging(argv[0], logFlags, logLevel, logFile, logFileLogLevel)) {
         fprintf(stderr, "Can't initialize logging with %d %s %s\n",
@@ -850,6 +911,20 @@ int main(int argc, char** argv)
         close(fd);
         serverOpts.socketFile = buf;
     }
+    if (!serverOpts.indexOnly.isEmpty()) {
+        // don't get in the way of a running rdm and don't do anything that only matters to editors
+        char buf[1024];
+        strcpy(buf, "/tmp/rtags-sock-XXXXXX");
+        const int fd = mkstemp(buf);
+        if (fd == -1) {
+            fprintf(stderr, "Failed to mkstemp (%d)\n", errno);
+            return 1;
+        }
+        close(fd);
+        serverOpts.socketFile = buf;
+        serverOpts.daemonCount = 0;
+        serverOpts.options |= Server::NoFileManager|Server::NoFileManagerWatch|Server::NoStartupCurrentProject;
+    }
     serverOpts.dataDir = serverOpts.dataDir.ensureTrailingSlash();
 
 #ifdef HAVE_BACKTRACE
@@ -876,6 +951,14 @@ int main(int argc, char** argv)
         return server->runTests() ? 0 : 1;
     }
 
+    if (!serverOpts.indexOnly.isEmpty()) {
+        const bool ok = server->runIndexOnly();
+        server.reset();
+        unlink(serverOpts.socketFile.constData());
+        cleanupLogging();
+        return ok ? 0 : 1;
+    }
+
     loop->setInactivityTimeout(inactivityTimeout * 1000);
 
     loop->exec();
@@ -15,16 +15,22 @@
 
 #define RTAGS_SINGLE_THREAD
 #include <signal.h>
+#include <stdlib.h>
 #include <syslog.h>
 
 #include "ClangIndexer.h"
 #include "Project.h"
+#include "RClient.h"
+#include "rct/Connection.h"
 #include "rct/Log.h"
+#include "rct/Process.h"
 #include "rct/StopWatch.h"
 #include "rct/String.h"
+#include "rct/ThreadPool.h"
 #include "RTags.h"
 #include "Server.h"
 #include "Source.h"
+#include "WorkerMessage.h"
 
 static void sigHandler(int signal)
 {
@@ -56,6 +62,152 @@ public:
     }
 };
 
+// Remote worker, pulls jobs from rdm over tcp and runs one rp per job. The
+// rps connect back to rdm for visit claims and send their shards along with
+// the IndexDataMessage. Each job gets its own scratch dir under a mkdtemp'ed
+// root so neither concurrent jobs nor other workers on the host collide.
+class Worker
+{
+public:
+    Worker(const String &host, uint16_t port, int jobs, int logLevel, const Path &secretFile)
+        : mHost(host), mPort(port), mJobs(jobs), mLogLevel(logLevel), mSecretFile(secretFile),
+          mConnection(Connection::create(RClient::NumOptions))
+    {
+    }
+
+    ~Worker()
+    {
+        for (const auto &child : mChildren) {
+            child.first->kill();
+            delete child.first;
+        }
+        if (!mDataDir.isEmpty())
+            Path::rmdir(mDataDir);
+    }
+
+    bool start()
+    {
+        enum { ConnectTimeout = 10000 };
+        const char *tmp = getenv("TMPDIR");
+        String dir = Path(tmp ? tmp : "/tmp").ensureTrailingSlash() + "rp-worker-XXXXXX";
+        if (!mkdtemp(&dir[0])) {
+            error("Failed to create scratch dir %s: %s", dir.constData(), Rct::strerror().constData());
+            return false;
+        }
+        mDataDir = Path(dir).ensureTrailingSlash();
+        String secret;
+        if (!mSecretFile.isEmpty())
+            secret = mSecretFile.readAll().trimmed();
+        if (!mConnection->connectTcp(mHost, mPort, ConnectTimeout)) {
+            error("Failed to connect to rdm on %s:%d", mHost.constData(), mPort);
+            return false;
+        }
+        mConnection->newMessage().connect(std::bind(&Worker::onMessage, this, std::placeholders::_1, std::placeholders::_2));
+        mConnection->disconnected().connect(std::bind([]() {
+                    error() << "Disconnected from rdm";
+                    EventLoop::eventLoop()->quit();
+                }));
+        char name[256];
+        if (gethostname(name, sizeof(name)))
+            strcpy(name, "unknown");
+        name[sizeof(name) - 1] = '\0';
+        WorkerMessage hello(WorkerMessage::Hello);
+        hello.setCapacity(mJobs);
+        hello.setName(String::format<512>("%s:%d", name, getpid()));
+        hello.setSecret(secret);
+        return mConnection->send(hello);
+    }
+private:
+    void onMessage(const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &)
+    {
+        if (message->messageId() != WorkerMessage::MessageId) {
+            error() << "Unexpected message" << static_cast<int>(message->messageId());
+            return;
+        }
+        const std::shared_ptr<WorkerMessage> msg = std::static_pointer_cast<WorkerMessage>(message);
+        switch (msg->type()) {
+        case WorkerMessage::Job:
+            startJob(msg->jobId(), msg->payload());
+            break;
+        case WorkerMessage::Abort:
+            for (const auto &child : mChildren) {
+                if (child.second == msg->jobId()) {
+                    child.first->kill();
+                    break;
+                }
+            }
+            break;
+        default:
+            error() << "Unexpected worker message" << static_cast<int>(msg->type());
+            break;
+        }
+    }
+
+    void startJob(uint64_t jobId, const String &payload)
+    {
+        List<String> arguments;
+        for (int i=mLogLevel; i>0; --i)
+            arguments << "-v";
+        arguments << "--server" << String::format<256>("%s:%d", mHost.constData(), mPort)
+                  << "--data-dir" << jobDir(jobId);
+        if (!mSecretFile.isEmpty())
+            arguments << "--worker-secret-file" << mSecretFile;
+        Process *process = new Process;
+        process->readyReadStdOut().connect([](Process *proc) { logDirect(LogLevel::Error, proc->readAllStdOut()); });
+        process->readyReadStdErr().connect([](Process *proc) { logDirect(LogLevel::Error, proc->readAllStdErr()); });
+        process->finished().connect(std::bind(&Worker::onProcessFinished, this, std::placeholders::_1));
+        if (!process->start(Rct::executablePath(), arguments)) {
+            error() << "Couldn't start rp" << Rct::executablePath() << process->errorString();
+            delete process;
+            WorkerMessage finished(WorkerMessage::Finished, jobId);
+            finished.setReturnCode(-1);
+            mConnection->send(finished);
+            return;
+        }
+        debug() << "Started rp" << process->pid() << "for job" << jobId;
+        mChildren[process] = jobId;
+        process->write(payload);
+    }
+
+    void onProcessFinished(Process *process)
+    {
+        const uint64_t jobId = mChildren.take(process);
+        // The shards went out with the IndexDataMessage
+        Path::rmdir(jobDir(jobId));
+        WorkerMessage finished(WorkerMessage::Finished, jobId);
+        finished.setReturnCode(process->returnCode());
+        mConnection->send(finished);
+        EventLoop::deleteLater(process);
+    }
+
+    Path jobDir(uint64_t jobId) const
+    {
+        return mDataDir + String::number(jobId) + '/';
+    }
+
+    const String mHost;
+    const uint16_t mPort;
+    const int mJobs, mLogLevel;
+    const Path mSecretFile;
+    Path mDataDir;
+    std::shared_ptr<Connection> mConnection;
+    Hash<Process *, uint64_t> mChildren;
+};
+
+static bool parseHostPort(const char *arg, String &host, uint16_t &port)
+{
+    const String str(arg);
+    const size_t colon = str.lastIndexOf(':');
+    if (colon == String::npos || !colon)
+        return false;
+    bool ok;
+    port = static_cast<uint16_t>(str.mid(colon + 1).toULongLong(&ok));
+    if (!ok || !port)
+        return false;
+    host = str.left(colon);
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     setvbuf(stdout, nullptr, _IONBF, 0);
@@ -64,6 +216,10 @@ int main(int argc, char **argv)
     Path file;
     bool logToSyslog = false;
     bool daemon = false;
+    String workerHost, serverHost;
+    uint16_t workerPort = 0, serverPort = 0;
+    int jobs = ThreadPool::idealThreadCount();
+    Path dataDir, secretFile;
 
     for (int i=1; i<argc; ++i) {
         if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
@@ -74,11 +230,40 @@ int main(int argc, char **argv)
             logToSyslog = true;
         } else if (!strcmp(argv[i], "--daemon")) {
             daemon = true;
+        } else if (!strcmp(argv[i], "--worker") && i + 1 < argc) {
+            if (!parseHostPort(argv[++i], workerHost, workerPort)) {
+                fprintf(stderr, "Invalid --worker argument %s, expected host:port\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--server") && i + 1 < argc) {
+            if (!parseHostPort(argv[++i], serverHost, serverPort)) {
+                fprintf(stderr, "Invalid --server argument %s, expected host:port\n", argv[i]);
+                return 1;
+            }
+        } else if ((!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+            if (jobs <= 0) {
+                fprintf(stderr, "Invalid --jobs argument %s\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--data-dir") && i + 1 < argc) {
+            dataDir = Path(argv[++i]).ensureTrailingSlash();
+        } else if (!strcmp(argv[i], "--worker-secret-file") && i + 1 < argc) {
+            secretFile = Path::resolved(argv[++i]);
+            if (!secretFile.isFile()) {
+                fprintf(stderr, "Invalid --worker-secret-file argument %s\n", argv[i]);
+                return 1;
+            }
         } else {
             file = argv[i];
         }
     }
 
+    if (!serverHost.isEmpty() && dataDir.isEmpty()) {
+        fprintf(stderr, "--server requires --data-dir\n");
+        return 1;
+    }
+
     if (const char *env = getenv("TMPDIR")) { // should really always be set by rdm
         Path path = Path(env).ensureTrailingSlash();
         path += String::number(getpid());
@@ -106,7 +291,17 @@ int main(int argc, char **argv)
     RTags::initMessages();
     auto eventLoop = std::make_shared<EventLoop>();
     eventLoop->init(EventLoop::MainEventLoop);
+    if (!workerHost.isEmpty()) {
+        Rct::findExecutablePath(*argv);
+        Worker worker(workerHost, workerPort, jobs, logLevel.toInt(), secretFile);
+        if (!worker.start())
+            return 1;
+        eventLoop->exec();
+        return 0;
+    }
     ClangIndexer indexer(daemon ? ClangIndexer::Daemon : ClangIndexer::Normal);
+    if (!serverHost.isEmpty())
+        indexer.setRemote(serverHost, serverPort, dataDir, secretFile.isEmpty() ? String() : secretFile.readAll().trimmed());
     while (true) {
         String data;
 
@@ -83,6 +83,7 @@
 (defconst rtags-exit-code-argument-parse-error 38)
 (defconst rtags-return-value-unexpected-message-error 39)
 (defconst rtags-return-value-unknown-message-error 40)
+(defconst rtags-exit-code-truncated 41)
 
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
@@ -1350,7 +1351,7 @@ to only call this when `rtags-socket-address' is defined.
           (let ((result (apply #'process-file rc nil output nil arguments)))
             (goto-char (point-min))
             (save-excursion
-              (cond ((equal result rtags-exit-code-success)
+              (cond ((memq result (list rtags-exit-code-success rtags-exit-code-truncated))
                      (when rtags-autostart-diagnostics
                        (rtags-diagnostics)))
                     ((equal result rtags-exit-code-connection-failure)
@@ -1372,7 +1373,7 @@ to only call this when `rtags-socket-address' is defined.
                     ((equal result "Aborted")
                      (rtags--error 'rtags-program-exited-abnormal rtags-rc-binary-name result))
                     (t))) ;; other error
-            (and (> (point-max) (point-min)) (equal result rtags-exit-code-success))))))))
+            (and (> (point-max) (point-min)) (memq result (list rtags-exit-code-success rtags-exit-code-truncated)))))))))
 
 (defvar rtags-preprocess-mode-map (make-sparse-keymap))
 (define-key rtags-preprocess-mode-map (kbd "q") 'rtags-call-bury-or-delete)
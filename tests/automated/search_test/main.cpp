@@ -0,0 +1,14 @@
+#include "src/tg_index.h"
+#include "src/trigram_index.h"
+#include "src/trigram_index_test.h"
+
+int fooBarBaz;
+int foo_bar_qux;
+int fooQux;
+int varAlpha;
+int varBeta;
+
+int main()
+{
+    return fooBarBaz + foo_bar_qux + fooQux + varAlpha + varBeta;
+}
@@ -0,0 +1 @@
+// found by --path, see test_search.py
@@ -0,0 +1,139 @@
+import os
+import os.path
+import shutil
+import time
+
+import pytest
+from _pytest.tmpdir import TempPathFactory
+
+from . import utils
+
+
+# pylint: disable=redefined-outer-name
+@pytest.fixture(scope='module')
+def rtags(tmp_path_factory: TempPathFactory):
+    '''Start rdm for this module, the data dir lives outside of the project.'''
+    _rtags = utils.RTags(str(tmp_path_factory.mktemp('search_rdm')))
+    _rtags.rdm()
+    yield _rtags
+    _rtags.rdm_stop()
+
+
+@pytest.fixture(scope='module')
+def project(rtags: utils.RTags, tmp_path_factory: TempPathFactory):
+    '''Index a copy of search_test, tests may add files to it.'''
+    directory = os.path.join(str(tmp_path_factory.mktemp('search_project')), 'search_test')
+    shutil.copytree(os.path.join(os.path.dirname(__file__), 'search_test'), directory)
+    rtags.parse(directory, ['main.cpp'])
+    return directory
+
+
+def query(rtags: utils.RTags, project: str, *args):
+    '''Run rc in the context of project and return the non-empty output lines.'''
+    output = rtags.rc('--current-file={}'.format(os.path.join(project, 'main.cpp')), *args)
+    return [line for line in output.split('\n') if line]
+
+
+def test_find_file(rtags: utils.RTags, project: str):
+    assert query(rtags, project, '-P', 'trigram') == ['src/trigram_index.h', 'src/trigram_index_test.h']
+    assert query(rtags, project, '-P', 'TRIGRAM_INDEX_', '-I') == ['src/trigram_index_test.h']
+    # too short for a trigram, every file is looked at
+    assert query(rtags, project, '-P', 'tg') == ['src/tg_index.h']
+    assert query(rtags, project, '-P', 'notes.txt') == ['docs/notes.txt']
+    assert query(rtags, project, '-K', '-P', 'tg_index') == [os.path.realpath(os.path.join(project, 'src/tg_index.h'))]
+
+
+def test_find_file_regex(rtags: utils.RTags, project: str):
+    assert query(rtags, project, '-Z', '-P', r'tg_\w+\.h$') == ['src/tg_index.h']
+    # escapes can't be mistaken for literals the path has to contain
+    assert query(rtags, project, '-Z', '-P', r'index_\x74est') == ['src/trigram_index_test.h']
+    assert query(rtags, project, '-Z', '-P', r'trigram_index\.h') == ['src/trigram_index.h']
+
+
+def test_find_file_fuzzy(rtags: utils.RTags, project: str):
+    # consecutive matches and segment starts rank higher, ties keep the order of the files
+    ranked = ['src/tg_index.h', 'src/trigram_index.h', 'src/trigram_index_test.h']
+    assert query(rtags, project, '-P', 'tgi', '--find-file-fuzzy') == ranked
+    assert query(rtags, project, '-P', 'TGI', '--find-file-fuzzy') == ranked
+    assert query(rtags, project, '-P', 'tgi', '--find-file-fuzzy', '-M', '2') == ranked[:2]
+    assert query(rtags, project, '-P', 'notx', '--find-file-fuzzy') == ['docs/notes.txt']
+
+
+def test_max_time(rtags: utils.RTags, project: str):
+    # Every header has a name that takes the regex a while to give up on, the query runs out
+    # of time after the first few and returns the matches found until then.
+    headers = 16
+    directory = os.path.join(project, 'maxtime')
+    os.mkdir(directory)
+    for i in range(headers):
+        with open(os.path.join(directory, 'h{}.h'.format(i)), 'w') as f:
+            f.write('int {}_{};\nint match_{};\n'.format('a' * 26, i, i))
+    with open(os.path.join(directory, 'maxtime.cpp'), 'w') as f:
+        f.write(''.join('#include "h{}.h"\n'.format(i) for i in range(headers)))
+    rtags.parse(directory, ['maxtime.cpp'], project)
+
+    args = ['--current-file={}'.format(os.path.join(directory, 'maxtime.cpp')), '-Z', '-S', '(a|aa)*c|^match_']
+    code, output = rtags.rc_status(args, '--max-time', '20')
+    lines = [line for line in output.split('\n') if line]
+    assert code == 41
+    assert lines[-1] == '(truncated, --max-time 20ms)'
+    assert 0 < len(lines) - 1 < headers
+
+    # elisp has to stay readable, the exit code is all it gets
+    code, output = rtags.rc_status(args, '--max-time', '20', '--elisp')
+    assert code == 41
+    assert output.strip().startswith('(list') and output.strip().endswith(')')
+    assert 'truncated' not in output
+
+    # without a budget everything is found
+    code, output = rtags.rc_status(args)
+    assert code == 0
+    assert len([line for line in output.split('\n') if line]) == headers
+
+    code, _ = rtags.rc_status(args, '--max-time', str(2**32))
+    assert code == 38
+
+
+def test_query_cache_invalidation(rtags: utils.RTags, project: str):
+    source = os.path.join(project, 'reindex.cpp')
+    with open(source, 'w') as f:
+        f.write('int counter;\nint first() { return counter; }\n')
+    rtags.parse(project, ['reindex.cpp'])
+
+    args = ['-R', 'counter', '--no-context']
+    references = query(rtags, project, args)
+    assert references
+    # asked again the answer comes from the cache
+    assert query(rtags, project, args) == references
+    expected = len(references) + 2
+
+    with open(source, 'a') as f:
+        f.write('int second() { return counter + counter; }\n')
+    rtags.rc('-V', source)
+    # the reindex may not have started yet, wait until the new references show up
+    for _ in range(100):
+        rtags.rc('--is-indexing', source)
+        references = query(rtags, project, args)
+        if len(references) == expected:
+            break
+        time.sleep(0.1)
+    assert len(references) == expected
+
+
+def test_symbol_search_regex(rtags: utils.RTags, project: str):
+    # names are also indexed with their type, "int fooQux", hence the anchors
+    assert query(rtags, project, '-Z', '-S', '^foo') == ['fooBarBaz', 'fooQux', 'foo_bar_qux']
+    assert query(rtags, project, '-Z', '-S', '^foo.*QUX$', '-I') == ['fooQux', 'foo_bar_qux']
+    # the payload of an escape isn't a literal the name has to contain
+    assert query(rtags, project, '-Z', '-S', r'^var\x41lpha$') == ['varAlpha']
+    assert query(rtags, project, '-Z', '-S', r'^fooBar\u0042az$') == ['fooBarBaz']
+    assert query(rtags, project, '-Z', '-S', r'^foo_bar\.?_qux$') == ['foo_bar_qux']
+
+
+def test_symbol_search_wildcard(rtags: utils.RTags, project: str):
+    assert query(rtags, project, '-a', '-S', 'foo*bar*') == ['foo_bar_qux']
+    assert query(rtags, project, '-a', '-S', 'foo*bar*', '-I') == ['fooBarBaz', 'foo_bar_qux']
+    # a bracket expression is one character, not a literal
+    assert query(rtags, project, '-a', '-S', 'foo[BQ]*') == ['fooBarBaz', 'fooQux']
+    # case insensitive prefixes can't use the symnames order either
+    assert query(rtags, project, '-S', 'VARB', '-I') == ['varBeta']
@@ -118,6 +118,17 @@ class RTags():
 
         return output
 
+    def rc_status(self, *args):
+        '''Call rc with args once and return its exit code and output.
+
+        Unlike rc() a failing command isn't retried, for tests that expect a specific exit code.
+        :params *args: Variable arguments
+        '''
+        rc_args = [self.__rc_exe]
+        self._add_args(rc_args, args)
+        process = sp.run(rc_args, stdout=sp.PIPE, stderr=sp.STDOUT, check=False)
+        return process.returncode, process.stdout.decode()
+
     def rdm(self, relative_sbroot=False):
         '''Start rdm.'''
         rdm_args = [